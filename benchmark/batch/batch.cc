@@ -0,0 +1,140 @@
+#include <arpa/inet.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "hpl_broadcast_group.h"
+#include "hpl_request_handler.h"
+#include "hpl_server.h"
+#include "hpl_websocket_connection.h"
+
+// count the sendmsg calls of the server, the library is linked statically
+// and calls this one
+static long g_sendmsg_calls = 0;
+
+extern "C" ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+  typedef ssize_t (*SendmsgFn)(int, const struct msghdr *, int);
+  static auto real = reinterpret_cast<SendmsgFn>(dlsym(RTLD_NEXT, "sendmsg"));
+  ++g_sendmsg_calls;
+  return real(fd, msg, flags);
+}
+
+// drain the clients, so no member lags
+static size_t Drain(const std::vector<int> &clients) {
+  static char buf[65536];
+  size_t total = 0;
+  for (int fd : clients) {
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+      total += n;
+    }
+  }
+  return total;
+}
+
+static int Run(hpl::BroadcastFlush flush, const char *name, int port,
+               int n_conns, int n_ticks, int per_tick) {
+  hpl::Server server;
+  if (server.Init("127.0.0.1", port, n_conns) != 0) {
+    return -1;
+  }
+  hpl::BroadcastPolicy policy;
+  policy.flush = flush;
+  hpl::BroadcastGroup group(policy);
+  hpl::RequestHandler handlers;
+  handlers.ws_ready_hook = [&group](hpl::WebsocketConnection *ws,
+                                    std::string_view) {
+    group.Join(ws);
+    return 0;
+  };
+  server.RegisterRequestHandler("/ws", std::move(handlers));
+
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  const std::string kUpgrade = "GET /ws HTTP/1.1\r\n"
+                               "Host: localhost\r\n"
+                               "Upgrade: websocket\r\n"
+                               "Connection: Upgrade\r\n"
+                               "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                               "Sec-WebSocket-Version: 13\r\n\r\n";
+  const unsigned kBufSize = 64;
+  char fmterrbuf[kBufSize];
+  std::vector<int> clients;
+  char rsp[1024];
+  for (int i = 0; i < n_conns; ++i) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      fprintf(stderr, "client connect err: %s\n",
+              strerror_r(errno, fmterrbuf, kBufSize));
+      return -1;
+    }
+    clients.push_back(fd);
+    write(fd, kUpgrade.data(), kUpgrade.size());
+    while (recv(fd, rsp, sizeof(rsp), MSG_DONTWAIT) <= 0) {
+      server.Poll(10);
+    }
+  }
+
+  // a tick of broadcasts from the application loop, then the poll
+  g_sendmsg_calls = 0;
+  size_t received = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int tick = 0; tick < n_ticks; ++tick) {
+    for (int i = 0; i < per_tick; ++i) {
+      auto msg = fmt::format("tick {} msg {}", tick, i);
+      group.Broadcast(msg, hpl::WsFrameType::kTypeText);
+    }
+    server.Poll(0);
+    received += Drain(clients);
+  }
+  server.Poll(0);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  long calls = g_sendmsg_calls;
+  received += Drain(clients);
+
+  printf("%-12s %8ld sendmsg %10zu bytes received %8.2f ms\n", name, calls,
+         received,
+         std::chrono::duration<double, std::milli>(elapsed).count());
+  for (int fd : clients) {
+    close(fd);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int n_conns = 10;
+  int n_ticks = 20;
+  int per_tick = 200;
+  int port = 3997;
+  if (argc > 1) {
+    n_conns = atoi(argv[1]);
+  }
+  if (argc > 2) {
+    n_ticks = atoi(argv[2]);
+  }
+  if (argc > 3) {
+    per_tick = atoi(argv[3]);
+  }
+  printf("%d members, %d ticks of %d broadcasts\n", n_conns, n_ticks,
+         per_tick);
+  if (Run(hpl::BroadcastFlush::kImmediate, "immediate", port, n_conns,
+          n_ticks, per_tick) == -1 ||
+      Run(hpl::BroadcastFlush::kEndOfPoll, "end of poll", port + 1, n_conns,
+          n_ticks, per_tick) == -1) {
+    return 1;
+  }
+  return 0;
+}
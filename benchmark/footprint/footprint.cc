@@ -0,0 +1,129 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <new>
+#include <string>
+#include <vector>
+
+#include "hpl_connection.h"
+#include "hpl_request_handler.h"
+#include "hpl_server.h"
+#include "hpl_websocket_connection.h"
+
+// count the bytes of every operator new, the pooled buffers are malloc-ed and
+// counted by the memory budget of the server
+static size_t g_heap_bytes = 0;
+static const size_t kHeader = 16;
+
+void *operator new(size_t size) {
+  auto *p = static_cast<size_t *>(malloc(size + kHeader));
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  *p = size;
+  g_heap_bytes += size;
+  return reinterpret_cast<char *>(p) + kHeader;
+}
+
+void operator delete(void *ptr) noexcept {
+  if (ptr == nullptr) {
+    return;
+  }
+  auto *p = reinterpret_cast<size_t *>(static_cast<char *>(ptr) - kHeader);
+  g_heap_bytes -= *p;
+  free(p);
+}
+
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+
+struct Snapshot {
+  size_t heap;
+  size_t budget;
+};
+
+static Snapshot Take(const hpl::Server &server) {
+  return {g_heap_bytes, server.GetMemoryBudget().Used()};
+}
+
+static void Report(const char *what, const Snapshot &from, const Snapshot &to,
+                   int n_conns) {
+  double heap = (double)(to.heap - from.heap) / n_conns;
+  double budget = (double)(to.budget - from.budget) / n_conns;
+  printf("%-16s heap %8.1f buffers %8.1f total %8.1f bytes/conn\n", what, heap,
+         budget, heap + budget);
+}
+
+int main(int argc, char **argv) {
+  int n_conns = 1000;
+  int port = 3998;
+  if (argc > 1) {
+    n_conns = atoi(argv[1]);
+  }
+  if (argc > 2) {
+    port = atoi(argv[2]);
+  }
+
+  hpl::Server server;
+  if (server.Init("127.0.0.1", port, n_conns) != 0) {
+    return 1;
+  }
+  hpl::RequestHandler handlers;
+  handlers.ws_message_handler = [](auto *, auto, auto) { return 0; };
+  server.RegisterRequestHandler("/ws", std::move(handlers));
+
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+  const unsigned kBufSize = 64;
+  char fmterrbuf[kBufSize];
+  auto before = Take(server);
+  std::vector<int> clients;
+  for (int i = 0; i < n_conns; ++i) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      fprintf(stderr, "client connect err: %s\n",
+              strerror_r(errno, fmterrbuf, kBufSize));
+      return 1;
+    }
+    clients.push_back(fd);
+    while (server.GetConnectionCount() < clients.size()) {
+      server.Poll(10);
+    }
+  }
+  auto http_idle = Take(server);
+
+  const std::string kUpgrade = "GET /ws HTTP/1.1\r\n"
+                               "Host: localhost\r\n"
+                               "Upgrade: websocket\r\n"
+                               "Connection: Upgrade\r\n"
+                               "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                               "Sec-WebSocket-Version: 13\r\n\r\n";
+  char rsp[1024];
+  for (int fd : clients) {
+    write(fd, kUpgrade.data(), kUpgrade.size());
+    while (recv(fd, rsp, sizeof(rsp), MSG_DONTWAIT) <= 0) {
+      server.Poll(10);
+    }
+  }
+  // let the server settle the last input
+  server.Poll(10);
+  auto ws_idle = Take(server);
+
+  printf("sizeof Connection %zu, WebsocketConnection %zu\n",
+         sizeof(hpl::Connection), sizeof(hpl::WebsocketConnection));
+  Report("idle http", before, http_idle, n_conns);
+  Report("idle websocket", before, ws_idle, n_conns);
+
+  for (int fd : clients) {
+    close(fd);
+  }
+  return 0;
+}
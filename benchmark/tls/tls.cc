@@ -0,0 +1,253 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "hpl_connection.h"
+#include "hpl_request_handler.h"
+#include "hpl_response.h"
+#include "hpl_server.h"
+
+// a self-signed P-256 certificate, so the benchmark needs no files. written
+// to a directory of its own, the server loads it once
+static bool MakeCertificate(const std::string &cert_file,
+                            const std::string &key_file) {
+  EVP_PKEY *key = EVP_EC_gen("P-256");
+  X509 *cert = X509_new();
+  if (key == nullptr || cert == nullptr) {
+    return false;
+  }
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+  X509_set_pubkey(cert, key);
+  auto *name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  bool ok = X509_sign(cert, key, EVP_sha256()) > 0;
+
+  FILE *fp = fopen(cert_file.c_str(), "w");
+  ok = ok && fp != nullptr && PEM_write_X509(fp, cert) == 1;
+  if (fp != nullptr) {
+    fclose(fp);
+  }
+  fp = fopen(key_file.c_str(), "w");
+  ok = ok && fp != nullptr &&
+       PEM_write_PrivateKey(fp, key, nullptr, nullptr, 0, nullptr, nullptr) ==
+           1;
+  if (fp != nullptr) {
+    fclose(fp);
+  }
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  return ok;
+}
+
+static int Connect(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    perror("connect");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// a handshake, then GET uri and read a response of len bytes
+// @return nullptr if any of it fails
+static SSL *Fetch(SSL_CTX *ctx, int port, SSL_SESSION *session,
+                  const char *uri, size_t len) {
+  int fd = Connect(port);
+  if (fd == -1) {
+    return nullptr;
+  }
+  SSL *ssl = SSL_new(ctx);
+  SSL_set_fd(ssl, fd);
+  if (session != nullptr) {
+    SSL_set_session(ssl, session);
+  }
+  if (SSL_connect(ssl) != 1) {
+    fprintf(stderr, "handshake failed\n");
+    SSL_free(ssl);
+    close(fd);
+    return nullptr;
+  }
+  if (uri != nullptr) {
+    std::string req = std::string("GET ") + uri + " HTTP/1.1\r\n\r\n";
+    if (SSL_write(ssl, req.data(), req.size()) !=
+        static_cast<int>(req.size())) {
+      fprintf(stderr, "write failed\n");
+      SSL_free(ssl);
+      close(fd);
+      return nullptr;
+    }
+    char buf[64 * 1024];
+    size_t total = 0;
+    while (total < len) {
+      int n = SSL_read(ssl, buf, sizeof(buf));
+      if (n <= 0) {
+        fprintf(stderr, "read failed after %zu of %zu bytes\n", total, len);
+        SSL_free(ssl);
+        close(fd);
+        return nullptr;
+      }
+      total += n;
+    }
+  }
+  return ssl;
+}
+
+// without a close_notify the session isn't resumable
+static void Free(SSL *ssl) {
+  int fd = SSL_get_fd(ssl);
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  close(fd);
+}
+
+int main(int argc, char **argv) {
+  int n_handshakes = 500;
+  size_t bulk_mb = 64;
+  int port = 3997;
+  if (argc > 1) {
+    n_handshakes = atoi(argv[1]);
+  }
+  if (argc > 2) {
+    bulk_mb = atoi(argv[2]);
+  }
+  if (argc > 3) {
+    port = atoi(argv[3]);
+  }
+  char dir[] = "/tmp/hpl-tls-bench-XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    perror("mkdtemp");
+    return 1;
+  }
+  hpl::TlsOptions options;
+  options.cert_file = std::string(dir) + "/cert.pem";
+  options.key_file = std::string(dir) + "/key.pem";
+  bool made = MakeCertificate(options.cert_file, options.key_file);
+
+  hpl::Server server;
+  int ret = made ? server.Init("127.0.0.1", port, 128) : -1;
+  if (ret == 0) {
+    ret = server.EnableTls(options);
+  }
+  unlink(options.cert_file.c_str());
+  unlink(options.key_file.c_str());
+  rmdir(dir);
+  if (!made) {
+    fprintf(stderr, "can't make the certificate\n");
+  }
+  if (ret != 0) {
+    return 1;
+  }
+  // the bulk response is queued whole
+  hpl::MemoryPolicy policy;
+  policy.max_output_per_conn = (bulk_mb + 1) << 20;
+  server.SetMemoryPolicy(policy);
+
+  const auto small = std::make_shared<const std::string>(
+      MakeResponse(200, hpl::HttpVersion::HTTP_1_1, {}, "ok"));
+  const auto bulk = std::make_shared<const std::string>(
+      MakeResponse(200, hpl::HttpVersion::HTTP_1_1, {},
+                   std::string(bulk_mb << 20, 'x')));
+  hpl::RequestHandler small_handlers;
+  small_handlers.http_handlers[static_cast<int>(hpl::HttpMethod::GET)] =
+      [&](hpl::Connection *conn, auto, auto &&, bool) {
+        return conn->WriteShared(small) == -1 ? -1 : 0;
+      };
+  server.RegisterRequestHandler("/small", std::move(small_handlers));
+  hpl::RequestHandler bulk_handlers;
+  bulk_handlers.http_handlers[static_cast<int>(hpl::HttpMethod::GET)] =
+      [&](hpl::Connection *conn, auto, auto &&, bool) {
+        return conn->WriteShared(bulk) == -1 ? -1 : 0;
+      };
+  server.RegisterRequestHandler("/bulk", std::move(bulk_handlers));
+
+  std::atomic<bool> stop{false};
+  std::thread loop([&] {
+    while (!stop) {
+      server.Poll(100);
+    }
+  });
+
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+  using Clock = std::chrono::steady_clock;
+  auto rate = [&](Clock::time_point start) {
+    std::chrono::duration<double> d = Clock::now() - start;
+    return n_handshakes / d.count();
+  };
+
+  auto start = Clock::now();
+  for (int i = 0; i < n_handshakes; ++i) {
+    SSL *ssl = Fetch(ctx, port, nullptr, nullptr, 0);
+    if (ssl == nullptr) {
+      return 1;
+    }
+    Free(ssl);
+  }
+  printf("full handshakes    %10.0f /s\n", rate(start));
+
+  // the TLS 1.3 tickets come after the handshake, with the first response
+  SSL *first = Fetch(ctx, port, nullptr, "/small", small->size());
+  if (first == nullptr) {
+    return 1;
+  }
+  SSL_SESSION *session = SSL_get1_session(first);
+  printf("protocol           %10s\n", SSL_get_version(first));
+  Free(first);
+  int resumed = 0;
+  start = Clock::now();
+  for (int i = 0; i < n_handshakes; ++i) {
+    SSL *ssl = Fetch(ctx, port, session, nullptr, 0);
+    if (ssl == nullptr) {
+      return 1;
+    }
+    resumed += SSL_session_reused(ssl);
+    Free(ssl);
+  }
+  printf("resumed handshakes %10.0f /s, %d/%d resumed\n", rate(start),
+         resumed, n_handshakes);
+  SSL_SESSION_free(session);
+
+  start = Clock::now();
+  SSL *ssl = Fetch(ctx, port, nullptr, "/bulk", bulk->size());
+  if (ssl == nullptr) {
+    return 1;
+  }
+  std::chrono::duration<double> d = Clock::now() - start;
+  Free(ssl);
+  std::ifstream ulp("/proc/sys/net/ipv4/tcp_available_ulp");
+  std::string ulps;
+  std::getline(ulp, ulps);
+  printf("bulk               %10.1f MB/s, ktls %s\n", bulk_mb / d.count(),
+         ulps.find("tls") == std::string::npos ? "unavailable" : "available");
+
+  SSL_CTX_free(ctx);
+  stop = true;
+  loop.join();
+  return 0;
+}
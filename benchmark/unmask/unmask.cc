@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+
+#include "hpl_unmask.h"
+
+// unmask throughput of every kernel the cpu runs. build the library with
+// optimization, e.g. make CXXFLAGS="-I$PWD/src -O2", for meaningful numbers
+int main(int argc, char **argv) {
+  size_t total = 1024ul * 1024 * 1024;
+  if (argc > 1) {
+    total = strtoul(argv[1], nullptr, 10) * 1024 * 1024;
+  }
+  const size_t kSizes[] = {125, 1024, 16 * 1024, 256 * 1024};
+  const uint32_t kMask = 0x37fa213d;
+
+  // one byte past an aligned block, so the kernels go through a head
+  std::vector<char> block(256 * 1024 + 64 + 1);
+  char *data = block.data() + 1;
+  for (size_t i = 0; i < block.size(); ++i) {
+    block[i] = static_cast<char>(i * 131);
+  }
+
+  // every kernel must agree with the scalar one
+  const std::vector<char> source(data, data + 256 * 1024);
+  std::vector<char> expect = source;
+  hpl::GetUnmaskKernel(hpl::UnmaskKernel::kScalar)(expect.data(),
+                                                   expect.size(), kMask);
+
+  printf("best: %s\n", hpl::UnmaskKernelName(hpl::BestUnmaskKernel()));
+  printf("%-8s", "kernel");
+  for (auto size : kSizes) {
+    printf(" %10zuB", size);
+  }
+  printf("   (GB/s)\n");
+  for (unsigned k = 0; k < static_cast<unsigned>(hpl::UnmaskKernel::kCount);
+       ++k) {
+    auto kernel = static_cast<hpl::UnmaskKernel>(k);
+    auto unmask = hpl::GetUnmaskKernel(kernel);
+    printf("%-8s", hpl::UnmaskKernelName(kernel));
+    if (unmask == nullptr) {
+      printf(" unsupported\n");
+      continue;
+    }
+
+    // unaligned like data
+    std::vector<char> check(source.size() + 1);
+    memcpy(check.data() + 1, source.data(), source.size());
+    unmask(check.data() + 1, source.size(), kMask);
+    if (memcmp(check.data() + 1, expect.data(), expect.size()) != 0) {
+      printf(" wrong result\n");
+      return 1;
+    }
+
+    for (auto size : kSizes) {
+      size_t rounds = total / size;
+      auto begin = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < rounds; ++i) {
+        unmask(data, size, kMask);
+      }
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - begin;
+      printf(" %11.2f", rounds * size / elapsed.count() / 1e9);
+    }
+    printf("\n");
+  }
+  return 0;
+}
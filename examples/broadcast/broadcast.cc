@@ -13,6 +13,9 @@ public:
       .ws_connect_hook =
           std::bind(&BroadcastContext::OnWsConnected, this,
                     std::placeholders::_1, std::placeholders::_2),
+      .ws_will_close_hook =
+          std::bind(&BroadcastContext::OnWsClose, this, std::placeholders::_1,
+                    std::placeholders::_2),
   };
 
   void Broadcast(std::string_view data) {
@@ -25,6 +28,11 @@ private:
     return 0;
   }
 
+  int OnWsClose(hpl::WebsocketConnection *conn, std::string_view uri) {
+    bg.Leave(conn);
+    return 0;
+  }
+
   hpl::BroadcastGroup bg;
 };
 
@@ -1,149 +1,206 @@
+#include <errno.h>
 #include <stddef.h>
-#include <sys/epoll.h>
-#include <unistd.h>
-
-#include <curl/curl.h>
-#include <curl/easy.h>
-#include <curl/multi.h>
+#include <stdlib.h>
 
 #include <chrono>
+#include <iterator>
 #include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <fmt/core.h>
 
 #include "hpl_connection.h"
 #include "hpl_logger.h"
 #include "hpl_method.h"
 #include "hpl_request_handler.h"
+#include "hpl_response.h"
 #include "hpl_server.h"
-
-size_t curl_write_body_func(char *ptr, size_t size, size_t nmemb,
-                            void *userdata);
-size_t curl_write_headers_func(char *ptr, size_t size, size_t nmemb,
-                               void *userdata);
-
-class request_pipe_t {
-public:
-  request_pipe_t(CURLM *curlm, hpl::Connection *conn, const std::string &uri)
-      : curlm_(curlm), conn_(conn), curl_(curl_easy_init()) {
-    curl_easy_setopt(curl_, CURLOPT_URL,
-                     (std::string("https://qq.com") + uri).c_str());
-    curl_easy_setopt(curl_, CURLOPT_WRITEDATA, this);
-    curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, curl_write_body_func);
-    curl_easy_setopt(curl_, CURLOPT_HEADERFUNCTION, curl_write_headers_func);
-    curl_easy_setopt(curl_, CURLOPT_HEADERDATA, this);
-    curl_multi_add_handle(curlm_, curl_);
-    LOG_TRACE("curl_multi_add_handle {}", fmt::ptr(curl_));
+#include "hpl_str.h"
+#include "hpl_upstream_pool.h"
+
+namespace {
+/// a parked request is answered by the pool within its request_timeout, the
+/// park outlives it
+constexpr std::chrono::seconds kParkMargin{1};
+
+/// headers of a hop, not forwarded. the framing is each hop's own, a
+/// Transfer-Encoding passed on next to the Content-Length of the pool would
+/// let a client smuggle a request to the backend
+bool IsHopByHop(std::string_view name) {
+  for (std::string_view hop :
+       {"connection", "content-length", "keep-alive", "proxy-connection", "te",
+        "trailer", "transfer-encoding", "upgrade"}) {
+    if (name.size() == hop.size() && hpl::icase_cmp(name, hop)) {
+      return true;
+    }
   }
+  return false;
+}
 
-  size_t curl_write_body(char *ptr, size_t size, size_t nmemb) {
-    LOG_TRACE("curl_write_body: [{}]", ptr);
-    conn_->Write(ptr, size * nmemb);
-    std::move(*conn_).Close();
-    return size * nmemb;
-  }
+uint64_t HandleKey(hpl::ConnHandle handle) {
+  return static_cast<uint64_t>(handle.index) << 32 | handle.generation;
+}
 
-  size_t curl_write_headers(char *ptr, size_t size, size_t nmemb) {
-    LOG_TRACE("curl_write_headers: [{}]", ptr);
-    conn_->Write(ptr, size * nmemb);
-    return size * nmemb;
+std::string_view StatusMessage(int status) {
+  if (status < 100 || status > 599 ||
+      hpl::kStatusMessages[status / 100 - 1].size() <= status % 100) {
+    return "";
   }
-  ~request_pipe_t() {
-    if (curl_) {
-      curl_multi_remove_handle(curlm_, curl_);
-      LOG_TRACE("curl_multi_remove_handle {}", fmt::ptr(curl_));
-      curl_easy_cleanup(curl_);
+  return hpl::kStatusMessages[status / 100 - 1][status % 100];
+}
+
+/// @brief the response of a backend with its own status, which FormatResponse
+/// would make a 500 if it doesn't know it. the body is dechunked, framed by
+/// its length
+std::string FormatUpstreamResponse(const hpl::UpstreamResponse &response,
+                                   hpl::HttpVersion version, bool head) {
+  const auto &parser = response.parser;
+  const int status = parser.GetStatus();
+  std::string out;
+  fmt::format_to(std::back_inserter(out), "{} {} {}\r\n",
+                 hpl::HttpVersionToString(version), status,
+                 StatusMessage(status));
+  for (const auto &[name, value] : parser.GetHeaders()) {
+    if (!IsHopByHop(name)) {
+      fmt::format_to(std::back_inserter(out), "{}: {}\r\n", name, value);
     }
   }
-  CURLM *curlm_ = nullptr;
-  hpl::Connection *conn_ = nullptr;
-  CURL *curl_ = nullptr;
-};
+  // an empty body is framed too, the client connection stays open
+  if (status != 204 && status != 304) {
+    uint64_t length = head && parser.GetContentLength()
+                          ? *parser.GetContentLength()
+                          : response.body.size();
+    fmt::format_to(std::back_inserter(out), "Content-Length: {}\r\n",
+                   length);
+  }
+  out += "\r\n";
+  out += response.body;
+  return out;
+}
+} // namespace
 
 struct ServerContext {
-  hpl::Handler getter = [this](hpl::Connection *conn,
-                               const std::string_view &uri,
-                               std::string &&partial, bool is_final) {
-    req_pipes_.push_back(std::unique_ptr<request_pipe_t>(
-        new request_pipe_t(curlm, conn, uri.data())));
-
-    return 0;
-  };
-  hpl::Handler poster = [](hpl::Connection *conn, const std::string_view &uri,
-                           std::string &&partial, bool is_final) {
-    printf("poster: %s\n", uri.data());
-    return 0;
-  };
-
-  hpl::RequestHandler request_handler;
-
-  std::vector<std::unique_ptr<request_pipe_t>> req_pipes_;
-  CURLM *curlm = nullptr;
-
-  size_t curl_pipe_to_conn_body(char *ptr, size_t size, size_t nmemb,
-                                request_pipe_t *req_pipe) {
-    auto iter = std::find_if(req_pipes_.begin(), req_pipes_.end(),
-                             [&](auto &p) { return p.get() == req_pipe; });
-    if (iter == req_pipes_.end()) {
-      LOG_ERROR("request_pipe_map.find failed");
-      return size * nmemb;
+  explicit ServerContext(hpl::Server *server)
+      : server(server), pool(server, options) {
+    for (auto &handler : request_handler.http_handlers) {
+      handler = forwarder;
     }
-    auto ret = req_pipe->curl_write_body(ptr, size, nmemb);
-    LOG_INFO("remove request_pipe_t {}, curl:{}", fmt::ptr(req_pipe),
-             fmt::ptr(req_pipe->curl_));
-    req_pipes_.erase(iter);
-    return ret;
   }
 
-  size_t curl_pipe_to_conn_headers(char *ptr, size_t size, size_t nmemb,
-                                   request_pipe_t *req_pipe) {
-    auto iter = std::find_if(req_pipes_.begin(), req_pipes_.end(),
-                             [&](auto &p) { return p.get() == req_pipe; });
-    if (iter == req_pipes_.end()) {
-      LOG_ERROR("request_pipe_map.find failed");
-      return size * nmemb;
+  /// @brief drop the bodies of the clients gone before their request ended
+  void DropBodies() {
+    for (auto iter = bodies.begin(); iter != bodies.end();) {
+      iter = server->IsOpen(iter->second.handle) ? std::next(iter)
+                                                 : bodies.erase(iter);
     }
-    auto ret = req_pipe->curl_write_headers(ptr, size, nmemb);
-    return ret;
   }
 
-  ServerContext() {
-    curlm = curl_multi_init();
-    request_handler.http_handlers[static_cast<int>(hpl::HttpMethod::GET)] =
-        getter;
-    request_handler.http_handlers[static_cast<int>(hpl::HttpMethod::POST)] =
-        poster;
-  }
-  ~ServerContext() {
-    if (curlm) {
-      curl_multi_cleanup(curlm);
+  hpl::Server *server;
+  hpl::UpstreamOptions options;
+  hpl::UpstreamPool pool;
+  struct PartialBody {
+    hpl::ConnHandle handle;
+    std::string body;
+  };
+  /// the bodies of the requests being received, by connection
+  std::unordered_map<uint64_t, PartialBody> bodies;
+
+  hpl::Handler forwarder = [this](hpl::Connection *conn,
+                                  const std::string_view &uri,
+                                  std::string &&partial, bool is_final) {
+    auto handle = conn->GetHandle();
+    auto key = HandleKey(handle);
+    if (!is_final) {
+      auto &partial_body = bodies[key];
+      partial_body.handle = handle;
+      partial_body.body += partial;
+      return 0;
+    }
+    const auto &parser = conn->GetParser();
+    hpl::UpstreamRequest request;
+    request.method = parser.GetMethod();
+    request.target = std::string(uri);
+    if (auto iter = bodies.find(key); iter != bodies.end()) {
+      request.body = std::move(iter->second.body) + partial;
+      bodies.erase(iter);
+    } else {
+      request.body = std::move(partial);
+    }
+    if (!parser.GetHost().empty()) {
+      request.headers.emplace_back("Host", parser.GetHost());
+    }
+    if (!parser.GetUserAgent().empty()) {
+      request.headers.emplace_back("User-Agent", parser.GetUserAgent());
+    }
+    for (const auto &[name, value] : parser.GetHeaders()) {
+      if (!IsHopByHop(name)) {
+        request.headers.emplace_back(name, value);
+      }
     }
-  }
-};
 
-ServerContext *g_context = nullptr;
+    auto version = parser.GetVersion();
+    bool head = request.method == hpl::HttpMethod::HEAD;
+    // the pipelined requests of the client wait until this one is answered,
+    // the responses go out in order
+    auto park_key = std::to_string(key);
+    if (server->Park(conn, park_key,
+                     options.request_timeout + kParkMargin) == -1) {
+      return -1;
+    }
+    int ret = pool.Send(
+        std::move(request),
+        [this, park_key, version, head](int error,
+                                        const hpl::UpstreamResponse &response) {
+          std::string out;
+          if (error != 0) {
+            out = hpl::MakeResponse(error == ETIMEDOUT ? 504 : 502, version,
+                                    {{"Content-Length", "0"}});
+          } else {
+            out = FormatUpstreamResponse(response, version, head);
+          }
+          // the client may be gone by now, nothing is parked under the key
+          // then
+          server->Wake(park_key,
+                       std::make_shared<const std::string>(std::move(out)));
+        });
+    if (ret == -1) {
+      server->Wake(park_key, std::make_shared<const std::string>(
+                                 hpl::MakeResponse(503, version,
+                                                   {{"Content-Length", "0"}})));
+    }
+    return 0;
+  };
 
-size_t curl_write_body_func(char *ptr, size_t size, size_t nmemb,
-                            void *userdata) {
-  request_pipe_t *request_pipe = (request_pipe_t *)userdata;
-  return g_context->curl_pipe_to_conn_body(ptr, size, nmemb, request_pipe);
-}
-size_t curl_write_headers_func(char *ptr, size_t size, size_t nmemb,
-                               void *userdata) {
-  request_pipe_t *request_pipe = (request_pipe_t *)userdata;
-  return g_context->curl_pipe_to_conn_headers(ptr, size, nmemb, request_pipe);
-}
+  hpl::RequestHandler request_handler;
+};
 
 int main(int argc, char **argv) {
+  unsigned port = 2999;
+  if (argc > 1) {
+    port = atoi(argv[1]);
+  }
   hpl::Server server;
-  server.Init("192.168.64.9", 2999, 50);
+  if (server.Init(nullptr, port, 50) != 0) {
+    return 1;
+  }
 
-  g_context = new ServerContext();
-  server.RegisterRequestHandler("*", std::move(g_context->request_handler));
+  ServerContext context(&server);
+  // proxy_like [port] [backend]..., e.g. 127.0.0.1:8080 or unix:/tmp/app.sock
+  for (int i = 2; i < argc; ++i) {
+    if (context.pool.AddBackend(argv[i]) == -1) {
+      return 1;
+    }
+  }
+  if (context.pool.GetBackendCount() == 0) {
+    context.pool.AddBackend("127.0.0.1:8080");
+  }
+  server.RegisterRequestHandler("*", std::move(context.request_handler));
 
-  int running_handles = 0;
   while (true) {
-    server.Poll(50);
-    curl_multi_perform(g_context->curlm, &running_handles);
+    server.Poll(1000);
+    context.DropBodies();
   }
-
   return 0;
-}
\ No newline at end of file
+}
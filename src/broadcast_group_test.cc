@@ -0,0 +1,166 @@
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hpl_broadcast_group.h"
+#include "hpl_pubsub_hub.h"
+#include "hpl_request_handler.h"
+#include "hpl_server.h"
+#include "hpl_websocket_connection.h"
+#include "test_util.h"
+
+namespace {
+using hpl::test::PollUntil;
+using hpl::test::WsClient;
+
+std::string Inflate(std::string_view data, int window_bits) {
+  z_stream z = {};
+  inflateInit2(&z, -window_bits);
+  std::string in(data);
+  in.append("\x00\x00\xff\xff", 4);
+  std::string out(1 << 16, '\0');
+  z.next_in = reinterpret_cast<Bytef *>(in.data());
+  z.avail_in = in.size();
+  z.next_out = reinterpret_cast<Bytef *>(out.data());
+  z.avail_out = out.size();
+  int ret = inflate(&z, Z_SYNC_FLUSH);
+  out.resize(ret == Z_OK || ret == Z_STREAM_END ? z.total_out : 0);
+  inflateEnd(&z);
+  return out;
+}
+
+struct GroupServer {
+  hpl::Server server;
+  hpl::BroadcastGroup group;
+  std::vector<hpl::WebsocketConnection *> members;
+
+  GroupServer(int port, const hpl::BroadcastPolicy &policy,
+              const hpl::WsDeflateOptions &deflate = {})
+      : group(policy) {
+    EXPECT_EQ(server.Init("127.0.0.1", port, 16), 0);
+    hpl::RequestHandler handlers;
+    handlers.ws_deflate = deflate;
+    handlers.ws_connect_hook = [this](hpl::WebsocketConnection *conn,
+                                      std::string_view) {
+      group.Join(conn);
+      members.push_back(conn);
+      return 0;
+    };
+    server.RegisterRequestHandler("/ws", std::move(handlers));
+  }
+};
+} // namespace
+
+TEST(broadcast_group, deflate_smallest_window) {
+  hpl::WsDeflateOptions deflate;
+  deflate.enable = true;
+  GroupServer s(39101, {}, deflate);
+  WsClient wide, narrow;
+  ASSERT_TRUE(wide.Open(s.server, 39101, "permessage-deflate"));
+  ASSERT_TRUE(narrow.Open(s.server, 39101,
+                          "permessage-deflate; server_max_window_bits=9"));
+  ASSERT_EQ(s.group.size(), 2);
+
+  // the member with the smaller window compresses for both
+  std::string message(4096, 'a');
+  for (size_t i = 0; i < message.size(); i += 7) {
+    message[i] = 'a' + i % 26;
+  }
+  EXPECT_EQ(s.group.Broadcast(message, hpl::WsFrameType::kTypeText), 0);
+  for (auto *client : {&wide, &narrow}) {
+    unsigned char b0 = 0;
+    std::string payload;
+    ASSERT_TRUE(client->ReadFrame(s.server, b0, payload));
+    EXPECT_EQ(b0, 0x81 | 0x40);
+    EXPECT_EQ(Inflate(payload, 9), message);
+  }
+}
+
+TEST(broadcast_group, no_backlog) {
+  for (auto slow_consumer : {hpl::SlowConsumerPolicy::kDropOldest,
+                             hpl::SlowConsumerPolicy::kConflate}) {
+    hpl::BroadcastPolicy policy;
+    policy.slow_consumer = slow_consumer;
+    policy.lag_bytes = 1;
+    policy.max_backlog = 0;
+    const int port =
+        slow_consumer == hpl::SlowConsumerPolicy::kConflate ? 39103 : 39102;
+    GroupServer s(port, policy);
+    WsClient client;
+    ASSERT_TRUE(client.Open(s.server, port, {}, 4096));
+    ASSERT_EQ(s.members.size(), 1);
+
+    // until the socket is full and the rest stays queued
+    std::string large(512 * 1024, 'a');
+    int sent = 0;
+    while (s.members[0]->QueuedBytes() == 0 && sent < 32) {
+      EXPECT_EQ(s.group.Broadcast(large, hpl::WsFrameType::kTypeBinary), 0);
+      ++sent;
+    }
+    ASSERT_GT(s.members[0]->QueuedBytes(), 0);
+    // the member lags and nothing may wait, the messages are dropped
+    EXPECT_EQ(s.group.Broadcast("b", hpl::WsFrameType::kTypeText, "key"), 0);
+    EXPECT_EQ(s.group.Broadcast("c", hpl::WsFrameType::kTypeText, "key"), 0);
+    EXPECT_EQ(s.group.GetStats().dropped, 2);
+    EXPECT_EQ(s.group.GetStats().backlog, 0);
+    EXPECT_EQ(s.group.GetBacklog(s.members[0]), 0);
+
+    unsigned char b0 = 0;
+    std::string payload;
+    for (int i = 0; i < sent; ++i) {
+      ASSERT_TRUE(client.ReadFrame(s.server, b0, payload));
+      EXPECT_EQ(payload.size(), large.size());
+    }
+    ASSERT_TRUE(PollUntil(s.server,
+                          [&] { return s.members[0]->QueuedBytes() == 0; }));
+    EXPECT_EQ(s.group.Broadcast("d", hpl::WsFrameType::kTypeText), 0);
+    ASSERT_TRUE(client.ReadFrame(s.server, b0, payload));
+    EXPECT_EQ(payload, "d");
+    EXPECT_EQ(s.group.GetStats().backlog, 0);
+    EXPECT_EQ(s.group.GetStats().lagging, 0);
+  }
+}
+
+TEST(pubsub_hub, closed_subscriber_unsubscribes) {
+  hpl::Server server;
+  ASSERT_EQ(server.Init("127.0.0.1", 39104, 16), 0);
+  hpl::PubSubHub hub;
+  hpl::RequestHandler handlers;
+  // no WillCloseHook, the hub finds out by itself
+  handlers.ws_connect_hook = [&hub](hpl::WebsocketConnection *conn,
+                                    std::string_view) {
+    hub.Subscribe(conn, "prices");
+    hub.SubscribePattern(conn, "prices.*");
+    return 0;
+  };
+  server.RegisterRequestHandler("/ws", std::move(handlers));
+
+  auto client = std::make_unique<WsClient>();
+  ASSERT_TRUE(client->Open(server, 39104));
+  WsClient other;
+  ASSERT_TRUE(other.Open(server, 39104));
+  ASSERT_EQ(hub.TopicCount(), 1);
+  ASSERT_EQ(hub.GetTopic("prices")->size(), 2);
+
+  client.reset();
+  ASSERT_TRUE(PollUntil(server, [&] {
+    return hub.GetTopic("prices")->size() == 1;
+  }));
+  EXPECT_EQ(hub.PatternCount(), 1);
+  EXPECT_EQ(hub.Publish("prices.eur", "1.08", hpl::WsFrameType::kTypeText), 0);
+  unsigned char b0 = 0;
+  std::string payload;
+  ASSERT_TRUE(other.ReadFrame(server, b0, payload));
+  EXPECT_EQ(payload, "1.08");
+
+  other.Close();
+  ASSERT_TRUE(PollUntil(server, [&] { return hub.TopicCount() == 0; }));
+  EXPECT_EQ(hub.PatternCount(), 0);
+}
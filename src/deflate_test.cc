@@ -0,0 +1,102 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <string_view>
+
+#include "hpl_deflate.h"
+
+namespace {
+/// @return the response to offers, "" if declined
+std::string Negotiate(const hpl::WsDeflateOptions &options,
+                      std::string_view offers,
+                      hpl::WsDeflateParams *params = nullptr) {
+  hpl::WsDeflateParams p;
+  std::string response;
+  if (!hpl::NegotiateDeflate(options, offers, p, response)) {
+    return "";
+  }
+  if (params != nullptr) {
+    *params = p;
+  }
+  return response;
+}
+} // namespace
+
+TEST(deflate, negotiate_context_takeover) {
+  hpl::WsDeflateOptions options;
+  options.enable = true;
+  // the server resets both sides unless told otherwise
+  EXPECT_EQ(Negotiate(options, "permessage-deflate"),
+            "permessage-deflate; server_no_context_takeover; "
+            "client_no_context_takeover");
+  options.no_context_takeover = false;
+  hpl::WsDeflateParams params;
+  EXPECT_EQ(Negotiate(options, "permessage-deflate", &params),
+            "permessage-deflate");
+  EXPECT_FALSE(params.server_no_context_takeover);
+  EXPECT_FALSE(params.client_no_context_takeover);
+  // the client asks for it
+  EXPECT_EQ(Negotiate(options,
+                      "permessage-deflate; client_no_context_takeover",
+                      &params),
+            "permessage-deflate; client_no_context_takeover");
+  EXPECT_FALSE(params.server_no_context_takeover);
+  EXPECT_TRUE(params.client_no_context_takeover);
+  // other extensions are skipped
+  EXPECT_EQ(Negotiate(options, "x-webkit-deflate-frame, permessage-deflate"),
+            "permessage-deflate");
+  EXPECT_EQ(Negotiate(options, "x-webkit-deflate-frame"), "");
+}
+
+TEST(deflate, negotiate_window_bits) {
+  hpl::WsDeflateOptions options;
+  options.enable = true;
+  options.no_context_takeover = false;
+  hpl::WsDeflateParams params;
+  // zlib can't compress with 8 bits, the next offer is taken
+  EXPECT_EQ(Negotiate(options, "permessage-deflate; server_max_window_bits=8"),
+            "");
+  EXPECT_EQ(Negotiate(options,
+                      "permessage-deflate; server_max_window_bits=8, "
+                      "permessage-deflate; server_max_window_bits=10",
+                      &params),
+            "permessage-deflate; server_max_window_bits=10");
+  EXPECT_EQ(params.server_window_bits, 10);
+  // the server window is lowered to the option and told
+  options.server_max_window_bits = 12;
+  EXPECT_EQ(Negotiate(options, "permessage-deflate", &params),
+            "permessage-deflate; server_max_window_bits=12");
+  EXPECT_EQ(params.server_window_bits, 12);
+
+  // client_max_window_bits without a value lets the server pick
+  options.client_max_window_bits = 10;
+  EXPECT_EQ(Negotiate(options, "permessage-deflate; client_max_window_bits",
+                      &params),
+            "permessage-deflate; server_max_window_bits=12; "
+            "client_max_window_bits=10");
+  EXPECT_EQ(params.client_window_bits, 10);
+  // without it the client may use 15 whatever the option
+  EXPECT_EQ(Negotiate(options, "permessage-deflate", &params),
+            "permessage-deflate; server_max_window_bits=12");
+  EXPECT_EQ(params.client_window_bits, 15);
+  EXPECT_EQ(Negotiate(options, "permessage-deflate; client_max_window_bits=9",
+                      &params),
+            "permessage-deflate; server_max_window_bits=12; "
+            "client_max_window_bits=9");
+  EXPECT_EQ(params.client_window_bits, 9);
+}
+
+TEST(deflate, negotiate_malformed) {
+  hpl::WsDeflateOptions options;
+  options.enable = true;
+  for (auto offer : {"permessage-deflate; server_max_window_bits",
+                     "permessage-deflate; server_max_window_bits=16",
+                     "permessage-deflate; client_max_window_bits=7",
+                     "permessage-deflate; client_max_window_bits=1x",
+                     "permessage-deflate; server_no_context_takeover=1",
+                     "permessage-deflate; server_no_context_takeover; "
+                     "server_no_context_takeover",
+                     "permessage-deflate; unknown"}) {
+    EXPECT_EQ(Negotiate(options, offer), "") << offer;
+  }
+}
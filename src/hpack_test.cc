@@ -0,0 +1,296 @@
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "hpl_hpack.h"
+
+namespace {
+/// "8286 84" to bytes, spaces are skipped
+std::string Hex(std::string_view hex) {
+  std::string out;
+  std::string byte;
+  for (char c : hex) {
+    if (c == ' ') {
+      continue;
+    }
+    byte += c;
+    if (byte.size() == 2) {
+      out.push_back(static_cast<char>(strtoul(byte.c_str(), nullptr, 16)));
+      byte.clear();
+    }
+  }
+  return out;
+}
+
+typedef std::vector<std::pair<std::string, std::string>> Fields;
+
+Fields Decode(hpl::HpackDecoder &decoder, std::string_view block) {
+  std::vector<hpl::HeaderField> fields;
+  EXPECT_EQ(decoder.Decode(block, &fields), 0);
+  Fields out;
+  for (auto &field : fields) {
+    out.emplace_back(field.name, field.value);
+  }
+  return out;
+}
+
+// the requests of RFC 7541 C.3 and C.4, the same fields without and with
+// Huffman coding
+const Fields kRequests[] = {
+    {{":method", "GET"},
+     {":scheme", "http"},
+     {":path", "/"},
+     {":authority", "www.example.com"}},
+    {{":method", "GET"},
+     {":scheme", "http"},
+     {":path", "/"},
+     {":authority", "www.example.com"},
+     {"cache-control", "no-cache"}},
+    {{":method", "GET"},
+     {":scheme", "https"},
+     {":path", "/index.html"},
+     {":authority", "www.example.com"},
+     {"custom-key", "custom-value"}},
+};
+
+// the responses of RFC 7541 C.5 and C.6, with a table of 256 bytes
+const Fields kResponses[] = {
+    {{":status", "302"},
+     {"cache-control", "private"},
+     {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+     {"location", "https://www.example.com"}},
+    {{":status", "307"},
+     {"cache-control", "private"},
+     {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+     {"location", "https://www.example.com"}},
+    {{":status", "200"},
+     {"cache-control", "private"},
+     {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+     {"location", "https://www.example.com"},
+     {"content-encoding", "gzip"},
+     {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}},
+};
+
+/// the size update to 256 bytes, the blocks of the RFC assume the setting
+const std::string kTable256 = Hex("3fe101");
+} // namespace
+
+TEST(hpack, decode_literals) {
+  // C.2.1 to C.2.4, one field per block
+  hpl::HpackDecoder decoder(4096, 64 * 1024);
+  EXPECT_EQ(Decode(decoder, Hex("400a 6375 7374 6f6d 2d6b 6579 0d63 7573"
+                                "746f 6d2d 6865 6164 6572")),
+            (Fields{{"custom-key", "custom-header"}}));
+  EXPECT_EQ(Decode(decoder, Hex("040c 2f73 616d 706c 652f 7061 7468")),
+            (Fields{{":path", "/sample/path"}}));
+  EXPECT_EQ(Decode(decoder, Hex("1008 7061 7373 776f 7264 0673 6563 7265 74")),
+            (Fields{{"password", "secret"}}));
+  EXPECT_EQ(Decode(decoder, Hex("82")), (Fields{{":method", "GET"}}));
+  // only the first went to the dynamic table
+  EXPECT_EQ(Decode(decoder, Hex("be")),
+            (Fields{{"custom-key", "custom-header"}}));
+  std::vector<hpl::HeaderField> fields;
+  EXPECT_EQ(decoder.Decode(Hex("bf"), &fields), -1);
+}
+
+TEST(hpack, decode_requests) {
+  const char *plain[] = {
+      "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+      "8286 84be 5808 6e6f 2d63 6163 6865",
+      "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+  };
+  const char *huffman[] = {
+      "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+      "8286 84be 5886 a8eb 1064 9cbf",
+      "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+  };
+  for (auto *blocks : {plain, huffman}) {
+    // a connection of three requests, the later ones index the earlier
+    hpl::HpackDecoder decoder(4096, 64 * 1024);
+    for (int i = 0; i < 3; ++i) {
+      EXPECT_EQ(Decode(decoder, Hex(blocks[i])), kRequests[i]) << i;
+    }
+  }
+}
+
+TEST(hpack, decode_responses_with_eviction) {
+  const char *plain[] = {
+      "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420"
+      "3230 3133 2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77"
+      "7777 2e65 7861 6d70 6c65 2e63 6f6d",
+      "4803 3330 37c1 c0bf",
+      "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32"
+      "3220 474d 54c0 5a04 677a 6970 7738 666f 6f3d 4153 444a 4b48 514b 425a"
+      "584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33"
+      "3630 303b 2076 6572 7369 6f6e 3d31",
+  };
+  const char *huffman[] = {
+      "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81"
+      "66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+      "4883 640e ffc1 c0bf",
+      "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a"
+      "839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36"
+      "72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07",
+  };
+  for (auto *blocks : {plain, huffman}) {
+    hpl::HpackDecoder decoder(4096, 64 * 1024);
+    // the second block refers to entries of the first, the third evicts
+    // them. a stale index reads the wrong field and fails the comparison
+    EXPECT_EQ(Decode(decoder, kTable256 + Hex(blocks[0])), kResponses[0]);
+    EXPECT_EQ(Decode(decoder, Hex(blocks[1])), kResponses[1]);
+    EXPECT_EQ(Decode(decoder, Hex(blocks[2])), kResponses[2]);
+    // the table holds the set-cookie, content-encoding and date entries
+    std::vector<hpl::HeaderField> fields;
+    EXPECT_EQ(decoder.Decode(Hex("be bf c0"), &fields), 0);
+    ASSERT_EQ(fields.size(), 3);
+    EXPECT_EQ(fields[0].name, "set-cookie");
+    EXPECT_EQ(fields[1].name, "content-encoding");
+    EXPECT_EQ(fields[2].value, "Mon, 21 Oct 2013 20:13:22 GMT");
+    EXPECT_EQ(decoder.Decode(Hex("c1"), &fields), -1);
+  }
+}
+
+TEST(hpack, encode_requests) {
+  // the encoder picks the same representations as C.4
+  const char *expected[] = {
+      "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+      "8286 84be 5886 a8eb 1064 9cbf",
+      "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+  };
+  hpl::HpackEncoder encoder;
+  hpl::HpackDecoder decoder(4096, 64 * 1024);
+  for (int i = 0; i < 3; ++i) {
+    std::vector<std::pair<std::string_view, std::string_view>> fields(
+        kRequests[i].begin(), kRequests[i].end());
+    std::string block;
+    encoder.Encode(fields, &block);
+    EXPECT_EQ(block, Hex(expected[i])) << i;
+    EXPECT_EQ(Decode(decoder, block), kRequests[i]);
+  }
+}
+
+TEST(hpack, encode_size_updates) {
+  hpl::HpackEncoder encoder;
+  hpl::HpackDecoder decoder(4096, 64 * 1024);
+  std::string block;
+  encoder.Encode({{"custom-key", "custom-value"}}, &block);
+  block.clear();
+  encoder.Encode({{"custom-key", "custom-value"}}, &block);
+  // indexed the second time
+  EXPECT_EQ(block, Hex("be"));
+
+  // the table shrinks to nothing and grows again before the next block, both
+  // sizes are signaled, C.1.2 codes the second
+  encoder.SetMaxTableSize(0);
+  encoder.SetMaxTableSize(1337);
+  block.clear();
+  encoder.Encode({}, &block);
+  EXPECT_EQ(block, Hex("20 3f9a0a"));
+  EXPECT_EQ(Decode(decoder, block), Fields{});
+  // the entry is evicted, the field is a literal again
+  block.clear();
+  encoder.Encode({{"custom-key", "custom-value"}}, &block);
+  EXPECT_EQ(block.substr(0, 2), Hex("4088"));
+  EXPECT_EQ(Decode(decoder, block), (Fields{{"custom-key", "custom-value"}}));
+
+  // no more than the default is used, whatever the peer allows
+  encoder.SetMaxTableSize(65536);
+  block.clear();
+  encoder.Encode({}, &block);
+  EXPECT_EQ(block, Hex("3fe11f"));
+}
+
+TEST(hpack, table_eviction) {
+  // 32 bytes of overhead per entry, 42 with these
+  hpl::HpackTable table(100);
+  table.Add("key1", "value1");
+  table.Add("key2", "value2");
+  EXPECT_EQ(table.Get(62)->name, "key2");
+  EXPECT_EQ(table.Get(63)->name, "key1");
+  // the oldest goes to make room
+  table.Add("key3", "value3");
+  EXPECT_EQ(table.Get(62)->name, "key3");
+  EXPECT_EQ(table.Get(63)->name, "key2");
+  EXPECT_EQ(table.Get(64), nullptr);
+  EXPECT_EQ(table.Find("key1", "value1"), std::make_pair(size_t(0), false));
+  EXPECT_EQ(table.Find("key2", "other"), std::make_pair(size_t(63), false));
+  EXPECT_EQ(table.Find(":method", "GET"), std::make_pair(size_t(2), true));
+
+  table.Resize(50);
+  EXPECT_EQ(table.Get(62)->name, "key3");
+  EXPECT_EQ(table.Get(63), nullptr);
+  // an entry larger than the table empties it
+  table.Add("key4", std::string(64, 'v'));
+  EXPECT_EQ(table.Get(62), nullptr);
+  EXPECT_EQ(table.Get(0), nullptr);
+}
+
+TEST(hpack, malformed_integers) {
+  const char *blocks[] = {
+      // truncated, and the continuation doesn't end
+      "ff",
+      "ff80",
+      // over 4 continuation bytes
+      "ff ffffffff7f",
+      // index 0, and past the dynamic table
+      "80",
+      "ff00",
+      // a size update over the setting, and after a field
+      "3fe21f",
+      "82 20",
+      // a string longer than the block
+      "400a 6375 7374",
+      // a name index past the tables
+      "7f 0a 01 61",
+  };
+  for (auto *hex : blocks) {
+    hpl::HpackDecoder decoder(4096, 64 * 1024);
+    std::vector<hpl::HeaderField> fields;
+    EXPECT_EQ(decoder.Decode(Hex(hex), &fields), -1) << hex;
+  }
+
+  // a field list over the limit
+  hpl::HpackDecoder decoder(4096, 50);
+  std::vector<hpl::HeaderField> fields;
+  EXPECT_EQ(decoder.Decode(Hex("82"), &fields), 0);
+  EXPECT_EQ(decoder.Decode(Hex("8282"), &fields), -1);
+}
+
+TEST(hpack, malformed_huffman) {
+  std::string all;
+  for (int c = 0; c < 256; ++c) {
+    all.push_back(static_cast<char>(c));
+  }
+  std::string encoded, decoded;
+  hpl::HuffmanEncode(all, &encoded);
+  EXPECT_EQ(encoded.size(), hpl::HuffmanEncodedSize(all));
+  EXPECT_EQ(hpl::HuffmanDecode(encoded, &decoded), 0);
+  EXPECT_EQ(decoded, all);
+
+  // "0" is 00000, padded with ones
+  decoded.clear();
+  EXPECT_EQ(hpl::HuffmanDecode(Hex("07"), &decoded), 0);
+  EXPECT_EQ(decoded, "0");
+  const char *bad[] = {
+      // padded with zeros
+      "00",
+      // a padding of 8 bits
+      "07ff",
+      "ff",
+      // EOS coded
+      "ffffffff",
+  };
+  for (auto *hex : bad) {
+    decoded.clear();
+    EXPECT_EQ(hpl::HuffmanDecode(Hex(hex), &decoded), -1) << hex;
+  }
+  // in a literal the error fails the block
+  hpl::HpackDecoder decoder(4096, 64 * 1024);
+  std::vector<hpl::HeaderField> fields;
+  EXPECT_EQ(decoder.Decode(Hex("4081 00 8107"), &fields), -1);
+}
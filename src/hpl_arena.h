@@ -0,0 +1,118 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <memory_resource>
+#include <new>
+
+#ifndef _HPL_ARENA_H_
+#define _HPL_ARENA_H_
+
+namespace hpl {
+/// @brief a monotonic arena for request scoped memory.
+/// the first block lives inline in the arena, the following blocks are taken
+/// from the heap and kept across Reset(), so a connection serving requests of
+/// similar size stops calling malloc after the first one.
+/// deallocate is a no-op, everything is given back at once by Reset().
+template <size_t InlineSize>
+class MonotonicArena : public std::pmr::memory_resource {
+public:
+  MonotonicArena() : cur_(inline_), end_(inline_ + InlineSize) {}
+  ~MonotonicArena() override { Release(); }
+  MonotonicArena(const MonotonicArena &) = delete;
+  MonotonicArena &operator=(const MonotonicArena &) = delete;
+
+  /// @brief rewind to the inline block, heap blocks are kept for reuse, O(1)
+  /// @note every container allocated from the arena must be dead or reset
+  /// before calling this
+  void Reset() {
+    cur_ = inline_;
+    end_ = inline_ + InlineSize;
+    active_ = nullptr;
+  }
+
+  /// @brief rewind and give the heap blocks back to the system
+  void Release() {
+    while (blocks_ != nullptr) {
+      Block *next = blocks_->next;
+      free(blocks_);
+      blocks_ = next;
+    }
+    reserved_ = 0;
+    Reset();
+  }
+
+  /// @brief bytes taken from the heap, the inline block not included
+  size_t HeapReserved() const { return reserved_; }
+
+private:
+  struct Block {
+    Block *next;
+    size_t size;
+    char *Data() { return reinterpret_cast<char *>(this + 1); }
+  };
+  static constexpr size_t kMinBlockSize = 4096;
+
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    auto *p = Carve(bytes, alignment);
+    if (p != nullptr) {
+      return p;
+    }
+    NextBlock(bytes + alignment);
+    return Carve(bytes, alignment);
+  }
+
+  void do_deallocate(void *, size_t, size_t) override {}
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    return this == &other;
+  }
+
+  void *Carve(size_t bytes, size_t alignment) {
+    auto addr = reinterpret_cast<uintptr_t>(cur_);
+    auto aligned = (addr + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (aligned + bytes > reinterpret_cast<uintptr_t>(end_)) {
+      return nullptr;
+    }
+    cur_ = reinterpret_cast<char *>(aligned + bytes);
+    return reinterpret_cast<void *>(aligned);
+  }
+
+  /// move to the next retained block, or insert a new one if it is too small
+  void NextBlock(size_t min_size) {
+    Block *next = active_ ? active_->next : blocks_;
+    if (next == nullptr || next->size < min_size) {
+      size_t size = min_size < kMinBlockSize ? kMinBlockSize : min_size;
+      auto *block = static_cast<Block *>(malloc(sizeof(Block) + size));
+      if (block == nullptr) {
+        throw std::bad_alloc();
+      }
+      block->size = size;
+      block->next = next;
+      if (active_) {
+        active_->next = block;
+      } else {
+        blocks_ = block;
+      }
+      reserved_ += size;
+      next = block;
+    }
+    active_ = next;
+    cur_ = next->Data();
+    end_ = cur_ + next->size;
+  }
+
+  alignas(max_align_t) char inline_[InlineSize];
+  char *cur_;
+  char *end_;
+  Block *blocks_ = nullptr;
+  Block *active_ = nullptr;
+  size_t reserved_ = 0;
+};
+
+using RequestArena = MonotonicArena<1024>;
+} // namespace hpl
+
+#endif // _HPL_ARENA_H_
@@ -1,128 +1,263 @@
 #include "hpl_broadcast_group.h"
 
-#include <array>
-#include <fcntl.h>
 #include <stddef.h>
 #include <string.h>
-#include <strings.h>
-#include <sys/sendfile.h>
-#include <sys/socket.h>
-#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
 #include <utility>
 
 #include "hpl_connection.h"
+#include "hpl_deflate.h"
 #include "hpl_logger.h"
 #include "hpl_request_handler.h"
 #include "hpl_websocket_connection.h"
 #include "hpl_websocket_utils.h"
 
 namespace hpl {
-BroadcastGroup::BroadcastGroup() {
-  int ret = pipe(pipefd_);
-
-  if (ret != 0) {
-    const unsigned int kBufSize = 64;
-    char fmtErrorBuf[kBufSize];
-    LOG_ERROR("pipe failed: {}", strerror_r(errno, fmtErrorBuf, kBufSize));
+const SharedBuffer &BroadcastMessage::Plain() {
+  if (!plain_) {
+    plain_ = MakeWebsocketFrame(data_, type_);
   }
-  fcntl(pipefd_[0], F_SETFL, O_NONBLOCK);
-  fcntl(pipefd_[1], F_SETFL, O_NONBLOCK);
+  return plain_;
 }
 
-BroadcastGroup::~BroadcastGroup() {
-  if (pipefd_[0] != -1) {
-    close(pipefd_[0]);
-  }
-  if (pipefd_[1] != -1) {
-    close(pipefd_[1]);
+const SharedBuffer &BroadcastMessage::Compressed(WsDeflate *deflate) {
+  if (!compress_tried_ && deflate != nullptr) {
+    compress_tried_ = true;
+    std::string_view compressed;
+    if (data_.size() >= deflate->Threshold() &&
+        deflate->Compress(data_, compressed)) {
+      compressed_ = MakeWebsocketFrame(compressed, type_, true);
+      window_bits_ = deflate->WindowBits();
+    }
   }
+  return compressed_;
+}
 
-  for (auto &pair : connections_) {
-    close(pair.first[0]);
-    close(pair.first[1]);
+BroadcastGroup::~BroadcastGroup() {
+  for (auto &member : members_) {
+    auto &groups = member.connection->groups_;
+    groups.erase(std::find(groups.begin(), groups.end(), this));
   }
-  connections_.clear();
 }
 
 int BroadcastGroup::Join(WebsocketConnection *connection) {
   if (connection == nullptr) {
     return -1;
   }
-
-  int enable = 1;
-  int i = setsockopt(connection->conn_->GetDescriptor(), SOL_SOCKET,
-                     SO_ZEROCOPY, &enable, sizeof(enable));
-  const unsigned int kBufSize = 64;
-  char fmtErrorBuf[kBufSize];
-
-  if (i < 0) {
-    LOG_ERROR("setsockopt failed: {}",
-              strerror_r(errno, fmtErrorBuf, kBufSize));
-  }
-  int pipes[2] = {-1, -1};
-  int ret = pipe(pipes);
-  if (ret != 0) {
-    LOG_ERROR("pipe failed: {}", strerror_r(errno, fmtErrorBuf, kBufSize));
+  if (!index_.emplace(connection, members_.size()).second) {
     return -1;
   }
-  fcntl(pipes[0], F_SETFL, O_NONBLOCK);
-  fcntl(pipes[1], F_SETFL, O_NONBLOCK);
-
-  connections_.emplace_back(
-      std::make_pair(std::array<int, 2>{pipes[0], pipes[1]}, connection));
+  members_.push_back({connection, nullptr});
+  connection->groups_.push_back(this);
+  stats_.members = members_.size();
   return 0;
 }
 
 int BroadcastGroup::Leave(const WebsocketConnection *connection) {
-  auto iter = std::find_if(
-      connections_.begin(), connections_.end(),
-      [connection](const auto &pair) { return pair.second == connection; });
-  if (iter == connections_.end()) {
+  auto iter = index_.find(connection);
+  if (iter == index_.end()) {
     return -1;
   }
-  close(iter->first[0]);
-  close(iter->first[1]);
-  connections_.erase(iter);
+  // the last member takes the place of the one leaving
+  size_t pos = iter->second;
+  index_.erase(iter);
+  auto &member = members_[pos];
+  DropBacklog(member);
+  auto &groups = member.connection->groups_;
+  groups.erase(std::find(groups.begin(), groups.end(), this));
+  if (pos + 1 != members_.size()) {
+    member = std::move(members_.back());
+    index_[member.connection] = pos;
+  }
+  members_.pop_back();
+  stats_.members = members_.size();
   return 0;
 }
 
+size_t
+BroadcastGroup::GetBacklog(const WebsocketConnection *connection) const {
+  auto iter = index_.find(connection);
+  if (iter == index_.end()) {
+    return 0;
+  }
+  const auto &backlog = members_[iter->second].backlog;
+  return backlog ? backlog->waiting.size() : 0;
+}
+
 int BroadcastGroup::Broadcast(const std::string_view &data,
-                              WsFrameType msg_type) {
-  if (pipefd_[0] == -1 || pipefd_[1] == -1) {
-    return -1;
+                              WsFrameType msg_type, std::string_view key) {
+  BroadcastMessage message(data, msg_type);
+  return Broadcast(message, key);
+}
+
+int BroadcastGroup::Broadcast(
+    BroadcastMessage &message, std::string_view key,
+    const std::function<bool(const WebsocketConnection *)> &skip) {
+  if (members_.empty()) {
+    return 0;
+  }
+
+  // the member without context takeover with the smallest window compresses
+  // for all of them, every other one can inflate its frame
+  WsDeflate *deflate = nullptr;
+  for (auto &member : members_) {
+    auto *member_deflate = member.connection->deflate_.get();
+    if (member_deflate != nullptr && member_deflate->Stateless() &&
+        (deflate == nullptr ||
+         member_deflate->WindowBits() < deflate->WindowBits()) &&
+        !(skip && skip(member.connection))) {
+      deflate = member_deflate;
+    }
+  }
+  const SharedBuffer &compressed = message.Compressed(deflate);
+
+  int disconnected = 0;
+  for (auto &member : members_) {
+    if (skip && skip(member.connection)) {
+      continue;
+    }
+    auto *member_deflate = member.connection->deflate_.get();
+    const bool deflated = compressed && member_deflate != nullptr &&
+                          member_deflate->Stateless() &&
+                          member_deflate->WindowBits() >= message.window_bits_;
+    if (Send(member, deflated ? compressed : message.Plain(), key) == -1) {
+      ++disconnected;
+    }
   }
-  if (connections_.empty()) {
+
+  LOG_TRACE("broadcast done, [{}] disconnected", disconnected);
+  return disconnected;
+}
+
+int BroadcastGroup::Send(Member &member, const SharedBuffer &frame,
+                         std::string_view key) {
+  auto *connection = member.connection;
+  if (connection->IsClosing()) {
     return 0;
   }
-  const unsigned int kBufSize = 64;
-  char fmtErrorBuf[kBufSize];
+  if (member.backlog && connection->QueuedBytes() == 0) {
+    // drained without the group noticing, e.g. by a streamed message
+    Drain(connection);
+    if (connection->IsClosing()) {
+      return -1;
+    }
+  }
+  if (!member.backlog) {
+    // output queued during a dispatch isn't sent yet, the socket decides if
+    // the member lags
+    if (connection->QueuedBytes() >= policy_.lag_bytes &&
+        connection->SendQueued() == -1) {
+      Disconnect(member);
+      return -1;
+    }
+    if (connection->QueuedBytes() < policy_.lag_bytes) {
+      if (Write(connection, frame) == -1) {
+        Disconnect(member);
+        return -1;
+      }
+      return 0;
+    }
+    member.backlog = std::make_unique<Backlog>();
+    ++stats_.lagging;
+  }
 
-  auto header = MakeWebsocketHeader(data.size(), msg_type);
-  int ret = write(pipefd_[1], header.first, header.second);
-  if (ret == -1) {
-    LOG_ERROR("write failed: {}", strerror_r(errno, fmtErrorBuf, kBufSize));
-    return -1;
+  auto &backlog = *member.backlog;
+  const bool conflate =
+      policy_.slow_consumer == SlowConsumerPolicy::kConflate && !key.empty();
+  if (conflate) {
+    auto iter = backlog.latest.find(std::string(key));
+    if (iter != backlog.latest.end()) {
+      backlog.waiting[iter->second - backlog.popped].frame = frame;
+      ++stats_.conflated;
+      return 0;
+    }
   }
-  ret = write(pipefd_[1], data.data(), data.size());
-  if (ret == -1) {
-    LOG_ERROR("write failed: {}", strerror_r(errno, fmtErrorBuf, kBufSize));
-    return -1;
+  if (backlog.waiting.size() >= policy_.max_backlog) {
+    if (policy_.slow_consumer == SlowConsumerPolicy::kDisconnect) {
+      LOG_ERROR("ws conn[{}] backlog over [{}], disconnect",
+                connection->GetDescriptor(), policy_.max_backlog);
+      Disconnect(member);
+      return -1;
+    }
+    ++stats_.dropped;
+    if (backlog.waiting.empty()) {
+      // max_backlog is 0, nothing may wait
+      return 0;
+    }
+    PopWaiting(backlog);
+    --stats_.backlog;
+  }
+  if (conflate) {
+    backlog.latest.emplace(key, backlog.popped + backlog.waiting.size());
+  }
+  backlog.waiting.push_back({frame, conflate ? std::string(key) : ""});
+  ++stats_.backlog;
+  return 0;
+}
+
+void BroadcastGroup::Drain(WebsocketConnection *connection) {
+  auto iter = index_.find(connection);
+  if (iter == index_.end()) {
+    return;
+  }
+  auto &member = members_[iter->second];
+  if (!member.backlog) {
+    return;
+  }
+  auto &backlog = *member.backlog;
+  while (!backlog.waiting.empty() &&
+         connection->QueuedBytes() < policy_.lag_bytes) {
+    auto frame = std::move(backlog.waiting.front().frame);
+    PopWaiting(backlog);
+    --stats_.backlog;
+    if (Write(connection, frame) == -1) {
+      Disconnect(member);
+      return;
+    }
   }
-  size_t n_conns = connections_.size();
-  for (auto i = 0; i < n_conns - 1; ++i) {
-    tee(pipefd_[0], connections_[i].first[1], header.second + data.length(), 0);
+  if (backlog.waiting.empty()) {
+    DropBacklog(member);
   }
-  splice(pipefd_[0], nullptr, connections_[n_conns - 1].first[1], nullptr,
-         header.second + data.length(), SPLICE_F_MOVE);
+}
 
-  for (auto i = 0; i < n_conns; ++i) {
-    splice(connections_[i].first[0], nullptr,
-           connections_[i].second->conn_->GetDescriptor(), nullptr,
-           header.second + data.length(), SPLICE_F_MOVE);
+int BroadcastGroup::Write(WebsocketConnection *connection,
+                          const SharedBuffer &frame) {
+  switch (policy_.flush) {
+  case BroadcastFlush::kEndOfPoll:
+    return connection->WriteFrame(frame, true);
+  case BroadcastFlush::kMaxDelay:
+    return connection->WriteFrame(frame, true,
+                                  std::max(policy_.max_delay,
+                                           std::chrono::milliseconds(1)));
+  default:
+    return connection->WriteFrame(frame);
   }
+}
 
-  LOG_TRACE("broadcast done");
-  return 0;
+void BroadcastGroup::PopWaiting(Backlog &backlog) {
+  auto &front = backlog.waiting.front();
+  if (!front.key.empty()) {
+    backlog.latest.erase(front.key);
+  }
+  backlog.waiting.pop_front();
+  ++backlog.popped;
 }
 
-} // namespace hpl
\ No newline at end of file
+void BroadcastGroup::DropBacklog(Member &member) {
+  if (member.backlog) {
+    stats_.backlog -= member.backlog->waiting.size();
+    --stats_.lagging;
+    member.backlog.reset();
+  }
+}
+
+void BroadcastGroup::Disconnect(Member &member) {
+  DropBacklog(member);
+  ++stats_.disconnected;
+  // policy violation, the member stays until the server closes it
+  member.connection->Close(1008);
+}
+} // namespace hpl
@@ -1,28 +1,175 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
 
+#include "hpl_output_queue.h"
 #include "hpl_request_handler.h"
 #include "hpl_websocket_connection.h"
 #ifndef HPL_BROADCAST_GROUP_H
 #define HPL_BROADCAST_GROUP_H
 
 namespace hpl {
+/// @brief what a group does with a lagging member whose backlog is full
+enum class SlowConsumerPolicy {
+  /// close the member with 1008
+  kDisconnect,
+  /// drop its oldest waiting message
+  kDropOldest,
+  /// keep only the latest message per key, drop the oldest when full
+  kConflate,
+};
+
+/// @brief when the frames of a broadcast are sent
+enum class BroadcastFlush {
+  /// right away, or at the end of the dispatch if the server is dispatching
+  kImmediate,
+  /// at the end of the current Server::Poll, or before the next one waits.
+  /// the frames of all the broadcasts until then go out with one sendmsg
+  /// per member
+  kEndOfPoll,
+  /// at most max_delay after the first frame queued to a member
+  kMaxDelay,
+};
+
+struct BroadcastPolicy {
+  SlowConsumerPolicy slow_consumer = SlowConsumerPolicy::kDisconnect;
+  /// a member with more output queued than this is lagging, its messages
+  /// wait in the group until its output drains
+  size_t lag_bytes = 256 * 1024;
+  /// messages waiting per lagging member
+  size_t max_backlog = 1024;
+  BroadcastFlush flush = BroadcastFlush::kImmediate;
+  /// for kMaxDelay
+  std::chrono::milliseconds max_delay{10};
+};
+
+struct BroadcastStats {
+  size_t members = 0;
+  /// members with messages waiting
+  size_t lagging = 0;
+  /// messages waiting, all members together
+  size_t backlog = 0;
+  uint64_t dropped = 0;
+  uint64_t conflated = 0;
+  uint64_t disconnected = 0;
+};
+
+/// @brief a message encoded once for any number of groups. the frames are
+/// made when the first member needs them
+class BroadcastMessage {
+public:
+  /// @param data, must outlive the message
+  BroadcastMessage(std::string_view data, WsFrameType type)
+      : data_(data), type_(type) {}
+  /// @param plain, the uncompressed frame, e.g. made by another thread
+  BroadcastMessage(SharedBuffer plain, size_t header_len, WsFrameType type)
+      : data_(plain->data() + header_len, plain->size() - header_len),
+        type_(type), plain_(std::move(plain)) {}
+
+private:
+  friend class BroadcastGroup;
+
+  const SharedBuffer &Plain();
+  /// @brief the frame compressed by deflate, or by the compressor of an
+  /// earlier group
+  /// @return null if the message isn't compressed
+  const SharedBuffer &Compressed(WsDeflate *deflate);
+
+  std::string_view data_;
+  WsFrameType type_;
+  SharedBuffer plain_;
+  SharedBuffer compressed_;
+  bool compress_tried_ = false;
+  /// window of the compressor, a member with a smaller one can't inflate it
+  int window_bits_ = 0;
+};
+
+/// @brief websocket connections that get the same messages.
+/// a message is encoded once into a shared buffer, and every member queues a
+/// reference to it, sent with the rest of its output
 class BroadcastGroup {
 public:
-  BroadcastGroup();
+  explicit BroadcastGroup(const BroadcastPolicy &policy = {})
+      : policy_(policy) {}
   ~BroadcastGroup();
+  BroadcastGroup(const BroadcastGroup &) = delete;
+  BroadcastGroup &operator=(const BroadcastGroup &) = delete;
 
+  /// @retval -1, null or already a member
   int Join(WebsocketConnection *connection);
+  /// @note a closed member leaves by itself
+  /// @retval -1, not a member
   int Leave(const WebsocketConnection *connection);
-  int Broadcast(const std::string_view &data, WsFrameType msg_type);
+  /// @brief send a message to every member. with permessage-deflate, the
+  /// message is compressed once and shared by the members that compress
+  /// every message on their own with a window no smaller, the others get the
+  /// uncompressed frame
+  /// @param key, with kConflate, a waiting message of the same key is
+  /// replaced. empty means no key
+  /// @return the members disconnected by this message
+  int Broadcast(const std::string_view &data, WsFrameType msg_type,
+                std::string_view key = {});
+  /// @brief same as above, for a message shared with other groups
+  /// @param skip, members it returns true for don't get the message
+  int Broadcast(BroadcastMessage &message, std::string_view key = {},
+                const std::function<bool(const WebsocketConnection *)> &skip =
+                    nullptr);
+  inline bool Contains(const WebsocketConnection *connection) const {
+    return index_.count(connection) != 0;
+  }
+
+  inline size_t size() const { return members_.size(); }
+  inline const BroadcastStats &GetStats() const { return stats_; }
+  /// messages waiting for connection, 0 if it isn't lagging
+  size_t GetBacklog(const WebsocketConnection *connection) const;
 
 private:
-  int pipefd_[2] = {-1, -1};
-  std::vector<std::pair<std::array<int, 2>, WebsocketConnection *>>
-      connections_;
+  friend class WebsocketConnection;
+
+  struct Waiting {
+    SharedBuffer frame;
+    std::string key;
+  };
+  /// the messages of a lagging member
+  struct Backlog {
+    std::deque<Waiting> waiting;
+    /// key -> position of its message, counted from the first ever waiting
+    std::unordered_map<std::string, uint64_t> latest;
+    /// messages popped so far
+    uint64_t popped = 0;
+  };
+  struct Member {
+    WebsocketConnection *connection;
+    std::unique_ptr<Backlog> backlog;
+  };
+
+  /// @brief queue frame to a member, or let it wait if the member lags
+  /// @retval -1, the member is disconnected
+  int Send(Member &member, const SharedBuffer &frame, std::string_view key);
+  /// @brief queue the waiting messages of connection while it keeps up
+  void Drain(WebsocketConnection *connection);
+  void PopWaiting(Backlog &backlog);
+  void DropBacklog(Member &member);
+  void Disconnect(Member &member);
+  /// @brief queue frame with the flush policy
+  int Write(WebsocketConnection *connection, const SharedBuffer &frame);
+
+  BroadcastPolicy policy_;
+  BroadcastStats stats_;
+  std::vector<Member> members_;
+  /// position of a member in members_
+  std::unordered_map<const WebsocketConnection *, size_t> index_;
 };
 } // namespace hpl
 
-#endif // HPL_BROADCAST_GROUP_H
\ No newline at end of file
+#endif // HPL_BROADCAST_GROUP_H
@@ -0,0 +1,132 @@
+#include "hpl_buffer_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpl_logger.h"
+
+namespace hpl {
+constexpr size_t BufferPool::kClassSizes[];
+
+int BufferPool::ClassOf(size_t size) {
+  for (size_t i = 0; i < kNumClasses; ++i) {
+    if (size <= kClassSizes[i]) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+std::pair<char *, size_t> BufferPool::Claim(size_t size) {
+  int cls = ClassOf(size);
+  if (cls != -1) {
+    size = kClassSizes[cls];
+    if (!free_[cls].empty()) {
+      char *block = free_[cls].back();
+      free_[cls].pop_back();
+      return {block, size};
+    }
+  }
+  auto *block = static_cast<char *>(malloc(size));
+  if (block == nullptr) {
+    LOG_ERROR("malloc {} bytes failed", size);
+    return {nullptr, 0};
+  }
+  budget_->Update(0, size);
+  return {block, size};
+}
+
+void BufferPool::Return(char *block, size_t size) {
+  int cls = ClassOf(size);
+  if (cls != -1 && kClassSizes[cls] == size &&
+      (free_[cls].size() + 1) * size <= kMaxCachedBytes &&
+      !budget_->UnderPressure()) {
+    free_[cls].push_back(block);
+    return;
+  }
+  free(block);
+  budget_->Update(size, 0);
+}
+
+void BufferPool::Trim() {
+  for (size_t i = 0; i < kNumClasses; ++i) {
+    for (auto *block : free_[i]) {
+      free(block);
+    }
+    budget_->Update(free_[i].size() * kClassSizes[i], 0);
+    free_[i].clear();
+    free_[i].shrink_to_fit();
+  }
+}
+
+char *InputBuffer::PrepareRead(size_t len, BufferPool *pool, char *scratch,
+                               size_t scratch_len) {
+  if (block_ == nullptr) {
+    if (scratch != nullptr && scratch_len >= len) {
+      block_ = scratch;
+      cap_ = scratch_len;
+      borrowed_ = true;
+      return block_;
+    }
+    if (!Reattach(len, pool)) {
+      return nullptr;
+    }
+    return block_ + end_;
+  }
+  if (cap_ - end_ >= len) {
+    return block_ + end_;
+  }
+  if (cap_ - size() >= len) {
+    // enough room once the consumed front is dropped
+    memmove(block_, block_ + begin_, size());
+    end_ -= begin_;
+    begin_ = 0;
+    return block_ + end_;
+  }
+  if (!Reattach(size() + len, pool)) {
+    return nullptr;
+  }
+  return block_ + end_;
+}
+
+bool InputBuffer::Reattach(size_t size, BufferPool *pool) {
+  auto [block, cap] = pool->Claim(size);
+  if (block == nullptr) {
+    return false;
+  }
+  auto len = this->size();
+  if (len > 0) {
+    memcpy(block, data(), len);
+  }
+  if (block_ != nullptr && !borrowed_) {
+    pool->Return(block_, cap_);
+  }
+  block_ = block;
+  cap_ = cap;
+  begin_ = 0;
+  end_ = len;
+  borrowed_ = false;
+  return true;
+}
+
+void InputBuffer::Settle(BufferPool *pool) {
+  if (block_ == nullptr) {
+    return;
+  }
+  if (empty()) {
+    Release(pool);
+  } else if (borrowed_ && !Reattach(size(), pool)) {
+    LOG_ERROR("no memory for {} bytes left in the scratch buffer", size());
+    Release(pool);
+  }
+}
+
+void InputBuffer::Release(BufferPool *pool) {
+  if (block_ != nullptr && !borrowed_) {
+    pool->Return(block_, cap_);
+  }
+  block_ = nullptr;
+  cap_ = begin_ = end_ = 0;
+  borrowed_ = false;
+}
+} // namespace hpl
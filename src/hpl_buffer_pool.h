@@ -0,0 +1,95 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include "hpl_memory_policy.h"
+
+#ifndef _HPL_BUFFER_POOL_H_
+#define _HPL_BUFFER_POOL_H_
+
+namespace hpl {
+/// @brief size classed blocks shared by the connections of a server.
+/// every block held by the pool, in use or cached, is charged to the budget
+class BufferPool {
+public:
+  explicit BufferPool(MemoryBudget *budget) : budget_(budget) {}
+  ~BufferPool() { Trim(); }
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  /// @brief a block of at least size bytes
+  /// @return the block and its real size, {nullptr, 0} if out of memory
+  std::pair<char *, size_t> Claim(size_t size);
+  void Return(char *block, size_t size);
+
+  /// @brief free the cached blocks
+  void Trim();
+
+private:
+  static constexpr size_t kClassSizes[] = {1024,       4 * 1024,  16 * 1024,
+                                           64 * 1024,  256 * 1024,
+                                           1024 * 1024};
+  static constexpr size_t kNumClasses =
+      sizeof(kClassSizes) / sizeof(kClassSizes[0]);
+  /// cached bytes kept per class
+  static constexpr size_t kMaxCachedBytes = 4 * 1024 * 1024;
+
+  static int ClassOf(size_t size);
+
+  MemoryBudget *budget_;
+  std::vector<char *> free_[kNumClasses];
+};
+
+/// @brief the input buffer of a connection.
+/// holds no memory while drained. a read first borrows the scratch buffer of
+/// the loop, Settle() then moves what is left into a pooled block, or gives
+/// the block back when everything is consumed.
+class InputBuffer {
+public:
+  InputBuffer() = default;
+  InputBuffer(const InputBuffer &) = delete;
+  InputBuffer &operator=(const InputBuffer &) = delete;
+
+  inline char *data() { return block_ + begin_; }
+  inline const char *data() const { return block_ + begin_; }
+  inline size_t size() const { return end_ - begin_; }
+  inline bool empty() const { return end_ == begin_; }
+  /// bytes of the attached block, 0 for a drained buffer
+  inline size_t capacity() const { return borrowed_ ? 0 : cap_; }
+  inline bool borrowed() const { return borrowed_; }
+
+  /// @brief drop n bytes from the front
+  void Consume(size_t n) {
+    begin_ += n;
+    if (begin_ == end_) {
+      begin_ = end_ = 0;
+    }
+  }
+
+  /// @brief room for a read of at least len bytes at the tail
+  /// @param scratch, borrowed if the buffer holds no block
+  /// @return nullptr if out of memory
+  char *PrepareRead(size_t len, BufferPool *pool, char *scratch,
+                    size_t scratch_len);
+  void CommitRead(size_t len) { end_ += len; }
+
+  /// @brief leave the scratch buffer, or give back the block if drained
+  void Settle(BufferPool *pool);
+  /// @brief give back the block, the data is dropped
+  void Release(BufferPool *pool);
+
+private:
+  bool Reattach(size_t size, BufferPool *pool);
+
+  char *block_ = nullptr;
+  uint32_t cap_ = 0;
+  uint32_t begin_ = 0;
+  uint32_t end_ = 0;
+  bool borrowed_ = false;
+};
+} // namespace hpl
+
+#endif // _HPL_BUFFER_POOL_H_
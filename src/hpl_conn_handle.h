@@ -0,0 +1,17 @@
+#pragma once
+#include <stdint.h>
+
+#ifndef _HPL_CONN_HANDLE_H_
+#define _HPL_CONN_HANDLE_H_
+
+namespace hpl {
+/// @brief names a connection from any thread, see Server::Post. once the
+/// connection is closed the handle is stale and resolves to nothing
+struct ConnHandle {
+  uint32_t index = 0;
+  /// 0 is never a live generation
+  uint32_t generation = 0;
+};
+} // namespace hpl
+
+#endif // _HPL_CONN_HANDLE_H_
@@ -20,30 +20,46 @@
 #include "hpl_str.h"
 
 namespace hpl {
-Connection::Connection(Server *svr, int fd) : svr_(svr), fd_(fd) {
-  buffer_.reserve(8192);
+// the hot part of a connection should stay within a few cache lines
+static_assert(sizeof(Connection) <= 256, "Connection grows out of hot state");
+
+Connection::Connection(Server *svr, int fd) : svr_(svr), fd_(fd) {}
+
+Connection::RequestState &Connection::Request() {
+  if (!req_) {
+    req_ = std::make_unique<RequestState>();
+  }
+  return *req_;
 }
 
-std::optional<std::string> Connection::PopLine() {
-  auto size = buffer_.size();
-  if (buffer_.size() < 2) {
-    return std::nullopt;
+const HttpHeaderParser &Connection::GetParser() const {
+  if (h2_conn_) {
+    return h2_conn_->GetParser();
   }
-  size_t idx = 0;
-  static const unsigned short kIntNewLine = '\r' | ('\n' << 8);
-  for (; idx < buffer_.size() - 1; ++idx) {
-    if (*reinterpret_cast<unsigned short *>(buffer_.data() + idx) ==
-        kIntNewLine) {
-      break;
+  static const HttpHeaderParser kEmptyParser;
+  return req_ ? req_->parser : kEmptyParser;
+}
+
+std::pmr::memory_resource *Connection::GetRequestResource() {
+  if (h2_conn_) {
+    if (auto *resource = h2_conn_->GetRequestResource()) {
+      return resource;
     }
   }
-  if (idx >= buffer_.size() - 1) {
-    LOG_DEBUG("popline no newline, idx [{}], buffer[{}]", idx, buffer_.size());
+  return &Request().arena;
+}
+
+std::optional<std::pmr::string> Connection::PopLine() {
+  auto *begin = buffer_.data();
+  auto *newline =
+      static_cast<const char *>(memmem(begin, buffer_.size(), "\r\n", 2));
+  if (newline == nullptr) {
+    LOG_DEBUG("popline no newline, buffer[{}]", buffer_.size());
     return std::nullopt;
   }
-  auto it = std::next(buffer_.begin(), idx + 2);
-  std::string line(buffer_.begin(), it);
-  buffer_.erase(buffer_.begin(), it);
+  size_t len = newline + 2 - begin;
+  std::pmr::string line(begin, len, &req_->arena);
+  buffer_.Consume(len);
 
   return line;
 }
@@ -52,23 +68,41 @@ std::optional<std::string> Connection::PopLine() {
 /// return 0, the stream drained, try another time
 /// return 1, success, try another read
 int Connection::Read() {
+  const auto &policy = svr_->GetMemoryPolicy();
   auto old_size = buffer_.size();
-#ifdef SMALL_MEMORY
-  const size_t kLocalBufferLen = SMALL_MEMORY;
-  size_t read_len = SMALL_MEMORY - old_size;
-#else
-  const size_t kLocalBufferLen = 1024;
-  size_t read_len = kLocalBufferLen;
-#endif
-  char local_buffer[kLocalBufferLen];
-
-  int nread = read(fd_, local_buffer, read_len);
+  size_t read_len = policy.read_chunk;
+  if (policy.max_input_per_conn != 0) {
+    if (old_size >= policy.max_input_per_conn) {
+      LOG_ERROR("conn[{}] input over the cap [{}]", fd_,
+                policy.max_input_per_conn);
+      return -1;
+    }
+    read_len = std::min(read_len, policy.max_input_per_conn - old_size);
+  }
+
+  char *scratch = nullptr;
+  if (!svr_->scratch_in_use_) {
+    scratch = svr_->Scratch();
+  }
+  bool borrowed = buffer_.borrowed();
+  char *tail = buffer_.PrepareRead(read_len, &svr_->buffer_pool_, scratch,
+                                   policy.read_chunk);
+  // the scratch buffer is taken, or left for a pooled block when full
+  if (buffer_.borrowed() != borrowed) {
+    svr_->scratch_in_use_ = buffer_.borrowed();
+  }
+  if (tail == nullptr) {
+    return -1;
+  }
+  int nread = tls_ ? tls_->Read(tail, read_len) : read(fd_, tail, read_len);
   if (nread > 0) {
-    buffer_.insert(buffer_.end(), local_buffer, local_buffer + nread);
+    buffer_.CommitRead(nread);
     return 1;
   }
+  const int kBufSize = 64;
+  char buf[kBufSize];
   LOG_DEBUG("read ret: {}, err[{}][{}]", nread, errno,
-            strerror_r(errno, local_buffer, kLocalBufferLen));
+            strerror_r(errno, buf, kBufSize));
   if (nread == -1) {
     if (errno == EAGAIN) {
       return 0;
@@ -83,13 +117,23 @@ int Connection::Read() {
   }
 }
 
-std::string &&Connection::PopBody() { return std::move(partial_body_); }
+std::string &&Connection::PopBody() {
+  return std::move(Request().partial_body);
+}
+
+void Connection::ResetRequest() {
+  if (req_) {
+    req_->parser.Reset();
+    req_->arena.Reset();
+  }
+}
 
-WebsocketConnection *Connection::UpgradeToWebsocket(WsHandler ws_on_msg,
-                                                    WsHook will_close_hook) {
+WebsocketConnection *
+Connection::UpgradeToWebsocket(const RequestHandler *handlers) {
   if (ws_conn_) {
     return ws_conn_.get();
   }
+  const auto &parser = GetParser();
   auto key = parser.GetHeader("Sec-WebSocket-Key");
   if (key.empty()) {
     key = parser.GetHeader("Sec-WebSocket-Key1");
@@ -101,14 +145,13 @@ WebsocketConnection *Connection::UpgradeToWebsocket(WsHandler ws_on_msg,
     LOG_ERROR("websocket key not found");
     return nullptr;
   }
-  ws_conn_ = std::make_unique<WebsocketConnection>(this, key, ws_on_msg,
-                                                   will_close_hook);
+  ws_conn_ = std::make_unique<WebsocketConnection>(this, key, handlers);
   return ws_conn_.get();
 }
 
 /// @retval -2, error or connection closed
-/// @retval -1, headers not complete
-/// @retval 0, headers complete, but body not complete
+/// @retval -1, nothing new for the handler, waiting for more data
+/// @retval 0, headers complete, or a slice of the body
 /// @retval 1, a complete request
 int Connection::ProcessDataIn() {
   auto state_ret = [](auto state) {
@@ -121,60 +164,213 @@ int Connection::ProcessDataIn() {
       return -1;
     }
   };
+  auto &parser = Request().parser;
   do {
+    if (parser.GetState() == HttpHeaderParser::ParserState::Done) {
+      if (buffer_.empty()) {
+        int ret = Read();
+        if (ret == -1) {
+          return -2;
+        } else if (ret == 0) {
+          return -1;
+        }
+      }
+      // the last request is complete, new data starts the next one
+      ResetRequest();
+    }
+
+    // consume what is buffered before reading more
+    do {
+      std::string_view line_view;
+      std::optional<std::pmr::string> line;
+      if (parser.GetState() == HttpHeaderParser::ParserState::Body) {
+        if (buffer_.empty()) {
+          break;
+        }
+        size_t remain = buffer_.size();
+        if (parser.GetContentLength()) {
+          remain = *parser.GetContentLength() - parser.GetBodyLength();
+        }
+        auto length = std::min(buffer_.size(), remain);
+        // assign, so the capacity left by the last slice is reused
+        auto &partial_body = req_->partial_body;
+        partial_body.assign(buffer_.data(), length);
+        line_view = partial_body;
+        buffer_.Consume(length);
+      } else {
+        line = PopLine();
+        if (!line) {
+          break;
+        }
+        line_view = *line;
+      }
+
+      auto stat = parser.PushLine(line_view);
+      if (stat == HttpHeaderParser::ParserState::Done ||
+          stat == HttpHeaderParser::ParserState::Body) {
+        return state_ret(stat);
+      }
+    } while (true); // PopLine
+
     int ret = Read();
     if (ret == -1) {
       return -2;
     } else if (ret == 0) {
-      return state_ret(parser.GetState());
-    } else {
-      do {
-        auto line = PopLine();
-        auto line_cref = std::cref(*line);
-        if (!line) {
-          if (buffer_.empty()) {
-            break;
-          }
-          if (parser.GetState() != HttpHeaderParser::ParserState::Body) {
-            break;
-          } else {
-            auto length_limit = std::min(buffer_.size(), 1024ul);
-            partial_body_ =
-                std::string(buffer_.begin(), buffer_.begin() + length_limit);
-            line_cref = std::cref(partial_body_);
-            buffer_.erase(buffer_.begin(), buffer_.begin() + length_limit);
-          }
-        }
-
-        auto stat = parser.PushLine(line_cref.get());
-        if (stat == HttpHeaderParser::ParserState::Done ||
-            stat == HttpHeaderParser::ParserState::Body) {
-          return state_ret(stat);
-        }
-      } while (true); // PopLine
+      return -1;
     }
   } while (true); // read until no more data, or error, or connection closed
-
-  return state_ret(parser.GetState());
 }
 
 int Connection::Write(const char *data, size_t len) {
+  struct iovec iov = {const_cast<char *>(data), len};
+  return Write(&iov, 1);
+}
+
+int Connection::Write(const struct iovec *iov, int iovcnt) {
+  if (h2_conn_) {
+    // the response of the selected stream
+    return h2_conn_->WriteStream(iov, iovcnt);
+  }
+  return WriteRaw(iov, iovcnt);
+}
+
+int Connection::WriteRaw(const struct iovec *iov, int iovcnt) {
   if (fd_ == -1) {
     LOG_ERROR("invalid fd [{}]", fd_);
     return -1;
   }
-  int nwrite = write(fd_, data, len);
-  if (nwrite == -1) {
-    if (errno == EAGAIN) {
-      return 0;
-    } else if (errno == EINTR) {
-      return 1;
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    len += iov[i].iov_len;
+  }
+  size_t nwrite = 0;
+  if (output_.empty() && !svr_->batching_) {
+    int ret = tls_ ? tls_->Write(iov, iovcnt) : writev(fd_, iov, iovcnt);
+    if (ret == -1) {
+      if (errno != EAGAIN && errno != EINTR) {
+        return -1;
+      }
     } else {
-      return -1;
+      nwrite = ret;
     }
-  } else {
+  }
+  if (nwrite == len) {
     return 1;
   }
+
+  auto cap = svr_->GetMemoryPolicy().max_output_per_conn;
+  if (cap != 0 && output_.size() + len - nwrite > cap) {
+    LOG_ERROR("conn[{}] output over the cap [{}]", fd_, cap);
+    return -1;
+  }
+  output_.Append(iov, iovcnt, nwrite);
+  Account();
+  if (svr_->batching_) {
+    svr_->ScheduleFlush(this);
+  } else {
+    svr_->UpdateEvents(this);
+  }
+  return 0;
+}
+
+int Connection::WriteFile(const char *header, size_t header_len,
+                          std::shared_ptr<const SharedFd> file, off_t offset,
+                          size_t len) {
+  if (fd_ == -1) {
+    LOG_ERROR("invalid fd [{}]", fd_);
+    return -1;
+  }
+  auto cap = svr_->GetMemoryPolicy().max_output_per_conn;
+  if (cap != 0 && output_.size() + header_len + len > cap) {
+    LOG_ERROR("conn[{}] output over the cap [{}]", fd_, cap);
+    return -1;
+  }
+  output_.Append(header, header_len);
+  output_.AppendFile(std::move(file), offset, len);
+  if (svr_->batching_) {
+    Account();
+    svr_->ScheduleFlush(this);
+    return 0;
+  }
+  int ret = output_.Send(fd_, tls_.get());
+  Account();
+  svr_->UpdateEvents(this);
+  return ret;
+}
+
+int Connection::WriteShared(SharedBuffer buf) {
+  if (h2_conn_) {
+    struct iovec iov = {const_cast<char *>(buf->data()), buf->size()};
+    return h2_conn_->WriteStream(&iov, 1);
+  }
+  if (QueueShared(std::move(buf)) == -1) {
+    return -1;
+  }
+  if (svr_->batching_) {
+    svr_->ScheduleFlush(this);
+    return 0;
+  }
+  int ret = output_.Send(fd_, tls_.get());
+  Account();
+  svr_->UpdateEvents(this);
+  return ret;
+}
+
+int Connection::QueueShared(SharedBuffer buf) {
+  if (fd_ == -1) {
+    LOG_ERROR("invalid fd [{}]", fd_);
+    return -1;
+  }
+  auto cap = svr_->GetMemoryPolicy().max_output_per_conn;
+  if (cap != 0 && output_.size() + buf->size() > cap) {
+    LOG_ERROR("conn[{}] output over the cap [{}]", fd_, cap);
+    return -1;
+  }
+  output_.AppendShared(std::move(buf));
+  Account();
+  return 0;
+}
+
+int Connection::FlushOutput() {
+  int ret = output_.Send(fd_, tls_.get());
+  if (ret == -1) {
+    return -1;
+  }
+  if (ret == 1) {
+    // an idle connection holds no output memory
+    output_.Shrink();
+  }
+  Account();
+  svr_->UpdateEvents(this);
+  if (ret == 1 && ws_conn_) {
+    return ws_conn_->OnDrained() == -1 ? -1 : 1;
+  }
+  if (ret == 1 && h2_conn_) {
+    return h2_conn_->OnDrained() == -1 ? -1 : 1;
+  }
+  return ret;
+}
+
+void Connection::ShrinkIdleBuffers() {
+  output_.Shrink();
+  Account();
+}
+
+void Connection::SettleInput() {
+  if (buffer_.borrowed()) {
+    svr_->scratch_in_use_ = false;
+  }
+  buffer_.Settle(&svr_->buffer_pool_);
+}
+
+void Connection::Account() {
+  // the input buffer is charged by the pool
+  size_t bytes = output_.capacity();
+  if (h2_conn_) {
+    bytes += h2_conn_->PendingBytes();
+  }
+  svr_->budget_.Update(accounted_, bytes);
+  accounted_ = bytes;
 }
 
 bool Connection::ShouldUpgradeWebsocket() const {
@@ -182,6 +378,7 @@ bool Connection::ShouldUpgradeWebsocket() const {
     // already upgraded, we don't upgrade twice
     return false;
   }
+  const auto &parser = GetParser();
   if ((parser.GetUpgradeFlags() &
        HttpHeaderParser::UpgradeFlags::UpgradeWebSocket) &&
       (parser.GetConnectionFlags() &
@@ -1,58 +1,170 @@
 #pragma once
 
+#include <stdint.h>
+#include <sys/uio.h>
+
 #include <memory>
+#include <memory_resource>
 #include <optional>
 #include <string>
 #include <vector>
 
+#include "hpl_arena.h"
+#include "hpl_buffer_pool.h"
+#include "hpl_conn_handle.h"
 #include "hpl_header_parser.h"
+#include "hpl_http2_connection.h"
 #include "hpl_method.h"
+#include "hpl_output_queue.h"
 #include "hpl_request_handler.h"
+#include "hpl_tls.h"
 #include "hpl_version.h"
 #include "hpl_websocket_connection.h"
 
 namespace hpl {
 class Server;
+class SseChannel;
 
 class Connection {
 public:
+  /// @brief write to the socket, what the socket doesn't take is queued and
+  /// sent when it becomes writable
+  /// @retval 1, all written
+  /// @retval 0, some data is queued
+  /// @retval -1, error, or the output cap of the memory policy is exceeded
   int Write(const char *data, size_t len);
-  inline const HttpHeaderParser &GetParser() const { return parser; }
+  /// @brief write the buffers with one syscall, same as Write otherwise.
+  /// while the server dispatches events, writes are only queued, and every
+  /// connection written to is flushed with one sendmsg when the dispatch ends
+  int Write(const struct iovec *iov, int iovcnt);
+  /// @brief queue a reference to buf and send it, the bytes are not copied,
+  /// and with zero copy on not even by the kernel. buf must not change
+  /// @return same as Write
+  int WriteShared(SharedBuffer buf);
+  const HttpHeaderParser &GetParser() const;
+
+  /// @brief memory for the current request, handlers may allocate from it
+  /// too. everything is given back when the next request on this connection
+  /// starts, so don't keep anything allocated from it beyond that.
+  std::pmr::memory_resource *GetRequestResource();
 
   /// @note don't call this function in a handler, or the connection will be
   /// double closed
   void Close() &&;
 
   int GetDescriptor() const { return fd_; }
+  inline ConnHandle GetHandle() const { return handle_; }
+  /// nullptr before the upgrade
+  inline WebsocketConnection *GetWebsocket() const { return ws_conn_.get(); }
+  /// nullptr unless the client speaks HTTP/2
+  inline Http2Connection *GetHttp2() const { return h2_conn_.get(); }
 
 private:
   Connection(Server *svr, int fd);
   bool ShouldUpgradeWebsocket() const;
 
+  /// the cold part, what a http request needs. it is created with the first
+  /// request and dropped once the connection is upgraded
+  struct RequestState {
+    RequestArena arena;
+    HttpHeaderParser parser{&arena};
+    std::string partial_body;
+    /// where the request is parked, see Server::Park
+    struct Park {
+      /// the key and the requests parked under it
+      std::pair<const std::string, std::vector<Connection *>> *waiters =
+          nullptr;
+      size_t index = 0;
+      /// the slot of the timing wheel and the index in it
+      size_t slot = 0;
+      size_t slot_index = 0;
+      /// turns of the wheel left before the deadline
+      size_t rounds = 0;
+    } park;
+  };
+
+  // the hot part, what the poll loop touches for every connection
   Server *svr_;
   int fd_ = -1;
-  std::vector<char> buffer_;
+  uint32_t ep_events_ = 0;
+  ConnHandle handle_;
+  bool read_paused_ = false;
+  /// on the flush list of the server
+  bool flush_pending_ = false;
+  /// the websocket consumer asked to stop reading
+  bool consumer_paused_ = false;
+  /// closed at the end of the poll, its events are ignored meanwhile
+  bool close_pending_ = false;
+  /// on the delayed flush list of the server
+  bool flush_delayed_ = false;
+  /// the request waits for Server::Wake, only a hang up is polled
+  bool parked_ = false;
+  /// the event stream this connection is subscribed to, no more requests
+  /// are read, only a hang up is polled
+  SseChannel *sse_ = nullptr;
+  InputBuffer buffer_;
+  OutputQueue output_;
+  /// buffer bytes charged to the memory budget of the server
+  size_t accounted_ = 0;
+  std::unique_ptr<RequestState> req_;
   std::unique_ptr<WebsocketConnection> ws_conn_;
+  /// nullptr for a plain connection
+  std::unique_ptr<TlsStream> tls_;
+  std::unique_ptr<Http2Connection> h2_conn_;
 
   friend class Server;
   friend class WebsocketConnection;
+  friend class SseChannel;
+  friend class Http2Connection;
 
+  RequestState &Request();
   int ProcessDataIn();
   std::string &&PopBody();
-  WebsocketConnection *UpgradeToWebsocket(WsHandler ws_on_msg,
-                                          WsHook will_close_hook);
+  WebsocketConnection *UpgradeToWebsocket(const RequestHandler *handlers);
 
-  std::string partial_body_;
-
-  std::optional<std::string> PopLine();
+  std::optional<std::pmr::string> PopLine();
 
   int HandleRequest();
 
-  HttpHeaderParser parser;
+  /// drop the state of the last request and rewind the arena
+  void ResetRequest();
 
   /// @retval -1, error or connection closed
   /// @retval 0, the stream drained, try another time
   /// @retval 1, success, try another read
   int Read();
+
+  /// @brief write the bytes as they are, the frames of HTTP/2 included
+  /// @return same as Write
+  int WriteRaw(const struct iovec *iov, int iovcnt);
+
+  /// @brief queue header and len bytes of file from offset, the file part is
+  /// sent with sendfile
+  /// @return same as Write
+  int WriteFile(const char *header, size_t header_len,
+                std::shared_ptr<const SharedFd> file, off_t offset,
+                size_t len);
+
+  /// @brief queue a reference to buf without sending it, the caller
+  /// schedules the flush
+  /// @retval -1, the output cap is exceeded
+  int QueueShared(SharedBuffer buf);
+
+  /// @brief send the queued output, then let a streamed websocket message
+  /// and the broadcast groups queue what waits for the drain
+  /// @retval 1, drained
+  /// @retval 0, the socket is full
+  /// @retval -1, error
+  int FlushOutput();
+
+  /// @brief free the buffers if they hold nothing
+  void ShrinkIdleBuffers();
+
+  /// @brief called when the input is processed, the data left moves from the
+  /// scratch buffer of the loop to a pooled block, a drained block goes back
+  void SettleInput();
+
+  /// charge the buffer growth to the memory budget of the server
+  void Account();
 };
 } // namespace hpl
\ No newline at end of file
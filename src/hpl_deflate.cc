@@ -0,0 +1,356 @@
+#include "hpl_deflate.h"
+
+#include <stdlib.h>
+#include <zlib.h>
+
+#include <algorithm>
+
+#include "hpl_logger.h"
+
+namespace hpl {
+namespace {
+/// a pooled stream remembers the settings it was made with
+struct PooledStream {
+  z_stream z;
+  int key;
+};
+
+PooledStream *Pooled(z_stream *z) {
+  return reinterpret_cast<PooledStream *>(z);
+}
+
+/// output bytes per inflate call
+constexpr size_t kInflateChunk = 16 * 1024;
+/// the empty stored block a sync flush ends with, stripped from the frames
+constexpr unsigned char kFlushTail[4] = {0x00, 0x00, 0xff, 0xff};
+
+std::string_view Trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+/// @brief the next item of a list separated by sep
+std::string_view NextItem(std::string_view &list, char sep) {
+  auto pos = list.find(sep);
+  auto item = list.substr(0, pos);
+  list.remove_prefix(pos == std::string_view::npos ? list.size() : pos + 1);
+  return Trim(item);
+}
+
+/// @return the window bits, or -1 if value isn't a number in [8, 15]
+int ParseWindowBits(std::string_view value) {
+  if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+    value = value.substr(1, value.size() - 2);
+  }
+  if (value.empty() || value.size() > 2) {
+    return -1;
+  }
+  int bits = 0;
+  for (char c : value) {
+    if (c < '0' || c > '9') {
+      return -1;
+    }
+    bits = bits * 10 + (c - '0');
+  }
+  return bits >= 8 && bits <= 15 ? bits : -1;
+}
+
+/// @brief the params of one permessage-deflate offer
+/// @param client_bits, set to the client_max_window_bits offered, 0 if absent
+/// @return false if the offer is malformed
+bool ParseOffer(std::string_view offer, WsDeflateParams &params,
+                int &client_bits) {
+  client_bits = 0;
+  bool seen[4] = {};
+  while (!offer.empty()) {
+    auto param = NextItem(offer, ';');
+    auto eq = param.find('=');
+    auto name = Trim(param.substr(0, eq));
+    auto value = eq == std::string_view::npos ? std::string_view()
+                                              : Trim(param.substr(eq + 1));
+    int index;
+    if (name == "server_no_context_takeover" && value.empty()) {
+      index = 0;
+      params.server_no_context_takeover = true;
+    } else if (name == "client_no_context_takeover" && value.empty()) {
+      index = 1;
+      params.client_no_context_takeover = true;
+    } else if (name == "server_max_window_bits") {
+      index = 2;
+      params.server_window_bits = ParseWindowBits(value);
+      if (params.server_window_bits == -1) {
+        return false;
+      }
+    } else if (name == "client_max_window_bits") {
+      index = 3;
+      client_bits = value.empty() ? 15 : ParseWindowBits(value);
+      if (client_bits == -1) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+    if (seen[index]) {
+      return false;
+    }
+    seen[index] = true;
+  }
+  return true;
+}
+} // namespace
+
+bool NegotiateDeflate(const WsDeflateOptions &options, std::string_view offers,
+                      WsDeflateParams &params, std::string &response) {
+  // zlib can't compress with a window of 8 bits, it inflates with one
+  const int server_max = std::clamp(options.server_max_window_bits, 9, 15);
+  const int client_max = std::clamp(options.client_max_window_bits, 8, 15);
+  while (!offers.empty()) {
+    auto offer = NextItem(offers, ',');
+    if (NextItem(offer, ';') != "permessage-deflate") {
+      continue;
+    }
+    WsDeflateParams p;
+    int client_bits;
+    if (!ParseOffer(offer, p, client_bits)) {
+      continue;
+    }
+    bool server_bits_asked = p.server_window_bits != 15;
+    p.server_window_bits = std::min(p.server_window_bits, server_max);
+    if (p.server_window_bits < 9) {
+      continue;
+    }
+    // a client that doesn't offer client_max_window_bits may use 15
+    p.client_window_bits =
+        client_bits == 0 ? 15 : std::min(client_bits, client_max);
+    p.server_no_context_takeover |= options.no_context_takeover;
+    p.client_no_context_takeover |= options.no_context_takeover;
+
+    response = "permessage-deflate";
+    if (p.server_no_context_takeover) {
+      response += "; server_no_context_takeover";
+    }
+    if (p.client_no_context_takeover) {
+      response += "; client_no_context_takeover";
+    }
+    if (server_bits_asked || p.server_window_bits != 15) {
+      response += "; server_max_window_bits=";
+      response += std::to_string(p.server_window_bits);
+    }
+    if (client_bits != 0) {
+      response += "; client_max_window_bits=";
+      response += std::to_string(p.client_window_bits);
+    }
+    params = p;
+    return true;
+  }
+  return false;
+}
+
+ZStreamPool::~ZStreamPool() {
+  for (auto &cached : deflaters_) {
+    FreeDeflater(cached.z);
+  }
+  for (auto &cached : inflaters_) {
+    FreeInflater(cached.z);
+  }
+}
+
+z_stream_s *ZStreamPool::TakeDeflater(int level, int window_bits,
+                                      int mem_level) {
+  int key = (level + 1) << 8 | window_bits << 4 | mem_level;
+  for (size_t i = 0; i < deflaters_.size(); ++i) {
+    if (deflaters_[i].key == key) {
+      auto *z = deflaters_[i].z;
+      deflaters_[i] = deflaters_.back();
+      deflaters_.pop_back();
+      return z;
+    }
+  }
+  auto *stream = new PooledStream{};
+  stream->key = key;
+  if (deflateInit2(&stream->z, level, Z_DEFLATED, -window_bits, mem_level,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    LOG_ERROR("deflateInit2 failed: {}", stream->z.msg ? stream->z.msg : "");
+    delete stream;
+    return nullptr;
+  }
+  return &stream->z;
+}
+
+void ZStreamPool::ReturnDeflater(z_stream_s *z) {
+  if (deflaters_.size() >= kMaxCached || deflateReset(z) != Z_OK) {
+    FreeDeflater(z);
+    return;
+  }
+  deflaters_.push_back({z, Pooled(z)->key});
+}
+
+z_stream_s *ZStreamPool::TakeInflater(int window_bits) {
+  for (size_t i = 0; i < inflaters_.size(); ++i) {
+    if (inflaters_[i].key == window_bits) {
+      auto *z = inflaters_[i].z;
+      inflaters_[i] = inflaters_.back();
+      inflaters_.pop_back();
+      return z;
+    }
+  }
+  auto *stream = new PooledStream{};
+  stream->key = window_bits;
+  if (inflateInit2(&stream->z, -window_bits) != Z_OK) {
+    LOG_ERROR("inflateInit2 failed: {}", stream->z.msg ? stream->z.msg : "");
+    delete stream;
+    return nullptr;
+  }
+  return &stream->z;
+}
+
+void ZStreamPool::ReturnInflater(z_stream_s *z) {
+  if (inflaters_.size() >= kMaxCached || inflateReset(z) != Z_OK) {
+    FreeInflater(z);
+    return;
+  }
+  inflaters_.push_back({z, Pooled(z)->key});
+}
+
+void ZStreamPool::FreeDeflater(z_stream_s *z) {
+  deflateEnd(z);
+  delete Pooled(z);
+}
+
+void ZStreamPool::FreeInflater(z_stream_s *z) {
+  inflateEnd(z);
+  delete Pooled(z);
+}
+
+WsDeflate::~WsDeflate() {
+  // a borrowed stream is only held during a message, give it back too
+  if (deflater_ != nullptr) {
+    params_.server_no_context_takeover ? pool_->ReturnDeflater(deflater_)
+                                       : ZStreamPool::FreeDeflater(deflater_);
+  }
+  if (inflater_ != nullptr) {
+    params_.client_no_context_takeover ? pool_->ReturnInflater(inflater_)
+                                       : ZStreamPool::FreeInflater(inflater_);
+  }
+}
+
+bool WsDeflate::Compress(std::string_view data, std::string_view &out) {
+  const bool takeover = !params_.server_no_context_takeover;
+  z_stream *z = deflater_;
+  if (z == nullptr) {
+    z = pool_->TakeDeflater(options_.level, params_.server_window_bits,
+                            options_.mem_level);
+    if (z == nullptr) {
+      return false;
+    }
+    if (takeover) {
+      deflater_ = z;
+    }
+  }
+
+  auto &buf = pool_->DeflateBuffer();
+  buf.resize(std::max<size_t>(buf.size(), data.size() / 2 + 64));
+  z->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  z->avail_in = data.size();
+  size_t produced = 0;
+  bool ok = true;
+  do {
+    if (buf.size() - produced < 64) {
+      buf.resize(buf.size() * 2);
+    }
+    z->next_out = reinterpret_cast<Bytef *>(buf.data() + produced);
+    z->avail_out = buf.size() - produced;
+    int ret = deflate(z, Z_SYNC_FLUSH);
+    produced = buf.size() - z->avail_out;
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      LOG_ERROR("deflate failed: {}", ret);
+      ok = false;
+      break;
+    }
+  } while (z->avail_in > 0 || z->avail_out == 0);
+
+  if (!takeover) {
+    pool_->ReturnDeflater(z);
+  }
+  if (!ok || produced < sizeof(kFlushTail)) {
+    return false;
+  }
+  produced -= sizeof(kFlushTail);
+  // without context takeover nothing depends on this message, a payload
+  // that doesn't shrink is sent as it is
+  if (!takeover && produced >= data.size()) {
+    return false;
+  }
+  out = std::string_view(buf.data(), produced);
+  return true;
+}
+
+int WsDeflate::Decompress(std::string_view piece, bool last,
+                          uint64_t max_size,
+                          const std::function<int(std::string_view)> &sink) {
+  if (inflater_ == nullptr) {
+    inflater_ = pool_->TakeInflater(params_.client_window_bits);
+    if (inflater_ == nullptr) {
+      return -1;
+    }
+  }
+  int ret = Inflate(reinterpret_cast<const unsigned char *>(piece.data()),
+                    piece.size(), max_size, sink);
+  if (ret == 0 && last) {
+    ret = Inflate(kFlushTail, sizeof(kFlushTail), max_size, sink);
+  }
+  if (last || ret != 0) {
+    inflated_ = 0;
+    if (params_.client_no_context_takeover) {
+      pool_->ReturnInflater(inflater_);
+      inflater_ = nullptr;
+    }
+  }
+  return ret;
+}
+
+int WsDeflate::Inflate(const unsigned char *data, size_t len,
+                       uint64_t max_size,
+                       const std::function<int(std::string_view)> &sink) {
+  auto *z = inflater_;
+  auto &buf = pool_->InflateBuffer();
+  if (buf.size() < kInflateChunk) {
+    buf.resize(kInflateChunk);
+  }
+  z->next_in = const_cast<Bytef *>(data);
+  z->avail_in = len;
+  do {
+    z->next_out = reinterpret_cast<Bytef *>(buf.data());
+    z->avail_out = buf.size();
+    int ret = inflate(z, Z_SYNC_FLUSH);
+    if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END) {
+      LOG_ERROR("inflate failed: {} {}", ret, z->msg ? z->msg : "");
+      return -1;
+    }
+    size_t out = buf.size() - z->avail_out;
+    if (out > 0) {
+      inflated_ += out;
+      if (max_size != 0 && inflated_ > max_size) {
+        return -2;
+      }
+      if (sink(std::string_view(buf.data(), out)) == -1) {
+        return -1;
+      }
+    }
+    if (ret == Z_STREAM_END) {
+      // the sender ended the deflate stream, what follows is the flush tail
+      inflateReset(z);
+      break;
+    }
+    if (ret == Z_BUF_ERROR && out == 0) {
+      break;
+    }
+  } while (z->avail_in > 0 || z->avail_out == 0);
+  return 0;
+}
+} // namespace hpl
@@ -0,0 +1,130 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef _HPL_DEFLATE_H_
+#define _HPL_DEFLATE_H_
+
+struct z_stream_s;
+
+namespace hpl {
+/// @brief permessage-deflate (RFC 7692) settings of a websocket route
+struct WsDeflateOptions {
+  bool enable = false;
+  /// messages shorter than this go out uncompressed
+  size_t threshold = 256;
+  /// zlib level, 1 fastest .. 9 smallest
+  int level = 6;
+  /// compress every message on its own, with zlib streams shared by all the
+  /// connections of the server. otherwise a connection keeps its compressor,
+  /// about 256 KiB with the default window and mem_level
+  bool no_context_takeover = true;
+  /// LZ77 windows, 9..15, a smaller window takes less memory
+  int server_max_window_bits = 15;
+  int client_max_window_bits = 15;
+  /// zlib memLevel of the compressor, 1..9
+  int mem_level = 8;
+};
+
+/// @brief what the handshake agreed on
+struct WsDeflateParams {
+  bool server_no_context_takeover = false;
+  bool client_no_context_takeover = false;
+  int server_window_bits = 15;
+  int client_window_bits = 15;
+};
+
+/// @brief accept the first permessage-deflate offer that fits options
+/// @param offers, the Sec-WebSocket-Extensions header of the request
+/// @param response, the Sec-WebSocket-Extensions header of the 101
+/// @return false if no offer is acceptable
+bool NegotiateDeflate(const WsDeflateOptions &options, std::string_view offers,
+                      WsDeflateParams &params, std::string &response);
+
+/// @brief zlib streams and buffers of a server, kept for reuse.
+/// a connection without context takeover takes a stream for a message only
+class ZStreamPool {
+public:
+  ZStreamPool() = default;
+  ~ZStreamPool();
+  ZStreamPool(const ZStreamPool &) = delete;
+  ZStreamPool &operator=(const ZStreamPool &) = delete;
+
+  /// @return nullptr if zlib fails
+  z_stream_s *TakeDeflater(int level, int window_bits, int mem_level);
+  void ReturnDeflater(z_stream_s *z);
+  z_stream_s *TakeInflater(int window_bits);
+  void ReturnInflater(z_stream_s *z);
+
+  static void FreeDeflater(z_stream_s *z);
+  static void FreeInflater(z_stream_s *z);
+
+  /// output of the compressor, valid until the next message is compressed
+  inline std::string &DeflateBuffer() { return deflate_buf_; }
+  inline std::string &InflateBuffer() { return inflate_buf_; }
+
+private:
+  /// idle streams kept per kind
+  static constexpr size_t kMaxCached = 8;
+
+  struct Cached {
+    z_stream_s *z;
+    int key;
+  };
+  std::vector<Cached> deflaters_;
+  std::vector<Cached> inflaters_;
+  std::string deflate_buf_;
+  std::string inflate_buf_;
+};
+
+/// @brief the permessage-deflate state of a websocket connection
+class WsDeflate {
+public:
+  WsDeflate(const WsDeflateOptions &options, const WsDeflateParams &params,
+            ZStreamPool *pool)
+      : options_(options), params_(params), pool_(pool) {}
+  ~WsDeflate();
+  WsDeflate(const WsDeflate &) = delete;
+  WsDeflate &operator=(const WsDeflate &) = delete;
+
+  inline size_t Threshold() const { return options_.threshold; }
+  /// messages compressed on their own, a frame compressed once can be shared
+  inline bool Stateless() const { return params_.server_no_context_takeover; }
+  inline int WindowBits() const { return params_.server_window_bits; }
+
+  /// @brief compress a message
+  /// @param out, set to the compressed payload, in the pool buffer
+  /// @return false if the message should go out uncompressed
+  bool Compress(std::string_view data, std::string_view &out);
+
+  /// @brief feed a piece of a compressed message
+  /// @param last, the piece ends the message
+  /// @param max_size, of the inflated message, 0 means unlimited
+  /// @param sink, gets the inflated bytes, a return of -1 stops
+  /// @retval -2, the inflated message is over max_size
+  /// @retval -1, a corrupt stream, or the sink returned -1
+  /// @retval 0, ok
+  int Decompress(std::string_view piece, bool last, uint64_t max_size,
+                 const std::function<int(std::string_view)> &sink);
+
+private:
+  int Inflate(const unsigned char *data, size_t len, uint64_t max_size,
+              const std::function<int(std::string_view)> &sink);
+
+  const WsDeflateOptions &options_;
+  const WsDeflateParams params_;
+  ZStreamPool *pool_;
+  /// owned with context takeover, borrowed during a message otherwise
+  z_stream_s *deflater_ = nullptr;
+  z_stream_s *inflater_ = nullptr;
+  /// inflated bytes of the message
+  uint64_t inflated_ = 0;
+};
+} // namespace hpl
+
+#endif // _HPL_DEFLATE_H_
@@ -11,22 +11,82 @@ static const std::string_view kHost = "host:";
 static const std::string_view kConnection = "connection:";
 static const std::string_view kUpgrade = "upgrade:";
 static const std::string_view kUserAgent = "user-agent:";
+static const std::string_view kTransferEncoding = "transfer-encoding:";
 
 static const std::string_view kUpgradeWs = "websocket";
+
+/// chars allowed in a request target, RFC 3986 unreserved, reserved and '%'
+struct UriChars {
+  bool allowed[256] = {};
+  constexpr UriChars() {
+    for (int c = 'a'; c <= 'z'; ++c) {
+      allowed[c] = true;
+    }
+    for (int c = 'A'; c <= 'Z'; ++c) {
+      allowed[c] = true;
+    }
+    for (int c = '0'; c <= '9'; ++c) {
+      allowed[c] = true;
+    }
+    for (unsigned char c : std::string_view("-._~:/?#[]@!$&'()*+,;=%")) {
+      allowed[c] = true;
+    }
+  }
+};
+constexpr UriChars kUriChars;
 } // namespace
 
 namespace hpl {
 
+HttpHeaderParser::HttpHeaderParser(std::pmr::memory_resource *mr,
+                                   bool response)
+    : resource_(mr), response_(response), uri_(mr), headers_(mr), host_(mr),
+      connection_(mr), user_agent_(mr) {}
+
+void HttpHeaderParser::Reset() {
+  // move-assign fresh members, the old storage goes back to the resource
+  method_ = HttpMethod::UNKNOWN;
+  uri_ = std::pmr::string(resource_);
+  version_ = HttpVersion::UNKNOWN;
+  headers_ = HeaderMap(resource_);
+  connection_flags_ = 0;
+  upgrade_flags_ = 0;
+  host_ = std::pmr::string(resource_);
+  connection_ = std::pmr::string(resource_);
+  user_agent_ = std::pmr::string(resource_);
+  content_length_.reset();
+  body_length_ = 0;
+  status_ = 0;
+  chunked_ = false;
+  state_ = ParserState::FirstLine;
+}
+
 HttpHeaderParser::ParserState
-HttpHeaderParser::PushLine(const std::string &line) {
-  if (state_ == ParserState::FirstLine) {
+HttpHeaderParser::PushLine(std::string_view line) {
+  if (state_ == ParserState::FirstLine && response_) {
+    status_ = ParseStatusLine(line);
+    if (status_ == 0) {
+      LOG_DEBUG("bad status line: [{}]", line);
+      state_ = ParserState::Done;
+      return state_;
+    }
+    state_ = ParserState::Headers;
+    LOG_DEBUG("status: {}, version: {}", status_,
+              static_cast<unsigned>(version_));
+  } else if (state_ == ParserState::FirstLine) {
     std::string_view sv;
     std::tie(method_, sv, version_) = ParseFirstLine(line);
+    if (method_ == HttpMethod::UNKNOWN) {
+      // nothing after a bad request line can be trusted. any client can
+      // send one, so it doesn't flood the error log
+      LOG_DEBUG("bad request line: [{}]", line);
+      state_ = ParserState::Done;
+      return state_;
+    }
     state_ = ParserState::Headers;
-    uri_ = std::string(sv);
-    LOG_DEBUG("method: {}, uri: {}, version: {}",
-              static_cast<unsigned>(method_), uri_,
-              static_cast<unsigned>(version_));
+    uri_.assign(sv);
+    LOG_DEBUG("method: {}, uri: {}, version: {}", HttpMethodToString(method_),
+              uri_, static_cast<unsigned>(version_));
   } else if (state_ == ParserState::Headers) {
     if (line == ("\r\n")) {
       if (content_length_) {
@@ -51,7 +111,7 @@ HttpHeaderParser::PushLine(const std::string &line) {
 
     auto iter = next_char(line, 0, [](auto c) { return c != ' '; });
     auto offset = std::distance(line.begin(), iter);
-    std::string_view key(line.data() + offset);
+    auto key = line.substr(offset);
     if (icase_cmp(key, kContentLength)) {
       std::advance(iter, kContentLength.size());
       iter = next_char(line, std::distance(line.begin(), iter),
@@ -70,8 +130,7 @@ HttpHeaderParser::PushLine(const std::string &line) {
           break;
         }
 
-        std::string_view value_sv(line.data() +
-                                  std::distance(line.begin(), iter));
+        auto value_sv = line.substr(std::distance(line.begin(), iter));
         if (icase_cmp(value_sv, kUpgradeWs)) {
           upgrade_flags_ |= UpgradeWebSocket;
           iter = next_char(line, std::distance(line.begin(), iter) + 1,
@@ -85,7 +144,7 @@ HttpHeaderParser::PushLine(const std::string &line) {
                        [](auto c) { return c != ' '; });
       auto end_iter = next_char(line, std::distance(line.begin(), iter),
                                 [](auto c) { return c == '\r' || c == '\n'; });
-      host_ = std::string(iter, end_iter);
+      host_.assign(iter, end_iter);
       LOG_DEBUG("host: [{}]", host_);
     } else if (icase_cmp(key, kConnection)) {
       std::advance(iter, kConnection.size() + 1);
@@ -100,7 +159,7 @@ HttpHeaderParser::PushLine(const std::string &line) {
           break;
         }
         auto offset = std::distance(line.begin(), iter);
-        std::string_view value_sv(line.data() + offset);
+        auto value_sv = line.substr(offset);
         if (icase_cmp(value_sv, kUpgrade)) {
           connection_flags_ |= ConnectionFlags::ConnectionUpgrade;
           iter += kUpgrade.size();
@@ -125,13 +184,24 @@ HttpHeaderParser::PushLine(const std::string &line) {
         }
       } while (true);
       LOG_DEBUG("connection: {:#x}", connection_flags_);
+    } else if (response_ && icase_cmp(key, kTransferEncoding)) {
+      // the body of a response is framed by its last coding
+      auto value = line.substr(offset + kTransferEncoding.size());
+      while (!value.empty() &&
+             (value.back() == '\r' || value.back() == '\n' ||
+              value.back() == ' ')) {
+        value.remove_suffix(1);
+      }
+      chunked_ = value.size() >= 7 &&
+                 icase_cmp(value.substr(value.size() - 7), "chunked");
+      LOG_DEBUG("chunked: {}", chunked_);
     } else if (icase_cmp(key, kUserAgent)) {
       std::advance(iter, kUserAgent.size());
       iter = next_char(line, std::distance(line.begin(), iter),
                        [](auto c) { return c != ' '; });
       auto end_iter = next_char(line, std::distance(line.begin(), iter),
                                 [](auto c) { return c == '\r' || c == '\n'; });
-      user_agent_ = std::string(iter, end_iter);
+      user_agent_.assign(iter, end_iter);
       LOG_DEBUG("user agent: [{}]", user_agent_);
     } else {
       iter = next_char(line, std::distance(line.begin(), iter),
@@ -139,13 +209,13 @@ HttpHeaderParser::PushLine(const std::string &line) {
       if (iter == line.end()) {
         return state_;
       }
-      auto key = std::string(line.begin(), iter);
+      auto key = std::pmr::string(line.begin(), iter, resource_);
       std::advance(iter, 1);
       iter = next_char(line, std::distance(line.begin(), iter),
                        [](auto c) { return c != ' '; });
       auto end_iter = next_char(line, std::distance(line.begin(), iter),
                                 [](auto c) { return c == '\r' || c == '\n'; });
-      auto value = std::string(iter, end_iter);
+      auto value = std::pmr::string(iter, end_iter, resource_);
       headers_.emplace(std::move(key), std::move(value));
     }
   } else if (state_ == ParserState::Body) {
@@ -162,18 +232,58 @@ HttpHeaderParser::PushLine(const std::string &line) {
 
 std::tuple<HttpMethod, std::string_view, HttpVersion>
 HttpHeaderParser::ParseFirstLine(std::string_view line) {
+  static const std::tuple<HttpMethod, std::string_view, HttpVersion> kBad = {
+      HttpMethod::UNKNOWN, "", HttpVersion::UNKNOWN};
+  // method SP request-target SP version CRLF, in one pass
   size_t pos = 0;
   auto method = ParseHttpMethod(line, 0, pos);
   if (method == HttpMethod::UNKNOWN) {
-    return {HttpMethod::UNKNOWN, "", HttpVersion::UNKNOWN};
+    return kBad;
   }
 
-  while (line[pos] == ' ') {
+  size_t uri_begin = pos + 1;
+  pos = uri_begin;
+  while (pos < line.size() &&
+         kUriChars.allowed[static_cast<unsigned char>(line[pos])]) {
     ++pos;
   }
-  auto next_pos = line.find(' ', pos);
-  auto uri = line.substr(pos, next_pos - pos);
-  auto version = ParseHttpVersion(line.data() + next_pos + 1, pos);
+  if (pos == uri_begin || pos >= line.size() || line[pos] != ' ') {
+    return kBad;
+  }
+  auto uri = line.substr(uri_begin, pos - uri_begin);
+
+  size_t version_len = 0;
+  auto rest = line.substr(pos + 1);
+  auto version = ParseHttpVersion(rest, version_len);
+  rest.remove_prefix(version_len);
+  if (version == HttpVersion::UNKNOWN ||
+      (!rest.empty() && rest != "\r\n" && rest != "\n")) {
+    return kBad;
+  }
   return {method, uri, version};
 }
-} // namespace hpl
\ No newline at end of file
+
+int HttpHeaderParser::ParseStatusLine(std::string_view line) {
+  size_t version_len = 0;
+  auto version = ParseHttpVersion(line, version_len);
+  if ((version != HttpVersion::HTTP_1_0 && version != HttpVersion::HTTP_1_1) ||
+      line.size() < version_len + 4 || line[version_len] != ' ') {
+    return 0;
+  }
+  int status = 0;
+  for (size_t i = version_len + 1; i < version_len + 4; ++i) {
+    if (line[i] < '0' || line[i] > '9') {
+      return 0;
+    }
+    status = status * 10 + line[i] - '0';
+  }
+  // the reason phrase may be empty, even without its space
+  auto rest = line.substr(version_len + 4);
+  if (status < 100 ||
+      (!rest.empty() && rest[0] != ' ' && rest != "\r\n" && rest != "\n")) {
+    return 0;
+  }
+  version_ = version;
+  return status;
+}
+} // namespace hpl
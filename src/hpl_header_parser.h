@@ -1,8 +1,10 @@
 #pragma once
 
 #include <map>
+#include <memory_resource>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <vector>
 
@@ -22,7 +24,20 @@ public:
   using UpgradeFlags = enum UpgradeFlags {
     UpgradeWebSocket = 1,
   };
-  ParserState PushLine(const std::string &line);
+  using HeaderMap =
+      std::pmr::map<std::pmr::string, std::pmr::string, std::less<>>;
+
+  /// @param mr, where the uri and the header strings are allocated from
+  /// @param response, the first line is a status line, e.g. of a backend
+  explicit HttpHeaderParser(
+      std::pmr::memory_resource *mr = std::pmr::get_default_resource(),
+      bool response = false);
+
+  ParserState PushLine(std::string_view line);
+
+  /// @brief drop the parse results, ready for the next request
+  /// @note call it before the memory resource is reset
+  void Reset();
 
   inline ParserState GetState() const { return state_; }
   inline HttpMethod GetMethod() const { return method_; }
@@ -30,10 +45,8 @@ public:
   inline HttpVersion GetVersion() const { return version_; }
   inline std::string_view GetHost() const { return host_; }
   inline std::string_view GetUserAgent() const { return user_agent_; }
-  inline const std::map<std::string, std::string> &GetHeaders() const {
-    return headers_;
-  }
-  inline std::string_view GetHeader(const std::string &key) const {
+  inline const HeaderMap &GetHeaders() const { return headers_; }
+  inline std::string_view GetHeader(std::string_view key) const {
     auto it = headers_.find(key);
     if (it == headers_.end()) {
       return std::string_view();
@@ -46,28 +59,41 @@ public:
     return content_length_;
   }
   inline unsigned GetUpgradeFlags() const { return upgrade_flags_; }
+  inline unsigned GetBodyLength() const { return body_length_; }
+  /// the status code of a response, 0 until its status line is parsed
+  inline int GetStatus() const { return status_; }
+  /// a response with Transfer-Encoding: chunked
+  inline bool IsChunked() const { return chunked_; }
 
 private:
+  std::pmr::memory_resource *resource_;
+  const bool response_;
+
   // parse results
   HttpMethod method_ = HttpMethod::UNKNOWN;
-  std::string uri_;
+  std::pmr::string uri_;
   HttpVersion version_ = HttpVersion::UNKNOWN;
-  std::map<std::string, std::string> headers_;
+  HeaderMap headers_;
 
   unsigned connection_flags_ = 0;
   unsigned upgrade_flags_ = 0;
 
   // special headers
-  std::string host_;
-  std::string connection_;
-  std::string user_agent_;
+  std::pmr::string host_;
+  std::pmr::string connection_;
+  std::pmr::string user_agent_;
   std::optional<unsigned> content_length_;
 
   unsigned body_length_ = 0;
+  int status_ = 0;
+  bool chunked_ = false;
 
 private:
   ParserState state_ = ParserState::FirstLine;
   std::tuple<HttpMethod, std::string_view, HttpVersion>
   ParseFirstLine(std::string_view line);
+  /// @brief HTTP/1.x SP 3DIGIT SP reason CRLF
+  /// @return the status, 0 if the line is malformed
+  int ParseStatusLine(std::string_view line);
 };
 } // namespace hpl
\ No newline at end of file
@@ -0,0 +1,471 @@
+#include "hpl_hpack.h"
+
+#include <algorithm>
+
+#include "hpl_logger.h"
+
+namespace hpl {
+namespace {
+/// RFC 7541 Appendix A
+const HeaderField kStaticTable[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+constexpr size_t kStaticTableSize =
+    sizeof(kStaticTable) / sizeof(*kStaticTable);
+constexpr size_t kEntryOverhead = 32;
+constexpr int kEos = 256;
+
+/// RFC 7541 Appendix B, the code and its length in bits by symbol
+const struct {
+  uint32_t code;
+  uint8_t bits;
+} kHuffmanCodes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13}, {0x15, 6},
+    {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6}, {0x0, 5}, {0x1, 5}, {0x2, 5},
+    {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6},
+    {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7},
+    {0x61, 7}, {0x62, 7}, {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7},
+    {0x68, 7}, {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7}, {0xfd, 8},
+    {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6},
+    {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6},
+    {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5},
+    {0x2d, 6}, {0x77, 7}, {0x78, 7}, {0x79, 7}, {0x7a, 7}, {0x7b, 7},
+    {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22},
+    {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22},
+    {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23},
+    {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23}, {0xffffec, 24},
+    {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24},
+    {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23},
+    {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22},
+    {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22},
+    {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22},
+    {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21}, {0x7fffea, 23},
+    {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21},
+    {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21},
+    {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23},
+    {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20},
+    {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23},
+    {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23}, {0x3ffffe0, 26},
+    {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22},
+    {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26},
+    {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27},
+    {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19},
+    {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27},
+    {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24}, {0x1fffe4, 21},
+    {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28},
+    {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20},
+    {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22},
+    {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22},
+    {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24},
+    {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23}, {0x3ffffeb, 26},
+    {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27},
+    {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27},
+    {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27},
+    {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+};
+
+/// a node of the decoding tree, a leaf has a symbol
+struct HuffmanNode {
+  int16_t next[2] = {-1, -1};
+  int16_t symbol = -1;
+};
+
+const std::vector<HuffmanNode> &HuffmanTree() {
+  static const std::vector<HuffmanNode> tree = [] {
+    std::vector<HuffmanNode> nodes(1);
+    for (int symbol = 0; symbol <= kEos; ++symbol) {
+      const auto &code = kHuffmanCodes[symbol];
+      size_t node = 0;
+      for (int i = code.bits - 1; i >= 0; --i) {
+        int bit = (code.code >> i) & 1;
+        if (nodes[node].next[bit] == -1) {
+          nodes[node].next[bit] = static_cast<int16_t>(nodes.size());
+          nodes.emplace_back();
+        }
+        node = nodes[node].next[bit];
+      }
+      nodes[node].symbol = static_cast<int16_t>(symbol);
+    }
+    return nodes;
+  }();
+  return tree;
+}
+
+void EncodeInt(uint64_t value, int prefix, uint8_t flags, std::string *out) {
+  const uint64_t max = (1u << prefix) - 1;
+  if (value < max) {
+    out->push_back(static_cast<char>(flags | value));
+    return;
+  }
+  out->push_back(static_cast<char>(flags | max));
+  value -= max;
+  while (value >= 128) {
+    out->push_back(static_cast<char>(value % 128 + 128));
+    value /= 128;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+/// @return false if the integer is truncated or too large
+bool DecodeInt(const unsigned char *&p, const unsigned char *end, int prefix,
+               uint64_t *value) {
+  if (p == end) {
+    return false;
+  }
+  const uint64_t max = (1u << prefix) - 1;
+  uint64_t v = *p++ & max;
+  if (v < max) {
+    *value = v;
+    return true;
+  }
+  // 4 continuation bytes are plenty for any size or index
+  for (int shift = 0; p != end && shift <= 28; shift += 7) {
+    uint8_t b = *p++;
+    v += static_cast<uint64_t>(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      *value = v;
+      return true;
+    }
+  }
+  return false;
+}
+
+void EncodeString(std::string_view s, std::string *out) {
+  size_t huffman_size = HuffmanEncodedSize(s);
+  if (huffman_size < s.size()) {
+    EncodeInt(huffman_size, 7, 0x80, out);
+    HuffmanEncode(s, out);
+  } else {
+    EncodeInt(s.size(), 7, 0, out);
+    out->append(s);
+  }
+}
+
+bool DecodeString(const unsigned char *&p, const unsigned char *end,
+                  std::string *out) {
+  if (p == end) {
+    return false;
+  }
+  const bool huffman = (*p & 0x80) != 0;
+  uint64_t length;
+  if (!DecodeInt(p, end, 7, &length) ||
+      length > static_cast<uint64_t>(end - p)) {
+    return false;
+  }
+  std::string_view raw(reinterpret_cast<const char *>(p), length);
+  p += length;
+  out->clear();
+  if (huffman) {
+    return HuffmanDecode(raw, out) == 0;
+  }
+  out->assign(raw);
+  return true;
+}
+} // namespace
+
+void HuffmanEncode(std::string_view in, std::string *out) {
+  uint64_t acc = 0;
+  int bits = 0;
+  for (unsigned char c : in) {
+    const auto &code = kHuffmanCodes[c];
+    acc = (acc << code.bits) | code.code;
+    bits += code.bits;
+    while (bits >= 8) {
+      bits -= 8;
+      out->push_back(static_cast<char>(acc >> bits));
+    }
+  }
+  if (bits > 0) {
+    // padded with the most significant bits of EOS
+    out->push_back(static_cast<char>((acc << (8 - bits)) | (0xff >> bits)));
+  }
+}
+
+size_t HuffmanEncodedSize(std::string_view in) {
+  size_t bits = 0;
+  for (unsigned char c : in) {
+    bits += kHuffmanCodes[c].bits;
+  }
+  return (bits + 7) / 8;
+}
+
+int HuffmanDecode(std::string_view in, std::string *out) {
+  const auto &tree = HuffmanTree();
+  size_t node = 0;
+  int pending_bits = 0;
+  bool all_ones = true;
+  for (unsigned char c : in) {
+    for (int i = 7; i >= 0; --i) {
+      int bit = (c >> i) & 1;
+      node = tree[node].next[bit];
+      ++pending_bits;
+      all_ones = all_ones && bit == 1;
+      if (tree[node].symbol == -1) {
+        continue;
+      }
+      if (tree[node].symbol == kEos) {
+        return -1;
+      }
+      out->push_back(static_cast<char>(tree[node].symbol));
+      node = 0;
+      pending_bits = 0;
+      all_ones = true;
+    }
+  }
+  return pending_bits <= 7 && all_ones ? 0 : -1;
+}
+
+const HeaderField *HpackTable::Get(size_t index) const {
+  if (index == 0) {
+    return nullptr;
+  }
+  if (index <= kStaticTableSize) {
+    return &kStaticTable[index - 1];
+  }
+  index -= kStaticTableSize + 1;
+  return index < entries_.size() ? &entries_[index] : nullptr;
+}
+
+void HpackTable::Add(std::string_view name, std::string_view value) {
+  const size_t size = name.size() + value.size() + kEntryOverhead;
+  if (size > max_size_) {
+    // an entry larger than the table empties it
+    entries_.clear();
+    size_ = 0;
+    return;
+  }
+  while (size_ + size > max_size_) {
+    const auto &last = entries_.back();
+    size_ -= last.name.size() + last.value.size() + kEntryOverhead;
+    entries_.pop_back();
+  }
+  entries_.push_front({std::string(name), std::string(value)});
+  size_ += size;
+}
+
+void HpackTable::Resize(size_t max_size) {
+  max_size_ = max_size;
+  while (size_ > max_size_) {
+    const auto &last = entries_.back();
+    size_ -= last.name.size() + last.value.size() + kEntryOverhead;
+    entries_.pop_back();
+  }
+}
+
+std::pair<size_t, bool> HpackTable::Find(std::string_view name,
+                                         std::string_view value) const {
+  size_t name_index = 0;
+  for (size_t i = 0; i < kStaticTableSize; ++i) {
+    if (kStaticTable[i].name != name) {
+      continue;
+    }
+    if (kStaticTable[i].value == value) {
+      return {i + 1, true};
+    }
+    if (name_index == 0) {
+      name_index = i + 1;
+    }
+  }
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    if (entries_[i].name != name) {
+      continue;
+    }
+    if (entries_[i].value == value) {
+      return {kStaticTableSize + 1 + i, true};
+    }
+    if (name_index == 0) {
+      name_index = kStaticTableSize + 1 + i;
+    }
+  }
+  return {name_index, false};
+}
+
+int HpackDecoder::Decode(std::string_view block,
+                         std::vector<HeaderField> *fields) {
+  fields->clear();
+  auto *p = reinterpret_cast<const unsigned char *>(block.data());
+  const auto *end = p + block.size();
+  size_t list_size = 0;
+  while (p != end) {
+    const uint8_t b = *p;
+    uint64_t index;
+    if (b & 0x80) {
+      // indexed field
+      const HeaderField *field;
+      if (!DecodeInt(p, end, 7, &index) ||
+          (field = table_.Get(index)) == nullptr) {
+        LOG_ERROR("hpack bad index");
+        return -1;
+      }
+      fields->push_back(*field);
+    } else if ((b & 0xe0) == 0x20) {
+      // a size update comes before the fields
+      if (!DecodeInt(p, end, 5, &index) || index > table_limit_ ||
+          !fields->empty()) {
+        LOG_ERROR("hpack bad table size update");
+        return -1;
+      }
+      table_.Resize(index);
+      continue;
+    } else {
+      // a literal, with incremental indexing, without, or never indexed
+      const bool indexing = (b & 0xc0) == 0x40;
+      HeaderField field;
+      if (!DecodeInt(p, end, indexing ? 6 : 4, &index)) {
+        LOG_ERROR("hpack bad literal");
+        return -1;
+      }
+      if (index != 0) {
+        const auto *name = table_.Get(index);
+        if (name == nullptr) {
+          LOG_ERROR("hpack bad name index");
+          return -1;
+        }
+        field.name = name->name;
+      } else if (!DecodeString(p, end, &field.name)) {
+        LOG_ERROR("hpack bad name");
+        return -1;
+      }
+      if (!DecodeString(p, end, &field.value)) {
+        LOG_ERROR("hpack bad value");
+        return -1;
+      }
+      if (indexing) {
+        table_.Add(field.name, field.value);
+      }
+      fields->push_back(std::move(field));
+    }
+    const auto &last = fields->back();
+    list_size += last.name.size() + last.value.size() + kEntryOverhead;
+    if (list_size > max_list_size_) {
+      LOG_ERROR("hpack header list over [{}]", max_list_size_);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void HpackEncoder::SetMaxTableSize(size_t size) {
+  // the encoder never needs more than the default
+  size = std::min(size, HpackDecoder::kDefaultTableSize);
+  min_update_ = std::min(min_update_, size);
+  pending_update_ = size;
+}
+
+void HpackEncoder::Encode(
+    const std::vector<std::pair<std::string_view, std::string_view>> &fields,
+    std::string *out) {
+  if (pending_update_ != SIZE_MAX) {
+    // the smallest size goes first if the table shrank and grew again
+    // and the peer evicts down to it, so must the encoder
+    if (min_update_ < pending_update_) {
+      EncodeInt(min_update_, 5, 0x20, out);
+      table_.Resize(min_update_);
+    }
+    EncodeInt(pending_update_, 5, 0x20, out);
+    table_.Resize(pending_update_);
+    min_update_ = SIZE_MAX;
+    pending_update_ = SIZE_MAX;
+  }
+  for (const auto &[name, value] : fields) {
+    auto [index, full] = table_.Find(name, value);
+    if (full) {
+      EncodeInt(index, 7, 0x80, out);
+      continue;
+    }
+    // values changing with every response would only churn the table
+    const bool sensitive = name == "set-cookie";
+    const bool indexing =
+        !sensitive && name != "content-length" && name != "date" &&
+        name != "etag" && name != "last-modified" && name != "age" &&
+        name != "expires" &&
+        name.size() + value.size() + kEntryOverhead <=
+            table_.GetMaxSize() / 4;
+    if (indexing) {
+      EncodeInt(index, 6, 0x40, out);
+    } else {
+      EncodeInt(index, 4, sensitive ? 0x10 : 0, out);
+    }
+    if (index == 0) {
+      EncodeString(name, out);
+    }
+    EncodeString(value, out);
+    if (indexing) {
+      table_.Add(name, value);
+    }
+  }
+}
+} // namespace hpl
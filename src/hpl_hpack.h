@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#ifndef _HPL_HPACK_H_
+#define _HPL_HPACK_H_
+
+namespace hpl {
+/// a header field of HTTP/2, the names are lower case
+struct HeaderField {
+  std::string name;
+  std::string value;
+};
+
+/// @brief the Huffman code of RFC 7541, appended to out
+void HuffmanEncode(std::string_view in, std::string *out);
+size_t HuffmanEncodedSize(std::string_view in);
+/// @retval -1, the padding is not the EOS prefix, or EOS is coded
+int HuffmanDecode(std::string_view in, std::string *out);
+
+/// @brief the dynamic table of one direction, the newest entry first
+class HpackTable {
+public:
+  explicit HpackTable(size_t max_size) : max_size_(max_size) {}
+
+  /// @brief a field of the static and the dynamic table, 1-based
+  /// @return nullptr if index is out of both
+  const HeaderField *Get(size_t index) const;
+  void Add(std::string_view name, std::string_view value);
+  /// @brief evict until the table fits in max_size
+  void Resize(size_t max_size);
+  inline size_t GetMaxSize() const { return max_size_; }
+
+  /// @brief the index of name and value, or of name alone
+  /// @return 0 if not found, the bool is set if the value matches too
+  std::pair<size_t, bool> Find(std::string_view name,
+                               std::string_view value) const;
+
+private:
+  std::deque<HeaderField> entries_;
+  /// the sizes of the entries, 32 bytes of overhead each
+  size_t size_ = 0;
+  size_t max_size_;
+};
+
+/// @brief decodes the header blocks of one connection, in order
+class HpackDecoder {
+public:
+  /// @param table_limit, the SETTINGS_HEADER_TABLE_SIZE advertised
+  /// @param max_list_size, the decoded fields of a block, with 32 bytes of
+  /// overhead each, larger blocks are an error
+  HpackDecoder(size_t table_limit, size_t max_list_size)
+      : table_(kDefaultTableSize), table_limit_(table_limit),
+        max_list_size_(max_list_size) {}
+
+  /// @brief decode a complete header block into fields
+  /// @retval -1, a COMPRESSION_ERROR, the connection can't go on
+  int Decode(std::string_view block, std::vector<HeaderField> *fields);
+
+  static constexpr size_t kDefaultTableSize = 4096;
+
+private:
+  HpackTable table_;
+  const size_t table_limit_;
+  const size_t max_list_size_;
+};
+
+/// @brief encodes the response headers of one connection
+class HpackEncoder {
+public:
+  HpackEncoder() : table_(HpackDecoder::kDefaultTableSize) {}
+
+  /// @brief the SETTINGS_HEADER_TABLE_SIZE of the peer, the update is
+  /// signaled at the start of the next block
+  void SetMaxTableSize(size_t size);
+  /// @brief append the block of fields to out
+  void Encode(const std::vector<std::pair<std::string_view, std::string_view>>
+                  &fields,
+              std::string *out);
+
+private:
+  HpackTable table_;
+  /// the smallest size set since the last block, and the latest
+  size_t min_update_ = SIZE_MAX;
+  size_t pending_update_ = SIZE_MAX;
+};
+} // namespace hpl
+
+#endif // _HPL_HPACK_H_
@@ -0,0 +1,1060 @@
+#include "hpl_http2_connection.h"
+
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <charconv>
+
+#include "hpl_connection.h"
+#include "hpl_logger.h"
+#include "hpl_server.h"
+
+namespace hpl {
+namespace {
+/// headers of the HTTP/1 connection, not allowed in HTTP/2
+bool IsConnectionHeader(std::string_view name) {
+  return name == "connection" || name == "keep-alive" ||
+         name == "proxy-connection" || name == "transfer-encoding" ||
+         name == "upgrade";
+}
+
+/// the names reach the handlers as HTTP/1 clients usually spell them
+void AppendTitleCase(std::string_view name, std::string *out) {
+  bool upper = true;
+  for (char c : name) {
+    out->push_back(upper && c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c);
+    upper = c == '-';
+  }
+}
+} // namespace
+
+Http2Connection::Http2Connection(Connection *conn, const Http2Options &options)
+    : conn_(conn), options_([&options] {
+        auto clamped = options;
+        clamped.initial_window = std::clamp(
+            clamped.initial_window, kHttp2DefaultWindow, kHttp2MaxWindow);
+        clamped.max_frame_size = std::clamp(
+            clamped.max_frame_size, kHttp2DefaultFrameSize, 0xffffffu);
+        return clamped;
+      }()),
+      decoder_(options_.header_table_size, options_.max_header_list_size),
+      recv_window_(options_.initial_window) {}
+
+int Http2Connection::SelectStream(uint32_t id) {
+  auto *stream = Find(id);
+  if (stream == nullptr || stream->local_closed) {
+    return -1;
+  }
+  current_ = id;
+  return 0;
+}
+
+int Http2Connection::Start() {
+  std::string settings;
+  AppendSettings(&settings, Http2Setting::kMaxConcurrentStreams,
+                 options_.max_concurrent_streams);
+  AppendSettings(&settings, Http2Setting::kInitialWindowSize,
+                 options_.initial_window);
+  AppendSettings(&settings, Http2Setting::kMaxFrameSize,
+                 options_.max_frame_size);
+  AppendSettings(&settings, Http2Setting::kHeaderTableSize,
+                 options_.header_table_size);
+  AppendSettings(&settings, Http2Setting::kMaxHeaderListSize,
+                 options_.max_header_list_size);
+  AppendHttp2FrameHeader(&out_, settings.size(), Http2FrameType::kSettings, 0,
+                         0);
+  out_ += settings;
+  // the connection window isn't a setting
+  if (options_.initial_window > kHttp2DefaultWindow) {
+    AppendWindowUpdate(&out_, 0, options_.initial_window - kHttp2DefaultWindow);
+  }
+  return Flush();
+}
+
+int Http2Connection::Read() {
+  // edge triggered connections must drain the socket, a tls connection its
+  // records
+  const bool drain =
+      conn_->svr_->GetMemoryPolicy().edge_triggered || conn_->tls_;
+  do {
+    auto ret = conn_->Read();
+    if (ret == -1) {
+      return -1;
+    } else if (ret == 0) {
+      return 0;
+    }
+    if (DecodeFrames() == -1) {
+      return -1;
+    }
+  } while (drain);
+  return 0;
+}
+
+int Http2Connection::DecodeFrames() {
+  auto &buffer = conn_->buffer_;
+  if (!preface_received_) {
+    size_t len = std::min(buffer.size(), kHttp2Preface.size());
+    if (memcmp(buffer.data(), kHttp2Preface.data(), len) != 0) {
+      LOG_ERROR("conn[{}] bad http2 preface", conn_->fd_);
+      return Fail(Http2Error::kProtocolError);
+    }
+    if (len < kHttp2Preface.size()) {
+      return 0;
+    }
+    buffer.Consume(len);
+    preface_received_ = true;
+  }
+  while (buffer.size() >= kHttp2FrameHeaderSize) {
+    auto *data = reinterpret_cast<const unsigned char *>(buffer.data());
+    auto header = DecodeHttp2FrameHeader(data);
+    if (header.length > options_.max_frame_size) {
+      LOG_ERROR("conn[{}] http2 frame of [{}] bytes", conn_->fd_,
+                header.length);
+      return Fail(Http2Error::kFrameSizeError);
+    }
+    if (buffer.size() < kHttp2FrameHeaderSize + header.length) {
+      break;
+    }
+    if (!settings_received_ && header.type != Http2FrameType::kSettings) {
+      return Fail(Http2Error::kProtocolError);
+    }
+    settings_received_ = true;
+    if (continuation_ && header.type != Http2FrameType::kContinuation) {
+      return Fail(Http2Error::kProtocolError);
+    }
+    int ret = HandleFrame(header, data + kHttp2FrameHeaderSize);
+    buffer.Consume(kHttp2FrameHeaderSize + header.length);
+    if (ret == -1) {
+      return -1;
+    }
+  }
+  if (Pump() == -1) {
+    return -1;
+  }
+  Sweep();
+  return Flush();
+}
+
+int Http2Connection::HandleFrame(const Http2FrameHeader &header,
+                                 const unsigned char *payload) {
+  LOG_TRACE("http2 conn[{}] frame type[{}] flags[{:#x}] stream[{}] len[{}]",
+            conn_->fd_, static_cast<unsigned>(header.type), header.flags,
+            header.stream_id, header.length);
+  switch (header.type) {
+  case Http2FrameType::kData:
+    return OnData(header, payload);
+  case Http2FrameType::kHeaders:
+    return OnHeaders(header, payload);
+  case Http2FrameType::kContinuation:
+    if (!continuation_ || header.stream_id != header_stream_) {
+      return Fail(Http2Error::kProtocolError);
+    }
+    header_block_.append(reinterpret_cast<const char *>(payload),
+                         header.length);
+    if (header_block_.size() > options_.max_header_list_size) {
+      return Fail(Http2Error::kEnhanceYourCalm);
+    }
+    return (header.flags & http2_flags::kEndHeaders) ? OnHeaderBlock() : 0;
+  case Http2FrameType::kPriority:
+    if (header.stream_id == 0) {
+      return Fail(Http2Error::kProtocolError);
+    }
+    if (header.length != 5) {
+      AppendRstStream(&out_, header.stream_id, Http2Error::kFrameSizeError);
+    }
+    return 0;
+  case Http2FrameType::kRstStream:
+    return OnRstStream(header, payload);
+  case Http2FrameType::kSettings:
+    return OnSettings(header, payload);
+  case Http2FrameType::kPing:
+    return OnPing(header, payload);
+  case Http2FrameType::kGoaway:
+    if (header.stream_id != 0) {
+      return Fail(Http2Error::kProtocolError);
+    }
+    // the client closes once its streams are answered
+    LOG_DEBUG("http2 conn[{}] goaway", conn_->fd_);
+    return 0;
+  case Http2FrameType::kWindowUpdate:
+    return OnWindowUpdate(header, payload);
+  case Http2FrameType::kPushPromise:
+    // clients don't push
+    return Fail(Http2Error::kProtocolError);
+  default:
+    // unknown frames are ignored
+    return 0;
+  }
+}
+
+bool Http2Connection::Unpad(const Http2FrameHeader &header,
+                            const unsigned char *&payload,
+                            size_t &length) const {
+  length = header.length;
+  size_t pad = 0;
+  if (header.flags & http2_flags::kPadded) {
+    if (length < 1) {
+      return false;
+    }
+    pad = payload[0];
+    ++payload;
+    --length;
+  }
+  if (header.type == Http2FrameType::kHeaders &&
+      (header.flags & http2_flags::kPriority)) {
+    // the priority is advisory, it is skipped
+    if (length < 5) {
+      return false;
+    }
+    payload += 5;
+    length -= 5;
+  }
+  if (pad > length) {
+    return false;
+  }
+  length -= pad;
+  return true;
+}
+
+int Http2Connection::OnHeaders(const Http2FrameHeader &header,
+                               const unsigned char *payload) {
+  size_t length;
+  if (header.stream_id == 0 || !Unpad(header, payload, length)) {
+    return Fail(Http2Error::kProtocolError);
+  }
+  header_stream_ = header.stream_id;
+  header_end_stream_ = (header.flags & http2_flags::kEndStream) != 0;
+  header_block_.assign(reinterpret_cast<const char *>(payload), length);
+  if (header.flags & http2_flags::kEndHeaders) {
+    return OnHeaderBlock();
+  }
+  continuation_ = true;
+  return 0;
+}
+
+int Http2Connection::OnHeaderBlock() {
+  continuation_ = false;
+  // the block is decoded even for a stream that is refused, the table of
+  // the decoder must stay in sync with the client
+  if (decoder_.Decode(header_block_, &fields_) == -1) {
+    return Fail(Http2Error::kCompressionError);
+  }
+  const uint32_t id = header_stream_;
+  if (auto *stream = Find(id)) {
+    // trailers, they end the body
+    if (stream->remote_closed) {
+      Reset(stream, Http2Error::kStreamClosed);
+      return 0;
+    }
+    if (!header_end_stream_) {
+      Reset(stream, Http2Error::kProtocolError);
+      return 0;
+    }
+    stream->remote_closed = true;
+    int ret = stream->discard ? 0 : Deliver(stream, std::string(), true);
+    Finish(stream);
+    return ret;
+  }
+  if (id % 2 == 0 || id <= last_stream_id_) {
+    return Fail(Http2Error::kProtocolError);
+  }
+  last_stream_id_ = id;
+  if (streams_.size() >= options_.max_concurrent_streams) {
+    AppendRstStream(&out_, id, Http2Error::kRefusedStream);
+    return 0;
+  }
+  auto &stream = streams_[id];
+  stream = std::make_unique<Stream>(id, peer_initial_window_,
+                                    options_.initial_window);
+  stream->remote_closed = header_end_stream_;
+  if (!BuildRequest(stream.get())) {
+    Reset(stream.get(), Http2Error::kProtocolError);
+    return 0;
+  }
+  return Dispatch(stream.get());
+}
+
+bool Http2Connection::BuildRequest(Stream *stream) {
+  std::string_view method, path, authority;
+  std::string cookie;
+  bool regular = false;
+  for (const auto &field : fields_) {
+    const std::string_view name = field.name;
+    if (name.empty()) {
+      return false;
+    }
+    if (name[0] == ':') {
+      // the pseudo headers come first
+      if (regular) {
+        return false;
+      }
+      if (name == ":method") {
+        method = field.value;
+      } else if (name == ":path") {
+        path = field.value;
+      } else if (name == ":authority") {
+        authority = field.value;
+      } else if (name != ":scheme") {
+        return false;
+      }
+      continue;
+    }
+    regular = true;
+    if (IsConnectionHeader(name) ||
+        std::any_of(name.begin(), name.end(),
+                    [](char c) { return c >= 'A' && c <= 'Z'; })) {
+      return false;
+    }
+  }
+  if (method.empty() || path.empty()) {
+    return false;
+  }
+
+  auto &parser = stream->parser;
+  line_.assign(method).append(" ").append(path).append(" HTTP/2.0\r\n");
+  parser.PushLine(line_);
+  if (parser.GetMethod() == HttpMethod::UNKNOWN) {
+    // answered with 400 by the dispatch
+    return true;
+  }
+  if (!authority.empty()) {
+    line_.assign("Host: ").append(authority).append("\r\n");
+    parser.PushLine(line_);
+  }
+  for (const auto &field : fields_) {
+    if (field.name[0] == ':') {
+      continue;
+    }
+    if (field.name == "cookie") {
+      // the crumbs of a cookie come in separate fields
+      cookie.append(cookie.empty() ? "" : "; ").append(field.value);
+      continue;
+    }
+    line_.clear();
+    AppendTitleCase(field.name, &line_);
+    line_.append(": ").append(field.value).append("\r\n");
+    parser.PushLine(line_);
+  }
+  if (!cookie.empty()) {
+    line_.assign("Cookie: ").append(cookie).append("\r\n");
+    parser.PushLine(line_);
+  }
+  parser.PushLine("\r\n");
+  return true;
+}
+
+int Http2Connection::Dispatch(Stream *stream) {
+  current_ = stream->id;
+  const auto &parser = stream->parser;
+  const auto method = parser.GetMethod();
+  if (method == HttpMethod::UNKNOWN) {
+    Respond(stream, 400);
+    return 0;
+  }
+  auto *server = conn_->svr_;
+  auto iter = server->FindRequestHandler(parser.GetUri());
+  LOG_DEBUG("http2 stream[{}] uri: {}, method: {}", stream->id,
+            parser.GetUri(), HttpMethodToString(method));
+  if (iter == server->request_handlers.end()) {
+    Respond(stream, 404);
+    return 0;
+  }
+  if (iter->second.sse_channel && method == HttpMethod::GET) {
+    // a channel subscribes whole connections, the client retries the event
+    // stream on one of its own
+    LOG_DEBUG("http2 stream[{}] event stream needs http/1.1", stream->id);
+    Reset(stream, Http2Error::kHttp11Required);
+    return 0;
+  }
+  const Handler &handler =
+      iter->second.http_handlers[static_cast<int>(method)];
+  if (!handler) {
+    LOG_ERROR("uri registered, method not support");
+    Respond(stream, 405);
+    return 0;
+  }
+  stream->handler = &handler;
+  return Deliver(stream, std::string(), stream->remote_closed);
+}
+
+int Http2Connection::Deliver(Stream *stream, std::string &&body, bool final) {
+  current_ = stream->id;
+  dispatching_ = true;
+  int ret = (*stream->handler)(conn_, stream->parser.GetUri(), std::move(body),
+                               final);
+  dispatching_ = false;
+  if (ret == -1) {
+    // the connection is shared, only the stream ends
+    if (stream->local_closed || stream->end_pending) {
+      stream->discard = true;
+    } else {
+      Reset(stream, Http2Error::kInternalError);
+    }
+    return 0;
+  }
+  if (final && stream->head_sent &&
+      stream->framing == Stream::Framing::kUntilEnd &&
+      !stream->local_closed && !stream->end_pending) {
+    // the response ends with the exchange
+    return EndBody(stream);
+  }
+  return 0;
+}
+
+void Http2Connection::Respond(Stream *stream, int status) {
+  const auto code = std::to_string(status);
+  SendHeaders(stream->id, {{":status", code}}, true);
+  stream->head_sent = true;
+  stream->local_closed = true;
+  stream->discard = true;
+  Finish(stream);
+}
+
+int Http2Connection::OnData(const Http2FrameHeader &header,
+                            const unsigned char *payload) {
+  size_t length;
+  if (header.stream_id == 0 || !Unpad(header, payload, length)) {
+    return Fail(Http2Error::kProtocolError);
+  }
+  // the padding counts too, the window of the connection is given back
+  // whatever happens to the stream
+  recv_window_ -= header.length;
+  unacked_ += header.length;
+  if (recv_window_ < 0) {
+    return Fail(Http2Error::kFlowControlError);
+  }
+  auto *stream = Find(header.stream_id);
+  if (stream == nullptr || stream->remote_closed) {
+    if (header.stream_id > last_stream_id_) {
+      return Fail(Http2Error::kProtocolError);
+    }
+    AppendRstStream(&out_, header.stream_id, Http2Error::kStreamClosed);
+    Replenish(nullptr);
+    return 0;
+  }
+  stream->recv_window -= header.length;
+  stream->unacked += header.length;
+  if (stream->recv_window < 0) {
+    Reset(stream, Http2Error::kFlowControlError);
+    Replenish(nullptr);
+    return 0;
+  }
+  stream->remote_closed = (header.flags & http2_flags::kEndStream) != 0;
+  int ret = 0;
+  if (!stream->discard) {
+    ret = Deliver(stream,
+                  std::string(reinterpret_cast<const char *>(payload), length),
+                  stream->remote_closed);
+  }
+  Replenish(stream);
+  Finish(stream);
+  return ret;
+}
+
+void Http2Connection::Replenish(Stream *stream) {
+  // half a window at once, so a large body doesn't cost a frame per frame
+  const uint32_t threshold = options_.initial_window / 2;
+  // a stream whose response backs up gets no more of the request, until
+  // Pump sends it
+  if (stream != nullptr && !stream->remote_closed &&
+      stream->unacked >= threshold &&
+      stream->pending.size() - stream->pending_offset <
+          options_.output_watermark) {
+    AppendWindowUpdate(&out_, stream->id, stream->unacked);
+    stream->recv_window += stream->unacked;
+    stream->unacked = 0;
+  }
+  if (unacked_ >= threshold) {
+    AppendWindowUpdate(&out_, 0, unacked_);
+    recv_window_ += unacked_;
+    unacked_ = 0;
+  }
+}
+
+int Http2Connection::OnSettings(const Http2FrameHeader &header,
+                                const unsigned char *payload) {
+  if (header.stream_id != 0) {
+    return Fail(Http2Error::kProtocolError);
+  }
+  if (header.flags & http2_flags::kAck) {
+    return header.length == 0 ? 0 : Fail(Http2Error::kFrameSizeError);
+  }
+  if (header.length % 6 != 0) {
+    return Fail(Http2Error::kFrameSizeError);
+  }
+  for (size_t i = 0; i < header.length; i += 6) {
+    auto id = static_cast<Http2Setting>(payload[i] << 8 | payload[i + 1]);
+    uint32_t value = ReadUint32(payload + i + 2);
+    switch (id) {
+    case Http2Setting::kHeaderTableSize:
+      encoder_.SetMaxTableSize(value);
+      break;
+    case Http2Setting::kEnablePush:
+      if (value > 1) {
+        return Fail(Http2Error::kProtocolError);
+      }
+      break;
+    case Http2Setting::kInitialWindowSize: {
+      if (value > kHttp2MaxWindow) {
+        return Fail(Http2Error::kFlowControlError);
+      }
+      // the change applies to the windows of the open streams
+      int64_t delta = static_cast<int64_t>(value) - peer_initial_window_;
+      peer_initial_window_ = value;
+      for (auto &[id, stream] : streams_) {
+        stream->send_window += delta;
+        if (stream->send_window > kHttp2MaxWindow) {
+          return Fail(Http2Error::kFlowControlError);
+        }
+        MarkReady(stream.get());
+      }
+      break;
+    }
+    case Http2Setting::kMaxFrameSize:
+      if (value < kHttp2DefaultFrameSize || value > 0xffffff) {
+        return Fail(Http2Error::kProtocolError);
+      }
+      peer_max_frame_ = value;
+      break;
+    default:
+      break;
+    }
+  }
+  AppendHttp2FrameHeader(&out_, 0, Http2FrameType::kSettings,
+                         http2_flags::kAck, 0);
+  return 0;
+}
+
+int Http2Connection::OnWindowUpdate(const Http2FrameHeader &header,
+                                    const unsigned char *payload) {
+  if (header.length != 4) {
+    return Fail(Http2Error::kFrameSizeError);
+  }
+  const uint32_t increment = ReadUint32(payload) & 0x7fffffff;
+  if (header.stream_id == 0) {
+    if (increment == 0) {
+      return Fail(Http2Error::kProtocolError);
+    }
+    send_window_ += increment;
+    if (send_window_ > kHttp2MaxWindow) {
+      return Fail(Http2Error::kFlowControlError);
+    }
+    return 0;
+  }
+  auto *stream = Find(header.stream_id);
+  if (stream == nullptr) {
+    // closed already
+    return 0;
+  }
+  if (increment == 0) {
+    Reset(stream, Http2Error::kProtocolError);
+    return 0;
+  }
+  stream->send_window += increment;
+  if (stream->send_window > kHttp2MaxWindow) {
+    Reset(stream, Http2Error::kFlowControlError);
+    return 0;
+  }
+  MarkReady(stream);
+  return 0;
+}
+
+int Http2Connection::OnRstStream(const Http2FrameHeader &header,
+                                 const unsigned char *payload) {
+  if (header.stream_id == 0 || header.stream_id > last_stream_id_) {
+    return Fail(Http2Error::kProtocolError);
+  }
+  if (header.length != 4) {
+    return Fail(Http2Error::kFrameSizeError);
+  }
+  if (auto *stream = Find(header.stream_id)) {
+    LOG_DEBUG("http2 stream[{}] reset by the client, error[{}]",
+              header.stream_id, ReadUint32(payload));
+    stream->remote_closed = true;
+    stream->local_closed = true;
+    stream->discard = true;
+    DropPending(stream);
+    Finish(stream);
+  }
+  return 0;
+}
+
+int Http2Connection::OnPing(const Http2FrameHeader &header,
+                            const unsigned char *payload) {
+  if (header.stream_id != 0) {
+    return Fail(Http2Error::kProtocolError);
+  }
+  if (header.length != 8) {
+    return Fail(Http2Error::kFrameSizeError);
+  }
+  if ((header.flags & http2_flags::kAck) == 0) {
+    AppendHttp2FrameHeader(&out_, 8, Http2FrameType::kPing, http2_flags::kAck,
+                           0);
+    out_.append(reinterpret_cast<const char *>(payload), 8);
+  }
+  return 0;
+}
+
+int Http2Connection::WriteStream(const struct iovec *iov, int iovcnt) {
+  auto *stream = Find(current_);
+  if (stream == nullptr || stream->local_closed || stream->end_pending) {
+    LOG_ERROR("http2 conn[{}] write to closed stream[{}]", conn_->fd_,
+              current_);
+    return -1;
+  }
+  for (int i = 0; i < iovcnt; ++i) {
+    if (Feed(stream, static_cast<const char *>(iov[i].iov_base),
+             iov[i].iov_len) == -1) {
+      Reset(stream, Http2Error::kInternalError);
+      Flush();
+      return -1;
+    }
+  }
+  // written after the handler returned, the write is the whole response
+  if (!dispatching_ && stream->head_sent &&
+      stream->framing == Stream::Framing::kUntilEnd &&
+      !stream->local_closed && !stream->end_pending &&
+      EndBody(stream) == -1) {
+    return -1;
+  }
+  if (Pump() == -1 || Flush() == -1) {
+    return -1;
+  }
+  return stream->pending.size() == stream->pending_offset &&
+                 conn_->output_.empty()
+             ? 1
+             : 0;
+}
+
+int Http2Connection::Feed(Stream *stream, const char *data, size_t len) {
+  if (stream->head_sent) {
+    return stream->framing == Stream::Framing::kChunked
+               ? Dechunk(stream, data, len)
+               : AppendBody(stream, data, len);
+  }
+  const size_t old = stream->head.size();
+  stream->head.append(data, len);
+  auto pos = stream->head.find("\r\n\r\n", old >= 3 ? old - 3 : 0);
+  if (pos == std::string::npos) {
+    return stream->head.size() > options_.max_header_list_size ? -1 : 0;
+  }
+  // the body written with the head
+  std::string body = stream->head.substr(pos + 4);
+  stream->head.resize(pos + 2);
+  if (SendHead(stream) == -1) {
+    return -1;
+  }
+  if (!body.empty()) {
+    return Feed(stream, body.data(), body.size());
+  }
+  return 0;
+}
+
+int Http2Connection::SendHead(Stream *stream) {
+  // HTTP/1.1 200 OK, then a line per header, in place of the head
+  auto &head = stream->head;
+  auto line_end = head.find("\r\n");
+  auto space = head.find(' ');
+  if (space == std::string::npos || space + 4 > line_end) {
+    LOG_ERROR("http2 stream[{}] bad response head", stream->id);
+    return -1;
+  }
+  std::string_view status(head.data() + space + 1, 3);
+  int code = 0;
+  std::from_chars(status.data(), status.data() + status.size(), code);
+  if (code < 100 || code > 999) {
+    LOG_ERROR("http2 stream[{}] bad status [{}]", stream->id, status);
+    return -1;
+  }
+  std::vector<std::pair<std::string_view, std::string_view>> fields;
+  fields.emplace_back(":status", status);
+  bool has_length = false;
+  uint64_t length = 0;
+  bool chunked = false;
+  size_t length_field = 0;
+  for (size_t pos = line_end + 2; pos < head.size();) {
+    auto end = head.find("\r\n", pos);
+    auto colon = head.find(':', pos);
+    if (colon == std::string::npos || colon > end) {
+      pos = end + 2;
+      continue;
+    }
+    std::transform(head.begin() + pos, head.begin() + colon, head.begin() + pos,
+                   [](char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a'
+                                                            : c; });
+    std::string_view name(head.data() + pos, colon - pos);
+    auto value_pos = head.find_first_not_of(' ', colon + 1);
+    std::string_view value;
+    if (value_pos < end) {
+      value = std::string_view(head.data() + value_pos, end - value_pos);
+    }
+    pos = end + 2;
+    if (name == "transfer-encoding") {
+      // the last coding frames the body
+      chunked = value.size() >= 7 &&
+                strncasecmp(value.data() + value.size() - 7, "chunked", 7) ==
+                    0;
+    }
+    if (IsConnectionHeader(name)) {
+      continue;
+    }
+    if (name == "content-length") {
+      has_length = true;
+      length_field = fields.size();
+      std::from_chars(value.data(), value.data() + value.size(), length);
+    }
+    fields.emplace_back(name, value);
+  }
+  if (chunked && has_length) {
+    // the chunks win over a length, RFC 9112 6.3
+    fields.erase(fields.begin() + length_field);
+    has_length = false;
+  }
+
+  if (code < 200) {
+    // informational, the final head follows
+    SendHeaders(stream->id, fields, false);
+    head.clear();
+    return 0;
+  }
+  const bool no_body = stream->parser.GetMethod() == HttpMethod::HEAD ||
+                       code == 204 || code == 304;
+  const bool end_stream = no_body || (has_length && length == 0);
+  SendHeaders(stream->id, fields, end_stream);
+  head.clear();
+  head.shrink_to_fit();
+  stream->head_sent = true;
+  stream->body_left = end_stream ? 0 : length;
+  if (!end_stream && !has_length) {
+    stream->framing = chunked ? Stream::Framing::kChunked
+                              : Stream::Framing::kUntilEnd;
+  }
+  if (end_stream) {
+    stream->local_closed = true;
+    Finish(stream);
+  }
+  return 0;
+}
+
+void Http2Connection::SendHeaders(
+    uint32_t id,
+    const std::vector<std::pair<std::string_view, std::string_view>> &fields,
+    bool end_stream) {
+  std::string block;
+  encoder_.Encode(fields, &block);
+  // a block larger than a frame goes on in CONTINUATION frames
+  size_t offset = 0;
+  auto type = Http2FrameType::kHeaders;
+  do {
+    size_t n = std::min<size_t>(block.size() - offset, peer_max_frame_);
+    uint8_t flags = offset + n == block.size() ? http2_flags::kEndHeaders : 0;
+    if (type == Http2FrameType::kHeaders && end_stream) {
+      flags |= http2_flags::kEndStream;
+    }
+    AppendHttp2FrameHeader(&out_, n, type, flags, id);
+    out_.append(block, offset, n);
+    offset += n;
+    type = Http2FrameType::kContinuation;
+  } while (offset < block.size());
+}
+
+int Http2Connection::Dechunk(Stream *stream, const char *data, size_t len) {
+  using Chunk = Stream::Chunk;
+  while (len > 0 && stream->chunk != Chunk::kDone) {
+    if (stream->chunk == Chunk::kData) {
+      size_t n = std::min<uint64_t>(len, stream->chunk_left);
+      if (QueueBody(stream, data, n, false) == -1) {
+        return -1;
+      }
+      data += n;
+      len -= n;
+      stream->chunk_left -= n;
+      if (stream->chunk_left == 0) {
+        stream->chunk = Chunk::kDataEnd;
+      }
+      continue;
+    }
+    // a size, the line break after a chunk, or a trailer
+    auto *newline = static_cast<const char *>(memchr(data, '\n', len));
+    size_t n = newline == nullptr ? len : newline - data + 1;
+    stream->chunk_line.append(data, n);
+    data += n;
+    len -= n;
+    if (stream->chunk_line.size() > options_.max_header_list_size) {
+      LOG_ERROR("http2 stream[{}] chunk line too long", stream->id);
+      return -1;
+    }
+    if (newline == nullptr) {
+      break;
+    }
+    std::string_view line = stream->chunk_line;
+    line.remove_suffix(line.size() >= 2 && line[line.size() - 2] == '\r' ? 2
+                                                                         : 1);
+    switch (stream->chunk) {
+    case Chunk::kSize: {
+      uint64_t size = 0;
+      auto [end, ec] =
+          std::from_chars(line.data(), line.data() + line.size(), size, 16);
+      if (ec != std::errc() || end == line.data() ||
+          (end != line.data() + line.size() && *end != ';' && *end != ' ')) {
+        LOG_ERROR("http2 stream[{}] bad chunk size", stream->id);
+        return -1;
+      }
+      stream->chunk = size == 0 ? Chunk::kTrailer : Chunk::kData;
+      stream->chunk_left = size;
+      break;
+    }
+    case Chunk::kDataEnd:
+      if (!line.empty()) {
+        LOG_ERROR("http2 stream[{}] chunk over its size", stream->id);
+        return -1;
+      }
+      stream->chunk = Chunk::kSize;
+      break;
+    default:
+      // the trailers are dropped, the blank line ends the body
+      if (line.empty()) {
+        stream->chunk = Chunk::kDone;
+      }
+      break;
+    }
+    stream->chunk_line.clear();
+    if (stream->chunk == Chunk::kDone && EndBody(stream) == -1) {
+      return -1;
+    }
+  }
+  if (len > 0) {
+    LOG_ERROR("http2 stream[{}] [{}] bytes after the last chunk dropped",
+              stream->id, len);
+  }
+  return 0;
+}
+
+int Http2Connection::AppendBody(Stream *stream, const char *data,
+                                size_t len) {
+  if (stream->framing != Stream::Framing::kLength) {
+    return QueueBody(stream, data, len, false);
+  }
+  if (len > stream->body_left) {
+    LOG_ERROR("http2 stream[{}] body over the Content-Length, [{}] bytes "
+              "dropped",
+              stream->id, len - stream->body_left);
+    len = stream->body_left;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  stream->body_left -= len;
+  return QueueBody(stream, data, len, stream->body_left == 0);
+}
+
+int Http2Connection::QueueBody(Stream *stream, const char *data, size_t len,
+                               bool end) {
+  if (stream->pending.size() == stream->pending_offset && ready_.empty()) {
+    // no stream waits, the frames take the bytes where the handler has them
+    while ((len > 0 || end) &&
+           conn_->output_.size() + out_.size() < options_.output_watermark) {
+      int64_t window = std::min(stream->send_window, send_window_);
+      if (window <= 0 && len > 0) {
+        break;
+      }
+      size_t n = std::min<size_t>(len, peer_max_frame_);
+      n = std::min<size_t>(n, std::max<int64_t>(window, 0));
+      const bool last = end && n == len;
+      if (SendData(stream, data, n, last) == -1) {
+        return -1;
+      }
+      if (last) {
+        return 0;
+      }
+      data += n;
+      len -= n;
+    }
+  }
+  if (len > 0) {
+    auto cap = conn_->svr_->GetMemoryPolicy().max_output_per_conn;
+    if (cap != 0 && conn_->output_.size() + pending_bytes_ + len > cap) {
+      LOG_ERROR("http2 conn[{}] output over the cap [{}]", conn_->fd_, cap);
+      return -1;
+    }
+    stream->pending.append(data, len);
+    pending_bytes_ += len;
+    conn_->Account();
+  }
+  if (end) {
+    stream->end_pending = true;
+  }
+  MarkReady(stream);
+  return 0;
+}
+
+int Http2Connection::EndBody(Stream *stream) {
+  return QueueBody(stream, nullptr, 0, true);
+}
+
+int Http2Connection::SendData(Stream *stream, const char *data, size_t n,
+                              bool last) {
+  AppendHttp2FrameHeader(&out_, n, Http2FrameType::kData,
+                         last ? http2_flags::kEndStream : 0, stream->id);
+  stream->send_window -= n;
+  send_window_ -= n;
+  if (last) {
+    stream->end_pending = false;
+    stream->local_closed = true;
+    Finish(stream);
+  }
+  if (n == 0) {
+    return 0;
+  }
+  if (conn_->tls_ && !conn_->tls_->KernelSend()) {
+    // the session writes a record per buffer, and encrypts into a copy anyway
+    out_.append(data, n);
+    return 0;
+  }
+  // the payload goes to the socket, or is copied once to the output queue
+  struct iovec iov[2] = {{out_.data(), out_.size()},
+                         {const_cast<char *>(data), n}};
+  int ret = conn_->WriteRaw(iov, 2);
+  out_.clear();
+  return ret == -1 ? -1 : 0;
+}
+
+void Http2Connection::DropPending(Stream *stream) {
+  pending_bytes_ -= stream->pending.size() - stream->pending_offset;
+  stream->pending = std::string();
+  stream->pending_offset = 0;
+  stream->end_pending = false;
+  conn_->Account();
+}
+
+void Http2Connection::MarkReady(Stream *stream) {
+  if (stream->ready || stream->local_closed ||
+      (stream->pending.size() == stream->pending_offset &&
+       !stream->end_pending)) {
+    return;
+  }
+  stream->ready = true;
+  ready_.push_back(stream->id);
+}
+
+int Http2Connection::Pump() {
+  while (!ready_.empty() &&
+         conn_->output_.size() + out_.size() < options_.output_watermark) {
+    auto *stream = Find(ready_.front());
+    ready_.pop_front();
+    if (stream == nullptr || stream->local_closed) {
+      continue;
+    }
+    stream->ready = false;
+    const size_t left = stream->pending.size() - stream->pending_offset;
+    int64_t window = std::min(stream->send_window, send_window_);
+    size_t n = std::min<size_t>(left, peer_max_frame_);
+    n = std::min<size_t>(n, std::max<int64_t>(window, 0));
+    if (n == 0 && left > 0) {
+      if (send_window_ <= 0) {
+        // the connection waits for a WINDOW_UPDATE, the stream keeps its turn
+        ready_.push_front(stream->id);
+        stream->ready = true;
+        break;
+      }
+      // the stream waits for its WINDOW_UPDATE
+      continue;
+    }
+    const bool last = n == left && stream->end_pending;
+    if (SendData(stream, stream->pending.data() + stream->pending_offset, n,
+                 last) == -1) {
+      return -1;
+    }
+    stream->pending_offset += n;
+    pending_bytes_ -= n;
+    if (stream->pending_offset == stream->pending.size()) {
+      // the memory goes back, the next writes are sent without it if they can
+      stream->pending = std::string();
+      stream->pending_offset = 0;
+    }
+    conn_->Account();
+    Replenish(stream);
+    if (!last) {
+      MarkReady(stream);
+    }
+  }
+  return 0;
+}
+
+Http2Connection::Stream *Http2Connection::Find(uint32_t id) const {
+  auto iter = streams_.find(id);
+  return iter == streams_.end() ? nullptr : iter->second.get();
+}
+
+void Http2Connection::Reset(Stream *stream, Http2Error error) {
+  LOG_DEBUG("http2 stream[{}] reset, error[{}]", stream->id,
+            static_cast<uint32_t>(error));
+  AppendRstStream(&out_, stream->id, error);
+  stream->remote_closed = true;
+  stream->local_closed = true;
+  stream->discard = true;
+  DropPending(stream);
+  Finish(stream);
+}
+
+void Http2Connection::Finish(Stream *stream) {
+  if (stream->finished || !stream->local_closed || !stream->remote_closed) {
+    return;
+  }
+  stream->finished = true;
+  finished_.push_back(stream->id);
+}
+
+void Http2Connection::Sweep() {
+  for (auto id : finished_) {
+    streams_.erase(id);
+  }
+  finished_.clear();
+}
+
+int Http2Connection::Fail(Http2Error error) {
+  LOG_ERROR("http2 conn[{}] error[{}], goaway", conn_->fd_,
+            static_cast<uint32_t>(error));
+  AppendGoaway(&out_, last_stream_id_, error);
+  Flush();
+  return -1;
+}
+
+int Http2Connection::Flush() {
+  if (out_.empty()) {
+    return 0;
+  }
+  struct iovec iov = {out_.data(), out_.size()};
+  int ret = conn_->WriteRaw(&iov, 1);
+  out_.clear();
+  return ret == -1 ? -1 : 0;
+}
+
+int Http2Connection::OnDrained() {
+  // a write the socket takes whole drains nothing later, the next frames
+  // are queued right away
+  do {
+    if (Pump() == -1) {
+      return -1;
+    }
+    Sweep();
+    if (Flush() == -1) {
+      return -1;
+    }
+  } while (!ready_.empty() && send_window_ > 0 && conn_->output_.empty() &&
+           !conn_->svr_->batching_);
+  return 0;
+}
+
+const HttpHeaderParser &Http2Connection::GetParser() const {
+  static const HttpHeaderParser kEmptyParser;
+  auto *stream = Find(current_);
+  return stream ? stream->parser : kEmptyParser;
+}
+
+std::pmr::memory_resource *Http2Connection::GetRequestResource() {
+  auto *stream = Find(current_);
+  return stream ? &stream->arena : nullptr;
+}
+} // namespace hpl
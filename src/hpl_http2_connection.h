@@ -0,0 +1,240 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <deque>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "hpl_arena.h"
+#include "hpl_header_parser.h"
+#include "hpl_hpack.h"
+#include "hpl_http2_frame.h"
+#include "hpl_request_handler.h"
+
+#ifndef _HPL_HTTP2_CONNECTION_H_
+#define _HPL_HTTP2_CONNECTION_H_
+
+namespace hpl {
+class Connection;
+
+/// @brief HTTP/2 settings of a server, see Server::EnableHttp2
+struct Http2Options {
+  /// streams a client may have open at once, more are refused
+  uint32_t max_concurrent_streams = 128;
+  /// the receive window of a stream, and of the connection. it is given
+  /// back as the handlers take the body, at least 65535
+  uint32_t initial_window = 1024 * 1024;
+  /// the largest frame a client may send, at least 16384
+  uint32_t max_frame_size = 16384;
+  /// the dynamic table of the request headers
+  uint32_t header_table_size = 4096;
+  /// the decoded request headers, larger blocks end the connection
+  uint32_t max_header_list_size = 64 * 1024;
+  /// the DATA frames of the streams are queued while the output of the
+  /// connection is below this, the streams take turns. a stream with this
+  /// much of its response waiting gets no more of the request body, its
+  /// window isn't given back
+  size_t output_watermark = 256 * 1024;
+};
+
+/// @brief the HTTP/2 side of a connection, from the client preface on.
+/// every stream goes to the http handler of its route as a request on its
+/// own connection would: the parser and the request resource of the
+/// connection are the ones of the stream being dispatched, and the HTTP/1
+/// response the handler writes is sent as HEADERS and DATA frames of the
+/// stream. the response body ends with its Content-Length or its last
+/// chunk. without either, it ends when the handler that got the end of the
+/// request returns, or with the write if that comes later. the body waiting
+/// for the windows counts against max_output_per_conn
+class Http2Connection {
+public:
+  Http2Connection(Connection *conn, const Http2Options &options);
+
+  /// the stream the writes of the connection go to, the last dispatched
+  inline uint32_t GetStreamId() const { return current_; }
+  /// @brief send the writes of the connection to the stream id, e.g. for a
+  /// response written after the handler returned
+  /// @retval -1, the stream is closed
+  int SelectStream(uint32_t id);
+  inline size_t GetStreamCount() const { return streams_.size(); }
+
+private:
+  friend class Server;
+  friend class Connection;
+
+  struct Stream {
+    Stream(uint32_t id, int64_t send_window, int64_t recv_window)
+        : id(id), send_window(send_window), recv_window(recv_window) {}
+    const uint32_t id;
+    RequestArena arena;
+    HttpHeaderParser parser{&arena};
+    /// the handler of the route and method
+    const Handler *handler = nullptr;
+    /// END_STREAM from the client
+    bool remote_closed = false;
+    /// END_STREAM to the client, or reset
+    bool local_closed = false;
+    /// the rest of the request is dropped, it is answered or failed
+    bool discard = false;
+    /// on the ready list
+    bool ready = false;
+    /// on the finished list
+    bool finished = false;
+    int64_t send_window;
+    int64_t recv_window;
+    /// DATA bytes taken and not given back with a WINDOW_UPDATE yet
+    uint32_t unacked = 0;
+
+    /// the HTTP/1 head written by the handler, until its blank line
+    std::string head;
+    bool head_sent = false;
+    /// how the end of the response body is found
+    enum class Framing : uint8_t {
+      kLength,
+      /// HTTP/1 chunks, decoded into DATA frames
+      kChunked,
+      /// the final write, see the class comment
+      kUntilEnd,
+    };
+    Framing framing = Framing::kLength;
+    uint64_t body_left = 0;
+    /// the chunk being decoded, and the size or trailer line read so far
+    enum class Chunk : uint8_t { kSize, kData, kDataEnd, kTrailer, kDone };
+    Chunk chunk = Chunk::kSize;
+    uint64_t chunk_left = 0;
+    std::string chunk_line;
+    /// body bytes waiting for the windows, END_STREAM goes with the last
+    std::string pending;
+    size_t pending_offset = 0;
+    bool end_pending = false;
+  };
+
+  Connection *const conn_;
+  const Http2Options options_;
+  HpackDecoder decoder_;
+  HpackEncoder encoder_;
+  std::unordered_map<uint32_t, std::unique_ptr<Stream>> streams_;
+  /// streams with DATA to send, in turn
+  std::deque<uint32_t> ready_;
+  /// streams done both ways, erased when no handler runs
+  std::vector<uint32_t> finished_;
+  uint32_t current_ = 0;
+  uint32_t last_stream_id_ = 0;
+  /// a handler runs, a body until the end waits for it to return
+  bool dispatching_ = false;
+  /// the pending bytes of every stream
+  size_t pending_bytes_ = 0;
+
+  bool preface_received_ = false;
+  bool settings_received_ = false;
+  /// a header block continues in CONTINUATION frames
+  bool continuation_ = false;
+  bool header_end_stream_ = false;
+  uint32_t header_stream_ = 0;
+  std::string header_block_;
+  std::vector<HeaderField> fields_;
+  /// a request line or header line for the parser
+  std::string line_;
+
+  /// the settings of the client
+  uint32_t peer_initial_window_ = kHttp2DefaultWindow;
+  uint32_t peer_max_frame_ = kHttp2DefaultFrameSize;
+  int64_t send_window_ = kHttp2DefaultWindow;
+  int64_t recv_window_;
+  uint32_t unacked_ = 0;
+
+  /// frames waiting for Flush
+  std::string out_;
+
+  /// @brief queue the settings of the server
+  int Start();
+  /// @brief read the socket and handle the frames
+  /// @retval -1, error, close the connection
+  int Read();
+  /// @brief handle every complete frame in the input buffer
+  /// @retval -1, error, a GOAWAY is queued, close the connection
+  int DecodeFrames();
+  int HandleFrame(const Http2FrameHeader &header, const unsigned char *payload);
+  int OnHeaders(const Http2FrameHeader &header, const unsigned char *payload);
+  int OnHeaderBlock();
+  int OnData(const Http2FrameHeader &header, const unsigned char *payload);
+  int OnSettings(const Http2FrameHeader &header, const unsigned char *payload);
+  int OnWindowUpdate(const Http2FrameHeader &header,
+                     const unsigned char *payload);
+  int OnRstStream(const Http2FrameHeader &header,
+                  const unsigned char *payload);
+  int OnPing(const Http2FrameHeader &header, const unsigned char *payload);
+  /// @brief strip the padding, and the priority of a HEADERS frame
+  /// @return false if the frame is malformed
+  bool Unpad(const Http2FrameHeader &header, const unsigned char *&payload,
+             size_t &length) const;
+
+  /// @brief feed the request headers of stream to its parser
+  /// @return false if they are malformed
+  bool BuildRequest(Stream *stream);
+  /// @brief find the route of a new stream and run its handler
+  int Dispatch(Stream *stream);
+  /// @brief run the handler with a piece of the body
+  int Deliver(Stream *stream, std::string &&body, bool final);
+  /// @brief answer stream with a head only response
+  void Respond(Stream *stream, int status);
+
+  /// @brief a write of the connection, bytes of the HTTP/1 response
+  /// @return same as Connection::Write
+  int WriteStream(const struct iovec *iov, int iovcnt);
+  /// @retval -1, the head or the chunks are malformed, or a write failed
+  int Feed(Stream *stream, const char *data, size_t len);
+  /// @brief take the body out of its HTTP/1 chunks
+  int Dechunk(Stream *stream, const char *data, size_t len);
+  /// @brief turn the HTTP/1 head into a HEADERS frame
+  int SendHead(Stream *stream);
+  void SendHeaders(uint32_t id,
+                   const std::vector<std::pair<std::string_view,
+                                               std::string_view>> &fields,
+                   bool end_stream);
+  int AppendBody(Stream *stream, const char *data, size_t len);
+  /// @brief send len bytes of the body as the windows allow, without a copy
+  /// if no stream waits, the rest goes to pending
+  /// @param end, END_STREAM goes with the last byte
+  int QueueBody(Stream *stream, const char *data, size_t len, bool end);
+  /// @brief a body without a length is complete
+  int EndBody(Stream *stream);
+  /// @brief queue a DATA frame of n bytes from data
+  int SendData(Stream *stream, const char *data, size_t n, bool last);
+  void DropPending(Stream *stream);
+  void MarkReady(Stream *stream);
+  /// @brief queue DATA frames as the windows and the watermark allow
+  int Pump();
+  /// @brief give the window of the taken DATA back
+  void Replenish(Stream *stream);
+
+  Stream *Find(uint32_t id) const;
+  void Reset(Stream *stream, Http2Error error);
+  void Finish(Stream *stream);
+  /// @brief erase the finished streams
+  void Sweep();
+  /// @brief queue a GOAWAY
+  /// @retval -1
+  int Fail(Http2Error error);
+  /// @brief write the queued frames to the connection
+  int Flush();
+  /// @brief the output drained, queue more DATA
+  int OnDrained();
+
+  /// body bytes waiting for the windows, charged to the memory budget
+  inline size_t PendingBytes() const { return pending_bytes_; }
+  const HttpHeaderParser &GetParser() const;
+  /// nullptr if no stream is selected
+  std::pmr::memory_resource *GetRequestResource();
+};
+} // namespace hpl
+
+#endif // _HPL_HTTP2_CONNECTION_H_
@@ -0,0 +1,55 @@
+#include "hpl_http2_frame.h"
+
+namespace hpl {
+Http2FrameHeader DecodeHttp2FrameHeader(const unsigned char *buf) {
+  Http2FrameHeader header;
+  header.length = (uint32_t)buf[0] << 16 | (uint32_t)buf[1] << 8 | buf[2];
+  header.type = static_cast<Http2FrameType>(buf[3]);
+  header.flags = buf[4];
+  // the reserved bit is ignored
+  header.stream_id = ReadUint32(buf + 5) & 0x7fffffff;
+  return header;
+}
+
+void AppendHttp2FrameHeader(std::string *out, uint32_t length,
+                            Http2FrameType type, uint8_t flags,
+                            uint32_t stream_id) {
+  out->push_back(static_cast<char>(length >> 16));
+  out->push_back(static_cast<char>(length >> 8));
+  out->push_back(static_cast<char>(length));
+  out->push_back(static_cast<char>(type));
+  out->push_back(static_cast<char>(flags));
+  AppendUint32(out, stream_id & 0x7fffffff);
+}
+
+void AppendUint32(std::string *out, uint32_t value) {
+  out->push_back(static_cast<char>(value >> 24));
+  out->push_back(static_cast<char>(value >> 16));
+  out->push_back(static_cast<char>(value >> 8));
+  out->push_back(static_cast<char>(value));
+}
+
+void AppendSettings(std::string *out, Http2Setting id, uint32_t value) {
+  out->push_back(static_cast<char>(static_cast<uint16_t>(id) >> 8));
+  out->push_back(static_cast<char>(id));
+  AppendUint32(out, value);
+}
+
+void AppendWindowUpdate(std::string *out, uint32_t stream_id,
+                        uint32_t increment) {
+  AppendHttp2FrameHeader(out, 4, Http2FrameType::kWindowUpdate, 0, stream_id);
+  AppendUint32(out, increment & 0x7fffffff);
+}
+
+void AppendRstStream(std::string *out, uint32_t stream_id, Http2Error error) {
+  AppendHttp2FrameHeader(out, 4, Http2FrameType::kRstStream, 0, stream_id);
+  AppendUint32(out, static_cast<uint32_t>(error));
+}
+
+void AppendGoaway(std::string *out, uint32_t last_stream_id,
+                  Http2Error error) {
+  AppendHttp2FrameHeader(out, 8, Http2FrameType::kGoaway, 0, 0);
+  AppendUint32(out, last_stream_id & 0x7fffffff);
+  AppendUint32(out, static_cast<uint32_t>(error));
+}
+} // namespace hpl
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+
+#ifndef _HPL_HTTP2_FRAME_H_
+#define _HPL_HTTP2_FRAME_H_
+
+namespace hpl {
+/// the first bytes from a HTTP/2 client, RFC 9113 3.4
+constexpr std::string_view kHttp2Preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+constexpr size_t kHttp2FrameHeaderSize = 9;
+/// the initial window and the smallest max frame size
+constexpr uint32_t kHttp2DefaultWindow = 65535;
+constexpr uint32_t kHttp2DefaultFrameSize = 16384;
+constexpr uint32_t kHttp2MaxWindow = 0x7fffffff;
+
+enum class Http2FrameType : uint8_t {
+  kData = 0x0,
+  kHeaders = 0x1,
+  kPriority = 0x2,
+  kRstStream = 0x3,
+  kSettings = 0x4,
+  kPushPromise = 0x5,
+  kPing = 0x6,
+  kGoaway = 0x7,
+  kWindowUpdate = 0x8,
+  kContinuation = 0x9,
+};
+
+namespace http2_flags {
+constexpr uint8_t kEndStream = 0x1;
+constexpr uint8_t kAck = 0x1;
+constexpr uint8_t kEndHeaders = 0x4;
+constexpr uint8_t kPadded = 0x8;
+constexpr uint8_t kPriority = 0x20;
+} // namespace http2_flags
+
+enum class Http2Error : uint32_t {
+  kNoError = 0x0,
+  kProtocolError = 0x1,
+  kInternalError = 0x2,
+  kFlowControlError = 0x3,
+  kSettingsTimeout = 0x4,
+  kStreamClosed = 0x5,
+  kFrameSizeError = 0x6,
+  kRefusedStream = 0x7,
+  kCancel = 0x8,
+  kCompressionError = 0x9,
+  kConnectError = 0xa,
+  kEnhanceYourCalm = 0xb,
+  kInadequateSecurity = 0xc,
+  kHttp11Required = 0xd,
+};
+
+enum class Http2Setting : uint16_t {
+  kHeaderTableSize = 0x1,
+  kEnablePush = 0x2,
+  kMaxConcurrentStreams = 0x3,
+  kInitialWindowSize = 0x4,
+  kMaxFrameSize = 0x5,
+  kMaxHeaderListSize = 0x6,
+};
+
+struct Http2FrameHeader {
+  uint32_t length = 0;
+  Http2FrameType type = Http2FrameType::kData;
+  uint8_t flags = 0;
+  uint32_t stream_id = 0;
+};
+
+/// @brief the header at buf, kHttp2FrameHeaderSize bytes
+Http2FrameHeader DecodeHttp2FrameHeader(const unsigned char *buf);
+/// @brief append a frame header to out, the payload follows
+void AppendHttp2FrameHeader(std::string *out, uint32_t length,
+                            Http2FrameType type, uint8_t flags,
+                            uint32_t stream_id);
+
+inline uint32_t ReadUint32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+void AppendUint32(std::string *out, uint32_t value);
+
+/// @brief a setting of a SETTINGS payload, 6 bytes
+void AppendSettings(std::string *out, Http2Setting id, uint32_t value);
+/// @brief the whole frames the server sends on its own
+void AppendWindowUpdate(std::string *out, uint32_t stream_id,
+                        uint32_t increment);
+void AppendRstStream(std::string *out, uint32_t stream_id, Http2Error error);
+void AppendGoaway(std::string *out, uint32_t last_stream_id, Http2Error error);
+} // namespace hpl
+
+#endif // _HPL_HTTP2_FRAME_H_
@@ -0,0 +1,58 @@
+#pragma once
+#include <stddef.h>
+
+#ifndef _HPL_MEMORY_POLICY_H_
+#define _HPL_MEMORY_POLICY_H_
+
+namespace hpl {
+/// @brief runtime memory limits of a server, 0 means unlimited
+struct MemoryPolicy {
+  /// bytes asked from the socket by one read
+  size_t read_chunk = 16 * 1024;
+  /// input buffered per connection, a connection over it is closed
+  size_t max_input_per_conn = 1024 * 1024;
+  /// output queued per connection, a write over it fails
+  size_t max_output_per_conn = 4 * 1024 * 1024;
+
+  /// all the connection buffers of the server together
+  size_t global_budget = 0;
+  /// percentage of global_budget, above which the server is under pressure.
+  /// under pressure, connections buffering more than pause_read_threshold stop
+  /// reading, idle buffers are shrunk and new connections get a 503
+  unsigned pressure_percent = 90;
+  size_t pause_read_threshold = 64 * 1024;
+
+  /// register connections with EPOLLET
+  bool edge_triggered = false;
+  /// queued chunks of at least this many bytes are sent with MSG_ZEROCOPY
+  /// and kept until the kernel is done with them, 0 disables. pays off for
+  /// large payloads only, e.g. broadcast snapshots
+  size_t zerocopy_threshold = 0;
+};
+
+/// @brief counts the bytes held by the connection buffers of a server
+class MemoryBudget {
+public:
+  void SetLimit(size_t limit, unsigned pressure_percent) {
+    limit_ = limit;
+    pressure_bytes_ = limit / 100 * pressure_percent;
+  }
+
+  /// @brief a buffer grew or shrunk from old_bytes to new_bytes
+  void Update(size_t old_bytes, size_t new_bytes) {
+    used_ = used_ + new_bytes - old_bytes;
+  }
+
+  size_t Used() const { return used_; }
+  size_t Limit() const { return limit_; }
+  bool UnderPressure() const { return limit_ != 0 && used_ >= pressure_bytes_; }
+  bool Exhausted() const { return limit_ != 0 && used_ >= limit_; }
+
+private:
+  size_t used_ = 0;
+  size_t limit_ = 0;
+  size_t pressure_bytes_ = 0;
+};
+} // namespace hpl
+
+#endif // _HPL_MEMORY_POLICY_H_
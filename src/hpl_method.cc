@@ -1,28 +1,59 @@
 #include "hpl_method.h"
 
 #include "hpl_logger.h"
+#include "hpl_str.h"
 namespace hpl {
+namespace {
+struct MethodWord {
+  uint64_t word;
+  uint64_t mask;
+  unsigned len;
+};
+
+/// token + ' ', the longest ("OPTIONS ", "CONNECT ") fill a whole word.
+/// with the space included no token is the prefix of another one, so at most
+/// one entry matches a word
+constexpr MethodWord MakeMethodWord(std::string_view token) {
+  uint64_t word = str_word(token) | uint64_t(' ') << (token.size() * 8);
+  return {word, word_mask(token.size() + 1),
+          static_cast<unsigned>(token.size())};
+}
+
+// indexed by HttpMethod, the last one never matches
+constexpr MethodWord kMethodWords[] = {
+    MakeMethodWord("GET"),     MakeMethodWord("POST"),
+    MakeMethodWord("PUT"),     MakeMethodWord("DELETE"),
+    MakeMethodWord("HEAD"),    MakeMethodWord("CONNECT"),
+    MakeMethodWord("OPTIONS"), MakeMethodWord("TRACE"),
+    MakeMethodWord("PATCH"),   {~uint64_t(0), 0, 0},
+};
+static_assert(sizeof(kMethodWords) / sizeof(kMethodWords[0]) ==
+                  static_cast<size_t>(HttpMethod::UNKNOWN) + 1,
+              "a word for every HttpMethod");
+
+constexpr std::string_view kMethodNames[] = {
+    "GET",     "POST",    "PUT",   "DELETE", "HEAD",
+    "CONNECT", "OPTIONS", "TRACE", "PATCH",  "UNKNOWN",
+};
+} // namespace
 
 HttpMethod ParseHttpMethod(std::string_view method, size_t pos,
                            size_t &end_pos) {
-  constexpr int IntGET = 'G' | 'E' << 8 | 'T' << 16;
-  int v = (*(int *)(method.data() + pos));
-  if ((v & 0x00ffffff) == IntGET) {
-    end_pos = pos + 3;
-    return HttpMethod::GET;
+  uint64_t word = load_word(method, pos);
+  // compare against every method, the selects compile to cmov
+  unsigned found = static_cast<unsigned>(HttpMethod::UNKNOWN);
+  for (unsigned i = 0; i < static_cast<unsigned>(HttpMethod::UNKNOWN); ++i) {
+    found = (word & kMethodWords[i].mask) == kMethodWords[i].word ? i : found;
   }
+  end_pos = pos + kMethodWords[found].len;
+  return static_cast<HttpMethod>(found);
+}
 
-  constexpr int IntPUT = 'P' | 'U' << 8 | 'T' << 16;
-  if ((v & 0x00ffffff) == IntPUT) {
-    end_pos = pos + 3;
-    return HttpMethod::PUT;
-  }
-  constexpr int IntPOST = 'P' | 'O' << 8 | 'S' << 16 | 'T' << 24;
-  if (v == IntPOST) {
-    end_pos = pos + 4;
-    return HttpMethod::POST;
+std::string_view HttpMethodToString(HttpMethod method) {
+  auto i = static_cast<unsigned>(method);
+  if (i > static_cast<unsigned>(HttpMethod::UNKNOWN)) {
+    i = static_cast<unsigned>(HttpMethod::UNKNOWN);
   }
-
-  return HttpMethod::UNKNOWN;
+  return kMethodNames[i];
 }
-} // namespace hpl
\ No newline at end of file
+} // namespace hpl
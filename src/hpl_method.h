@@ -1,6 +1,7 @@
 #pragma once
 #include <cstddef>
 #include <string>
+#include <string_view>
 namespace hpl {
 enum class HttpMethod : unsigned {
   GET = 0,
@@ -15,6 +16,10 @@ enum class HttpMethod : unsigned {
   UNKNOWN, // make sure this is the last one
 };
 
+/// @brief match the method token at pos, it must be followed by a space
+/// @param end_pos, set to the position of the space on a match
+/// @return UNKNOWN if no method matches, never reads past the input
 HttpMethod ParseHttpMethod(std::string_view method, size_t pos,
                            size_t &end_pos);
-} // namespace hpl
\ No newline at end of file
+std::string_view HttpMethodToString(HttpMethod method);
+} // namespace hpl
@@ -0,0 +1,85 @@
+#pragma once
+#include <stddef.h>
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+#ifndef _HPL_MPSC_QUEUE_H_
+#define _HPL_MPSC_QUEUE_H_
+
+namespace hpl {
+/// @brief a bounded lock-free queue, any thread pushes, one thread pops.
+/// each cell carries a sequence number telling whose turn it is, so a push
+/// is one compare-and-swap on the tail and no lock is taken
+template <typename T> class MpscQueue {
+public:
+  /// @param capacity, rounded up to a power of 2
+  explicit MpscQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    cells_ = std::make_unique<Cell[]>(size);
+    for (size_t i = 0; i < size; ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+  MpscQueue(const MpscQueue &) = delete;
+  MpscQueue &operator=(const MpscQueue &) = delete;
+
+  /// @return false if the queue is full, value is left untouched
+  bool TryPush(T &&value) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      auto &cell = cells_[pos & mask_];
+      size_t seq = cell.seq.load(std::memory_order_acquire);
+      auto diff = static_cast<ptrdiff_t>(seq) - static_cast<ptrdiff_t>(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          cell.value = std::move(value);
+          cell.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        // the consumer hasn't freed the cell a lap ago
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /// @brief only from the consumer thread
+  /// @return false if the queue is empty
+  bool TryPop(T &value) {
+    auto &cell = cells_[head_ & mask_];
+    size_t seq = cell.seq.load(std::memory_order_acquire);
+    if (seq != head_ + 1) {
+      return false;
+    }
+    value = std::move(cell.value);
+    cell.value = T();
+    cell.seq.store(head_ + mask_ + 1, std::memory_order_release);
+    ++head_;
+    return true;
+  }
+
+  inline size_t capacity() const { return mask_ + 1; }
+
+private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T value;
+  };
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  /// producers and the consumer on separate cache lines
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) size_t head_ = 0;
+};
+} // namespace hpl
+
+#endif // _HPL_MPSC_QUEUE_H_
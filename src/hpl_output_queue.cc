@@ -0,0 +1,260 @@
+#include "hpl_output_queue.h"
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "hpl_logger.h"
+#include "hpl_tls.h"
+
+namespace hpl {
+void OutputQueue::Append(const char *data, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  if (head_ < chunks_.size() && !chunks_.back().file &&
+      !chunks_.back().shared &&
+      chunks_.back().data.size() + len <= kCoalesceSize) {
+    auto &chunk = chunks_.back().data;
+    auto old_capacity = chunk.capacity();
+    chunk.append(data, len);
+    capacity_ += chunk.capacity() - old_capacity;
+  } else {
+    chunks_.emplace_back();
+    chunks_.back().data.assign(data, len);
+    capacity_ += chunks_.back().data.capacity();
+  }
+  bytes_ += len;
+}
+
+void OutputQueue::Append(const struct iovec *iov, int iovcnt, size_t skip) {
+  for (int i = 0; i < iovcnt; ++i) {
+    if (skip >= iov[i].iov_len) {
+      skip -= iov[i].iov_len;
+      continue;
+    }
+    Append(static_cast<const char *>(iov[i].iov_base) + skip,
+           iov[i].iov_len - skip);
+    skip = 0;
+  }
+}
+
+void OutputQueue::AppendShared(SharedBuffer buf) {
+  if (!buf || buf->empty()) {
+    return;
+  }
+  bytes_ += buf->size();
+  chunks_.emplace_back();
+  chunks_.back().shared = std::move(buf);
+}
+
+void OutputQueue::AppendFile(std::shared_ptr<const SharedFd> file,
+                             off_t offset, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  chunks_.emplace_back();
+  auto &chunk = chunks_.back();
+  chunk.offset = offset;
+  chunk.length = len;
+  chunk.file = std::move(file);
+  bytes_ += len;
+}
+
+int OutputQueue::Send(int fd, TlsStream *tls) {
+  if (tls != nullptr && tls->KernelSend()) {
+    // the kernel encrypts, sendfile and sendmsg work as they are
+    tls = nullptr;
+  }
+  while (bytes_ > 0) {
+    ssize_t nsent;
+    auto &head = chunks_[head_];
+    if (tls != nullptr) {
+      nsent = SendTls(tls);
+    } else if (head.file) {
+      off_t offset = head.offset;
+      nsent = sendfile(fd, head.file->get(), &offset, head.length);
+      if (nsent == 0) {
+        LOG_ERROR("file [{}] ends before the queued range",
+                  head.file->get());
+        return -1;
+      }
+    } else if (ZeroCopyEligible(head)) {
+      nsent = SendZeroCopy(fd);
+    } else {
+      // the owned and shared chunks up to the next file range, or the next
+      // chunk sent with zero copy
+      struct iovec iov[kMaxIov];
+      int n = 0;
+      for (size_t i = head_; i < chunks_.size() && n < kMaxIov; ++i, ++n) {
+        auto &chunk = chunks_[i];
+        if (chunk.file || (i != head_ && ZeroCopyEligible(chunk))) {
+          break;
+        }
+        const auto &bytes = chunk.Bytes();
+        iov[n].iov_base = const_cast<char *>(bytes.data()) + chunk.offset;
+        iov[n].iov_len = bytes.size() - chunk.offset;
+      }
+      struct msghdr msg = {};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = n;
+      nsent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    }
+    if (nsent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN ? 0 : -1;
+    }
+    Consume(nsent);
+  }
+  return 1;
+}
+
+ssize_t OutputQueue::SendTls(TlsStream *tls) {
+  auto &head = chunks_[head_];
+  if (head.file) {
+    ssize_t nsent = tls->WriteFile(head.file->get(), head.offset, head.length);
+    if (nsent == 0) {
+      LOG_ERROR("file [{}] ends before the queued range", head.file->get());
+      errno = EIO;
+      return -1;
+    }
+    return nsent;
+  }
+  const auto &bytes = head.Bytes();
+  struct iovec iov = {const_cast<char *>(bytes.data()) + head.offset,
+                      bytes.size() - head.offset};
+  return tls->Write(&iov, 1);
+}
+
+void OutputQueue::Consume(size_t len) {
+  bytes_ -= len;
+  while (len > 0) {
+    auto &chunk = chunks_[head_];
+    size_t left = chunk.Left();
+    if (len < left) {
+      chunk.offset += len;
+      if (chunk.file) {
+        chunk.length -= len;
+      }
+      return;
+    }
+    len -= left;
+    capacity_ -= chunk.data.capacity();
+    std::string().swap(chunk.data);
+    chunk.file.reset();
+    chunk.shared.reset();
+    ++head_;
+  }
+  if (head_ == chunks_.size()) {
+    chunks_.clear();
+    head_ = 0;
+  } else if (head_ * 2 >= chunks_.size()) {
+    chunks_.erase(chunks_.begin(), chunks_.begin() + head_);
+    head_ = 0;
+  }
+}
+
+bool OutputQueue::ZeroCopyEligible(const Chunk &chunk) const {
+  return zerocopy_ && !zerocopy_->copied && !chunk.file &&
+         chunk.Left() >= zerocopy_->threshold;
+}
+
+ssize_t OutputQueue::SendZeroCopy(int fd) {
+  auto &head = chunks_[head_];
+  if (!head.shared) {
+    // an owned chunk becomes shared, so it can outlive the queue
+    capacity_ -= head.data.capacity();
+    head.shared = std::make_shared<const std::string>(std::move(head.data));
+    std::string().swap(head.data);
+  }
+  struct iovec iov = {const_cast<char *>(head.shared->data()) + head.offset,
+                      head.shared->size() - head.offset};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  ssize_t nsent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+  if (nsent == -1 && errno == ENOBUFS) {
+    // out of option memory for the notifications, copy this time
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+  }
+  if (nsent >= 0) {
+    zerocopy_->pinned.push_back({zerocopy_->next_seq++, false, head.shared});
+  }
+  return nsent;
+}
+
+void OutputQueue::EnableZeroCopy(size_t threshold) {
+  if (threshold == 0) {
+    return;
+  }
+  if (!zerocopy_) {
+    zerocopy_ = std::make_unique<ZeroCopy>();
+  }
+  zerocopy_->threshold = threshold;
+}
+
+int OutputQueue::ReapZeroCopy(int fd) {
+  if (!zerocopy_) {
+    return 0;
+  }
+  int reaped = 0;
+  while (true) {
+    char control[128];
+    struct msghdr msg = {};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN ? reaped : -1;
+    }
+    for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+          !(cmsg->cmsg_level == SOL_IPV6 &&
+            cmsg->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+      auto *err = reinterpret_cast<const struct sock_extended_err *>(
+          CMSG_DATA(cmsg));
+      if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+        continue;
+      }
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        LOG_DEBUG("fd [{}] zero copy fell back to copying", fd);
+        zerocopy_->copied = true;
+      }
+      // the sends from ee_info to ee_data are done
+      CompleteZeroCopy(err->ee_info, err->ee_data);
+      ++reaped;
+    }
+  }
+}
+
+void OutputQueue::CompleteZeroCopy(uint32_t lo, uint32_t hi) {
+  auto &pinned = zerocopy_->pinned;
+  for (auto &item : pinned) {
+    // the counter wraps around
+    if (static_cast<int32_t>(item.seq - lo) >= 0 &&
+        static_cast<int32_t>(hi - item.seq) >= 0) {
+      item.done = true;
+    }
+  }
+  while (!pinned.empty() && pinned.front().done) {
+    pinned.pop_front();
+  }
+}
+
+void OutputQueue::Shrink() {
+  if (empty()) {
+    std::vector<Chunk>().swap(chunks_);
+    head_ = 0;
+    capacity_ = 0;
+  }
+}
+} // namespace hpl
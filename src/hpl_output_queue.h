@@ -0,0 +1,146 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef _HPL_OUTPUT_QUEUE_H_
+#define _HPL_OUTPUT_QUEUE_H_
+
+namespace hpl {
+class TlsStream;
+
+/// @brief a file descriptor shared by the queued ranges of a file, closed
+/// with the last of them
+class SharedFd {
+public:
+  explicit SharedFd(int fd) : fd_(fd) {}
+  ~SharedFd() {
+    if (fd_ != -1) {
+      close(fd_);
+    }
+  }
+  SharedFd(const SharedFd &) = delete;
+  SharedFd &operator=(const SharedFd &) = delete;
+
+  inline int get() const { return fd_; }
+
+private:
+  int fd_;
+};
+
+/// @brief immutable bytes queued by many connections at once, e.g. a frame
+/// broadcast to a group, freed when the last of them has sent it
+typedef std::shared_ptr<const std::string> SharedBuffer;
+
+/// @brief the bytes a connection has yet to send.
+/// small writes are coalesced into chunks, the chunks go out together with
+/// one sendmsg
+class OutputQueue {
+public:
+  OutputQueue() = default;
+  OutputQueue(const OutputQueue &) = delete;
+  OutputQueue &operator=(const OutputQueue &) = delete;
+  OutputQueue(OutputQueue &&) = default;
+  OutputQueue &operator=(OutputQueue &&) = default;
+
+  inline bool empty() const { return bytes_ == 0; }
+  /// bytes queued, file ranges included
+  inline size_t size() const { return bytes_; }
+  /// bytes held by the chunks
+  inline size_t capacity() const { return capacity_; }
+
+  void Append(const char *data, size_t len);
+  /// @brief queue the iovecs, skipping the first skip bytes
+  void Append(const struct iovec *iov, int iovcnt, size_t skip);
+  /// @brief queue a reference to buf, the bytes are not copied
+  void AppendShared(SharedBuffer buf);
+  /// @brief queue len bytes of file from offset, sent with sendfile
+  void AppendFile(std::shared_ptr<const SharedFd> file, off_t offset,
+                  size_t len);
+
+  /// @brief send as much as the socket takes
+  /// @param tls, encrypts the bytes unless the kernel does
+  /// @retval 1, drained
+  /// @retval 0, the socket is full
+  /// @retval -1, error
+  int Send(int fd, TlsStream *tls = nullptr);
+
+  /// @brief give back the memory of a drained queue
+  void Shrink();
+
+  /// @brief send the chunks of at least threshold bytes with MSG_ZEROCOPY,
+  /// the socket must have SO_ZEROCOPY set. a sent chunk is pinned until the
+  /// kernel reports the completion
+  void EnableZeroCopy(size_t threshold);
+  /// @brief unpin the buffers completed, as read from the error queue of fd.
+  /// a completion that reports a copy turns zero copy off for the queue
+  /// @return completions read, -1 on error
+  int ReapZeroCopy(int fd);
+  /// chunks the kernel may still read
+  inline size_t pinned() const {
+    return zerocopy_ ? zerocopy_->pinned.size() : 0;
+  }
+
+private:
+  /// chunks up to this size take more appended data
+  static constexpr size_t kCoalesceSize = 16 * 1024;
+  /// iovecs per sendmsg, the frames of a batched broadcast are one each
+  static constexpr int kMaxIov = 256;
+
+  /// owned bytes, shared bytes if shared is set, or a file range if file
+  /// is set
+  struct Chunk {
+    std::string data;
+    /// bytes sent, or the file position
+    off_t offset = 0;
+    /// file bytes left
+    size_t length = 0;
+    std::shared_ptr<const SharedFd> file;
+    SharedBuffer shared;
+
+    inline const std::string &Bytes() const { return shared ? *shared : data; }
+    inline size_t Left() const {
+      return file ? length : Bytes().size() - offset;
+    }
+  };
+
+  void Consume(size_t len);
+  /// @brief send the head chunk through tls, at most a record of a file
+  ssize_t SendTls(TlsStream *tls);
+
+  struct ZeroCopy {
+    size_t threshold;
+    /// the kernel reported a copy, don't try again
+    bool copied = false;
+    /// the kernel counts the zero copy sends of a socket, from 0
+    uint32_t next_seq = 0;
+    struct Pinned {
+      uint32_t seq;
+      bool done;
+      SharedBuffer buf;
+    };
+    /// in the order of seq
+    std::deque<Pinned> pinned;
+  };
+  bool ZeroCopyEligible(const Chunk &chunk) const;
+  /// @brief send the head chunk with MSG_ZEROCOPY and pin it
+  ssize_t SendZeroCopy(int fd);
+  void CompleteZeroCopy(uint32_t lo, uint32_t hi);
+
+  /// chunks before head_ are sent, they are dropped in batches
+  std::vector<Chunk> chunks_;
+  size_t head_ = 0;
+  size_t bytes_ = 0;
+  size_t capacity_ = 0;
+  std::unique_ptr<ZeroCopy> zerocopy_;
+};
+} // namespace hpl
+
+#endif // _HPL_OUTPUT_QUEUE_H_
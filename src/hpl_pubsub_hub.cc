@@ -0,0 +1,173 @@
+#include "hpl_pubsub_hub.h"
+
+#include <fnmatch.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "hpl_logger.h"
+
+namespace hpl {
+PubSubHub::~PubSubHub() {
+  for (auto &[connection, subscriptions] : subscribers_) {
+    auto &hubs = subscriptions.connection->hubs_;
+    hubs.erase(std::find(hubs.begin(), hubs.end(), this));
+  }
+}
+
+int PubSubHub::Subscribe(WebsocketConnection *connection,
+                         std::string_view topic) {
+  return Add(topics_, false, connection, topic);
+}
+
+int PubSubHub::SubscribePattern(WebsocketConnection *connection,
+                                std::string_view pattern) {
+  return Add(patterns_, true, connection, pattern);
+}
+
+int PubSubHub::Unsubscribe(const WebsocketConnection *connection,
+                           std::string_view topic) {
+  return Remove(topics_, false, connection, topic);
+}
+
+int PubSubHub::UnsubscribePattern(const WebsocketConnection *connection,
+                                  std::string_view pattern) {
+  return Remove(patterns_, true, connection, pattern);
+}
+
+int PubSubHub::Add(GroupMap &groups, bool pattern,
+                   WebsocketConnection *connection, std::string_view name) {
+  if (connection == nullptr) {
+    return -1;
+  }
+  // the key is kept in the subscriptions of the connection too
+  std::string key(name);
+  auto &group = groups[key];
+  if (!group) {
+    group = std::make_unique<BroadcastGroup>(policy_);
+  }
+  if (group->Join(connection) == -1) {
+    return -1;
+  }
+  auto [sub_iter, added] = subscribers_.try_emplace(connection);
+  auto &subscriptions = sub_iter->second;
+  if (added) {
+    // the connection unsubscribes from the hub when it is destroyed
+    subscriptions.connection = connection;
+    connection->hubs_.push_back(this);
+  }
+  (pattern ? subscriptions.patterns : subscriptions.topics)
+      .push_back(std::move(key));
+  return 0;
+}
+
+int PubSubHub::Remove(GroupMap &groups, bool pattern,
+                      const WebsocketConnection *connection,
+                      std::string_view name) {
+  auto sub_iter = subscribers_.find(connection);
+  if (sub_iter == subscribers_.end()) {
+    return -1;
+  }
+  auto &names =
+      pattern ? sub_iter->second.patterns : sub_iter->second.topics;
+  auto name_iter = std::find(names.begin(), names.end(), name);
+  if (name_iter == names.end()) {
+    return -1;
+  }
+  Leave(groups, connection, *name_iter);
+  *name_iter = std::move(names.back());
+  names.pop_back();
+  if (sub_iter->second.topics.empty() && sub_iter->second.patterns.empty()) {
+    Erase(sub_iter);
+  }
+  return 0;
+}
+
+void PubSubHub::Leave(GroupMap &groups, const WebsocketConnection *connection,
+                      const std::string &name) {
+  auto group_iter = groups.find(name);
+  if (group_iter == groups.end()) {
+    return;
+  }
+  group_iter->second->Leave(connection);
+  if (group_iter->second->size() == 0) {
+    groups.erase(group_iter);
+  }
+}
+
+void PubSubHub::Erase(SubscriberMap::iterator iter) {
+  auto &hubs = iter->second.connection->hubs_;
+  hubs.erase(std::find(hubs.begin(), hubs.end(), this));
+  subscribers_.erase(iter);
+}
+
+void PubSubHub::UnsubscribeAll(const WebsocketConnection *connection) {
+  auto sub_iter = subscribers_.find(connection);
+  if (sub_iter == subscribers_.end()) {
+    return;
+  }
+  for (const auto &name : sub_iter->second.topics) {
+    Leave(topics_, connection, name);
+  }
+  for (const auto &name : sub_iter->second.patterns) {
+    Leave(patterns_, connection, name);
+  }
+  Erase(sub_iter);
+}
+
+WsHook PubSubHub::WillCloseHook(WsHook next) {
+  return [this, next = std::move(next)](WebsocketConnection *connection,
+                                        std::string_view uri) {
+    UnsubscribeAll(connection);
+    return next ? next(connection, uri) : 0;
+  };
+}
+
+const BroadcastGroup *PubSubHub::GetTopic(std::string_view topic) const {
+  auto iter = topics_.find(std::string(topic));
+  return iter == topics_.end() ? nullptr : iter->second.get();
+}
+
+int PubSubHub::Publish(std::string_view topic, std::string_view data,
+                       WsFrameType type, std::string_view key) {
+  BroadcastMessage message(data, type);
+  const std::string name(topic);
+  int disconnected = 0;
+  auto topic_iter = topics_.find(name);
+  const BroadcastGroup *topic_group = nullptr;
+  if (topic_iter != topics_.end()) {
+    topic_group = topic_iter->second.get();
+    disconnected += topic_iter->second->Broadcast(message, key);
+  }
+  if (patterns_.empty()) {
+    return disconnected;
+  }
+
+  // a subscriber already reached by the topic or an earlier pattern is
+  // skipped
+  std::vector<const BroadcastGroup *> reached;
+  if (topic_group != nullptr) {
+    reached.push_back(topic_group);
+  }
+  auto skip = [&reached](const WebsocketConnection *connection) {
+    for (const auto *group : reached) {
+      if (group->Contains(connection)) {
+        return true;
+      }
+    }
+    return false;
+  };
+  for (auto &[pattern, group] : patterns_) {
+    if (fnmatch(pattern.c_str(), name.c_str(), 0) != 0) {
+      continue;
+    }
+    disconnected += group->Broadcast(
+        message, key,
+        reached.empty() ? std::function<bool(const WebsocketConnection *)>()
+                        : skip);
+    reached.push_back(group.get());
+  }
+  LOG_TRACE("publish [{}] done", name);
+  return disconnected;
+}
+} // namespace hpl
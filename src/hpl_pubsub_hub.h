@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "hpl_broadcast_group.h"
+#include "hpl_request_handler.h"
+#include "hpl_websocket_connection.h"
+
+#ifndef _HPL_PUBSUB_HUB_H_
+#define _HPL_PUBSUB_HUB_H_
+
+namespace hpl {
+/// @brief topics of websocket subscribers, each topic a BroadcastGroup.
+/// a connection subscribes to a topic by name, or to every topic matching a
+/// glob pattern, see fnmatch(3). a publish is encoded once for all the
+/// subscribers, and a connection gets it once however many of its
+/// subscriptions match
+class PubSubHub {
+public:
+  /// @param policy, of every topic
+  explicit PubSubHub(const BroadcastPolicy &policy = {}) : policy_(policy) {}
+  ~PubSubHub();
+  PubSubHub(const PubSubHub &) = delete;
+  PubSubHub &operator=(const PubSubHub &) = delete;
+
+  /// @retval -1, null or already subscribed
+  int Subscribe(WebsocketConnection *connection, std::string_view topic);
+  int SubscribePattern(WebsocketConnection *connection,
+                       std::string_view pattern);
+  /// @retval -1, not subscribed
+  int Unsubscribe(const WebsocketConnection *connection,
+                  std::string_view topic);
+  int UnsubscribePattern(const WebsocketConnection *connection,
+                         std::string_view pattern);
+  /// @brief drop every subscription of connection, in the time of its
+  /// subscription count
+  /// @note a closed connection unsubscribes by itself
+  void UnsubscribeAll(const WebsocketConnection *connection);
+
+  /// @brief a ws_will_close_hook that drops the subscriptions of the closed
+  /// connection, then calls next if set. only needed to stop publishing to
+  /// it before it is destroyed
+  WsHook WillCloseHook(WsHook next = nullptr);
+
+  /// @param key, for the conflation of lagging subscribers, see
+  /// BroadcastGroup::Broadcast
+  /// @return the subscribers disconnected by this message
+  int Publish(std::string_view topic, std::string_view data, WsFrameType type,
+              std::string_view key = {});
+
+  /// topics with subscribers
+  inline size_t TopicCount() const { return topics_.size(); }
+  inline size_t PatternCount() const { return patterns_.size(); }
+  /// @return null if nobody subscribes to topic by name
+  const BroadcastGroup *GetTopic(std::string_view topic) const;
+
+private:
+  typedef std::unordered_map<std::string, std::unique_ptr<BroadcastGroup>>
+      GroupMap;
+
+  int Add(GroupMap &groups, bool pattern, WebsocketConnection *connection,
+          std::string_view name);
+  int Remove(GroupMap &groups, bool pattern,
+             const WebsocketConnection *connection, std::string_view name);
+  /// @brief leave the group of name, dropped once empty
+  static void Leave(GroupMap &groups, const WebsocketConnection *connection,
+                    const std::string &name);
+
+  /// the subscriptions of a connection
+  struct Subscriptions {
+    WebsocketConnection *connection;
+    std::vector<std::string> topics;
+    std::vector<std::string> patterns;
+  };
+
+  BroadcastPolicy policy_;
+  GroupMap topics_;
+  GroupMap patterns_;
+  typedef std::unordered_map<const WebsocketConnection *, Subscriptions>
+      SubscriberMap;
+  SubscriberMap subscribers_;
+  /// @brief forget a connection without subscriptions
+  void Erase(SubscriberMap::iterator iter);
+};
+} // namespace hpl
+
+#endif // _HPL_PUBSUB_HUB_H_
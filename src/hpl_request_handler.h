@@ -1,13 +1,16 @@
 #pragma once
 
+#include "hpl_deflate.h"
 #include "hpl_method.h"
 #include <functional>
+#include <stdint.h>
 #include <string>
 #include <string_view>
 
 namespace hpl {
 class Connection;
 class WebsocketConnection;
+class SseChannel;
 
 enum WsFrameType {
   kTypeContinuation = 0x0,
@@ -25,9 +28,22 @@ typedef std::function<int(Connection *, const std::string_view &uri,
                           std::string &&partial, bool is_final)>
     Handler;
 typedef std::function<int(WebsocketConnection *, std::string_view uri)> WsHook;
+/// @brief the handler of a complete websocket message
+/// @retval -1, close the connection
+/// @retval 0, keep the connection
+/// @retval 1, stop reading until WebsocketConnection::ResumeRead()
 typedef std::function<int(WebsocketConnection *, WsFrameType type,
                           std::string_view data)>
     WsHandler;
+/// @brief the handler of a websocket message delivered piece by piece as it
+/// is received, data is only valid during the call
+/// @param type, of the message, the same for every piece
+/// @param first, the first piece of the message
+/// @param last, the message is complete
+/// @return same as WsHandler
+typedef std::function<int(WebsocketConnection *, WsFrameType type,
+                          std::string_view data, bool first, bool last)>
+    WsStreamHandler;
 
 struct RequestHandler {
   Handler http_handlers[static_cast<int>(HttpMethod::UNKNOWN)] = {};
@@ -35,5 +51,15 @@ struct RequestHandler {
   WsHook ws_ready_hook = nullptr;
   WsHook ws_will_close_hook = nullptr;
   WsHandler ws_message_handler = nullptr;
+  /// replaces ws_message_handler if set, messages are not buffered
+  WsStreamHandler ws_stream_handler = nullptr;
+  /// a larger message closes the connection with 1009, 0 means unlimited.
+  /// for a compressed message, both the compressed and the inflated size
+  uint64_t ws_max_message_size = 0;
+  /// permessage-deflate, offered by the client and enabled here
+  WsDeflateOptions ws_deflate;
+  /// a GET on the route is an event stream of the channel, the other
+  /// methods go to http_handlers
+  SseChannel *sse_channel = nullptr;
 };
 } // namespace hpl
\ No newline at end of file
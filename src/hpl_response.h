@@ -2,7 +2,9 @@
 
 #include <iterator>
 #include <map>
+#include <memory_resource>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <fmt/core.h>
@@ -70,11 +72,11 @@ static const std::vector<std::vector<std::string>> kStatusMessages = {
         "Network Authentication Required", // 511
     }};
 
-inline std::string
-MakeResponse(int status_code, HttpVersion version,
-             const std::map<std::string_view, std::string_view> &headers,
-             const std::string &body = "") {
-  std::string ret;
+template <typename String>
+inline void
+FormatResponse(String &ret, int status_code, HttpVersion version,
+               const std::map<std::string_view, std::string_view> &headers,
+               std::string_view body) {
   if (status_code < 100 || status_code > 599) {
     status_code = 500;
   }
@@ -92,10 +94,30 @@ MakeResponse(int status_code, HttpVersion version,
   if (!body.empty()) {
     fmt::format_to(std::back_inserter(ret), "Content-Length: {}\r\n\r\n",
                    body.size());
-    fmt::format_to(std::back_inserter(ret), "{}", body);
+    ret.append(body.data(), body.size());
   } else {
     fmt::format_to(std::back_inserter(ret), "\r\n");
   }
+}
+
+inline std::string
+MakeResponse(int status_code, HttpVersion version,
+             const std::map<std::string_view, std::string_view> &headers,
+             const std::string &body = "") {
+  std::string ret;
+  FormatResponse(ret, status_code, version, headers, body);
+  return ret;
+}
+
+/// @brief same as above, but the response is allocated from mr, e.g. the
+/// request arena of the connection
+inline std::pmr::string
+MakeResponse(std::pmr::memory_resource *mr, int status_code,
+             HttpVersion version,
+             const std::map<std::string_view, std::string_view> &headers,
+             std::string_view body = {}) {
+  std::pmr::string ret(mr);
+  FormatResponse(ret, status_code, version, headers, body);
   return ret;
 }
 
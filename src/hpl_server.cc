@@ -6,9 +6,11 @@
 #include <string.h>
 #include <string>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <regex>
@@ -20,12 +22,28 @@
 #include "hpl_logger.h"
 #include "hpl_method.h"
 #include "hpl_response.h"
+#include "hpl_sse_channel.h"
 #include "hpl_utils.h"
 
 namespace hpl {
 
 Server::Server() : poll_fd(-1) {}
 
+void Server::SetMemoryPolicy(const MemoryPolicy &policy) {
+  if (policy.read_chunk != policy_.read_chunk) {
+    scratch_.reset();
+  }
+  policy_ = policy;
+  budget_.SetLimit(policy_.global_budget, policy_.pressure_percent);
+}
+
+char *Server::Scratch() {
+  if (!scratch_) {
+    scratch_.reset(new char[policy_.read_chunk]);
+  }
+  return scratch_.get();
+}
+
 int Server::Init(const char *addr, int port, int backlog) {
   struct sigaction sa;
   sa.sa_handler = SIG_IGN;
@@ -93,6 +111,18 @@ int Server::Init(const char *addr, int port, int backlog) {
               strerror_r(errno, fmt_error_buf, kFmtErrorBufSize));
     return -4;
   }
+
+  post_watcher_.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (post_watcher_.fd == -1) {
+    LOG_FATAL("Init error eventfd {}",
+              strerror_r(errno, fmt_error_buf, kFmtErrorBufSize));
+    return -5;
+  }
+  post_watcher_.callback = [this](uint32_t) { RunPosted(); };
+  if (Watch(&post_watcher_, EPOLLIN) == -1) {
+    return -5;
+  }
+  posted_ = std::make_unique<MpscQueue<Posted>>(post_queue_size_);
   return 0;
 }
 
@@ -102,6 +132,8 @@ int Server::Poll(int timeout) {
   char fmt_error_buf[kFmtErrorBufSize];
   struct epoll_event events[max_events];
 
+  CheckMemoryPressure();
+  ResumeConsumers();
   for (auto pending_con_iter = pending_conns_.begin();
        pending_con_iter != pending_conns_.end(); ++pending_con_iter) {
     auto &pending_con = *pending_con_iter;
@@ -112,6 +144,16 @@ int Server::Poll(int timeout) {
       }
     }
   }
+  ExpireParks();
+  SendHeartbeats();
+  if (!lingering_.empty()) {
+    CloseLingering();
+  }
+  // output deferred since the last poll, e.g. broadcast from a timer
+  FlushScheduled();
+  FlushDelayed();
+  CloseDeferred();
+  timeout = HeartbeatTimeout(ParkTimeout(DelayedFlushTimeout(timeout)));
   int nfds = epoll_wait(poll_fd, events, max_events, timeout);
   if (nfds == -1) {
     LOG_ERROR("epoll_wait err[{}][{}] nfds[{}]", errno,
@@ -119,17 +161,37 @@ int Server::Poll(int timeout) {
     return -1;
   }
 
+  // writes of the handlers are queued and go out together after the dispatch
+  batching_ = true;
   for (int i = 0; i < nfds; ++i) {
+    // a watcher is tagged with the low bit, connections are aligned
+    if (events[i].data.u64 & kWatcherTag) {
+      auto *watcher =
+          reinterpret_cast<Watcher *>(events[i].data.u64 & ~kWatcherTag);
+      watcher->callback(events[i].events);
+      continue;
+    }
     auto *conn = static_cast<Connection *>(events[i].data.ptr);
     if (conn == server_conn_.get()) {
       LOG_INFO("EPOLLIN for server_conn_");
       auto new_conn = AcceptNewConnection();
+      if (new_conn && budget_.UnderPressure()) {
+        LOG_ERROR("memory pressure, used[{}] limit[{}], reject conn[{}]",
+                  budget_.Used(), budget_.Limit(), new_conn->fd_);
+        if (!new_conn->tls_) {
+          // a tls client can't read a response before the handshake
+          auto rsp_503 = MakeResponse(503, HttpVersion::HTTP_1_1,
+                                      {{"Connection", "close"}});
+          write(new_conn->fd_, rsp_503.data(), rsp_503.size());
+        }
+        close(new_conn->fd_);
+        continue;
+      }
       if (new_conn) {
-#ifdef SMALL_MEMORY
         uint32_t ep_flags = EPOLLIN;
-#else
-        uint32_t ep_flags = EPOLLIN | EPOLLET;
-#endif
+        if (policy_.edge_triggered) {
+          ep_flags |= EPOLLET;
+        }
         struct epoll_event event = {
             .events = ep_flags,
             .data = {.ptr = new_conn.get()},
@@ -139,104 +201,84 @@ int Server::Poll(int timeout) {
                     strerror_r(errno, fmt_error_buf, kFmtErrorBufSize));
           return -4;
         }
+        new_conn->ep_events_ = ep_flags;
+        new_conn->Account();
+        AssignHandle(new_conn.get());
         pending_conns_.push_back(std::move(new_conn));
       }
+    } else if (conn->close_pending_) {
+      continue;
     } else {
       LOG_TRACE("epoll event[{:#x}] for conn[{} {}]",
                 (unsigned)events[i].events, fmt::ptr(conn), conn->fd_);
+      if ((events[i].events & EPOLLERR) && conn->output_.pinned() > 0) {
+        // zero copy completions are queued on the error queue
+        if (conn->output_.ReapZeroCopy(conn->fd_) == -1) {
+          CloseConn(conn);
+          continue;
+        }
+        // EPOLLERR may be for the completions only, not a socket error
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(conn->fd_, SOL_SOCKET, SO_ERROR, &error, &len) == -1 ||
+            error != 0) {
+          LOG_TRACE("EPOLLERR for conn[{} {}] error[{}]", fmt::ptr(conn),
+                    conn->fd_, error);
+          CloseConn(conn);
+          continue;
+        }
+        events[i].events &= ~EPOLLERR;
+      }
+      if (conn->tls_ && !conn->tls_->Established()) {
+        int ret = conn->tls_->Handshake();
+        if (ret == -1) {
+          CloseConn(conn);
+          continue;
+        }
+        UpdateEvents(conn);
+        if (ret == 0) {
+          continue;
+        }
+        if (http2_options_ && conn->tls_->IsHttp2() &&
+            StartHttp2(conn) == -1) {
+          continue;
+        }
+        // the request may have come with the last flight, it is buffered in
+        // the session already
+        events[i].events |= EPOLLIN;
+      }
+      if (events[i].events & EPOLLOUT) {
+        if (conn->FlushOutput() == -1) {
+          CloseConn(conn);
+          continue;
+        }
+      }
+      if (conn->parked_ || conn->sse_) {
+        if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+          LOG_TRACE("idle conn[{} {}] hung up", fmt::ptr(conn), conn->fd_);
+          CloseConn(conn);
+        }
+        continue;
+      }
       if (events[i].events & EPOLLIN) {
         if (conn->ws_conn_) {
           auto ret = conn->ws_conn_->Read();
           LOG_DEBUG("websocket read ret[{}]", ret);
           if (ret == -1) {
-            if (conn->ws_conn_->will_close_hook_) {
-              conn->ws_conn_->will_close_hook_(conn->ws_conn_.get(), "");
-            }
             CloseConn(conn);
+            continue;
           }
-        } else {
-          auto ret = conn->ProcessDataIn();
-          LOG_DEBUG("EPOLLIN for conn[{} {}] ret[{}]", fmt::ptr(conn),
-                    conn->fd_, ret);
-          switch (ret) {
-          case -2: {
-            LOG_DEBUG("EPOLLIN for conn[{} {}] ret[{}]", fmt::ptr(conn),
-                      conn->fd_, ret);
+          conn->SettleInput();
+          PauseRead(conn);
+        } else if (conn->h2_conn_) {
+          if (conn->h2_conn_->Read() == -1) {
             CloseConn(conn);
-            break;
-          }
-          case -1: {
             continue;
           }
-          case 1:
-          case 0: {
-            // short http request(HTTP/1.0, HTTP/1.1)
-            const auto &parser = conn->GetParser();
-            const auto &uri = parser.GetUri();
-            const auto &method = parser.GetMethod();
-            auto &&handlers_iter = FindRequestHandler(uri);
-
-            LOG_DEBUG("uri: {}, method: {}", uri,
-                      static_cast<unsigned>(method));
-            if (handlers_iter != request_handlers.end()) {
-              Handler handler = nullptr;
-
-              if (conn->ShouldUpgradeWebsocket()) {
-                auto *ws_conn = conn->UpgradeToWebsocket(
-                    handlers_iter->second.ws_message_handler,
-                    handlers_iter->second.ws_will_close_hook);
-                LOG_DEBUG("upgrade websocket [{}] key[{}] accept[{}]",
-                          conn->fd_, ws_conn->GetWsKey(),
-                          ws_conn->GetWsAccept());
-                int n = 0;
-                if (handlers_iter->second.ws_connect_hook) {
-                  n = handlers_iter->second.ws_connect_hook(ws_conn, uri);
-                }
-                if (n == -1) {
-                  LOG_ERROR("ws_connect_hook close conn {}", conn->fd_);
-                  CloseConn(conn);
-                  continue;
-                }
-
-                const auto switch_protocol_rsp = MakeResponse(
-                    101, conn->GetParser().GetVersion(),
-                    {{"Upgrade", "websocket"},
-                     {"Connection", "Upgrade"},
-                     {"Sec-WebSocket-Accept", ws_conn->GetWsAccept()}});
-                conn->Write(switch_protocol_rsp.data(),
-                            switch_protocol_rsp.size());
-                LOG_TRACE("write switch_protocol_rsp");
-                if (handlers_iter->second.ws_ready_hook) {
-                  n = handlers_iter->second.ws_ready_hook(ws_conn, uri);
-                }
-                if (n == -1) {
-                  CloseConn(conn);
-                }
-                continue;
-
-              } else {
-                handler = handlers_iter->second
-                              .http_handlers[static_cast<int>(method)];
-              }
-
-              int handler_ret = -1;
-              if (handler) {
-                handler_ret = handler(conn, uri, conn->PopBody(),
-                                      ret == 1 ? true : false);
-              } else {
-                LOG_ERROR("uri registered, method not support");
-              }
-              if (handler_ret == -1) {
-                CloseConn(conn);
-              }
-            } else {
-              auto rsp_404 =
-                  MakeResponse(404, conn->GetParser().GetVersion(), {});
-              ret = conn->Write(rsp_404.data(), rsp_404.size());
-              CloseConn(conn);
-            }
-          }
-          }
+          conn->SettleInput();
+          PauseRead(conn);
+        } else if (HandleHttpIn(conn) != -1) {
+          conn->SettleInput();
         }
       } else if (events[i].events & EPOLLRDHUP) {
         LOG_TRACE("EPOLLRDHUP for conn[{} {}]", fmt::ptr(conn), conn->fd_);
@@ -250,9 +292,362 @@ int Server::Poll(int timeout) {
       }
     }
   }
+  batching_ = false;
+  FlushScheduled();
+  FlushDelayed();
+  CloseDeferred();
   return nfds;
 }
 
+int Server::EnableTls(const TlsOptions &options) {
+  auto ctx = std::make_unique<TlsContext>();
+  if (ctx->Init(options) == -1) {
+    return -1;
+  }
+  tls_ctx_ = std::move(ctx);
+  tls_ctx_->SetHttp2(http2_options_.has_value());
+  return 0;
+}
+
+void Server::EnableHttp2(const Http2Options &options) {
+  http2_options_ = options;
+  if (tls_ctx_) {
+    tls_ctx_->SetHttp2(true);
+  }
+}
+
+int Server::StartHttp2(Connection *conn) {
+  LOG_DEBUG("conn[{}] speaks http2", conn->fd_);
+  conn->h2_conn_ = std::make_unique<Http2Connection>(conn, *http2_options_);
+  if (conn->h2_conn_->Start() == -1 ||
+      (!conn->buffer_.empty() && conn->h2_conn_->DecodeFrames() == -1)) {
+    CloseConn(conn);
+    return -1;
+  }
+  return 0;
+}
+
+int Server::Watch(Watcher *watcher, uint32_t events) {
+  struct epoll_event event = {};
+  event.events = events;
+  event.data.u64 = reinterpret_cast<uintptr_t>(watcher) | kWatcherTag;
+  if (epoll_ctl(poll_fd, EPOLL_CTL_ADD, watcher->fd, &event) == -1) {
+    const int kBufSize = 64;
+    char buf[kBufSize];
+    LOG_ERROR("epoll_ctl, add watcher fd[{}] error:{}", watcher->fd,
+              strerror_r(errno, buf, kBufSize));
+    return -1;
+  }
+  return 0;
+}
+
+int Server::Unwatch(Watcher *watcher) {
+  struct epoll_event event = {};
+  if (epoll_ctl(poll_fd, EPOLL_CTL_DEL, watcher->fd, &event) == -1) {
+    const int kBufSize = 64;
+    char buf[kBufSize];
+    LOG_ERROR("epoll_ctl, del watcher fd[{}] error:{}", watcher->fd,
+              strerror_r(errno, buf, kBufSize));
+    return -1;
+  }
+  return 0;
+}
+
+void Server::ScheduleFlush(Connection *conn) {
+  if (!conn->flush_pending_) {
+    conn->flush_pending_ = true;
+    flush_conns_.push_back(conn);
+  }
+}
+
+void Server::ScheduleDelayedFlush(Connection *conn,
+                                  std::chrono::milliseconds delay) {
+  auto deadline = std::chrono::steady_clock::now() + delay;
+  if (delayed_conns_.empty() || deadline < flush_deadline_) {
+    flush_deadline_ = deadline;
+  }
+  if (!conn->flush_delayed_) {
+    conn->flush_delayed_ = true;
+    delayed_conns_.push_back(conn);
+  }
+}
+
+void Server::FlushDelayed() {
+  if (delayed_conns_.empty() ||
+      std::chrono::steady_clock::now() < flush_deadline_) {
+    return;
+  }
+  std::vector<Connection *> conns;
+  conns.swap(delayed_conns_);
+  for (auto *conn : conns) {
+    conn->flush_delayed_ = false;
+    if (conn->FlushOutput() == -1) {
+      CloseConn(conn);
+    }
+  }
+  conns.clear();
+  delayed_conns_.swap(conns);
+}
+
+int Server::DelayedFlushTimeout(int timeout) const {
+  if (delayed_conns_.empty()) {
+    return timeout;
+  }
+  auto left = std::chrono::ceil<std::chrono::milliseconds>(
+      flush_deadline_ - std::chrono::steady_clock::now());
+  int delay = std::max<int>(left.count(), 0);
+  return timeout < 0 ? delay : std::min(timeout, delay);
+}
+
+void Server::CloseLater(Connection *conn) {
+  if (!conn->close_pending_) {
+    conn->close_pending_ = true;
+    closing_conns_.push_back(conn);
+  }
+}
+
+void Server::CloseDeferred() {
+  while (!closing_conns_.empty()) {
+    auto *conn = closing_conns_.back();
+    // the best effort send of CloseConn takes the close frame out
+    CloseConn(conn);
+  }
+}
+
+void Server::Linger(int fd, OutputQueue &&output) {
+  auto &item = lingering_.emplace_back();
+  item.watcher.fd = fd;
+  item.output = std::move(output);
+  item.deadline = std::chrono::steady_clock::now() + kLingerTime;
+  item.watcher.callback = [&item](uint32_t) {
+    item.output.ReapZeroCopy(item.watcher.fd);
+  };
+  // the completions come with EPOLLERR, reported without asking. unwatched,
+  // the socket is checked at every poll
+  item.watched = Watch(&item.watcher, EPOLLET) == 0;
+}
+
+void Server::CloseLingering() {
+  auto now = std::chrono::steady_clock::now();
+  for (auto iter = lingering_.begin(); iter != lingering_.end();) {
+    auto &item = *iter;
+    if (!item.watched) {
+      item.output.ReapZeroCopy(item.watcher.fd);
+    }
+    if (item.output.pinned() > 0 && now < item.deadline) {
+      ++iter;
+      continue;
+    }
+    if (item.output.pinned() > 0) {
+      // a reset drops the segments that still point to the buffers
+      LOG_DEBUG("fd [{}] zero copy not completed, reset", item.watcher.fd);
+      struct linger linger = {1, 0};
+      setsockopt(item.watcher.fd, SOL_SOCKET, SO_LINGER, &linger,
+                 sizeof(linger));
+    }
+    if (item.watched) {
+      Unwatch(&item.watcher);
+    }
+    close(item.watcher.fd);
+    iter = lingering_.erase(iter);
+  }
+}
+
+void Server::ScheduleResume(Connection *conn) {
+  resumed_conns_.push_back(conn);
+}
+
+void Server::ResumeConsumers() {
+  if (resumed_conns_.empty()) {
+    return;
+  }
+  std::vector<Connection *> conns;
+  conns.swap(resumed_conns_);
+  batching_ = true;
+  for (auto *conn : conns) {
+    if (conn->consumer_paused_ || conn->close_pending_) {
+      // paused again before this poll
+      continue;
+    }
+    if (!conn->ws_conn_) {
+      // the requests pipelined behind a parked one
+      if (HandleHttpIn(conn) == -1) {
+        continue;
+      }
+    } else if (conn->ws_conn_->DecodeFrames() == -1 ||
+               ((policy_.edge_triggered ||
+                 (conn->tls_ && conn->tls_->Pending())) &&
+                conn->ws_conn_->Read() == -1)) {
+      // the frames buffered when the consumer paused, then the ones left in
+      // the socket, which gives no new edge, or in the tls session, which
+      // the socket isn't readable for
+      CloseConn(conn);
+      continue;
+    }
+    conn->SettleInput();
+    UpdateEvents(conn);
+  }
+  batching_ = false;
+  FlushScheduled();
+  CloseDeferred();
+}
+
+void Server::FlushScheduled() {
+  std::vector<Connection *> conns;
+  conns.swap(flush_conns_);
+  for (auto *conn : conns) {
+    conn->flush_pending_ = false;
+    if (conn->FlushOutput() == -1) {
+      CloseConn(conn);
+    }
+  }
+  // keep the capacity for the next dispatch
+  conns.clear();
+  flush_conns_.swap(conns);
+}
+
+int Server::HandleHttpIn(Connection *conn) {
+  while (http2_options_ && !conn->req_) {
+    // a client with prior knowledge starts with the preface, not a request
+    auto &buffer = conn->buffer_;
+    auto len = std::min(buffer.size(), kHttp2Preface.size());
+    if (len > 0 && memcmp(buffer.data(), kHttp2Preface.data(), len) != 0) {
+      break;
+    }
+    if (len == kHttp2Preface.size()) {
+      return StartHttp2(conn);
+    }
+    auto ret = conn->Read();
+    if (ret == -1) {
+      CloseConn(conn);
+      return -1;
+    } else if (ret == 0) {
+      return 0;
+    }
+  }
+  do {
+    auto ret = conn->ProcessDataIn();
+    LOG_DEBUG("EPOLLIN for conn[{} {}] ret[{}]", fmt::ptr(conn), conn->fd_,
+              ret);
+    if (ret == -2) {
+      CloseConn(conn);
+      return -1;
+    }
+    if (ret == -1) {
+      conn->SettleInput();
+      PauseRead(conn);
+      return 0;
+    }
+
+    // short http request(HTTP/1.0, HTTP/1.1)
+    const auto &parser = conn->GetParser();
+    const auto &uri = parser.GetUri();
+    const auto &method = parser.GetMethod();
+    if (method == HttpMethod::UNKNOWN) {
+      {
+        auto rsp_400 = MakeResponse(conn->GetRequestResource(), 400,
+                                    HttpVersion::HTTP_1_1, {});
+        conn->Write(rsp_400.data(), rsp_400.size());
+      }
+      CloseConn(conn);
+      return -1;
+    }
+    auto &&handlers_iter = FindRequestHandler(uri);
+
+    LOG_DEBUG("uri: {}, method: {}", uri, HttpMethodToString(method));
+    if (handlers_iter == request_handlers.end()) {
+      {
+        // allocated from the arena of conn, must be gone before closing it
+        auto rsp_404 = MakeResponse(conn->GetRequestResource(), 404,
+                                    conn->GetParser().GetVersion(), {});
+        conn->Write(rsp_404.data(), rsp_404.size());
+      }
+      CloseConn(conn);
+      return -1;
+    }
+
+    if (conn->ShouldUpgradeWebsocket()) {
+      auto *ws_conn = conn->UpgradeToWebsocket(&handlers_iter->second);
+      LOG_DEBUG("upgrade websocket [{}] key[{}] accept[{}]", conn->fd_,
+                ws_conn->GetWsKey(), ws_conn->GetWsAccept());
+      const auto &deflate_options = handlers_iter->second.ws_deflate;
+      const auto &parser = conn->GetParser();
+      std::string extensions;
+      WsDeflateParams deflate_params;
+      if (deflate_options.enable &&
+          NegotiateDeflate(deflate_options,
+                           parser.GetHeader("Sec-WebSocket-Extensions"),
+                           deflate_params, extensions)) {
+        ws_conn->deflate_ = std::make_unique<WsDeflate>(
+            deflate_options, deflate_params, &zstream_pool_);
+      }
+      int n = 0;
+      if (handlers_iter->second.ws_connect_hook) {
+        n = handlers_iter->second.ws_connect_hook(ws_conn, uri);
+      }
+      if (n == -1) {
+        LOG_ERROR("ws_connect_hook close conn {}", conn->fd_);
+        CloseConn(conn);
+        return -1;
+      }
+
+      {
+        std::map<std::string_view, std::string_view> headers{
+            {"Upgrade", "websocket"},
+            {"Connection", "Upgrade"},
+            {"Sec-WebSocket-Accept", ws_conn->GetWsAccept()}};
+        if (!extensions.empty()) {
+          headers.emplace("Sec-WebSocket-Extensions", extensions);
+        }
+        const auto switch_protocol_rsp =
+            MakeResponse(conn->GetRequestResource(), 101, parser.GetVersion(),
+                         headers);
+        conn->Write(switch_protocol_rsp.data(), switch_protocol_rsp.size());
+        LOG_TRACE("write switch_protocol_rsp");
+      }
+      if (handlers_iter->second.ws_ready_hook) {
+        n = handlers_iter->second.ws_ready_hook(ws_conn, uri);
+      }
+      if (n == -1) {
+        CloseConn(conn);
+        return -1;
+      }
+      // no more http on this connection
+      conn->req_.reset();
+      // frames sent right behind the handshake
+      if (!conn->buffer_.empty() && ws_conn->DecodeFrames() == -1) {
+        CloseConn(conn);
+        return -1;
+      }
+      return 0;
+    }
+
+    auto *sse_channel = handlers_iter->second.sse_channel;
+    if (sse_channel && method == HttpMethod::GET && ret == 1) {
+      return StartEventStream(conn, sse_channel);
+    }
+
+    const Handler &handler =
+        handlers_iter->second.http_handlers[static_cast<int>(method)];
+    int handler_ret = -1;
+    if (handler) {
+      handler_ret =
+          handler(conn, uri, conn->PopBody(), ret == 1 ? true : false);
+    } else {
+      LOG_ERROR("uri registered, method not support");
+    }
+    if (handler_ret == -1) {
+      CloseConn(conn);
+      return -1;
+    }
+    if (conn->parked_) {
+      // pipelined requests wait until the parked one is answered
+      return 0;
+    }
+    // a body slice or a request is handled, go on with what is buffered
+  } while (true);
+}
+
 std::unique_ptr<Connection> Server::AcceptNewConnection() {
   struct sockaddr_in client_addr;
   socklen_t client_addr_len = sizeof(client_addr);
@@ -274,6 +669,23 @@ std::unique_ptr<Connection> Server::AcceptNewConnection() {
   setnonblocking(client_fd);
 
   auto new_conn = std::unique_ptr<Connection>(new Connection(this, client_fd));
+  // no zero copy with tls, the records are encrypted into a copy anyway
+  if (tls_ctx_) {
+    auto *ssl = tls_ctx_->NewSession(client_fd);
+    if (ssl == nullptr) {
+      close(client_fd);
+      return nullptr;
+    }
+    new_conn->tls_ = std::make_unique<TlsStream>(ssl);
+  } else if (policy_.zerocopy_threshold != 0) {
+    if (setsockopt(client_fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) ==
+        -1) {
+      LOG_ERROR("setsockopt zero copy error [{}]",
+                strerror_r(errno, buf, kBufSize));
+    } else {
+      new_conn->output_.EnableZeroCopy(policy_.zerocopy_threshold);
+    }
+  }
   return new_conn;
 }
 
@@ -291,14 +703,378 @@ int Server::CloseConn(Connection *conn) {
     return -1;
   }
   LOG_DEBUG("{} {}", __FUNCTION__, conn->fd_);
+  if (conn->ws_conn_ && conn->ws_conn_->handlers_->ws_will_close_hook) {
+    conn->ws_conn_->handlers_->ws_will_close_hook(conn->ws_conn_.get(), "");
+  }
   if (conn->fd_ != -1) {
-    close(conn->fd_);
+    // best effort for the queued output, e.g. an error response
+    conn->output_.Send(conn->fd_, conn->tls_.get());
+    if (conn->tls_) {
+      conn->tls_->Shutdown();
+    }
+    if (conn->output_.pinned() > 0) {
+      Linger(conn->fd_, std::move(conn->output_));
+    } else {
+      close(conn->fd_);
+    }
     conn->fd_ = -1;
   }
+  if (conn->buffer_.borrowed()) {
+    scratch_in_use_ = false;
+  }
+  conn->buffer_.Release(&buffer_pool_);
+  budget_.Update(conn->accounted_, 0);
+  conn->accounted_ = 0;
+  if (conn->read_paused_) {
+    paused_conns_.erase(
+        std::find(paused_conns_.begin(), paused_conns_.end(), conn));
+  }
+  if (!resumed_conns_.empty()) {
+    resumed_conns_.erase(
+        std::remove(resumed_conns_.begin(), resumed_conns_.end(), conn),
+        resumed_conns_.end());
+  }
+  if (conn->flush_delayed_) {
+    delayed_conns_.erase(
+        std::find(delayed_conns_.begin(), delayed_conns_.end(), conn));
+  }
+  if (conn->close_pending_) {
+    closing_conns_.erase(
+        std::find(closing_conns_.begin(), closing_conns_.end(), conn));
+  }
+  if (conn->flush_pending_) {
+    auto iter = std::find(flush_conns_.begin(), flush_conns_.end(), conn);
+    if (iter != flush_conns_.end()) {
+      flush_conns_.erase(iter);
+    }
+  }
+  if (conn->parked_) {
+    Unpark(conn, false);
+  }
+  if (conn->sse_) {
+    conn->sse_->Leave(conn);
+  }
+  ReleaseHandle(conn);
   pending_conns_.remove_if([conn](const auto &c) { return c.get() == conn; });
   return 0;
 }
 
+int Server::Park(Connection *conn, std::string_view key,
+                 std::chrono::milliseconds timeout) {
+  if (conn->parked_ || conn->ws_conn_ || conn->h2_conn_ || !conn->req_ ||
+      conn->req_->parser.GetState() != HttpHeaderParser::ParserState::Done) {
+    LOG_ERROR("conn[{}] can't be parked", conn->fd_);
+    return -1;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (parked_count_ == 0) {
+    park_wheel_.resize(kParkWheelSlots);
+    park_tick_time_ = now;
+  }
+  auto &park = conn->req_->park;
+  auto &waiters = *parks_.try_emplace(std::string(key)).first;
+  park.waiters = &waiters;
+  park.index = waiters.second.size();
+  waiters.second.push_back(conn);
+
+  // counted from the start of the cursor slot, rounded up to a tick
+  auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+      now - park_tick_time_ + timeout);
+  size_t ticks = std::max<int64_t>(
+      1, (wait + kParkTick - std::chrono::milliseconds(1)) / kParkTick);
+  park.slot = (park_cursor_ + ticks) % kParkWheelSlots;
+  park.rounds = (ticks - 1) / kParkWheelSlots;
+  auto &slot = park_wheel_[park.slot];
+  park.slot_index = slot.size();
+  slot.push_back(conn);
+
+  conn->parked_ = true;
+  ++parked_count_;
+  UpdateEvents(conn);
+  return 0;
+}
+
+size_t Server::Wake(std::string_view key, SharedBuffer response) {
+  auto iter = parks_.find(std::string(key));
+  if (iter == parks_.end()) {
+    return 0;
+  }
+  // Unpark drops the key with its last request
+  auto conns = iter->second;
+  for (auto *conn : conns) {
+    Unpark(conn);
+    if (conn->WriteShared(response) == -1) {
+      CloseLater(conn);
+    }
+  }
+  return conns.size();
+}
+
+void Server::Unpark(Connection *conn, bool resume) {
+  auto &park = conn->req_->park;
+  auto &waiters = park.waiters->second;
+  waiters[park.index] = waiters.back();
+  waiters[park.index]->req_->park.index = park.index;
+  waiters.pop_back();
+  if (waiters.empty()) {
+    parks_.erase(parks_.find(park.waiters->first));
+  }
+  park.waiters = nullptr;
+
+  auto &slot = park_wheel_[park.slot];
+  slot[park.slot_index] = slot.back();
+  slot[park.slot_index]->req_->park.slot_index = park.slot_index;
+  slot.pop_back();
+
+  conn->parked_ = false;
+  --parked_count_;
+  if (!resume) {
+    return;
+  }
+  UpdateEvents(conn);
+  // pipelined requests, buffered or still in the tls session
+  if (!conn->buffer_.empty() || (conn->tls_ && conn->tls_->Pending())) {
+    ScheduleResume(conn);
+  }
+}
+
+void Server::ExpireParks() {
+  auto now = std::chrono::steady_clock::now();
+  while (parked_count_ > 0 && now - park_tick_time_ >= kParkTick) {
+    park_tick_time_ += kParkTick;
+    park_cursor_ = (park_cursor_ + 1) % kParkWheelSlots;
+    auto &slot = park_wheel_[park_cursor_];
+    // backwards, Unpark moves the last request into the hole
+    for (size_t i = slot.size(); i-- > 0;) {
+      auto *conn = slot[i];
+      auto &park = conn->req_->park;
+      if (park.rounds > 0) {
+        --park.rounds;
+        continue;
+      }
+      Unpark(conn);
+      auto rsp_204 = MakeResponse(conn->GetRequestResource(), 204,
+                                  conn->GetParser().GetVersion(), {});
+      if (conn->Write(rsp_204.data(), rsp_204.size()) == -1) {
+        CloseLater(conn);
+      }
+    }
+  }
+}
+
+int Server::ParkTimeout(int timeout) const {
+  if (parked_count_ == 0) {
+    return timeout;
+  }
+  auto left = std::chrono::ceil<std::chrono::milliseconds>(
+      park_tick_time_ + kParkTick - std::chrono::steady_clock::now());
+  int delay = std::max<int>(left.count(), 0);
+  return timeout < 0 ? delay : std::min(timeout, delay);
+}
+
+int Server::StartEventStream(Connection *conn, SseChannel *channel) {
+  {
+    auto head = MakeResponse(conn->GetRequestResource(), 200,
+                             conn->GetParser().GetVersion(),
+                             {{"Content-Type", "text/event-stream"},
+                              {"Cache-Control", "no-cache"}});
+    if (conn->Write(head.data(), head.size()) == -1 ||
+        channel->Subscribe(conn,
+                           conn->GetParser().GetHeader("Last-Event-ID")) ==
+            -1) {
+      CloseConn(conn);
+      return -1;
+    }
+  }
+  // no more http on this connection, what the client sends is ignored
+  conn->req_.reset();
+  conn->buffer_.Consume(conn->buffer_.size());
+  UpdateEvents(conn);
+  return 0;
+}
+
+void Server::SendHeartbeats() {
+  if (sse_channels_.empty()) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (now < next_heartbeat_) {
+    return;
+  }
+  next_heartbeat_ = std::chrono::steady_clock::time_point::max();
+  for (auto *channel : sse_channels_) {
+    next_heartbeat_ = std::min(next_heartbeat_, channel->Heartbeat(now));
+  }
+}
+
+int Server::HeartbeatTimeout(int timeout) const {
+  if (next_heartbeat_ == std::chrono::steady_clock::time_point::max()) {
+    return timeout;
+  }
+  auto left = std::chrono::ceil<std::chrono::milliseconds>(
+      next_heartbeat_ - std::chrono::steady_clock::now());
+  int delay = std::max<int>(left.count(), 0);
+  return timeout < 0 ? delay : std::min(timeout, delay);
+}
+
+void Server::AssignHandle(Connection *conn) {
+  uint32_t index;
+  if (free_handles_.empty()) {
+    index = handle_slots_.size();
+    handle_slots_.emplace_back();
+  } else {
+    index = free_handles_.back();
+    free_handles_.pop_back();
+  }
+  handle_slots_[index].conn = conn;
+  conn->handle_ = {index, handle_slots_[index].generation};
+}
+
+void Server::ReleaseHandle(Connection *conn) {
+  if (conn->handle_.generation == 0) {
+    return;
+  }
+  auto &slot = handle_slots_[conn->handle_.index];
+  slot.conn = nullptr;
+  // a handle of the closed connection never matches again, 0 is skipped
+  if (++slot.generation == 0) {
+    slot.generation = 1;
+  }
+  free_handles_.push_back(conn->handle_.index);
+  conn->handle_ = {};
+}
+
+Connection *Server::Resolve(ConnHandle handle) const {
+  if (handle.index >= handle_slots_.size()) {
+    return nullptr;
+  }
+  auto &slot = handle_slots_[handle.index];
+  if (slot.generation != handle.generation || slot.conn == nullptr ||
+      slot.conn->close_pending_) {
+    return nullptr;
+  }
+  return slot.conn;
+}
+
+int Server::Post(ConnHandle handle, std::function<void(Connection *)> fn) {
+  return Enqueue({handle, std::move(fn), {}, WsFrameType::kTypeBinary});
+}
+
+int Server::Send(ConnHandle handle, std::string_view bytes, WsFrameType type) {
+  return Enqueue({handle, nullptr, std::string(bytes), type});
+}
+
+int Server::Enqueue(Posted &&posted) {
+  if (!posted_ || !posted_->TryPush(std::move(posted))) {
+    LOG_ERROR("post to conn[{}] dropped, the queue is full",
+              posted.handle.index);
+    return -1;
+  }
+  // one wakeup until the loop runs the posts
+  if (!post_notified_.exchange(true)) {
+    uint64_t one = 1;
+    if (write(post_watcher_.fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+      const int kBufSize = 64;
+      char buf[kBufSize];
+      LOG_ERROR("eventfd write error:{}", strerror_r(errno, buf, kBufSize));
+    }
+  }
+  return 0;
+}
+
+void Server::RunPosted() {
+  uint64_t count;
+  while (read(post_watcher_.fd, &count, sizeof(count)) == -1 &&
+         errno == EINTR) {
+  }
+  post_notified_.store(false);
+  Posted posted;
+  while (posted_->TryPop(posted)) {
+    auto *conn = Resolve(posted.handle);
+    if (conn == nullptr) {
+      continue;
+    }
+    if (posted.fn) {
+      posted.fn(conn);
+      continue;
+    }
+    if (conn->h2_conn_) {
+      // a response needs its stream, which the bytes don't carry
+      LOG_ERROR("conn[{}] send to a http2 connection dropped", conn->fd_);
+      continue;
+    }
+    int ret = conn->ws_conn_
+                  ? conn->ws_conn_->Write(posted.type, posted.bytes.data(),
+                                          posted.bytes.size())
+                  : conn->Write(posted.bytes.data(), posted.bytes.size());
+    if (ret == -1) {
+      CloseLater(conn);
+    }
+  }
+}
+
+int Server::UpdateEvents(Connection *conn) {
+  uint32_t ep_flags = 0;
+  if (conn->parked_ || conn->sse_) {
+    ep_flags |= EPOLLRDHUP;
+  } else if (!conn->read_paused_ && !conn->consumer_paused_) {
+    ep_flags |= EPOLLIN;
+  }
+  if (!conn->output_.empty() || (conn->tls_ && conn->tls_->WantWrite())) {
+    ep_flags |= EPOLLOUT;
+  }
+  if (policy_.edge_triggered) {
+    ep_flags |= EPOLLET;
+  }
+  if (ep_flags == conn->ep_events_ || conn->fd_ == -1) {
+    return 0;
+  }
+  struct epoll_event event = {
+      .events = ep_flags,
+      .data = {.ptr = conn},
+  };
+  if (epoll_ctl(poll_fd, EPOLL_CTL_MOD, conn->fd_, &event) == -1) {
+    const int kBufSize = 64;
+    char buf[kBufSize];
+    LOG_ERROR("epoll_ctl, mod conn[{} {}] error:{}", fmt::ptr(conn), conn->fd_,
+              strerror_r(errno, buf, kBufSize));
+    return -1;
+  }
+  conn->ep_events_ = ep_flags;
+  return 0;
+}
+
+void Server::PauseRead(Connection *conn) {
+  if (!budget_.UnderPressure() || conn->read_paused_ ||
+      conn->buffer_.capacity() < policy_.pause_read_threshold) {
+    return;
+  }
+  LOG_DEBUG("memory pressure, pause reading conn[{}] buffered[{}]", conn->fd_,
+            conn->buffer_.size());
+  conn->read_paused_ = true;
+  paused_conns_.push_back(conn);
+  UpdateEvents(conn);
+}
+
+void Server::CheckMemoryPressure() {
+  bool under_pressure = budget_.UnderPressure();
+  if (under_pressure && !under_pressure_) {
+    LOG_INFO("memory pressure, used[{}] limit[{}]", budget_.Used(),
+             budget_.Limit());
+    buffer_pool_.Trim();
+    for (auto &conn : pending_conns_) {
+      conn->ShrinkIdleBuffers();
+    }
+  } else if (!under_pressure && !paused_conns_.empty()) {
+    for (auto *conn : paused_conns_) {
+      conn->read_paused_ = false;
+      UpdateEvents(conn);
+    }
+    paused_conns_.clear();
+  }
+  under_pressure_ = under_pressure;
+}
+
 int Server::RegisterRequestHandler(const std::string &uri,
                                    RequestHandler &&handler) {
   std::string uri_copy(uri);
@@ -310,23 +1086,31 @@ int Server::RegisterRequestHandler(const std::string &uri,
     }
     ++iter;
   }
+  auto *sse_channel = handler.sse_channel;
+  if (sse_channel && std::find(sse_channels_.begin(), sse_channels_.end(),
+                               sse_channel) == sse_channels_.end()) {
+    sse_channels_.push_back(sse_channel);
+    // the next poll asks the channel when its heartbeat is due
+    next_heartbeat_ = std::chrono::steady_clock::now();
+  }
   request_handlers[uri_copy] = std::move(handler);
+
+  routes_.clear();
+  for (auto iter = request_handlers.cbegin(); iter != request_handlers.cend();
+       ++iter) {
+    routes_.emplace_back(std::regex(iter->first), iter);
+  }
   return 0;
 }
 
 decltype(Server::request_handlers)::const_iterator
 Server::FindRequestHandler(std::string_view uri) const {
-  std::string uri_str(uri.data());
-  auto handle_iter = request_handlers.end();
-  for (auto iter = request_handlers.begin(); iter != request_handlers.end();
-       ++iter) {
-    std::regex uri_regex(iter->first);
-    if (std::regex_match(uri_str, uri_regex)) {
-      handle_iter = iter;
-      break;
+  for (const auto &[uri_regex, iter] : routes_) {
+    if (std::regex_match(uri.data(), uri.data() + uri.size(), uri_regex)) {
+      return iter;
     }
   }
-  return handle_iter;
+  return request_handlers.end();
 }
 
 } // namespace hpl
\ No newline at end of file
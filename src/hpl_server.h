@@ -1,19 +1,46 @@
+#pragma once
 
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <list>
 #include <map>
 #include <memory>
+#include <optional>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
+#include "hpl_buffer_pool.h"
 #include "hpl_connection.h"
+#include "hpl_deflate.h"
+#include "hpl_memory_policy.h"
+#include "hpl_mpsc_queue.h"
 #include "hpl_request_handler.h"
 namespace hpl {
 
 class Connection;
 
+/// @brief a descriptor other than a connection, polled by a server, e.g. an
+/// eventfd another thread wakes the loop with. owned by the caller
+struct Watcher {
+  int fd = -1;
+  /// runs on the loop thread with the epoll events, writes to connections
+  /// are batched as in the handlers
+  std::function<void(uint32_t events)> callback;
+};
+
 class Server {
 public:
   explicit Server();
   int Init(const char *addr, int port, int backlog);
+  /// @brief before Init, the posts and sends waiting for the loop, rounded up
+  /// to a power of 2. Post and Send fail once that many are waiting
+  inline void SetPostQueueSize(size_t size) { post_queue_size_ = size; }
 
   /// @param timeout, in milliseconds, -1 == infinite
   int Poll(int timeout);
@@ -21,7 +48,204 @@ public:
 
   int CloseConn(Connection *conn);
 
+  /// @brief poll watcher->fd for events in this server, may be called from
+  /// any thread. watcher must stay valid until Unwatch
+  int Watch(Watcher *watcher, uint32_t events);
+  /// @brief only from the loop thread, or once the loop stopped
+  int Unwatch(Watcher *watcher);
+
+  /// @brief run fn with the connection of handle on the loop thread, may be
+  /// called from any thread. fn doesn't run if the connection is closed by
+  /// then. writes of fn are batched as in the handlers. on a http/2
+  /// connection fn answers the stream it selects first with
+  /// conn->GetHttp2()->SelectStream, the one selected by then may be ended
+  /// @retval -1, the queue of posts is full, see SetPostQueueSize, or the
+  /// server isn't initialized
+  int Post(ConnHandle handle, std::function<void(Connection *)> fn);
+  /// @brief from any thread, send bytes as a message of type to a websocket
+  /// connection, or as they are to a http/1 connection. a stale handle or a
+  /// http/2 connection drops them, use Post there. a failed write closes the
+  /// connection
+  /// @return same as Post
+  int Send(ConnHandle handle, std::string_view bytes,
+           WsFrameType type = WsFrameType::kTypeBinary);
+  /// @brief on the loop thread, the connection of handle isn't closed, e.g.
+  /// to drop what is kept for a client gone in the middle of a request
+  inline bool IsOpen(ConnHandle handle) const {
+    return Resolve(handle) != nullptr;
+  }
+
+  /// @brief from a http handler, hold the complete request of conn until
+  /// Wake(key), or answer it with 204 once timeout passed. the handler
+  /// returns 0, meanwhile the connection is only polled for a hang up
+  /// @retval -1, the request isn't complete, or conn is parked or upgraded
+  int Park(Connection *conn, std::string_view key,
+           std::chrono::milliseconds timeout);
+  /// @brief answer the requests parked under key, the same response bytes
+  /// are queued to all of them
+  /// @param response, a whole http response, e.g. from MakeResponse
+  /// @return the requests answered
+  size_t Wake(std::string_view key, SharedBuffer response);
+  inline size_t GetParkedCount() const { return parked_count_; }
+
+  /// @brief terminate TLS on the connections accepted from now on. the
+  /// handshakes run on the loop, the sessions are cached in the server
+  /// @retval -1, error, e.g. the certificate or key can't be loaded
+  int EnableTls(const TlsOptions &options);
+  /// @brief speak HTTP/2 with the clients starting with its preface on a
+  /// plain connection, and with the ones choosing h2 by ALPN on a TLS one.
+  /// a GET on an event stream route is reset with HTTP_1_1_REQUIRED there,
+  /// browsers retry it over HTTP/1.1
+  void EnableHttp2(const Http2Options &options = {});
+
+  /// @note the caps apply to the connections from now on, the trigger mode
+  /// and zero copy only to the connections accepted later
+  void SetMemoryPolicy(const MemoryPolicy &policy);
+  inline const MemoryPolicy &GetMemoryPolicy() const { return policy_; }
+  inline const MemoryBudget &GetMemoryBudget() const { return budget_; }
+  inline size_t GetConnectionCount() const { return pending_conns_.size(); }
+
 private:
+  friend class Connection;
+  friend class WebsocketConnection;
+  friend class SseChannel;
+  friend class Http2Connection;
+
+  static constexpr uint64_t kWatcherTag = 1;
+  /// posts waiting for the loop, see SetPostQueueSize
+  size_t post_queue_size_ = 1024;
+
+  MemoryPolicy policy_;
+  MemoryBudget budget_;
+  BufferPool buffer_pool_{&budget_};
+  /// zlib streams of permessage-deflate, declared before the connections
+  ZStreamPool zstream_pool_;
+  /// reads of drained connections land here first, see InputBuffer
+  std::unique_ptr<char[]> scratch_;
+  bool scratch_in_use_ = false;
+  char *Scratch();
+  /// connections not reading because of the memory pressure
+  std::vector<Connection *> paused_conns_;
+  bool under_pressure_ = false;
+
+  /// set while the events are dispatched, writes are queued meanwhile
+  bool batching_ = false;
+  /// connections written to during the dispatch
+  std::vector<Connection *> flush_conns_;
+  void ScheduleFlush(Connection *conn);
+  /// @brief send the output queued during the dispatch, one sendmsg per
+  /// connection
+  void FlushScheduled();
+
+  /// connections whose queued output waits until flush_deadline_
+  std::vector<Connection *> delayed_conns_;
+  std::chrono::steady_clock::time_point flush_deadline_;
+  /// @brief send the output of conn within delay, with what else is
+  /// queued for it by then
+  void ScheduleDelayedFlush(Connection *conn, std::chrono::milliseconds delay);
+  /// @brief flush the delayed connections once the deadline passed
+  void FlushDelayed();
+  /// @return timeout shortened to the flush deadline
+  int DelayedFlushTimeout(int timeout) const;
+
+  /// websocket connections resumed by their consumer
+  std::vector<Connection *> resumed_conns_;
+  void ScheduleResume(Connection *conn);
+  /// @brief deliver the frames buffered by the resumed connections
+  void ResumeConsumers();
+  /// connections to close at the end of the poll
+  std::vector<Connection *> closing_conns_;
+  /// @brief close conn once the events of this poll are handled
+  void CloseLater(Connection *conn);
+  void CloseDeferred();
+
+  /// a closed connection whose zero copy sends the kernel may still read,
+  /// the socket stays open for the completions
+  struct Lingering {
+    Watcher watcher;
+    OutputQueue output;
+    std::chrono::steady_clock::time_point deadline;
+    bool watched = false;
+  };
+  /// a socket still pinning buffers after this is reset
+  static constexpr std::chrono::seconds kLingerTime{10};
+  std::list<Lingering> lingering_;
+  /// @brief keep fd open and the pinned buffers of output until completed
+  void Linger(int fd, OutputQueue &&output);
+  /// @brief close the lingering sockets completed or past their deadline
+  void CloseLingering();
+
+  /// resolution and size of the timing wheel of the parked requests
+  static constexpr std::chrono::milliseconds kParkTick{100};
+  static constexpr size_t kParkWheelSlots = 512;
+  /// parked requests by key
+  std::unordered_map<std::string, std::vector<Connection *>> parks_;
+  std::vector<std::vector<Connection *>> park_wheel_;
+  size_t park_cursor_ = 0;
+  /// the time the cursor slot started
+  std::chrono::steady_clock::time_point park_tick_time_;
+  size_t parked_count_ = 0;
+  /// @brief take conn out of its key and the wheel
+  /// @param resume, poll conn again and handle its pipelined requests
+  void Unpark(Connection *conn, bool resume = true);
+  /// @brief answer the parked requests whose deadline passed with 204
+  void ExpireParks();
+  /// @return timeout shortened to the next tick of the wheel
+  int ParkTimeout(int timeout) const;
+
+  /// the channels of the registered event stream routes
+  std::vector<SseChannel *> sse_channels_;
+  /// the earliest heartbeat due
+  std::chrono::steady_clock::time_point next_heartbeat_ =
+      std::chrono::steady_clock::time_point::max();
+  /// @brief answer a GET on an event stream route and subscribe conn
+  /// @retval -1, conn is closed
+  int StartEventStream(Connection *conn, SseChannel *channel);
+  /// @brief send the heartbeats due
+  void SendHeartbeats();
+  /// @return timeout shortened to the next heartbeat
+  int HeartbeatTimeout(int timeout) const;
+
+  /// the connection and generation of every handle index
+  struct HandleSlot {
+    Connection *conn = nullptr;
+    uint32_t generation = 1;
+  };
+  std::vector<HandleSlot> handle_slots_;
+  std::vector<uint32_t> free_handles_;
+  void AssignHandle(Connection *conn);
+  void ReleaseHandle(Connection *conn);
+  /// @return nullptr if handle is stale
+  Connection *Resolve(ConnHandle handle) const;
+
+  struct Posted {
+    ConnHandle handle;
+    /// nullptr for a Send
+    std::function<void(Connection *)> fn;
+    std::string bytes;
+    WsFrameType type = WsFrameType::kTypeBinary;
+  };
+  std::unique_ptr<MpscQueue<Posted>> posted_;
+  /// an eventfd, written by the first post after the loop drained
+  Watcher post_watcher_;
+  std::atomic<bool> post_notified_{false};
+  int Enqueue(Posted &&posted);
+  /// @brief on the loop thread, run the posts and sends
+  void RunPosted();
+
+  /// @brief sync the epoll interest of conn with its read/write state
+  int UpdateEvents(Connection *conn);
+  /// @brief apply the pressure behavior before waiting for events
+  void CheckMemoryPressure();
+  void PauseRead(Connection *conn);
+
+  /// nullptr while the connections are plain
+  std::unique_ptr<TlsContext> tls_ctx_;
+  std::optional<Http2Options> http2_options_;
+  /// @brief switch conn to HTTP/2 and handle what it buffered
+  /// @retval -1, conn is closed
+  int StartHttp2(Connection *conn);
+
   int server_fd;
   int poll_fd;
   std::unique_ptr<Connection> server_conn_;
@@ -30,8 +254,19 @@ private:
 
   std::unique_ptr<Connection> AcceptNewConnection();
 
+  /// @brief parse and dispatch the http requests buffered by conn
+  /// @retval -1, conn is closed
+  /// @retval 0, waiting for more data
+  int HandleHttpIn(Connection *conn);
+
   std::map<std::string, RequestHandler, std::less<>> request_handlers;
 
+  /// compiled uri patterns in the order of request_handlers, so a request
+  /// doesn't build a regex per registered uri
+  std::vector<
+      std::pair<std::regex, decltype(request_handlers)::const_iterator>>
+      routes_;
+
   decltype(request_handlers)::const_iterator
   FindRequestHandler(std::string_view uri_view) const;
 };
@@ -0,0 +1,111 @@
+#include "hpl_sharded_broadcast_group.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <utility>
+
+#include "hpl_logger.h"
+#include "hpl_websocket_utils.h"
+
+namespace hpl {
+ShardedBroadcastGroup::ShardedBroadcastGroup(const std::vector<Server *> &loops,
+                                             const BroadcastPolicy &policy,
+                                             size_t inbox_capacity) {
+  const unsigned kBufSize = 64;
+  char fmt_error_buf[kBufSize];
+  for (auto *server : loops) {
+    auto shard = std::make_unique<Shard>(server, policy, inbox_capacity);
+    shard->watcher.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard->watcher.fd == -1) {
+      LOG_ERROR("eventfd err[{}]",
+                strerror_r(errno, fmt_error_buf, kBufSize));
+      continue;
+    }
+    auto *raw = shard.get();
+    shard->watcher.callback = [this, raw](uint32_t) { Drain(*raw); };
+    if (server->Watch(&shard->watcher, EPOLLIN) == -1) {
+      close(shard->watcher.fd);
+      continue;
+    }
+    shards_.push_back(std::move(shard));
+  }
+}
+
+ShardedBroadcastGroup::~ShardedBroadcastGroup() {
+  for (auto &shard : shards_) {
+    shard->server->Unwatch(&shard->watcher);
+    close(shard->watcher.fd);
+  }
+}
+
+ShardedBroadcastGroup::Shard *
+ShardedBroadcastGroup::FindShard(const WebsocketConnection *connection) const {
+  if (connection == nullptr) {
+    return nullptr;
+  }
+  for (auto &shard : shards_) {
+    if (shard->server == connection->GetServer()) {
+      return shard.get();
+    }
+  }
+  return nullptr;
+}
+
+int ShardedBroadcastGroup::Join(WebsocketConnection *connection) {
+  auto *shard = FindShard(connection);
+  return shard ? shard->group.Join(connection) : -1;
+}
+
+int ShardedBroadcastGroup::Leave(const WebsocketConnection *connection) {
+  auto *shard = FindShard(connection);
+  return shard ? shard->group.Leave(connection) : -1;
+}
+
+int ShardedBroadcastGroup::Publish(std::string_view data, WsFrameType type,
+                                   std::string_view key) {
+  auto frame = MakeWebsocketFrame(data, type);
+  const size_t header_len = frame->size() - data.size();
+  int dropped = 0;
+  for (auto &shard : shards_) {
+    Item item{frame, header_len, type, std::string(key)};
+    if (!shard->inbox.TryPush(std::move(item))) {
+      ++dropped;
+      continue;
+    }
+    // one wakeup until the loop drains, whatever the publishes meanwhile
+    if (!shard->notified.exchange(true)) {
+      uint64_t one = 1;
+      if (write(shard->watcher.fd, &one, sizeof(one)) == -1 &&
+          errno != EAGAIN) {
+        const unsigned kBufSize = 64;
+        char fmt_error_buf[kBufSize];
+        LOG_ERROR("eventfd write err[{}]",
+                  strerror_r(errno, fmt_error_buf, kBufSize));
+      }
+    }
+  }
+  if (dropped != 0) {
+    LOG_ERROR("publish dropped by [{}] full shards", dropped);
+  }
+  return dropped;
+}
+
+void ShardedBroadcastGroup::Drain(Shard &shard) {
+  uint64_t count;
+  while (read(shard.watcher.fd, &count, sizeof(count)) == -1 &&
+         errno == EINTR) {
+  }
+  // cleared before popping, a publish racing with the drain wakes us again
+  shard.notified.store(false);
+  Item item;
+  while (shard.inbox.TryPop(item)) {
+    BroadcastMessage message(std::move(item.frame), item.header_len,
+                             item.type);
+    shard.group.Broadcast(message, item.key);
+  }
+}
+} // namespace hpl
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hpl_broadcast_group.h"
+#include "hpl_mpsc_queue.h"
+#include "hpl_output_queue.h"
+#include "hpl_server.h"
+#include "hpl_websocket_connection.h"
+
+#ifndef _HPL_SHARDED_BROADCAST_GROUP_H_
+#define _HPL_SHARDED_BROADCAST_GROUP_H_
+
+namespace hpl {
+/// @brief a broadcast group whose members live on several servers, each
+/// polled by its own thread. every server has a shard, a local
+/// BroadcastGroup with an inbox. a publish from any thread encodes the frame
+/// once, pushes a reference into every inbox and wakes the loops with an
+/// eventfd, and each loop fans out to its own members
+class ShardedBroadcastGroup {
+public:
+  /// @param loops, one shard each, the servers must be initialized
+  /// @param inbox_capacity, messages waiting per shard, a publish to a full
+  /// inbox is dropped for that shard
+  explicit ShardedBroadcastGroup(const std::vector<Server *> &loops,
+                                 const BroadcastPolicy &policy = {},
+                                 size_t inbox_capacity = 4096);
+  /// @note destroy the group once the loops stopped polling
+  ~ShardedBroadcastGroup();
+  ShardedBroadcastGroup(const ShardedBroadcastGroup &) = delete;
+  ShardedBroadcastGroup &operator=(const ShardedBroadcastGroup &) = delete;
+
+  /// @brief from the loop thread of connection
+  /// @retval -1, the server of connection has no shard, or already a member
+  int Join(WebsocketConnection *connection);
+  int Leave(const WebsocketConnection *connection);
+
+  /// @brief from any thread, compression is done once per shard
+  /// @return the shards the message is dropped for
+  int Publish(std::string_view data, WsFrameType type,
+              std::string_view key = {});
+
+  inline size_t ShardCount() const { return shards_.size(); }
+  /// @brief from the loop thread of the shard
+  inline const BroadcastGroup &GetShard(size_t index) const {
+    return shards_[index]->group;
+  }
+
+private:
+  struct Item {
+    SharedBuffer frame;
+    size_t header_len = 0;
+    WsFrameType type = WsFrameType::kTypeText;
+    std::string key;
+  };
+  struct Shard {
+    Shard(Server *server, const BroadcastPolicy &policy, size_t capacity)
+        : server(server), group(policy), inbox(capacity) {}
+    Server *server;
+    BroadcastGroup group;
+    MpscQueue<Item> inbox;
+    Watcher watcher;
+    /// the eventfd is written and the loop hasn't drained yet
+    std::atomic<bool> notified{false};
+  };
+
+  Shard *FindShard(const WebsocketConnection *connection) const;
+  /// @brief on the loop thread, broadcast what is in the inbox
+  void Drain(Shard &shard);
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+} // namespace hpl
+
+#endif // _HPL_SHARDED_BROADCAST_GROUP_H_
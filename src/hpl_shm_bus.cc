@@ -0,0 +1,344 @@
+#include "hpl_shm_bus.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include "hpl_logger.h"
+
+namespace hpl {
+namespace {
+constexpr uint32_t kMagic = 0x68706c62; // "hplb"
+constexpr uint32_t kVersion = 1;
+/// yields before a producer takes over a slot whose writer seems dead
+constexpr int kMaxSpin = 1 << 16;
+/// how long a reader waits for a message being written while later ones
+/// are, before it takes the writer for dead and skips it
+constexpr std::chrono::milliseconds kMaxStall{2};
+/// the length of a slot taken from a dead writer, no message in it
+constexpr uint32_t kLostLength = UINT32_MAX;
+
+/// @brief the start of the segment, the slots follow
+struct Header {
+  std::atomic<uint32_t> magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t slot_size;
+  /// the next position to reserve
+  alignas(64) std::atomic<uint64_t> write_pos;
+  /// futex word, bumped by every publish
+  alignas(64) std::atomic<uint32_t> signal;
+  /// notifier threads sleeping on signal
+  std::atomic<uint32_t> waiters;
+};
+
+/// @brief seq is 2 * pos + 1 while the message of pos is written, and
+/// 2 * pos + 2 once it is complete, or once a producer found the writer of
+/// the lap before dead and set kLostLength
+struct Slot {
+  std::atomic<uint64_t> seq;
+  uint32_t length;
+  uint8_t type;
+  uint8_t key_length;
+  char data[];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+                  std::atomic<uint32_t>::is_always_lock_free,
+              "the segment needs address free atomics");
+
+size_t SlotStride(uint32_t slot_size) {
+  return (sizeof(Slot) + slot_size + 63) & ~size_t(63);
+}
+
+size_t SegmentSize(uint32_t slots, uint32_t slot_size) {
+  return sizeof(Header) + SlotStride(slot_size) * slots;
+}
+
+Header *HeaderOf(void *map) { return static_cast<Header *>(map); }
+
+Slot *SlotOf(void *map, uint64_t pos) {
+  auto *header = HeaderOf(map);
+  auto index = pos & (header->slots - 1);
+  return reinterpret_cast<Slot *>(static_cast<char *>(map) + sizeof(Header) +
+                                  SlotStride(header->slot_size) * index);
+}
+
+long Futex(std::atomic<uint32_t> *word, int op, uint32_t value) {
+  // not FUTEX_PRIVATE_FLAG, the word is shared with other processes
+  return syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), op, value,
+                 nullptr, nullptr, 0);
+}
+} // namespace
+
+ShmBroadcastBus::~ShmBroadcastBus() {
+  if (notifier_.joinable()) {
+    stop_ = true;
+    auto *header = HeaderOf(map_);
+    header->signal.fetch_add(1);
+    Futex(&header->signal, FUTEX_WAKE, INT32_MAX);
+    notifier_.join();
+  }
+  if (watcher_.fd != -1) {
+    server_->Unwatch(&watcher_);
+    close(watcher_.fd);
+  }
+  if (map_ != nullptr) {
+    munmap(map_, map_len_);
+  }
+}
+
+int ShmBroadcastBus::Open(const char *name, uint32_t slots,
+                          uint32_t slot_size) {
+  const unsigned kBufSize = 64;
+  char fmt_error_buf[kBufSize];
+  if (map_ != nullptr) {
+    LOG_ERROR("shm bus already open");
+    return -1;
+  }
+  uint32_t size = 2;
+  while (size < slots) {
+    size <<= 1;
+  }
+  slots = size;
+  const size_t len = SegmentSize(slots, slot_size);
+
+  bool created = true;
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd == -1 && errno == EEXIST) {
+    created = false;
+    fd = shm_open(name, O_RDWR | O_CLOEXEC, 0600);
+  }
+  if (fd == -1) {
+    LOG_ERROR("shm_open {} err[{}]", name,
+              strerror_r(errno, fmt_error_buf, kBufSize));
+    return -1;
+  }
+  if (created && ftruncate(fd, len) == -1) {
+    LOG_ERROR("ftruncate {} err[{}]", name,
+              strerror_r(errno, fmt_error_buf, kBufSize));
+    close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+  // the creator may not have sized the segment yet
+  struct stat st = {};
+  for (int i = 0; i < 1000 && st.st_size == 0; ++i) {
+    if (fstat(fd, &st) == -1) {
+      break;
+    }
+    if (st.st_size == 0) {
+      usleep(1000);
+    }
+  }
+  if (static_cast<size_t>(st.st_size) != len) {
+    LOG_ERROR("shm bus {} has [{}] bytes, [{}] expected", name, st.st_size,
+              len);
+    close(fd);
+    return -1;
+  }
+  void *map = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    LOG_ERROR("mmap {} err[{}]", name,
+              strerror_r(errno, fmt_error_buf, kBufSize));
+    return -1;
+  }
+
+  auto *header = HeaderOf(map);
+  if (created) {
+    // ftruncate zero fills, every slot seq starts at 0
+    header->version = kVersion;
+    header->slots = slots;
+    header->slot_size = slot_size;
+    header->magic.store(kMagic, std::memory_order_release);
+  } else {
+    for (int i = 0;
+         i < 1000 && header->magic.load(std::memory_order_acquire) != kMagic;
+         ++i) {
+      usleep(1000);
+    }
+    if (header->magic.load(std::memory_order_acquire) != kMagic ||
+        header->version != kVersion || header->slots != slots ||
+        header->slot_size != slot_size) {
+      LOG_ERROR("shm bus {} doesn't match slots[{}] slot_size[{}]", name,
+                slots, slot_size);
+      munmap(map, len);
+      return -1;
+    }
+  }
+
+  watcher_.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (watcher_.fd == -1) {
+    LOG_ERROR("eventfd err[{}]", strerror_r(errno, fmt_error_buf, kBufSize));
+    munmap(map, len);
+    return -1;
+  }
+  watcher_.callback = [this](uint32_t) { Drain(); };
+  if (server_->Watch(&watcher_, EPOLLIN) == -1) {
+    close(watcher_.fd);
+    watcher_.fd = -1;
+    munmap(map, len);
+    return -1;
+  }
+  map_ = map;
+  map_len_ = len;
+  // the signal before the read position, a publish in between wakes the
+  // notifier instead of waiting for the next one
+  uint32_t seen = header->signal.load();
+  read_pos_ = header->write_pos.load();
+  notifier_ = std::thread(&ShmBroadcastBus::Notify, this, seen);
+  return 0;
+}
+
+int ShmBroadcastBus::Publish(std::string_view data, WsFrameType type,
+                             std::string_view key) {
+  if (map_ == nullptr) {
+    return -1;
+  }
+  auto *header = HeaderOf(map_);
+  if (key.size() > UINT8_MAX || key.size() + data.size() > header->slot_size) {
+    LOG_ERROR("shm bus message of [{}] bytes is over a slot",
+              key.size() + data.size());
+    return -1;
+  }
+  Slot *slot;
+  uint64_t writing;
+  while (true) {
+    const uint64_t pos = header->write_pos.fetch_add(1);
+    slot = SlotOf(map_, pos);
+    writing = 2 * pos + 1;
+    uint64_t seq = slot->seq.load(std::memory_order_relaxed);
+    int spin = 0;
+    while (seq < writing && seq % 2 == 1 && ++spin < kMaxSpin) {
+      // the writer of a lap ago is still copying
+      sched_yield();
+      seq = slot->seq.load(std::memory_order_relaxed);
+    }
+    while (seq < writing && !slot->seq.compare_exchange_weak(
+                                seq, writing, std::memory_order_acquire)) {
+    }
+    if (seq >= writing) {
+      // lapped by a producer a whole ring ahead, the message is lost anyway
+      return 0;
+    }
+    if (seq % 2 == 0) {
+      break;
+    }
+    // the writer of a lap ago died in the slot, or is as good as dead. its
+    // copy may still land, so the slot is marked for the readers to skip
+    // and the message takes the next one
+    LOG_ERROR("shm bus writer of position [{}] seems dead", (seq - 1) / 2);
+    slot->length = kLostLength;
+    slot->seq.store(writing + 1, std::memory_order_release);
+  }
+  // readers of the previous lap see the change of seq after the copy
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->length = data.size();
+  slot->type = type;
+  slot->key_length = key.size();
+  memcpy(slot->data, key.data(), key.size());
+  memcpy(slot->data + key.size(), data.data(), data.size());
+  uint64_t expected = writing;
+  slot->seq.compare_exchange_strong(expected, writing + 1,
+                                    std::memory_order_release);
+
+  header->signal.fetch_add(1);
+  if (header->waiters.load() > 0) {
+    Futex(&header->signal, FUTEX_WAKE, INT32_MAX);
+  }
+  return 0;
+}
+
+void ShmBroadcastBus::Drain() {
+  uint64_t count;
+  while (read(watcher_.fd, &count, sizeof(count)) == -1 && errno == EINTR) {
+  }
+  auto *header = HeaderOf(map_);
+  while (true) {
+    auto *slot = SlotOf(map_, read_pos_);
+    const uint64_t done = 2 * read_pos_ + 2;
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+    if (seq == done - 1 && header->write_pos.load() > read_pos_ + 1) {
+      // being written while later messages are, wait a bit for a writer
+      // that is alive
+      auto deadline = std::chrono::steady_clock::now() + kMaxStall;
+      while (seq == done - 1 && std::chrono::steady_clock::now() < deadline) {
+        sched_yield();
+        seq = slot->seq.load(std::memory_order_acquire);
+      }
+      if (seq == done - 1) {
+        ++lost_;
+        LOG_ERROR("shm bus writer of position [{}] stalled, skipped",
+                  read_pos_);
+        ++read_pos_;
+        continue;
+      }
+    }
+    if (seq < done) {
+      // not published yet, the notifier wakes us again once it is
+      break;
+    }
+    if (seq == done) {
+      uint32_t length = slot->length;
+      uint8_t key_length = slot->key_length;
+      auto type = static_cast<WsFrameType>(slot->type);
+      // kLostLength is over any slot
+      const bool fits = size_t(key_length) + length <= header->slot_size;
+      if (fits) {
+        buf_.assign(slot->data, key_length + length);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot->seq.load(std::memory_order_relaxed) == done) {
+        ++read_pos_;
+        if (fits) {
+          std::string_view message(buf_);
+          sink_(message.substr(0, key_length), message.substr(key_length),
+                type);
+        }
+        continue;
+      }
+    }
+    // overwritten, skip to the oldest message still in the ring
+    uint64_t oldest = header->write_pos.load() - header->slots;
+    if (oldest <= read_pos_) {
+      oldest = read_pos_ + 1;
+    }
+    lost_ += oldest - read_pos_;
+    LOG_ERROR("shm bus lost [{}] messages", oldest - read_pos_);
+    read_pos_ = oldest;
+  }
+}
+
+void ShmBroadcastBus::Notify(uint32_t seen) {
+  auto *header = HeaderOf(map_);
+  while (!stop_) {
+    header->waiters.fetch_add(1);
+    if (header->signal.load() == seen) {
+      Futex(&header->signal, FUTEX_WAIT, seen);
+    }
+    header->waiters.fetch_sub(1);
+    uint32_t signal = header->signal.load();
+    if (signal != seen && !stop_) {
+      seen = signal;
+      uint64_t one = 1;
+      if (write(watcher_.fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        const unsigned kBufSize = 64;
+        char fmt_error_buf[kBufSize];
+        LOG_ERROR("eventfd write err[{}]",
+                  strerror_r(errno, fmt_error_buf, kBufSize));
+      }
+    }
+  }
+}
+} // namespace hpl
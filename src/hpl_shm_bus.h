@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "hpl_request_handler.h"
+#include "hpl_server.h"
+
+#ifndef _HPL_SHM_BUS_H_
+#define _HPL_SHM_BUS_H_
+
+namespace hpl {
+/// @brief a broadcast bus between the processes of a host, a ring of slots
+/// in a named shared memory segment. any process publishes a message once,
+/// and every attached process, the publisher included, gets it on its loop
+/// to fan out to its own members, e.g.
+///   ShmBroadcastBus bus(&server, [&hub](auto key, auto data, auto type) {
+///     hub.Publish(key, data, type);
+///   });
+/// the ring doesn't wait for readers, a process that falls a lap behind
+/// loses the overwritten messages. a slot whose writer died is skipped by the
+/// readers, and marked empty by the producer coming to it a lap later
+class ShmBroadcastBus {
+public:
+  /// @brief gets a message on the loop thread
+  typedef std::function<void(std::string_view key, std::string_view data,
+                             WsFrameType type)>
+      Sink;
+
+  ShmBroadcastBus(Server *server, Sink sink)
+      : server_(server), sink_(std::move(sink)) {}
+  /// @note destroy the bus from the loop thread, or once the loop stopped
+  ~ShmBroadcastBus();
+  ShmBroadcastBus(const ShmBroadcastBus &) = delete;
+  ShmBroadcastBus &operator=(const ShmBroadcastBus &) = delete;
+
+  /// @brief create the segment, or attach to it. the processes sharing a
+  /// name must agree on slots and slot_size. the segment outlives the
+  /// processes, shm_unlink it to start over
+  /// @param name, for shm_open, like "/httpoll-bus"
+  /// @param slots, messages in the ring, rounded up to a power of 2
+  /// @param slot_size, the largest key and message of a slot
+  /// @retval -1, error
+  int Open(const char *name, uint32_t slots = 4096, uint32_t slot_size = 4096);
+
+  /// @brief from any thread, the message is read from this process too
+  /// @retval -1, the key and data don't fit a slot, or the bus isn't open
+  int Publish(std::string_view data, WsFrameType type,
+              std::string_view key = {});
+
+  /// messages overwritten before this process read them, or skipped for a
+  /// writer that stalled in the middle of one
+  inline uint64_t Lost() const { return lost_; }
+
+private:
+  /// @brief on the loop thread, deliver the messages published since
+  void Drain();
+  /// @brief on the notifier thread, wait on the futex of the segment and
+  /// wake the loop with the eventfd
+  /// @param seen, the futex word when the read position was taken
+  void Notify(uint32_t seen);
+
+  Server *const server_;
+  Sink sink_;
+
+  void *map_ = nullptr;
+  size_t map_len_ = 0;
+  /// the next position to read
+  uint64_t read_pos_ = 0;
+  uint64_t lost_ = 0;
+  /// a copy of the slot being read
+  std::string buf_;
+
+  Watcher watcher_;
+  std::thread notifier_;
+  std::atomic<bool> stop_{false};
+};
+} // namespace hpl
+
+#endif // _HPL_SHM_BUS_H_
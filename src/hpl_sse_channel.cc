@@ -0,0 +1,159 @@
+#include "hpl_sse_channel.h"
+
+#include <charconv>
+#include <iterator>
+#include <memory>
+#include <string>
+
+#include <fmt/format.h>
+
+#include "hpl_connection.h"
+#include "hpl_logger.h"
+#include "hpl_server.h"
+
+namespace hpl {
+SseChannel::SseChannel(const SseOptions &options)
+    : options_(options),
+      heartbeat_(std::make_shared<const std::string>(":\n\n")),
+      next_heartbeat_(std::chrono::steady_clock::now() + options.heartbeat) {
+  if (options_.retry.count() > 0) {
+    retry_ = std::make_shared<const std::string>(
+        fmt::format("retry: {}\n\n", options_.retry.count()));
+  }
+}
+
+SseChannel::~SseChannel() {
+  for (auto *conn : members_) {
+    conn->sse_ = nullptr;
+  }
+}
+
+uint64_t SseChannel::Publish(std::string_view data, std::string_view event) {
+  const uint64_t id = next_id_++;
+  std::string buf;
+  buf.reserve(data.size() + event.size() + 32);
+  fmt::format_to(std::back_inserter(buf), "id: {}\n", id);
+  if (!event.empty()) {
+    // a line break would end the field early, it is dropped
+    buf += "event: ";
+    for (char c : event) {
+      if (c != '\r' && c != '\n') {
+        buf += c;
+      }
+    }
+    buf += '\n';
+  }
+  // a line break in the data, CRLF, LF or a lone CR, starts another data
+  // field
+  do {
+    auto pos = data.find_first_of("\r\n");
+    fmt::format_to(std::back_inserter(buf), "data: {}\n", data.substr(0, pos));
+    if (pos == std::string_view::npos) {
+      break;
+    }
+    data.remove_prefix(data.compare(pos, 2, "\r\n") == 0 ? pos + 2 : pos + 1);
+  } while (!data.empty());
+  buf += '\n';
+  auto shared = std::make_shared<const std::string>(std::move(buf));
+
+  if (options_.replay != 0) {
+    if (ring_.size() == options_.replay) {
+      ring_.pop_front();
+    }
+    ring_.emplace_back(id, shared);
+  }
+  // Write may close a member, which leaves the channel at the end of the poll
+  for (size_t i = 0; i < members_.size(); ++i) {
+    Write(members_[i], shared);
+  }
+  return id;
+}
+
+int SseChannel::Subscribe(Connection *conn, std::string_view last_event_id) {
+  if (conn->sse_ != nullptr || !index_.emplace(conn, members_.size()).second) {
+    return -1;
+  }
+  members_.push_back(conn);
+  conn->sse_ = this;
+  if (retry_ && Write(conn, retry_) == -1) {
+    return -1;
+  }
+  uint64_t last = 0;
+  auto [end, ec] = std::from_chars(
+      last_event_id.data(), last_event_id.data() + last_event_id.size(), last);
+  if (last_event_id.empty() || ec != std::errc() ||
+      end != last_event_id.data() + last_event_id.size() || last >= next_id_) {
+    return 0;
+  }
+  for (auto &[id, buf] : ring_) {
+    if (id > last && Write(conn, buf) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int SseChannel::Leave(const Connection *conn) {
+  auto iter = index_.find(conn);
+  if (iter == index_.end()) {
+    return -1;
+  }
+  // the last member takes the place of the one leaving
+  size_t pos = iter->second;
+  index_.erase(iter);
+  members_[pos]->sse_ = nullptr;
+  if (pos + 1 != members_.size()) {
+    members_[pos] = members_.back();
+    index_[members_[pos]] = pos;
+  }
+  members_.pop_back();
+  return 0;
+}
+
+std::chrono::steady_clock::time_point
+SseChannel::Heartbeat(std::chrono::steady_clock::time_point now) {
+  if (options_.heartbeat.count() == 0) {
+    return std::chrono::steady_clock::time_point::max();
+  }
+  if (now >= next_heartbeat_) {
+    for (size_t i = 0; i < members_.size(); ++i) {
+      Write(members_[i], heartbeat_);
+    }
+    next_heartbeat_ = now + options_.heartbeat;
+  }
+  return next_heartbeat_;
+}
+
+int SseChannel::Write(Connection *conn, const SharedBuffer &buf) {
+  if (conn->close_pending_) {
+    return -1;
+  }
+  auto *server = conn->svr_;
+  if (options_.lag_bytes != 0 && conn->output_.size() >= options_.lag_bytes) {
+    // output queued during the dispatch isn't lag yet, send it first
+    if (conn->FlushOutput() == -1 ||
+        conn->output_.size() >= options_.lag_bytes) {
+      LOG_DEBUG("sse conn[{}] lagging with [{}] bytes queued, close",
+                conn->fd_, conn->output_.size());
+      ++disconnected_;
+      server->CloseLater(conn);
+      return -1;
+    }
+  }
+  int ret;
+  if (options_.flush == BroadcastFlush::kImmediate) {
+    ret = conn->WriteShared(buf);
+  } else if ((ret = conn->QueueShared(buf)) != -1) {
+    if (options_.flush == BroadcastFlush::kEndOfPoll) {
+      server->ScheduleFlush(conn);
+    } else {
+      server->ScheduleDelayedFlush(conn, options_.max_delay);
+    }
+  }
+  if (ret == -1) {
+    server->CloseLater(conn);
+    return -1;
+  }
+  return 0;
+}
+} // namespace hpl
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <deque>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "hpl_broadcast_group.h"
+#include "hpl_output_queue.h"
+
+#ifndef _HPL_SSE_CHANNEL_H_
+#define _HPL_SSE_CHANNEL_H_
+
+namespace hpl {
+class Connection;
+
+struct SseOptions {
+  /// the last events kept for the clients resuming with Last-Event-ID
+  size_t replay = 256;
+  /// a comment sent to every subscriber this often, keeps proxies from
+  /// closing the stream, 0 disables
+  std::chrono::milliseconds heartbeat{15000};
+  /// the reconnection delay told to the clients, 0 leaves theirs
+  std::chrono::milliseconds retry{0};
+  /// a subscriber with more output queued than this is closed, it resumes
+  /// from the replay ring when it reconnects. 0 means unlimited
+  size_t lag_bytes = 256 * 1024;
+  /// when the events go out, same as for a BroadcastGroup
+  BroadcastFlush flush = BroadcastFlush::kImmediate;
+  std::chrono::milliseconds max_delay{10};
+};
+
+/// @brief a text/event-stream route. set it as RequestHandler::sse_channel,
+/// a GET on the route gets the response head and is subscribed, resuming
+/// after its Last-Event-ID. an event is encoded once and the buffer is
+/// shared by the subscribers. a channel belongs to one server, it must
+/// outlive the server
+class SseChannel {
+public:
+  explicit SseChannel(const SseOptions &options = {});
+  ~SseChannel();
+  SseChannel(const SseChannel &) = delete;
+  SseChannel &operator=(const SseChannel &) = delete;
+
+  /// @brief send an event to every subscriber, from the loop thread
+  /// @param data, each line of it goes in a data field
+  /// @param event, the event type, "message" for the clients if empty. its
+  /// line breaks are dropped
+  /// @return the id of the event
+  uint64_t Publish(std::string_view data, std::string_view event = {});
+
+  inline size_t size() const { return members_.size(); }
+  inline uint64_t LastId() const { return next_id_ - 1; }
+  /// subscribers closed for lagging
+  inline uint64_t Disconnected() const { return disconnected_; }
+
+private:
+  friend class Server;
+
+  /// @brief add conn, whose response head is written, and send it the
+  /// events after last_event_id still in the ring
+  /// @retval -1, error, close conn
+  int Subscribe(Connection *conn, std::string_view last_event_id);
+  int Leave(const Connection *conn);
+  /// @brief send a heartbeat if it is due
+  /// @return when the next one is due
+  std::chrono::steady_clock::time_point
+  Heartbeat(std::chrono::steady_clock::time_point now);
+
+  /// @brief queue buf to conn as the options say, a lagging conn is closed
+  /// @retval -1, conn is closing
+  int Write(Connection *conn, const SharedBuffer &buf);
+
+  const SseOptions options_;
+  std::vector<Connection *> members_;
+  /// position of a member in members_
+  std::unordered_map<const Connection *, size_t> index_;
+  /// the last events by id
+  std::deque<std::pair<uint64_t, SharedBuffer>> ring_;
+  uint64_t next_id_ = 1;
+  uint64_t disconnected_ = 0;
+  SharedBuffer heartbeat_;
+  SharedBuffer retry_;
+  std::chrono::steady_clock::time_point next_heartbeat_;
+};
+} // namespace hpl
+
+#endif // _HPL_SSE_CHANNEL_H_
@@ -1,7 +1,11 @@
 #pragma once
+#include <stdint.h>
+#include <string.h>
+
 #include <algorithm>
 #include <iterator>
 #include <string>
+#include <string_view>
 
 #ifndef _HPL_STR_H_
 #define _HPL_STR_H_
@@ -24,6 +28,32 @@ inline auto icase_find(const std::string_view &s1,
       begin_iter, s1.end(), s2.begin(), s2.end(),
       [](auto c1, auto c2) { return std::tolower(c1) == std::tolower(c2); });
 }
+
+/// @brief the first (at most 8) chars of s packed into a little endian word,
+/// the layout load_word() gives on the x86/arm hosts the parser runs on
+constexpr uint64_t str_word(std::string_view s) {
+  uint64_t word = 0;
+  for (size_t i = 0; i < s.size() && i < 8; ++i) {
+    word |= static_cast<uint64_t>(static_cast<unsigned char>(s[i])) << (i * 8);
+  }
+  return word;
+}
+
+/// @brief mask of the first n (at most 8) bytes of a word
+constexpr uint64_t word_mask(size_t n) {
+  return n >= 8 ? ~uint64_t(0) : (uint64_t(1) << (n * 8)) - 1;
+}
+
+/// @brief 8 bytes of s from pos, zero padded past the end of s
+inline uint64_t load_word(std::string_view s, size_t pos) {
+  uint64_t word = 0;
+  if (pos + 8 <= s.size()) {
+    memcpy(&word, s.data() + pos, 8);
+  } else if (pos < s.size()) {
+    memcpy(&word, s.data() + pos, s.size() - pos);
+  }
+  return word;
+}
 } // namespace hpl
 
 #endif // _HPL_STR_H_
\ No newline at end of file
@@ -0,0 +1,236 @@
+#include "hpl_tls.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "hpl_logger.h"
+
+namespace hpl {
+namespace {
+/// records are at most 16 KiB, so is a bounce buffer
+constexpr size_t kRecordSize = 16 * 1024;
+
+/// @brief the first error queued by openssl, the queue is cleared
+std::string TakeError() {
+  char buf[256] = {};
+  unsigned long err = ERR_get_error();
+  if (err != 0) {
+    ERR_error_string_n(err, buf, sizeof(buf));
+  }
+  ERR_clear_error();
+  return buf;
+}
+
+/// @brief errno for a failed call, -1 returned
+ssize_t Fail(ssl_st *ssl, int ret) {
+  switch (SSL_get_error(ssl, ret)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_ZERO_RETURN:
+    // close_notify from the peer
+    return 0;
+  case SSL_ERROR_SYSCALL:
+    if (errno == 0) {
+      errno = EPIPE;
+    }
+    ERR_clear_error();
+    return -1;
+  default:
+    LOG_DEBUG("tls error: {}", TakeError());
+    errno = EIO;
+    return -1;
+  }
+}
+/// @brief the first protocol of the server the client offers
+int SelectAlpn(SSL *, const unsigned char **out, unsigned char *outlen,
+               const unsigned char *in, unsigned int inlen, void *arg) {
+  static const unsigned char kProtocols[] = "\x02h2\x08http/1.1";
+  const bool http2 = *static_cast<const bool *>(arg);
+  const unsigned char *protocols = http2 ? kProtocols : kProtocols + 3;
+  unsigned int len = sizeof(kProtocols) - 1 - (http2 ? 0 : 3);
+  if (SSL_select_next_proto(const_cast<unsigned char **>(out), outlen,
+                            protocols, len, in,
+                            inlen) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+} // namespace
+
+TlsContext::~TlsContext() {
+  if (ctx_ != nullptr) {
+    SSL_CTX_free(ctx_);
+  }
+}
+
+int TlsContext::Init(const TlsOptions &options) {
+  ctx_ = SSL_CTX_new(TLS_server_method());
+  if (ctx_ == nullptr) {
+    LOG_ERROR("SSL_CTX_new failed: {}", TakeError());
+    return -1;
+  }
+  SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+  if (SSL_CTX_use_certificate_chain_file(ctx_, options.cert_file.c_str()) !=
+          1 ||
+      SSL_CTX_use_PrivateKey_file(ctx_, options.key_file.c_str(),
+                                  SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx_) != 1) {
+    LOG_ERROR("tls cert[{}] key[{}]: {}", options.cert_file, options.key_file,
+              TakeError());
+    return -1;
+  }
+
+  uint64_t ssl_options = SSL_OP_NO_RENEGOTIATION |
+                         SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_NO_COMPRESSION;
+  if (!options.tickets) {
+    ssl_options |= SSL_OP_NO_TICKET;
+  }
+#ifdef SSL_OP_ENABLE_KTLS
+  if (options.ktls) {
+    ssl_options |= SSL_OP_ENABLE_KTLS;
+  }
+#endif // SSL_OP_ENABLE_KTLS
+  SSL_CTX_set_options(ctx_, ssl_options);
+  // a write may be retried from the output queue, at another address. an
+  // idle connection gives its record buffers back
+  SSL_CTX_set_mode(ctx_, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                             SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                             SSL_MODE_RELEASE_BUFFERS);
+
+  if (options.session_cache > 0) {
+    static const unsigned char kContext[] = "httpoll";
+    SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx_, options.session_cache);
+    SSL_CTX_set_session_id_context(ctx_, kContext, sizeof(kContext) - 1);
+  } else {
+    SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_OFF);
+  }
+  SSL_CTX_set_timeout(ctx_, options.session_timeout.count());
+  SSL_CTX_set_alpn_select_cb(ctx_, SelectAlpn, &http2_);
+  // one TLS 1.3 ticket is enough for a client to resume, none without a way
+  // to resume
+  SSL_CTX_set_num_tickets(
+      ctx_, options.tickets || options.session_cache > 0 ? 1 : 0);
+  return 0;
+}
+
+ssl_st *TlsContext::NewSession(int fd) const {
+  auto *ssl = SSL_new(ctx_);
+  if (ssl == nullptr || SSL_set_fd(ssl, fd) != 1) {
+    LOG_ERROR("tls session for fd[{}]: {}", fd, TakeError());
+    SSL_free(ssl);
+    return nullptr;
+  }
+  SSL_set_accept_state(ssl);
+  return ssl;
+}
+
+TlsStream::~TlsStream() { SSL_free(ssl_); }
+
+int TlsStream::Handshake() {
+  ERR_clear_error();
+  int ret = SSL_do_handshake(ssl_);
+  if (ret == 1) {
+    established_ = true;
+    want_write_ = false;
+    resumed_ = SSL_session_reused(ssl_) == 1;
+#ifdef SSL_OP_ENABLE_KTLS
+    ktls_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_)) == 1;
+#endif // SSL_OP_ENABLE_KTLS
+    LOG_DEBUG("tls established {} resumed[{}] ktls[{}]", SSL_get_version(ssl_),
+              resumed_, ktls_send_);
+    return 1;
+  }
+  switch (SSL_get_error(ssl_, ret)) {
+  case SSL_ERROR_WANT_READ:
+    want_write_ = false;
+    return 0;
+  case SSL_ERROR_WANT_WRITE:
+    want_write_ = true;
+    return 0;
+  default:
+    LOG_DEBUG("tls handshake failed: {}", TakeError());
+    return -1;
+  }
+}
+
+bool TlsStream::IsHttp2() const {
+  const unsigned char *protocol = nullptr;
+  unsigned int len = 0;
+  SSL_get0_alpn_selected(ssl_, &protocol, &len);
+  return len == 2 && memcmp(protocol, "h2", 2) == 0;
+}
+
+ssize_t TlsStream::Read(char *buf, size_t len) {
+  ERR_clear_error();
+  int ret = SSL_read(ssl_, buf, len);
+  return ret > 0 ? ret : Fail(ssl_, ret);
+}
+
+bool TlsStream::Pending() const {
+  // the rest of a record, or records read ahead
+  return SSL_pending(ssl_) > 0 || SSL_has_pending(ssl_) == 1;
+}
+
+ssize_t TlsStream::Write(const struct iovec *iov, int iovcnt) {
+  if (ktls_send_) {
+    return writev(SSL_get_fd(ssl_), iov, iovcnt);
+  }
+  // a record per buffer, small buffers are coalesced by the output queue
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len == 0) {
+      continue;
+    }
+    ERR_clear_error();
+    int ret = SSL_write(ssl_, iov[i].iov_base, iov[i].iov_len);
+    if (ret <= 0) {
+      if (total > 0) {
+        ERR_clear_error();
+        return total;
+      }
+      if (Fail(ssl_, ret) == 0) {
+        errno = EPIPE;
+      }
+      return -1;
+    }
+    total += ret;
+    if (static_cast<size_t>(ret) < iov[i].iov_len) {
+      break;
+    }
+  }
+  return total;
+}
+
+ssize_t TlsStream::WriteFile(int file, off_t offset, size_t len) {
+  if (ktls_send_) {
+    return sendfile(SSL_get_fd(ssl_), file, &offset, len);
+  }
+  char buf[kRecordSize];
+  ssize_t nread = pread(file, buf, std::min(len, sizeof(buf)), offset);
+  if (nread <= 0) {
+    return nread;
+  }
+  struct iovec iov = {buf, static_cast<size_t>(nread)};
+  return Write(&iov, 1);
+}
+
+void TlsStream::Shutdown() {
+  if (established_) {
+    ERR_clear_error();
+    SSL_shutdown(ssl_);
+    ERR_clear_error();
+  }
+}
+} // namespace hpl
@@ -0,0 +1,99 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <chrono>
+#include <string>
+
+#ifndef _HPL_TLS_H_
+#define _HPL_TLS_H_
+
+struct ssl_st;
+struct ssl_ctx_st;
+
+namespace hpl {
+/// @brief TLS settings of a server, see Server::EnableTls
+struct TlsOptions {
+  /// PEM files, the chain starts with the certificate of the server
+  std::string cert_file;
+  std::string key_file;
+  /// sessions kept by the server for resumption by id, 0 disables the cache
+  long session_cache = 20 * 1024;
+  std::chrono::seconds session_timeout{300};
+  /// resumption with tickets the clients keep, no server state
+  bool tickets = true;
+  /// let the kernel encrypt the records when it has kTLS for the cipher,
+  /// sendfile and the shared buffers then go out without a user space copy
+  bool ktls = true;
+};
+
+/// @brief the SSL_CTX of a server, the session cache lives in it
+class TlsContext {
+public:
+  TlsContext() = default;
+  ~TlsContext();
+  TlsContext(const TlsContext &) = delete;
+  TlsContext &operator=(const TlsContext &) = delete;
+
+  /// @retval -1, error, e.g. the certificate or key can't be loaded
+  int Init(const TlsOptions &options);
+  /// @brief a server side session on fd
+  /// @return nullptr on error
+  ssl_st *NewSession(int fd) const;
+  /// @brief offer h2 before http/1.1 by ALPN
+  inline void SetHttp2(bool on) { http2_ = on; }
+
+private:
+  ssl_ctx_st *ctx_ = nullptr;
+  bool http2_ = false;
+};
+
+/// @brief the TLS state of a connection, the handshake and the records are
+/// driven by the loop on the non-blocking socket
+class TlsStream {
+public:
+  explicit TlsStream(ssl_st *ssl) : ssl_(ssl) {}
+  ~TlsStream();
+  TlsStream(const TlsStream &) = delete;
+  TlsStream &operator=(const TlsStream &) = delete;
+
+  /// @brief go on with the handshake
+  /// @retval 1, established
+  /// @retval 0, waiting for the socket, see WantWrite
+  /// @retval -1, failed, close the connection
+  int Handshake();
+  inline bool Established() const { return established_; }
+  /// the handshake waits for the socket to be writable
+  inline bool WantWrite() const { return want_write_; }
+  /// the kernel encrypts what is written to the socket
+  inline bool KernelSend() const { return ktls_send_; }
+  inline bool Resumed() const { return resumed_; }
+  /// h2 is chosen by ALPN
+  bool IsHttp2() const;
+
+  /// @brief same as read(2), errno is EAGAIN while no record is complete
+  ssize_t Read(char *buf, size_t len);
+  /// the session holds input already taken from the socket, which isn't
+  /// polled readable for it
+  bool Pending() const;
+  /// @brief same as writev(2), errno is EAGAIN if nothing is taken.
+  /// after a -1 with EAGAIN, the bytes must be written again from the same
+  /// position, with at least the same length
+  ssize_t Write(const struct iovec *iov, int iovcnt);
+  /// @brief len bytes of file from offset, through a bounce buffer unless
+  /// the kernel encrypts
+  ssize_t WriteFile(int file, off_t offset, size_t len);
+  /// @brief best effort close_notify
+  void Shutdown();
+
+private:
+  ssl_st *ssl_;
+  bool established_ = false;
+  bool want_write_ = false;
+  bool ktls_send_ = false;
+  bool resumed_ = false;
+};
+} // namespace hpl
+
+#endif // _HPL_TLS_H_
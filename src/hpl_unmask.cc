@@ -0,0 +1,153 @@
+#include "hpl_unmask.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HPL_UNMASK_X86 1
+#endif
+
+namespace hpl {
+namespace {
+/// payloads shorter than this skip the dispatch
+constexpr size_t kShortPayload = 16;
+
+inline uint32_t RotateMask(uint32_t mask, unsigned bytes) {
+  bytes &= 3;
+  return bytes == 0 ? mask : (mask >> (bytes * 8)) | (mask << (32 - bytes * 8));
+}
+
+/// @brief unmask byte by byte until data is aligned to align, or len is 0
+/// @return the mask rotated to the next byte
+inline uint32_t UnmaskHead(char *&data, size_t &len, uint32_t mask,
+                           size_t align) {
+  while (len > 0 && (reinterpret_cast<uintptr_t>(data) & (align - 1)) != 0) {
+    *data++ ^= static_cast<char>(mask);
+    mask = RotateMask(mask, 1);
+    --len;
+  }
+  return mask;
+}
+
+inline void UnmaskTail(char *data, size_t len, uint32_t mask) {
+  for (size_t i = 0; i < len; ++i) {
+    data[i] ^= static_cast<char>(mask >> ((i & 3) * 8));
+  }
+}
+
+void UnmaskScalar(char *data, size_t len, uint32_t mask) {
+  UnmaskTail(data, len, mask);
+}
+
+void UnmaskWord(char *data, size_t len, uint32_t mask) {
+  mask = UnmaskHead(data, len, mask, 8);
+  const uint64_t mask64 = static_cast<uint64_t>(mask) << 32 | mask;
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    word ^= mask64;
+    memcpy(data, &word, 8);
+  }
+  UnmaskTail(data, len, mask);
+}
+
+#ifdef HPL_UNMASK_X86
+__attribute__((target("sse2"))) void UnmaskSse2(char *data, size_t len,
+                                                uint32_t mask) {
+  mask = UnmaskHead(data, len, mask, 16);
+  const __m128i m = _mm_set1_epi32(static_cast<int>(mask));
+  for (; len >= 16; data += 16, len -= 16) {
+    auto *p = reinterpret_cast<__m128i *>(data);
+    _mm_store_si128(p, _mm_xor_si128(_mm_load_si128(p), m));
+  }
+  UnmaskTail(data, len, mask);
+}
+
+__attribute__((target("avx2"))) void UnmaskAvx2(char *data, size_t len,
+                                                uint32_t mask) {
+  mask = UnmaskHead(data, len, mask, 32);
+  const __m256i m = _mm256_set1_epi32(static_cast<int>(mask));
+  for (; len >= 64; data += 64, len -= 64) {
+    auto *p = reinterpret_cast<__m256i *>(data);
+    _mm256_store_si256(p, _mm256_xor_si256(_mm256_load_si256(p), m));
+    _mm256_store_si256(p + 1, _mm256_xor_si256(_mm256_load_si256(p + 1), m));
+  }
+  for (; len >= 32; data += 32, len -= 32) {
+    auto *p = reinterpret_cast<__m256i *>(data);
+    _mm256_store_si256(p, _mm256_xor_si256(_mm256_load_si256(p), m));
+  }
+  UnmaskTail(data, len, mask);
+}
+
+__attribute__((target("avx512f"))) void UnmaskAvx512(char *data, size_t len,
+                                                     uint32_t mask) {
+  mask = UnmaskHead(data, len, mask, 64);
+  const __m512i m = _mm512_set1_epi32(static_cast<int>(mask));
+  for (; len >= 64; data += 64, len -= 64) {
+    auto *p = reinterpret_cast<__m512i *>(data);
+    _mm512_store_si512(p, _mm512_xor_si512(_mm512_load_si512(p), m));
+  }
+  UnmaskTail(data, len, mask);
+}
+#endif // HPL_UNMASK_X86
+
+UnmaskKernel SelectUnmaskKernel() {
+#ifdef HPL_UNMASK_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return UnmaskKernel::kAvx512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return UnmaskKernel::kAvx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return UnmaskKernel::kSse2;
+  }
+#endif // HPL_UNMASK_X86
+  return UnmaskKernel::kWord;
+}
+
+const UnmaskKernel kBestKernel = SelectUnmaskKernel();
+const UnmaskFunc kBestFunc = GetUnmaskKernel(kBestKernel);
+} // namespace
+
+UnmaskFunc GetUnmaskKernel(UnmaskKernel kernel) {
+  switch (kernel) {
+  case UnmaskKernel::kScalar:
+    return UnmaskScalar;
+  case UnmaskKernel::kWord:
+    return UnmaskWord;
+#ifdef HPL_UNMASK_X86
+  case UnmaskKernel::kSse2:
+    return __builtin_cpu_supports("sse2") ? UnmaskSse2 : nullptr;
+  case UnmaskKernel::kAvx2:
+    return __builtin_cpu_supports("avx2") ? UnmaskAvx2 : nullptr;
+  case UnmaskKernel::kAvx512:
+    return __builtin_cpu_supports("avx512f") ? UnmaskAvx512 : nullptr;
+#endif // HPL_UNMASK_X86
+  default:
+    return nullptr;
+  }
+}
+
+const char *UnmaskKernelName(UnmaskKernel kernel) {
+  static const char *kNames[] = {"scalar", "word", "sse2", "avx2", "avx512"};
+  auto i = static_cast<unsigned>(kernel);
+  return i < static_cast<unsigned>(UnmaskKernel::kCount) ? kNames[i]
+                                                           : "unknown";
+}
+
+UnmaskKernel BestUnmaskKernel() { return kBestKernel; }
+
+void UnmaskPayload(char *data, size_t len, const unsigned char mask[4],
+                   uint64_t offset) {
+  uint32_t mask32;
+  memcpy(&mask32, mask, 4);
+  mask32 = RotateMask(mask32, offset & 3);
+  if (len < kShortPayload) {
+    UnmaskTail(data, len, mask32);
+    return;
+  }
+  kBestFunc(data, len, mask32);
+}
+} // namespace hpl
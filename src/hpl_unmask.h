@@ -0,0 +1,34 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _HPL_UNMASK_H_
+#define _HPL_UNMASK_H_
+
+namespace hpl {
+/// @brief xor a websocket payload with its masking key, in place
+/// @param offset, of data in the payload, selects the key byte to start with,
+/// so a payload can be unmasked piece by piece as it is read
+void UnmaskPayload(char *data, size_t len, const unsigned char mask[4],
+                   uint64_t offset);
+
+enum class UnmaskKernel : unsigned {
+  kScalar = 0,
+  kWord,
+  kSse2,
+  kAvx2,
+  kAvx512,
+  kCount, // make sure this is the last one
+};
+
+/// @brief byte i of data is xor-ed with byte (i & 3) of the little endian mask
+typedef void (*UnmaskFunc)(char *data, size_t len, uint32_t mask);
+
+/// @return nullptr if the cpu, or the build, lacks the kernel
+UnmaskFunc GetUnmaskKernel(UnmaskKernel kernel);
+const char *UnmaskKernelName(UnmaskKernel kernel);
+/// @brief the widest kernel the cpu runs, picked once at startup
+UnmaskKernel BestUnmaskKernel();
+} // namespace hpl
+
+#endif // _HPL_UNMASK_H_
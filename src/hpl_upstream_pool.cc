@@ -0,0 +1,775 @@
+#include "hpl_upstream_pool.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iterator>
+
+#include <fmt/core.h>
+
+#include "hpl_logger.h"
+
+namespace hpl {
+namespace {
+/// a status line, header, chunk size or trailer line
+constexpr size_t kMaxLineSize = 64 * 1024;
+/// read at once from a backend
+constexpr size_t kReadSize = 16 * 1024;
+/// a response body kept by an idle connection for the next one
+constexpr size_t kKeptBodySize = 64 * 1024;
+
+bool IsIdempotent(HttpMethod method) {
+  switch (method) {
+  case HttpMethod::GET:
+  case HttpMethod::HEAD:
+  case HttpMethod::PUT:
+  case HttpMethod::DELETE:
+  case HttpMethod::OPTIONS:
+  case HttpMethod::TRACE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool IsHeader(std::string_view name, std::string_view expected) {
+  return name.size() == expected.size() &&
+         strncasecmp(name.data(), expected.data(), name.size()) == 0;
+}
+
+/// @brief a target fit for the request line, no control byte or space
+bool IsValidTarget(std::string_view target) {
+  return !target.empty() &&
+         std::none_of(target.begin(), target.end(), [](unsigned char c) {
+           return c <= ' ' || c == 0x7f;
+         });
+}
+
+/// @brief the line at offset of in, without its line break
+/// @return false if the line isn't complete
+bool TakeLine(const std::string &in, size_t &offset, std::string_view &line) {
+  auto pos = in.find('\n', offset);
+  if (pos == std::string::npos) {
+    return false;
+  }
+  line = std::string_view(in).substr(offset, pos - offset);
+  if (!line.empty() && line.back() == '\r') {
+    line.remove_suffix(1);
+  }
+  offset = pos + 1;
+  return true;
+}
+} // namespace
+
+UpstreamPool::UpstreamPool(Server *server, const UpstreamOptions &options)
+    : server_(server), options_(options) {
+  timer_.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  timer_.callback = [this](uint32_t) { OnTick(); };
+  if (timer_.fd == -1 || server_->Watch(&timer_, EPOLLIN) == -1) {
+    const int kBufSize = 64;
+    char buf[kBufSize];
+    LOG_ERROR("upstream timer error:{}", strerror_r(errno, buf, kBufSize));
+  }
+}
+
+UpstreamPool::~UpstreamPool() {
+  for (auto &conn : conns_) {
+    if (conn.state != ConnState::kFree) {
+      server_->Unwatch(&conn.watcher);
+      close(conn.watcher.fd);
+    }
+  }
+  if (timer_.fd != -1) {
+    server_->Unwatch(&timer_);
+    close(timer_.fd);
+  }
+}
+
+int UpstreamPool::AddBackend(std::string_view address) {
+  Backend backend;
+  backend.address = address;
+  if (address.substr(0, 5) == "unix:") {
+    struct sockaddr_un addr = {};
+    auto path = address.substr(5);
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+      LOG_ERROR("upstream address [{}] malformed", address);
+      return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    backend.family = AF_UNIX;
+    backend.sockaddr.assign(reinterpret_cast<const char *>(&addr),
+                            sizeof(addr));
+    backend.host = "localhost";
+    backends_.push_back(std::move(backend));
+    return backends_.size() - 1;
+  }
+
+  auto colon = address.rfind(':');
+  if (colon == std::string_view::npos || colon + 1 == address.size()) {
+    LOG_ERROR("upstream address [{}] malformed", address);
+    return -1;
+  }
+  int port = atoi(std::string(address.substr(colon + 1)).c_str());
+  std::string ip(address.substr(0, colon));
+  if (port <= 0 || port > 65535) {
+    LOG_ERROR("upstream address [{}] malformed", address);
+    return -1;
+  }
+  if (ip.size() > 2 && ip.front() == '[' && ip.back() == ']') {
+    struct sockaddr_in6 addr = {};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(port);
+    if (inet_pton(AF_INET6, ip.substr(1, ip.size() - 2).c_str(),
+                  &addr.sin6_addr) != 1) {
+      LOG_ERROR("upstream address [{}] malformed", address);
+      return -1;
+    }
+    backend.family = AF_INET6;
+    backend.sockaddr.assign(reinterpret_cast<const char *>(&addr),
+                            sizeof(addr));
+  } else {
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) != 1) {
+      LOG_ERROR("upstream address [{}] malformed", address);
+      return -1;
+    }
+    backend.family = AF_INET;
+    backend.sockaddr.assign(reinterpret_cast<const char *>(&addr),
+                            sizeof(addr));
+  }
+  backend.host = address;
+  backends_.push_back(std::move(backend));
+  return backends_.size() - 1;
+}
+
+int UpstreamPool::Send(UpstreamRequest &&request, UpstreamCallback callback) {
+  // the pool frames the message, a target or header of the caller can't
+  // contradict it on a connection shared by other requests
+  if (!IsValidTarget(request.target)) {
+    LOG_ERROR("upstream request target refused");
+    errno = EINVAL;
+    return -1;
+  }
+  for (const auto &[name, value] : request.headers) {
+    if (IsHeader(name, "content-length") ||
+        IsHeader(name, "transfer-encoding") || IsHeader(name, "connection") ||
+        name.find_first_of("\r\n") != std::string::npos ||
+        value.find_first_of("\r\n") != std::string::npos) {
+      LOG_ERROR("upstream request header [{}] refused", name);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  auto call = std::make_unique<Call>();
+  call->request = std::move(request);
+  call->callback = std::move(callback);
+  call->deadline = Clock::now() + options_.request_timeout;
+  return Dispatch(call);
+}
+
+size_t UpstreamPool::GetOutstanding(size_t backend) const {
+  return backends_[backend].busy + backends_[backend].pending.size();
+}
+
+size_t UpstreamPool::GetIdleCount(size_t backend) const {
+  return backends_[backend].idle.size();
+}
+
+bool UpstreamPool::IsEjected(size_t backend) const {
+  return backends_[backend].ejected_until > Clock::now();
+}
+
+int UpstreamPool::Dispatch(std::unique_ptr<Call> &call) {
+  int index = PickBackend();
+  if (index == -1) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  auto &backend = backends_[index];
+  // a request sent again goes on a new connection, the idle ones may be as
+  // stale as the one it failed on
+  if (!backend.idle.empty() && !call->retried) {
+    // the most recently used is the least likely closed by the backend
+    auto *conn = backend.idle.back();
+    backend.idle.pop_back();
+    ++reuses_;
+    conn->reused = true;
+    Start(conn, std::move(call));
+    return 0;
+  }
+  if (backend.conns < options_.max_conns) {
+    Connect(index, std::move(call));
+    return 0;
+  }
+  if (pending_count_ >= options_.max_pending) {
+    LOG_ERROR("upstream [{}] too many requests wait", backend.address);
+    errno = EAGAIN;
+    return -1;
+  }
+  backend.pending.push_back(std::move(call));
+  ++pending_count_;
+  ArmTimer();
+  return 0;
+}
+
+int UpstreamPool::PickBackend() {
+  // the least outstanding requests, the ties in turn
+  const auto now = Clock::now();
+  int best = -1;
+  size_t best_load = 0;
+  for (size_t i = 0; i < backends_.size(); ++i) {
+    size_t index = (next_backend_ + i) % backends_.size();
+    if (backends_[index].ejected_until > now) {
+      continue;
+    }
+    size_t load = GetOutstanding(index);
+    if (best == -1 || load < best_load) {
+      best = index;
+      best_load = load;
+    }
+  }
+  if (!backends_.empty()) {
+    next_backend_ = (next_backend_ + 1) % backends_.size();
+  }
+  return best;
+}
+
+void UpstreamPool::Connect(size_t index, std::unique_ptr<Call> call) {
+  auto &backend = backends_[index];
+  int fd = socket(backend.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  0);
+  if (fd == -1) {
+    int error = errno;
+    const int kBufSize = 64;
+    char buf[kBufSize];
+    LOG_ERROR("upstream socket error:{}", strerror_r(error, buf, kBufSize));
+    FailCall(std::move(call), error);
+    return;
+  }
+  if (backend.family != AF_UNIX) {
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  int ret = connect(
+      fd, reinterpret_cast<const struct sockaddr *>(backend.sockaddr.data()),
+      backend.sockaddr.size());
+  if (ret == -1 && errno != EINPROGRESS) {
+    int error = errno;
+    const int kBufSize = 64;
+    char buf[kBufSize];
+    LOG_ERROR("upstream [{}] connect error:{}", backend.address,
+              strerror_r(error, buf, kBufSize));
+    close(fd);
+    RecordFailure(index);
+    FailCall(std::move(call), error);
+    return;
+  }
+
+  Conn *conn;
+  if (free_conns_.empty()) {
+    conn = &conns_.emplace_back();
+    conn->watcher.callback = [this, conn](uint32_t) { OnEvents(conn); };
+  } else {
+    conn = free_conns_.back();
+    free_conns_.pop_back();
+  }
+  conn->watcher.fd = fd;
+  conn->backend = index;
+  conn->reused = false;
+  // the events of the socket are polled once, the writes are driven by the
+  // edges
+  if (server_->Watch(&conn->watcher,
+                     EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) == -1) {
+    close(fd);
+    conn->watcher.fd = -1;
+    free_conns_.push_back(conn);
+    FailCall(std::move(call), EIO);
+    return;
+  }
+  ++backend.conns;
+  ++connects_;
+  SetState(conn, ConnState::kConnecting);
+  conn->call = std::move(call);
+  conn->deadline = Clock::now() + options_.connect_timeout;
+  LOG_DEBUG("upstream [{}] connecting fd[{}]", backend.address, fd);
+  ArmTimer();
+  if (ret == 0) {
+    Start(conn, std::move(conn->call));
+  }
+}
+
+void UpstreamPool::Start(Conn *conn, std::unique_ptr<Call> call) {
+  const auto &backend = backends_[conn->backend];
+  const auto &request = call->request;
+  auto &out = conn->out;
+  out.clear();
+  conn->out_offset = 0;
+  fmt::format_to(std::back_inserter(out), "{} {} HTTP/1.1\r\n",
+                 HttpMethodToString(request.method), request.target);
+  bool has_host = false;
+  for (const auto &[name, value] : request.headers) {
+    has_host = has_host || IsHeader(name, "host");
+    fmt::format_to(std::back_inserter(out), "{}: {}\r\n", name, value);
+  }
+  if (!has_host) {
+    fmt::format_to(std::back_inserter(out), "Host: {}\r\n", backend.host);
+  }
+  if (!request.body.empty() || request.method == HttpMethod::POST ||
+      request.method == HttpMethod::PUT ||
+      request.method == HttpMethod::PATCH) {
+    fmt::format_to(std::back_inserter(out), "Content-Length: {}\r\n",
+                   request.body.size());
+  }
+  out += "\r\n";
+  out += request.body;
+
+  conn->call = std::move(call);
+  conn->deadline = conn->call->deadline;
+  conn->received = false;
+  conn->until_close = false;
+  conn->body_state = Conn::BodyState::kNone;
+  SetState(conn, ConnState::kBusy);
+  Flush(conn);
+}
+
+void UpstreamPool::SetState(Conn *conn, ConnState state) {
+  auto busy = [](ConnState s) {
+    return s == ConnState::kConnecting || s == ConnState::kBusy;
+  };
+  auto &backend = backends_[conn->backend];
+  backend.busy += busy(state);
+  backend.busy -= busy(conn->state);
+  conn->state = state;
+}
+
+void UpstreamPool::OnEvents(Conn *conn) {
+  // the events only hint, a slot may get the ones of the connection it held
+  // before
+  switch (conn->state) {
+  case ConnState::kFree:
+    return;
+  case ConnState::kConnecting: {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    getsockopt(conn->watcher.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (error != 0) {
+      const int kBufSize = 64;
+      char buf[kBufSize];
+      LOG_ERROR("upstream [{}] connect error:{}",
+                backends_[conn->backend].address,
+                strerror_r(error, buf, kBufSize));
+      Fail(conn, error, true);
+      return;
+    }
+    struct sockaddr_storage peer;
+    len = sizeof(peer);
+    if (getpeername(conn->watcher.fd, reinterpret_cast<sockaddr *>(&peer),
+                    &len) == -1) {
+      // still connecting
+      return;
+    }
+    Start(conn, std::move(conn->call));
+    return;
+  }
+  case ConnState::kBusy:
+    if (Flush(conn) == -1) {
+      return;
+    }
+    ReadInput(conn);
+    return;
+  case ConnState::kIdle:
+    ReadInput(conn);
+    return;
+  }
+}
+
+int UpstreamPool::Flush(Conn *conn) {
+  while (conn->out_offset < conn->out.size()) {
+    ssize_t ret = send(conn->watcher.fd, conn->out.data() + conn->out_offset,
+                       conn->out.size() - conn->out_offset, MSG_NOSIGNAL);
+    if (ret == -1) {
+      if (errno == EAGAIN) {
+        return 0;
+      } else if (errno == EINTR) {
+        continue;
+      }
+      Fail(conn, errno, true);
+      return -1;
+    }
+    conn->out_offset += ret;
+  }
+  conn->out.clear();
+  conn->out_offset = 0;
+  return 0;
+}
+
+void UpstreamPool::ReadInput(Conn *conn) {
+  const int fd = conn->watcher.fd;
+  if (conn->state == ConnState::kIdle) {
+    // an idle connection hears nothing but its close
+    char c;
+    ssize_t ret = recv(fd, &c, 1, MSG_PEEK);
+    if (ret == 0 || ret == 1 || (errno != EAGAIN && errno != EINTR)) {
+      LOG_DEBUG("upstream [{}] idle fd[{}] closed",
+                backends_[conn->backend].address, fd);
+      Close(conn);
+    }
+    return;
+  }
+
+  auto &in = conn->in;
+  while (true) {
+    size_t old = in.size();
+    in.resize(old + kReadSize);
+    ssize_t ret = read(fd, in.data() + old, kReadSize);
+    in.resize(old + std::max<ssize_t>(ret, 0));
+    if (ret == -1) {
+      if (errno == EAGAIN) {
+        return;
+      } else if (errno == EINTR) {
+        continue;
+      }
+      Fail(conn, errno, true);
+      return;
+    }
+    if (ret == 0) {
+      if (conn->until_close) {
+        Complete(conn, false);
+      } else {
+        Fail(conn, conn->received ? EPROTO : ECONNRESET, true);
+      }
+      return;
+    }
+    conn->received = true;
+    int parsed = Parse(conn);
+    if (parsed == -1) {
+      Fail(conn, EPROTO, true);
+      return;
+    }
+    if (conn->in_offset == in.size()) {
+      in.clear();
+      conn->in_offset = 0;
+    } else if (conn->in_offset > kReadSize) {
+      in.erase(0, conn->in_offset);
+      conn->in_offset = 0;
+    }
+    if (parsed == 1) {
+      Complete(conn, true);
+      return;
+    }
+  }
+}
+
+int UpstreamPool::Parse(Conn *conn) {
+  auto &parser = conn->response.parser;
+  const auto &in = conn->in;
+  while (conn->body_state == Conn::BodyState::kNone) {
+    auto pos = in.find('\n', conn->in_offset);
+    if (pos == std::string::npos) {
+      return in.size() - conn->in_offset > kMaxLineSize ? -1 : 0;
+    }
+    auto line =
+        std::string_view(in).substr(conn->in_offset, pos + 1 - conn->in_offset);
+    conn->in_offset = pos + 1;
+    auto state = parser.PushLine(line);
+    if (parser.GetStatus() == 0) {
+      return -1;
+    }
+    if (state == HttpHeaderParser::Headers) {
+      continue;
+    }
+
+    const int status = parser.GetStatus();
+    if (status < 200) {
+      // an interim response, the final one follows
+      parser.Reset();
+      continue;
+    }
+    if (conn->call->request.method == HttpMethod::HEAD || status == 204 ||
+        status == 304) {
+      return 1;
+    }
+    if (parser.IsChunked()) {
+      conn->body_state = Conn::BodyState::kChunkSize;
+    } else if (parser.GetContentLength()) {
+      if (*parser.GetContentLength() > options_.max_response_size) {
+        LOG_ERROR("upstream response of [{}] bytes",
+                  *parser.GetContentLength());
+        return -1;
+      }
+      conn->body_left = *parser.GetContentLength();
+      conn->body_state = Conn::BodyState::kLength;
+      conn->response.body.reserve(conn->body_left);
+    } else {
+      conn->until_close = true;
+      conn->body_left = UINT64_MAX;
+      conn->body_state = Conn::BodyState::kLength;
+    }
+  }
+  return ParseBody(conn);
+}
+
+int UpstreamPool::ParseBody(Conn *conn) {
+  const auto &in = conn->in;
+  auto &body = conn->response.body;
+  std::string_view line;
+  while (true) {
+    const size_t avail = in.size() - conn->in_offset;
+    switch (conn->body_state) {
+    case Conn::BodyState::kNone:
+      return 0;
+    case Conn::BodyState::kLength:
+    case Conn::BodyState::kChunkData: {
+      size_t n = std::min<uint64_t>(avail, conn->body_left);
+      body.append(in, conn->in_offset, n);
+      conn->in_offset += n;
+      if (!conn->until_close) {
+        conn->body_left -= n;
+      }
+      if (body.size() > options_.max_response_size) {
+        LOG_ERROR("upstream response over [{}] bytes",
+                  options_.max_response_size);
+        return -1;
+      }
+      if (conn->body_left > 0) {
+        return 0;
+      }
+      if (conn->body_state == Conn::BodyState::kLength) {
+        return 1;
+      }
+      conn->body_state = Conn::BodyState::kChunkEnd;
+      break;
+    }
+    case Conn::BodyState::kChunkSize: {
+      if (!TakeLine(in, conn->in_offset, line)) {
+        return avail > kMaxLineSize ? -1 : 0;
+      }
+      // hex digits, then maybe extensions
+      uint64_t size = 0;
+      size_t i = 0;
+      for (; i < line.size() && i < 16 &&
+             isxdigit(static_cast<unsigned char>(line[i]));
+           ++i) {
+        size = size * 16 + (isdigit(line[i]) ? line[i] - '0'
+                                             : (line[i] | 0x20) - 'a' + 10);
+      }
+      if (i == 0 || (i < line.size() && line[i] != ';' && line[i] != ' ')) {
+        return -1;
+      }
+      conn->body_left = size;
+      conn->body_state = size == 0 ? Conn::BodyState::kTrailer
+                                   : Conn::BodyState::kChunkData;
+      break;
+    }
+    case Conn::BodyState::kChunkEnd:
+      if (!TakeLine(in, conn->in_offset, line)) {
+        return avail > 2 ? -1 : 0;
+      }
+      if (!line.empty()) {
+        return -1;
+      }
+      conn->body_state = Conn::BodyState::kChunkSize;
+      break;
+    case Conn::BodyState::kTrailer:
+      // the trailer fields are dropped
+      if (!TakeLine(in, conn->in_offset, line)) {
+        return avail > kMaxLineSize ? -1 : 0;
+      }
+      if (line.empty()) {
+        return 1;
+      }
+      break;
+    }
+  }
+}
+
+void UpstreamPool::Complete(Conn *conn, bool keep_alive) {
+  auto &backend = backends_[conn->backend];
+  backend.failures = 0;
+  const auto &parser = conn->response.parser;
+  keep_alive = keep_alive && conn->in_offset == conn->in.size() &&
+               conn->out_offset == conn->out.size() &&
+               !(parser.GetConnectionFlags() &
+                 HttpHeaderParser::ConnectionClose) &&
+               (parser.GetVersion() == HttpVersion::HTTP_1_1 ||
+                (parser.GetConnectionFlags() &
+                 HttpHeaderParser::ConnectionKeepAlive));
+
+  // conn stays busy meanwhile, a Send of the callback doesn't take it
+  auto call = std::move(conn->call);
+  call->callback(0, conn->response);
+
+  conn->response.parser.Reset();
+  conn->response.body.clear();
+  if (conn->response.body.capacity() > kKeptBodySize) {
+    std::string().swap(conn->response.body);
+  }
+  if (!keep_alive) {
+    Close(conn);
+    return;
+  }
+  Release(conn);
+}
+
+void UpstreamPool::Fail(Conn *conn, int error, bool backend_fault) {
+  const size_t index = conn->backend;
+  auto call = std::move(conn->call);
+  // a kept alive connection the backend closed before it read the request
+  const bool stale = conn->reused && !conn->received && error != ETIMEDOUT;
+  Close(conn);
+  if (backend_fault && !stale) {
+    RecordFailure(index);
+  }
+  if (!call) {
+    return;
+  }
+  if (stale && !call->retried && IsIdempotent(call->request.method)) {
+    LOG_DEBUG("upstream [{}] stale connection, request sent again",
+              backends_[index].address);
+    call->retried = true;
+    if (Dispatch(call) == 0) {
+      return;
+    }
+    error = errno;
+  }
+  FailCall(std::move(call), error);
+}
+
+void UpstreamPool::FailCall(std::unique_ptr<Call> call, int error) {
+  static const UpstreamResponse kEmptyResponse;
+  call->callback(error, kEmptyResponse);
+}
+
+void UpstreamPool::Release(Conn *conn) {
+  auto &backend = backends_[conn->backend];
+  if (!backend.pending.empty()) {
+    auto call = std::move(backend.pending.front());
+    backend.pending.pop_front();
+    --pending_count_;
+    ++reuses_;
+    conn->reused = true;
+    Start(conn, std::move(call));
+    return;
+  }
+  if (backend.idle.size() >= options_.max_idle) {
+    Close(conn);
+    return;
+  }
+  SetState(conn, ConnState::kIdle);
+  conn->deadline = Clock::now() + options_.idle_timeout;
+  backend.idle.push_back(conn);
+}
+
+void UpstreamPool::Close(Conn *conn) {
+  auto &backend = backends_[conn->backend];
+  if (conn->state == ConnState::kIdle) {
+    backend.idle.erase(
+        std::find(backend.idle.begin(), backend.idle.end(), conn));
+  }
+  SetState(conn, ConnState::kFree);
+  --backend.conns;
+  server_->Unwatch(&conn->watcher);
+  close(conn->watcher.fd);
+  conn->watcher.fd = -1;
+  conn->out.clear();
+  conn->in.clear();
+  conn->in_offset = 0;
+  conn->out_offset = 0;
+  conn->response.parser.Reset();
+  conn->response.body.clear();
+  free_conns_.push_back(conn);
+}
+
+void UpstreamPool::RecordFailure(size_t index) {
+  auto &backend = backends_[index];
+  ++backend.failures;
+  const auto now = Clock::now();
+  if (backend.failures < options_.max_failures ||
+      backend.ejected_until > now) {
+    return;
+  }
+  LOG_ERROR("upstream [{}] ejected after [{}] failures", backend.address,
+            backend.failures);
+  backend.ejected_until = now + options_.eject_time;
+  while (!backend.idle.empty()) {
+    Close(backend.idle.back());
+  }
+  // the waiting requests go to the other backends
+  auto pending = std::move(backend.pending);
+  backend.pending.clear();
+  pending_count_ -= pending.size();
+  for (auto &call : pending) {
+    if (Dispatch(call) == -1) {
+      FailCall(std::move(call), errno);
+    }
+  }
+}
+
+void UpstreamPool::OnTick() {
+  uint64_t expirations;
+  if (read(timer_.fd, &expirations, sizeof(expirations)) == -1 &&
+      errno == EAGAIN) {
+    return;
+  }
+  const auto now = Clock::now();
+  // by index, a callback may open connections
+  for (size_t i = 0; i < conns_.size(); ++i) {
+    auto *conn = &conns_[i];
+    if (conn->state == ConnState::kFree || conn->deadline > now) {
+      continue;
+    }
+    if (conn->state == ConnState::kIdle) {
+      Close(conn);
+      continue;
+    }
+    LOG_ERROR("upstream [{}] {} timed out", backends_[conn->backend].address,
+              conn->state == ConnState::kConnecting ? "connect" : "request");
+    Fail(conn, ETIMEDOUT, true);
+  }
+  // the whole queue, a call sent again or moved from an ejected backend is
+  // queued behind newer ones
+  std::vector<std::unique_ptr<Call>> expired;
+  for (auto &backend : backends_) {
+    auto &pending = backend.pending;
+    auto iter = std::stable_partition(
+        pending.begin(), pending.end(),
+        [now](const auto &call) { return call->deadline > now; });
+    std::move(iter, pending.end(), std::back_inserter(expired));
+    pending.erase(iter, pending.end());
+  }
+  pending_count_ -= expired.size();
+  for (auto &call : expired) {
+    FailCall(std::move(call), ETIMEDOUT);
+  }
+  if (conns_.size() == free_conns_.size() && pending_count_ == 0) {
+    struct itimerspec spec = {};
+    timerfd_settime(timer_.fd, 0, &spec, nullptr);
+    timer_armed_ = false;
+  }
+}
+
+void UpstreamPool::ArmTimer() {
+  if (timer_armed_ || timer_.fd == -1) {
+    return;
+  }
+  struct itimerspec spec = {};
+  spec.it_interval.tv_nsec =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(kTick).count();
+  spec.it_value = spec.it_interval;
+  timerfd_settime(timer_.fd, 0, &spec, nullptr);
+  timer_armed_ = true;
+}
+} // namespace hpl
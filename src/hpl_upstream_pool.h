@@ -0,0 +1,233 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "hpl_header_parser.h"
+#include "hpl_method.h"
+#include "hpl_server.h"
+
+#ifndef _HPL_UPSTREAM_POOL_H_
+#define _HPL_UPSTREAM_POOL_H_
+
+namespace hpl {
+/// @brief limits of an UpstreamPool, per backend unless told otherwise
+struct UpstreamOptions {
+  /// connections of a backend, busy and idle, more requests wait for one
+  size_t max_conns = 64;
+  /// idle connections kept for the next requests, the rest are closed
+  size_t max_idle = 16;
+  std::chrono::milliseconds idle_timeout{30000};
+  std::chrono::milliseconds connect_timeout{1000};
+  /// from Send to the end of the response, the wait for a connection
+  /// included
+  std::chrono::milliseconds request_timeout{10000};
+  /// requests waiting for a connection of the pool, more fail at once
+  size_t max_pending = 1024;
+  /// consecutive failures that eject a backend for eject_time, it gets no
+  /// requests meanwhile
+  uint32_t max_failures = 3;
+  std::chrono::milliseconds eject_time{5000};
+  /// the body of a response, larger ones fail
+  size_t max_response_size = 64 * 1024 * 1024;
+};
+
+/// @brief a request to a backend. Host is the address of the backend
+/// unless a header gives it, Content-Length is added for a body. the pool
+/// frames the message, headers has no Content-Length, Transfer-Encoding or
+/// Connection
+struct UpstreamRequest {
+  HttpMethod method = HttpMethod::GET;
+  std::string target = "/";
+  std::vector<std::pair<std::string, std::string>> headers;
+  std::string body;
+};
+
+/// @brief the response of a backend, the status and the headers are the
+/// ones of its parser. the body is dechunked
+struct UpstreamResponse {
+  UpstreamResponse() : parser(std::pmr::get_default_resource(), true) {}
+  HttpHeaderParser parser;
+  std::string body;
+};
+
+/// @brief gets the response on the loop thread
+/// @param error, 0 on success, else an errno, e.g. ETIMEDOUT, ECONNREFUSED,
+/// EHOSTUNREACH if every backend is ejected, EPROTO for a malformed
+/// response. the response is empty then
+typedef std::function<void(int error, const UpstreamResponse &response)>
+    UpstreamCallback;
+
+/// @brief HTTP/1.1 client connections to a set of backends, polled by the
+/// loop of a server. the connections are kept alive and reused, a request
+/// goes to the healthy backend with the fewest outstanding requests, e.g.
+///   UpstreamPool pool(&server);
+///   pool.AddBackend("127.0.0.1:8080");
+///   pool.Send(std::move(request), [](int error, auto &response) {...});
+/// a request that fails on a reused connection before any response byte,
+/// e.g. the backend closed it meanwhile, is sent again once if idempotent
+class UpstreamPool {
+public:
+  /// @note after server is initialized
+  explicit UpstreamPool(Server *server, const UpstreamOptions &options = {});
+  /// @note from the loop thread outside the callbacks of the pool, or once
+  /// the loop stopped. the callbacks of the requests in flight don't run
+  ~UpstreamPool();
+  UpstreamPool(const UpstreamPool &) = delete;
+  UpstreamPool &operator=(const UpstreamPool &) = delete;
+
+  /// @param address, "ip:port", "[ipv6]:port" or "unix:/path", no name is
+  /// resolved
+  /// @return the index of the backend, -1 if address is malformed
+  int AddBackend(std::string_view address);
+  inline size_t GetBackendCount() const { return backends_.size(); }
+
+  /// @brief on the loop thread. callback runs once with the response, or
+  /// with the error, before Send returns if the request fails at once
+  /// @retval -1, every backend is ejected, or too many requests wait, or the
+  /// target or a header of request is refused, errno is EINVAL then.
+  /// callback doesn't run
+  int Send(UpstreamRequest &&request, UpstreamCallback callback);
+
+  /// requests sent and not answered yet
+  size_t GetOutstanding(size_t backend) const;
+  size_t GetIdleCount(size_t backend) const;
+  bool IsEjected(size_t backend) const;
+  /// connections opened, and requests sent on a kept alive one
+  inline uint64_t GetConnectCount() const { return connects_; }
+  inline uint64_t GetReuseCount() const { return reuses_; }
+
+private:
+  using Clock = std::chrono::steady_clock;
+  /// timeouts are checked at this resolution
+  static constexpr std::chrono::milliseconds kTick{100};
+
+  struct Call {
+    UpstreamRequest request;
+    UpstreamCallback callback;
+    Clock::time_point deadline;
+    /// sent once more after a failure on a reused connection
+    bool retried = false;
+  };
+
+  struct Conn;
+  struct Backend {
+    std::string address;
+    /// sockaddr_in, sockaddr_in6 or sockaddr_un
+    std::string sockaddr;
+    int family = 0;
+    /// for the Host header
+    std::string host;
+    size_t conns = 0;
+    size_t busy = 0;
+    /// the most recently used last
+    std::vector<Conn *> idle;
+    /// requests waiting for a connection, the oldest first
+    std::deque<std::unique_ptr<Call>> pending;
+    uint32_t failures = 0;
+    Clock::time_point ejected_until;
+  };
+
+  enum class ConnState { kFree, kConnecting, kBusy, kIdle };
+
+  /// a connection slot, reused and never freed before the pool, so an
+  /// event queued for a closed one is harmless
+  struct Conn {
+    Watcher watcher;
+    ConnState state = ConnState::kFree;
+    size_t backend = 0;
+    std::unique_ptr<Call> call;
+    /// the request was sent on a kept alive connection
+    bool reused = false;
+    /// the connect or idle deadline, the one of the call while busy
+    Clock::time_point deadline;
+    std::string out;
+    size_t out_offset = 0;
+    std::string in;
+    size_t in_offset = 0;
+    /// any byte of the response arrived
+    bool received = false;
+    UpstreamResponse response;
+    /// the body is read until the backend closes
+    bool until_close = false;
+    /// bytes of the body, or of the chunk, still to read
+    uint64_t body_left = 0;
+    enum class BodyState {
+      kNone,
+      kLength,
+      kChunkSize,
+      kChunkData,
+      kChunkEnd,
+      kTrailer
+    };
+    BodyState body_state = BodyState::kNone;
+  };
+
+  Server *const server_;
+  const UpstreamOptions options_;
+  std::deque<Backend> backends_;
+  std::deque<Conn> conns_;
+  std::vector<Conn *> free_conns_;
+  size_t pending_count_ = 0;
+  /// where the search for the least loaded backend starts, in turn
+  size_t next_backend_ = 0;
+  uint64_t connects_ = 0;
+  uint64_t reuses_ = 0;
+
+  /// a timerfd ticking while connections or requests are open
+  Watcher timer_;
+  bool timer_armed_ = false;
+
+  /// @brief pick the backend of call and send it, or queue it. a failure
+  /// to connect fails call
+  /// @retval -1, every backend is ejected or the queue is full, errno is
+  /// set and call is left to the caller
+  int Dispatch(std::unique_ptr<Call> &call);
+  /// @return -1 if every backend is ejected
+  int PickBackend();
+  /// @brief open a connection to backend for call
+  void Connect(size_t backend, std::unique_ptr<Call> call);
+  /// @brief send the call of a connected or idle conn
+  void Start(Conn *conn, std::unique_ptr<Call> call);
+  /// @brief keep the busy count of the backend of conn
+  void SetState(Conn *conn, ConnState state);
+
+  /// @brief the events of conn, edge triggered
+  void OnEvents(Conn *conn);
+  /// @retval -1, conn failed and is closed
+  int Flush(Conn *conn);
+  /// @brief read the response of a busy conn, or the close of an idle one
+  void ReadInput(Conn *conn);
+  /// @brief parse the input of conn
+  /// @retval 1, the response is complete
+  /// @retval 0, more is needed
+  /// @retval -1, malformed
+  int Parse(Conn *conn);
+  int ParseBody(Conn *conn);
+  /// @brief hand the response to the callback, keep or close conn
+  void Complete(Conn *conn, bool keep_alive);
+  /// @brief close conn and fail its call
+  /// @param backend_fault, count the failure against the backend
+  void Fail(Conn *conn, int error, bool backend_fault);
+  void FailCall(std::unique_ptr<Call> call, int error);
+  /// @brief give the idle conn the next waiting request, or keep it
+  void Release(Conn *conn);
+  void Close(Conn *conn);
+
+  void RecordFailure(size_t backend);
+  /// @brief check the deadlines
+  void OnTick();
+  void ArmTimer();
+};
+} // namespace hpl
+
+#endif // _HPL_UPSTREAM_POOL_H_
@@ -1,42 +1,31 @@
 #include "hpl_version.h"
 #include "hpl_logger.h"
+#include "hpl_str.h"
 
 namespace {
-constexpr int IntHTTP = 'H' | 'T' << 8 | 'T' << 16 | 'P' << 24;
-constexpr int IntWS = 'W' | 'S' << 8 | 'S' << 16 | '/' << 24;
-constexpr int Int1_0 = '1' | '.' << 8 | '0' << 16;
-constexpr int Int1_1 = '1' | '.' << 8 | '1' << 16;
-constexpr int Int2_0 = '2' | '.' << 8 | '0' << 16;
-
-hpl::HttpVersion HttpVersion(std::string_view version, size_t &end_pos) {
-  int v = *(int *)(version.data()) & 0x00ffffff;
-  if (v == Int1_0) {
-    end_pos = 3;
-    return hpl::HttpVersion::HTTP_1_0;
-  } else if (v == Int1_1) {
-    end_pos = 3;
-    return hpl::HttpVersion::HTTP_1_1;
-  } else if (v == Int2_0) {
-    end_pos = 3;
-    return hpl::HttpVersion::HTTP_2_0;
-  } else {
-    return hpl::HttpVersion::UNKNOWN;
-  }
-}
-
-hpl::HttpVersion WsVersion(std::string_view version, size_t &end_pos) {
-  return hpl::HttpVersion::WS;
-}
+// "HTTP/x.y" fills a whole word
+constexpr uint64_t WordHTTP1_0 = hpl::str_word("HTTP/1.0");
+constexpr uint64_t WordHTTP1_1 = hpl::str_word("HTTP/1.1");
+constexpr uint64_t WordHTTP2_0 = hpl::str_word("HTTP/2.0");
+constexpr uint64_t WordWS = hpl::str_word("WSS/");
+constexpr uint64_t MaskWS = hpl::word_mask(4);
 } // namespace
 
 namespace hpl {
 HttpVersion ParseHttpVersion(std::string_view version, size_t &end_pos) {
-  int v = *(int *)(version.data());
-  if (v == IntHTTP && version.length() > 4 && version[4] == '/') {
-    return ::HttpVersion(version.data() + 5, end_pos);
-  }
-  if (v == IntWS) {
-    return ::WsVersion(version.data() + 4, end_pos);
+  uint64_t v = load_word(version, 0);
+  if (v == WordHTTP1_1) {
+    end_pos = 8;
+    return HttpVersion::HTTP_1_1;
+  } else if (v == WordHTTP1_0) {
+    end_pos = 8;
+    return HttpVersion::HTTP_1_0;
+  } else if (v == WordHTTP2_0) {
+    end_pos = 8;
+    return HttpVersion::HTTP_2_0;
+  } else if ((v & MaskWS) == WordWS) {
+    end_pos = 4;
+    return HttpVersion::WS;
   }
   return HttpVersion::UNKNOWN;
 }
@@ -55,4 +44,4 @@ std::string HttpVersionToString(HttpVersion version) {
     return "UNKNOWN";
   }
 }
-} // namespace hpl
\ No newline at end of file
+} // namespace hpl
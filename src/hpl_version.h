@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 namespace hpl {
 enum HttpVersion {
   HTTP_1_0,
@@ -10,6 +11,9 @@ enum HttpVersion {
   UNKNOWN,
 };
 
+/// @brief match the version at the start of version
+/// @param end_pos, set to the length of the match
+/// @return UNKNOWN if nothing matches, never reads past the input
 HttpVersion ParseHttpVersion(std::string_view version, size_t &end_pos);
 std::string HttpVersionToString(HttpVersion version);
 } // namespace hpl
\ No newline at end of file
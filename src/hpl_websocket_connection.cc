@@ -1,16 +1,23 @@
 #include "hpl_websocket_connection.h"
 
 #include <cstdint>
+#include <errno.h>
 #include <netinet/in.h>
 #include <openssl/sha.h>
+#include <string.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <vector>
 
 #include "external_helpers.h"
 #include "hpl_connection.h"
 #include "hpl_logger.h"
+#include "hpl_pubsub_hub.h"
 #include "hpl_request_handler.h"
 #include "hpl_server.h"
+#include "hpl_unmask.h"
 #include "hpl_websocket_utils.h"
 
 namespace hpl {
@@ -34,98 +41,497 @@ std::string WebsocketConnection::GetWsAcceptByKey(std::string_view ws_sec_key) {
   return ret;
 }
 
+WebsocketConnection::~WebsocketConnection() {
+  // UnsubscribeAll takes the hub out of hubs_
+  while (!hubs_.empty()) {
+    hubs_.back()->UnsubscribeAll(this);
+  }
+  // Leave takes the group out of groups_
+  while (!groups_.empty()) {
+    groups_.back()->Leave(this);
+  }
+}
+
 int WebsocketConnection::GetDescriptor() const {
   return conn_ ? conn_->GetDescriptor() : -1;
 }
 
+Server *WebsocketConnection::GetServer() const {
+  return conn_ ? conn_->svr_ : nullptr;
+}
+
+ConnHandle WebsocketConnection::GetHandle() const {
+  return conn_ ? conn_->handle_ : ConnHandle{};
+}
+
 int WebsocketConnection::Read() {
   if (!conn_) {
     return -1;
   }
-  auto ret = conn_->Read();
-  if (ret < 0) {
-    return ret;
+  if (conn_->consumer_paused_) {
+    return 0;
   }
-  std::vector<char> buf = std::move(conn_->buffer_);
+  // edge triggered connections must drain the socket, a tls connection its
+  // records, the decrypted rest isn't polled. a paused consumer leaves the
+  // rest where it is, ResumeRead reads on
+  const bool drain =
+      conn_->svr_->GetMemoryPolicy().edge_triggered || conn_->tls_;
+  do {
+    auto ret = conn_->Read();
+    if (ret == -1) {
+      return -1;
+    } else if (ret == 0) {
+      return 0;
+    }
 #ifdef HPL_ENABLE_PING_PONG
-  last_io_time_ = std::chrono::steady_clock::now();
+    last_io_time_ = std::chrono::steady_clock::now();
 #endif // HPL_ENABLE_PING_PONG
-  struct WsFrameHeader *header =
-      reinterpret_cast<struct WsFrameHeader *>(buf.data());
-#pragma pack(1)
-  struct WsFrameHeader {
-    unsigned opcode : 4;
-    unsigned rsv3 : 1;
-    unsigned rsv2 : 1;
-    unsigned rsv1 : 1;
-    unsigned fin : 1;
-
-    unsigned payload_prefix : 7;
-    unsigned mask : 1;
-  };
-#pragma pack()
-  off_t offset = sizeof(struct WsFrameHeader);
-  uint64_t payload_len = header->payload_prefix;
-  if (header->payload_prefix == 126) {
-    payload_len = ntohs(*reinterpret_cast<uint16_t *>(buf.data() + offset));
-    offset += 2;
-  } else if (header->payload_prefix == 127) {
-    auto l = ntohl(*reinterpret_cast<uint64_t *>(buf.data() + offset));
-    auto h = ntohl(*reinterpret_cast<uint64_t *>(buf.data() + offset + 4));
-    payload_len = (static_cast<uint64_t>(h) << 32) | l;
-    offset += 8;
-  }
-  unsigned char mask[4];
-  if (header->mask) {
-    memcpy(mask, buf.data() + offset, 4);
-    offset += 4;
-  }
-  auto i = 0;
-  for (i = 0; i < payload_len && header->mask; ++i) {
-    buf[offset + i] ^= mask[i & 3];
-  }
-  last_payload_.append(buf.data() + offset, payload_len);
-  LOG_DEBUG("last_payload_: {}", last_payload_);
-  if (header->opcode == 0x8) {
-    // close
+    if (DecodeFrames() == -1) {
+      return -1;
+    }
+  } while (drain && !conn_->consumer_paused_);
+  return 0;
+}
+
+int WebsocketConnection::DecodeHeader(const unsigned char *buf, size_t len) {
+  if (len < 2) {
+    return 0;
+  }
+  const bool fin = buf[0] & 0x80;
+  const unsigned rsv = buf[0] & 0x70;
+  const unsigned char opcode = buf[0] & 0x0f;
+  const bool masked = buf[1] & 0x80;
+  uint64_t length = buf[1] & 0x7f;
+  size_t header_len = 2;
+  if (length == 126) {
+    header_len += 2;
+  } else if (length == 127) {
+    header_len += 8;
+  }
+  if (masked) {
+    header_len += 4;
+  }
+  if (len < header_len) {
+    return 0;
+  }
+  if (!masked) {
+    // a client masks every frame, RFC 6455 5.1
+    LOG_ERROR("ws conn[{}] unmasked frame", conn_->fd_);
+    SendClose(1002);
+    return -1;
+  }
+
+  if (length == 126) {
+    length = static_cast<uint64_t>(buf[2]) << 8 | buf[3];
+  } else if (length == 127) {
+    length = 0;
+    for (int i = 2; i < 10; ++i) {
+      length = length << 8 | buf[i];
+    }
+    if (length >> 63) {
+      LOG_ERROR("ws conn[{}] bad frame length", conn_->fd_);
+      return -1;
+    }
+  }
+  // permessage-deflate marks the first frame of a compressed message
+  const bool compressed = rsv == 0x40 && deflate_ &&
+                          (opcode == WsFrameType::kTypeText ||
+                           opcode == WsFrameType::kTypeBinary);
+  if (rsv != 0 && !compressed) {
+    LOG_ERROR("ws conn[{}] rsv bits {:#x} without extension", conn_->fd_, rsv);
+    return -1;
+  }
+  if (opcode & 0x8) {
+    if (!fin || length > 125) {
+      LOG_ERROR("ws conn[{}] bad control frame", conn_->fd_);
+      return -1;
+    }
+  } else if (opcode == WsFrameType::kTypeContinuation) {
+    if (message_opcode_ == 0) {
+      LOG_ERROR("ws conn[{}] continuation without a message", conn_->fd_);
+      return -1;
+    }
+  } else if (opcode == WsFrameType::kTypeText ||
+             opcode == WsFrameType::kTypeBinary) {
+    if (message_opcode_ != 0) {
+      LOG_ERROR("ws conn[{}] new message inside a fragmented one",
+                conn_->fd_);
+      return -1;
+    }
+    message_opcode_ = opcode;
+    message_length_ = 0;
+    message_compressed_ = compressed;
+    stream_first_ = true;
+  } else {
+    LOG_ERROR("ws conn[{}] unknown opcode {:#x}", conn_->fd_, opcode);
+    return -1;
+  }
+  if (!(opcode & 0x8)) {
+    message_length_ += length;
+    const auto max_size = handlers_->ws_max_message_size;
+    if (max_size != 0 && message_length_ > max_size) {
+      LOG_ERROR("ws conn[{}] message over [{}] bytes", conn_->fd_, max_size);
+      // message too big
+      SendClose(1009);
+      return -1;
+    }
+  }
+
+  frame_.length = length;
+  frame_.received = 0;
+  frame_.opcode = opcode;
+  frame_.fin = fin;
+  frame_.masked = masked;
+  if (masked) {
+    memcpy(frame_.mask, buf + header_len - 4, 4);
+  }
+  frame_.in_frame = true;
+  return header_len;
+}
+
+int WebsocketConnection::DecodeFrames() {
+  auto &buffer = conn_->buffer_;
+  const auto &stream_handler = handlers_->ws_stream_handler;
+  while (!conn_->consumer_paused_ && (!buffer.empty() || frame_.in_frame)) {
+    if (!frame_.in_frame) {
+      int n = DecodeHeader(reinterpret_cast<unsigned char *>(buffer.data()),
+                           buffer.size());
+      if (n <= 0) {
+        return n;
+      }
+      buffer.Consume(n);
+    }
+
+    const bool control = frame_.opcode & 0x8;
+    const uint64_t remain = frame_.length - frame_.received;
+    if (control && buffer.size() < remain) {
+      // at most 125 bytes, wait for the whole frame
+      return 0;
+    }
+    const size_t n = std::min<uint64_t>(buffer.size(), remain);
+    if (n == 0 && remain > 0) {
+      return 0;
+    }
+    char *payload = buffer.data();
+    if (frame_.masked) {
+      UnmaskPayload(payload, n, frame_.mask, frame_.received);
+    }
+    // a frame completely in the buffer and not part of a fragmented message
+    // is delivered from the buffer, without a copy
+    const bool whole = frame_.received == 0 && n == frame_.length &&
+                       frame_.fin && frame_.opcode != 0;
+    frame_.received += n;
+    const bool frame_done = frame_.received == frame_.length;
+    const bool message_done = !control && frame_done && frame_.fin;
+    if (frame_done) {
+      frame_.in_frame = false;
+    }
+
+    int ret = 0;
+    auto type = static_cast<WsFrameType>(message_opcode_);
+    if (control) {
+      ret = Deliver(static_cast<WsFrameType>(frame_.opcode), {payload, n});
+    } else if (message_compressed_) {
+      if (n > 0 || message_done) {
+        ret = InflatePiece({payload, n}, message_done, type);
+      }
+    } else if (stream_handler) {
+      if (n > 0 || message_done) {
+        ret = stream_handler(this, type, {payload, n}, stream_first_,
+                             message_done);
+        stream_first_ = false;
+      }
+    } else if (!message_done) {
+      last_payload_.append(payload, n);
+    } else if (whole) {
+      ret = Deliver(type, {payload, n});
+    } else {
+      last_payload_.append(payload, n);
+      ret = Deliver(type, last_payload_);
+      // don't keep the capacity of the message for an idle connection
+      std::string().swap(last_payload_);
+    }
+    if (message_done) {
+      message_opcode_ = 0;
+      message_length_ = 0;
+      message_compressed_ = false;
+    }
+    buffer.Consume(n);
+    if (ret == -1) {
+      return -1;
+    } else if (ret == 1) {
+      PauseRead();
+    }
+  }
+  return 0;
+}
+
+int WebsocketConnection::InflatePiece(std::string_view piece, bool last,
+                                      WsFrameType type) {
+  const auto &stream_handler = handlers_->ws_stream_handler;
+  int handler_ret = 0;
+  int ret = deflate_->Decompress(
+      piece, last, handlers_->ws_max_message_size, [&](std::string_view out) {
+        if (!stream_handler) {
+          last_payload_.append(out);
+          return 0;
+        }
+        // a pause takes effect once the piece is inflated
+        int r = stream_handler(this, type, out, stream_first_, false);
+        stream_first_ = false;
+        handler_ret = std::max(handler_ret, r == -1 ? 2 : r);
+        return r == -1 ? -1 : 0;
+      });
+  if (handler_ret == 2) {
+    return -1;
+  } else if (ret == -2) {
+    LOG_ERROR("ws conn[{}] inflated message over [{}] bytes", conn_->fd_,
+              handlers_->ws_max_message_size);
+    SendClose(1009);
+    return -1;
+  } else if (ret == -1) {
+    LOG_ERROR("ws conn[{}] bad compressed message", conn_->fd_);
+    // invalid payload data
+    SendClose(1007);
+    return -1;
+  }
+  if (!last) {
+    return handler_ret;
+  }
+  if (stream_handler) {
+    ret = stream_handler(this, type, {}, stream_first_, true);
+    stream_first_ = false;
+    return ret == -1 ? -1 : std::max(ret, handler_ret);
+  }
+  ret = Deliver(type, last_payload_);
+  std::string().swap(last_payload_);
+  return ret;
+}
+
+void WebsocketConnection::SendClose(uint16_t status) {
+  const char payload[2] = {static_cast<char>(status >> 8),
+                           static_cast<char>(status & 0xff)};
+  Write(WsFrameType::kTypeClose, payload, sizeof(payload));
+}
+
+int WebsocketConnection::Deliver(WsFrameType type, std::string_view payload) {
+  LOG_DEBUG("ws conn[{}] frame type[{:#x}] len[{}]", conn_->fd_,
+            static_cast<unsigned>(type), payload.size());
+  if (type == WsFrameType::kTypeClose) {
     return -1;
   }
 #ifdef HPL_ENABLE_PING_PONG
-  if (header->opcode == WsFrameType::kTypePing) {
-    // ping
-    Write(WsFrameType::kTypePong, buf.data() + offset, payload_len);
+  if (type == WsFrameType::kTypePing) {
+    Write(WsFrameType::kTypePong, payload.data(), payload.size());
     LOG_TRACE("pong to {}", conn_->fd_);
-
-    last_payload_.clear();
     return 0;
-  } else if (header->opcode == WsFrameType::kTypePong) {
-    // pong
+  } else if (type == WsFrameType::kTypePong) {
     LOG_TRACE("pong from {}", conn_->fd_);
-    last_payload_.clear();
     return 0;
   }
 #endif // HPL_ENABLE_PING_PONG
-
-  if (header->fin) {
-    int ret = 0;
-    if (on_data_) {
-      ret = on_data_(this, static_cast<WsFrameType>(header->opcode),
-                     last_payload_);
-    }
-    last_payload_.clear();
-    return ret;
-  } else {
-    return 1;
+  if (handlers_->ws_message_handler) {
+    return handlers_->ws_message_handler(this, type, payload);
   }
+  return 0;
 }
 
 int WebsocketConnection::Write(WsFrameType type, const char *data, size_t len) {
+  std::string_view compressed;
+  const bool deflated = deflate_ && !(type & 0x8) &&
+                        len >= deflate_->Threshold() &&
+                        deflate_->Compress({data, len}, compressed);
+  if (deflated) {
+    data = compressed.data();
+    len = compressed.size();
+  }
   auto [header, header_len] = MakeWebsocketHeader(len, type);
-  conn_->Write(header, header_len);
-  conn_->Write(data, len);
+  if (deflated) {
+    header[0] |= 0x40;
+  }
+  if (out_stream_ && !(type & 0x8)) {
+    // can't go between the fragments of the streamed message
+    auto cap = conn_->svr_->GetMemoryPolicy().max_output_per_conn;
+    if (cap != 0 && held_.size() + header_len + len > cap) {
+      LOG_ERROR("ws conn[{}] held output over the cap [{}]", conn_->fd_, cap);
+      return -1;
+    }
+    held_.append(header, header_len);
+    held_.append(data, len);
+    return 0;
+  }
+  struct iovec iov[2] = {{header, header_len},
+                         {const_cast<char *>(data), len}};
+  int ret = conn_->Write(iov, 2);
 #ifdef HPL_ENABLE_PING_PONG
   last_io_time_ = std::chrono::steady_clock::now();
 #endif // HPL_ENABLE_PING_PONG
+  return ret == -1 ? -1 : 0;
+}
+
+int WebsocketConnection::WriteFrame(const SharedBuffer &frame, bool defer,
+                                    std::chrono::milliseconds max_delay) {
+  if (!conn_) {
+    return -1;
+  }
+  if (out_stream_) {
+    auto cap = conn_->svr_->GetMemoryPolicy().max_output_per_conn;
+    if (cap != 0 && held_.size() + frame->size() > cap) {
+      LOG_ERROR("ws conn[{}] held output over the cap [{}]", conn_->fd_, cap);
+      return -1;
+    }
+    held_.append(*frame);
+    return 0;
+  }
+  int ret;
+  if (!defer) {
+    ret = conn_->WriteShared(frame);
+  } else if ((ret = conn_->QueueShared(frame)) != -1) {
+    if (max_delay.count() == 0) {
+      conn_->svr_->ScheduleFlush(conn_);
+    } else {
+      conn_->svr_->ScheduleDelayedFlush(conn_, max_delay);
+    }
+  }
+#ifdef HPL_ENABLE_PING_PONG
+  last_io_time_ = std::chrono::steady_clock::now();
+#endif // HPL_ENABLE_PING_PONG
+  return ret == -1 ? -1 : 0;
+}
+
+int WebsocketConnection::StreamMessage(WsFrameType type, WsProducer producer,
+                                       size_t fragment_size) {
+  if (!conn_ || out_stream_ || (type & 0x8) || fragment_size == 0 ||
+      !producer) {
+    return -1;
+  }
+  out_stream_ = std::make_unique<OutStream>();
+  out_stream_->type = type;
+  out_stream_->fragment_size = fragment_size;
+  out_stream_->producer = std::move(producer);
+  return PumpStream();
+}
+
+int WebsocketConnection::StreamFile(WsFrameType type, int fd, off_t offset,
+                                    uint64_t length, size_t fragment_size) {
+  if (!conn_ || out_stream_ || (type & 0x8) || fragment_size == 0) {
+    return -1;
+  }
+  int file_fd = dup(fd);
+  if (file_fd == -1) {
+    const unsigned kBufSize = 64;
+    char fmt_error_buf[kBufSize];
+    LOG_ERROR("dup [{}] err[{}]", fd,
+              strerror_r(errno, fmt_error_buf, kBufSize));
+    return -1;
+  }
+  out_stream_ = std::make_unique<OutStream>();
+  out_stream_->type = type;
+  out_stream_->fragment_size = fragment_size;
+  out_stream_->file = std::make_shared<const SharedFd>(file_fd);
+  out_stream_->offset = offset;
+  out_stream_->left = length;
+  return PumpStream();
+}
+
+int WebsocketConnection::PumpStream() {
+  while (out_stream_ && conn_->output_.size() < out_stream_->fragment_size) {
+    auto &stream = *out_stream_;
+    auto type = stream.first ? stream.type : WsFrameType::kTypeContinuation;
+    stream.first = false;
+    bool fin;
+    int ret;
+    if (stream.file) {
+      size_t len = std::min<uint64_t>(stream.left, stream.fragment_size);
+      fin = len == stream.left;
+      auto [header, header_len] = MakeWebsocketHeader(len, type, fin);
+      ret = conn_->WriteFile(header, header_len, stream.file, stream.offset,
+                             len);
+      stream.offset += len;
+      stream.left -= len;
+    } else {
+      stream.buf.resize(stream.fragment_size);
+      ssize_t len = stream.producer(stream.buf.data(), stream.buf.size());
+      if (len < 0) {
+        LOG_ERROR("ws conn[{}] producer failed", conn_->fd_);
+        out_stream_.reset();
+        return -1;
+      }
+      // the end is only known when the producer runs dry, the last fragment
+      // is empty
+      fin = len == 0;
+      auto [header, header_len] = MakeWebsocketHeader(len, type, fin);
+      struct iovec iov[2] = {{header, header_len},
+                             {stream.buf.data(), static_cast<size_t>(len)}};
+      ret = conn_->Write(iov, 2);
+    }
+    if (ret == -1) {
+      out_stream_.reset();
+      return -1;
+    }
+    if (fin) {
+      out_stream_.reset();
+      if (!held_.empty()) {
+        ret = conn_->Write(held_.data(), held_.size());
+        std::string().swap(held_);
+        if (ret == -1) {
+          return -1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+void WebsocketConnection::PauseRead() {
+  LOG_DEBUG("ws conn[{}] pause read", conn_->fd_);
+  conn_->consumer_paused_ = true;
+  conn_->svr_->UpdateEvents(conn_);
+}
+
+void WebsocketConnection::ResumeRead() {
+  if (!conn_ || !conn_->consumer_paused_) {
+    return;
+  }
+  LOG_DEBUG("ws conn[{}] resume read", conn_->fd_);
+  conn_->consumer_paused_ = false;
+  conn_->svr_->ScheduleResume(conn_);
+}
+
+bool WebsocketConnection::IsReadPaused() const {
+  return conn_ && conn_->consumer_paused_;
+}
+
+void WebsocketConnection::Close(uint16_t status) {
+  if (!conn_ || conn_->close_pending_) {
+    return;
+  }
+  SendClose(status);
+  conn_->svr_->CloseLater(conn_);
+}
+
+bool WebsocketConnection::IsClosing() const {
+  return !conn_ || conn_->close_pending_;
+}
+
+size_t WebsocketConnection::QueuedBytes() const {
+  return conn_ ? conn_->output_.size() + held_.size() : 0;
+}
+
+int WebsocketConnection::SendQueued() {
+  int ret = conn_->output_.Send(conn_->fd_, conn_->tls_.get());
+  conn_->Account();
+  conn_->svr_->UpdateEvents(conn_);
+  return ret;
+}
+
+int WebsocketConnection::OnDrained() {
+  if (out_stream_ && PumpStream() == -1) {
+    return -1;
+  }
+  for (size_t i = 0; i < groups_.size() && conn_->output_.empty(); ++i) {
+    groups_[i]->Drain(this);
+  }
   return 0;
 }
 
@@ -1,22 +1,38 @@
 #pragma once
 
-#ifdef HPL_ENABLE_PING_PONG
 #include <chrono>
-#endif // HPL_ENABLE_PING_PONG
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <memory>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include "hpl_broadcast_group.h"
+#include "hpl_conn_handle.h"
+#include "hpl_deflate.h"
+#include "hpl_output_queue.h"
 #include "hpl_request_handler.h"
 
 namespace hpl {
 class Server;
+class BroadcastGroup;
+class PubSubHub;
+
+/// @brief fills buf with the next bytes of a streamed message
+/// @return the bytes filled, 0 at the end of the message, -1 on error
+typedef std::function<ssize_t(char *buf, size_t len)> WsProducer;
+
 class WebsocketConnection {
 public:
+  /// @param handlers, registered to the server, outlives the connection
   explicit WebsocketConnection(Connection *const conn, std::string_view ws_key,
-                               WsHandler on_data, WsHook will_close_hook)
-      : ws_key_(ws_key), conn_(conn), on_data_(on_data),
-        will_close_hook_(will_close_hook) {}
+                               const RequestHandler *handlers)
+      : ws_key_(ws_key), handlers_(handlers), conn_(conn) {}
+  /// leaves the groups it is still in
+  ~WebsocketConnection();
 
   inline std::string_view GetWsAccept() {
     if (ws_accept_.empty()) {
@@ -25,35 +41,146 @@ public:
     return ws_accept_;
   }
   inline std::string_view GetWsKey() const { return ws_key_; }
+  /// @note a data frame written while a message is streamed is held back
+  /// until the stream ends, control frames go out between the fragments
   int Write(WsFrameType type, const char *data, size_t len);
 
+  static constexpr size_t kDefaultFragmentSize = 64 * 1024;
+  /// @brief send a message in fragments, each produced when the output of
+  /// the connection drains below a fragment
+  /// @retval 0, the stream is started
+  /// @retval -1, another stream is running, or error, close the connection
+  int StreamMessage(WsFrameType type, WsProducer producer,
+                    size_t fragment_size = kDefaultFragmentSize);
+  /// @brief send length bytes of fd from offset as a message, fragments go
+  /// out with sendfile. fd is duplicated, the caller may close it
+  /// @return same as StreamMessage
+  int StreamFile(WsFrameType type, int fd, off_t offset, uint64_t length,
+                 size_t fragment_size = kDefaultFragmentSize);
+  inline bool IsStreaming() const { return out_stream_ != nullptr; }
+  /// permessage-deflate is negotiated
+  inline bool IsCompressed() const { return deflate_ != nullptr; }
+
   /// try to send a ping frame to client if it is idle for a long time
   /// @retval true, ping frame is sent
   bool ServerPing();
 
   int GetDescriptor() const;
+  /// the server polling this connection
+  Server *GetServer() const;
+  /// for Server::Post and Server::Send from other threads
+  ConnHandle GetHandle() const;
+
+  /// @brief read again after a handler returned 1, the frames already
+  /// buffered are delivered at the start of the next Server::Poll
+  void ResumeRead();
+  bool IsReadPaused() const;
+
+  /// @brief send a close frame with status, and close the connection once
+  /// the server is done with the events of this poll. safe to call from any
+  /// handler, and more than once
+  void Close(uint16_t status = 1000);
+  bool IsClosing() const;
+  /// bytes waiting to be sent
+  size_t QueuedBytes() const;
 
 private:
-  const std::string_view ws_key_;
+  // the request is gone after the upgrade, keep a copy of the key
+  const std::string ws_key_;
   std::string ws_accept_;
-  const WsHandler on_data_;
-  const WsHook will_close_hook_;
+  const RequestHandler *const handlers_;
   static std::string GetWsAcceptByKey(std::string_view ws_sec_key);
 
+  /// the fragments of the message being received
   std::string last_payload_;
 
+  /// decoder state of the frame being received, its header is consumed
+  struct FrameState {
+    uint64_t length = 0;
+    uint64_t received = 0;
+    unsigned char mask[4] = {};
+    unsigned char opcode = 0;
+    bool fin = false;
+    bool masked = false;
+    bool in_frame = false;
+  } frame_;
+  /// opcode of the first frame of the message, 0 if no message is started
+  unsigned char message_opcode_ = 0;
+  /// the next piece for the stream handler starts a message
+  bool stream_first_ = false;
+  /// payload bytes of the message, the current frame included
+  uint64_t message_length_ = 0;
+  /// the message has RSV1 set, its payload is inflated
+  bool message_compressed_ = false;
+  std::unique_ptr<WsDeflate> deflate_;
+
 #ifdef HPL_ENABLE_PING_PONG
   std::chrono::steady_clock::time_point last_io_time_ =
       std::chrono::steady_clock::now();
 #endif // HPL_ENABLE_PING_PONG
 
-  /// @retval 0, a complete frame is read
-  /// @retval 1, a frame is read but not complete
-  /// @retval -1, error
+  /// @brief read the socket and decode the frames
+  /// @retval 0, keep the connection
+  /// @retval -1, error or close frame
   int Read();
 
+  /// @brief decode every complete frame in the input buffer, a partial header
+  /// stays in the buffer, a partial payload is moved into last_payload_
+  /// @retval 0, keep the connection
+  /// @retval -1, error or close frame
+  int DecodeFrames();
+  /// @retval -1, the header is malformed
+  /// @retval 0, the header is not complete
+  /// @retval >0, the length of the header
+  int DecodeHeader(const unsigned char *buf, size_t len);
+  /// @brief a control frame, or the last frame of a message, is complete
+  int Deliver(WsFrameType type, std::string_view payload);
+  /// @brief stop reading until ResumeRead()
+  void PauseRead();
+  /// @brief inflate a piece of a compressed message and deliver it
+  /// @return same as the handlers
+  int InflatePiece(std::string_view piece, bool last, WsFrameType type);
+  /// @brief send a close frame with status, the caller closes
+  void SendClose(uint16_t status);
+  /// @brief queue an encoded data frame shared with other connections
+  /// @param defer, don't send before the end of the poll, or before
+  /// max_delay passed if it isn't 0
+  /// @retval -1, error
+  int WriteFrame(const SharedBuffer &frame, bool defer = false,
+                 std::chrono::milliseconds max_delay = {});
+  /// @brief send the queued output now, even while the server dispatches
+  /// @return same as Connection::FlushOutput
+  int SendQueued();
+  /// @brief the output drained, queue what waits for it
+  /// @retval -1, error, a group disconnecting a member closes it later
+  int OnDrained();
+  /// groups this connection is a member of
+  std::vector<BroadcastGroup *> groups_;
+  /// hubs this connection subscribes to
+  std::vector<PubSubHub *> hubs_;
+
+  /// an outgoing message sent in fragments
+  struct OutStream {
+    WsFrameType type;
+    size_t fragment_size;
+    bool first = true;
+    WsProducer producer;
+    std::string buf;
+    std::shared_ptr<const SharedFd> file;
+    off_t offset = 0;
+    uint64_t left = 0;
+  };
+  std::unique_ptr<OutStream> out_stream_;
+  /// data frames written during the stream
+  std::string held_;
+  /// @brief queue fragments until the output holds one
+  /// @retval -1, error
+  int PumpStream();
+
   Connection *const conn_;
   friend class Server;
+  friend class Connection;
   friend class BroadcastGroup;
+  friend class PubSubHub;
 };
 } // namespace hpl
\ No newline at end of file
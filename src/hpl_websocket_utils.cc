@@ -2,27 +2,41 @@
 
 namespace hpl {
 std::pair<char[16], size_t> MakeWebsocketHeader(size_t message_length,
-                                                WsFrameType type) {
+                                                WsFrameType type, bool fin) {
   std::pair<char[16], size_t> ret;
   char *header = ret.first;
   auto &header_size = ret.second;
 
-  header[0] = 0x80 | type;
+  header[0] = (fin ? 0x80 : 0) | type;
   if (message_length < 126) {
     header[1] = message_length;
     header_size = 2;
-  } else if (message_length < 0xffff) {
+  } else if (message_length <= 0xffff) {
     header[1] = 126;
     header[2] = (message_length >> 8) & 0xff;
     header[3] = message_length & 0xff;
     header_size = 4;
   } else {
     header[1] = 127;
-    header[2] = (message_length >> 56) & 0xff;
-    header[3] = (message_length >> 48) & 0xff;
-    header[4] = (message_length >> 40) & 0xff;
-    header_size = 6;
+    for (int i = 0; i < 8; ++i) {
+      header[2 + i] = (static_cast<uint64_t>(message_length) >> (56 - i * 8)) &
+                      0xff;
+    }
+    header_size = 10;
   }
   return ret;
 }
-} // namespace hpl
\ No newline at end of file
+
+SharedBuffer MakeWebsocketFrame(std::string_view payload, WsFrameType type,
+                                bool compressed) {
+  auto [header, header_len] = MakeWebsocketHeader(payload.size(), type);
+  if (compressed) {
+    header[0] |= 0x40;
+  }
+  auto frame = std::make_shared<std::string>();
+  frame->reserve(header_len + payload.size());
+  frame->append(header, header_len);
+  frame->append(payload);
+  return frame;
+}
+} // namespace hpl
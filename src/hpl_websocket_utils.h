@@ -3,13 +3,24 @@
 #define HPL_WEBSOCKET_UTILS_H
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <string_view>
 #include <utility>
 
+#include "hpl_output_queue.h"
 #include "hpl_request_handler.h"
 
 namespace hpl {
+/// @brief the header of an unmasked frame
+/// @param fin, false for every fragment of a message but the last
 std::pair<char[16], size_t> MakeWebsocketHeader(size_t message_length,
-                                                WsFrameType type);
+                                                WsFrameType type,
+                                                bool fin = true);
+
+/// @brief a whole unmasked frame in a buffer to share between connections
+/// @param compressed, set RSV1 for a permessage-deflate payload
+SharedBuffer MakeWebsocketFrame(std::string_view payload, WsFrameType type,
+                                bool compressed = false);
 } // namespace hpl
 #endif // HPL_WEBSOCKET_UTILS_H
\ No newline at end of file
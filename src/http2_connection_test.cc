@@ -0,0 +1,309 @@
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "hpl_connection.h"
+#include "hpl_hpack.h"
+#include "hpl_http2_connection.h"
+#include "hpl_http2_frame.h"
+#include "hpl_request_handler.h"
+#include "hpl_response.h"
+#include "hpl_server.h"
+#include "hpl_sse_channel.h"
+#include "test_util.h"
+
+namespace {
+using hpl::test::PollUntil;
+
+/// what a stream got from the server
+struct Response {
+  std::string status;
+  std::string data;
+  bool end = false;
+  bool reset = false;
+  hpl::Http2Error error = hpl::Http2Error::kNoError;
+};
+
+/// @brief a h2c client with prior knowledge, reading without blocking the
+/// loop
+struct Http2Client {
+  int fd = -1;
+  std::string in;
+  hpl::HpackEncoder encoder;
+  hpl::HpackDecoder decoder{4096, 64 * 1024};
+  std::map<uint32_t, Response> streams;
+
+  ~Http2Client() {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+
+  /// @param window, the initial window of the streams
+  bool Open(int port, uint32_t window) {
+    fd = hpl::test::ConnectLoopback(port);
+    if (fd == -1) {
+      return false;
+    }
+    std::string out(hpl::kHttp2Preface);
+    std::string settings;
+    hpl::AppendSettings(&settings, hpl::Http2Setting::kInitialWindowSize,
+                        window);
+    hpl::AppendHttp2FrameHeader(&out, settings.size(),
+                                hpl::Http2FrameType::kSettings, 0, 0);
+    out += settings;
+    return Send(out);
+  }
+
+  bool Send(const std::string &out) {
+    return write(fd, out.data(), out.size()) ==
+           static_cast<ssize_t>(out.size());
+  }
+
+  bool Get(uint32_t id, std::string_view path) {
+    std::string block;
+    encoder.Encode({{":method", "GET"},
+                    {":scheme", "http"},
+                    {":authority", "localhost"},
+                    {":path", path}},
+                   &block);
+    std::string out;
+    hpl::AppendHttp2FrameHeader(
+        &out, block.size(), hpl::Http2FrameType::kHeaders,
+        hpl::http2_flags::kEndHeaders | hpl::http2_flags::kEndStream, id);
+    out += block;
+    return Send(out);
+  }
+
+  bool WindowUpdate(uint32_t id, uint32_t increment) {
+    std::string out;
+    hpl::AppendWindowUpdate(&out, id, increment);
+    return Send(out);
+  }
+
+  /// @brief read and take the frames in
+  void Receive() {
+    char buf[65536];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+      in.append(buf, n);
+    }
+    while (in.size() >= hpl::kHttp2FrameHeaderSize) {
+      auto *data = reinterpret_cast<const unsigned char *>(in.data());
+      auto header = hpl::DecodeHttp2FrameHeader(data);
+      if (in.size() < hpl::kHttp2FrameHeaderSize + header.length) {
+        break;
+      }
+      std::string_view payload(in.data() + hpl::kHttp2FrameHeaderSize,
+                               header.length);
+      auto &response = streams[header.stream_id];
+      const bool end = header.flags & hpl::http2_flags::kEndStream;
+      if (header.type == hpl::Http2FrameType::kHeaders) {
+        std::vector<hpl::HeaderField> fields;
+        EXPECT_EQ(decoder.Decode(payload, &fields), 0);
+        for (auto &field : fields) {
+          if (field.name == ":status") {
+            response.status = field.value;
+          }
+        }
+        response.end = end;
+      } else if (header.type == hpl::Http2FrameType::kData) {
+        response.data += payload;
+        response.end = end;
+      } else if (header.type == hpl::Http2FrameType::kRstStream) {
+        response.reset = true;
+        uint32_t error = 0;
+        for (size_t i = 0; i < 4 && i < payload.size(); ++i) {
+          error = error << 8 | static_cast<unsigned char>(payload[i]);
+        }
+        response.error = static_cast<hpl::Http2Error>(error);
+      }
+      in.erase(0, hpl::kHttp2FrameHeaderSize + header.length);
+    }
+  }
+
+  bool Wait(hpl::Server &server, uint32_t id) {
+    return PollUntil(server, [&] {
+      Receive();
+      return streams[id].end || streams[id].reset;
+    });
+  }
+};
+
+void Route(hpl::Server &server, const std::string &uri,
+           std::function<int(hpl::Connection *)> respond) {
+  hpl::RequestHandler handlers;
+  handlers.http_handlers[static_cast<int>(hpl::HttpMethod::GET)] =
+      [respond](hpl::Connection *conn, std::string_view, std::string &&,
+                bool final) { return final ? respond(conn) : 0; };
+  server.RegisterRequestHandler(uri, std::move(handlers));
+}
+
+int Write(hpl::Connection *conn, std::string_view data) {
+  return conn->Write(data.data(), data.size());
+}
+} // namespace
+
+TEST(http2_connection, body_framing) {
+  hpl::Server server;
+  ASSERT_EQ(server.Init("127.0.0.1", 39501, 16), 0);
+  server.EnableHttp2();
+  Route(server, "/chunked", [](hpl::Connection *conn) {
+    // a size line split between the writes, and a trailer
+    Write(conn, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                "5\r\nhello\r\n");
+    Write(conn, "6");
+    return Write(conn, "\r\n world\r\n0\r\nX-Trailer: 1\r\n\r\n") == -1 ? -1
+                                                                        : 0;
+  });
+  Route(server, "/until_end", [](hpl::Connection *conn) {
+    Write(conn, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\npart1");
+    return Write(conn, "part2") == -1 ? -1 : 0;
+  });
+  hpl::Connection *later = nullptr;
+  uint32_t later_id = 0;
+  Route(server, "/later", [&](hpl::Connection *conn) {
+    later = conn;
+    later_id = conn->GetHttp2()->GetStreamId();
+    return 0;
+  });
+
+  Http2Client client;
+  ASSERT_TRUE(client.Open(39501, 65535));
+  ASSERT_TRUE(client.Get(1, "/chunked"));
+  ASSERT_TRUE(client.Get(3, "/until_end"));
+  ASSERT_TRUE(client.Get(5, "/later"));
+  ASSERT_TRUE(client.Wait(server, 1));
+  EXPECT_EQ(client.streams[1].status, "200");
+  EXPECT_EQ(client.streams[1].data, "hello world");
+  EXPECT_FALSE(client.streams[1].reset);
+  // the body ends when the handler that got the request returns
+  ASSERT_TRUE(client.Wait(server, 3));
+  EXPECT_EQ(client.streams[3].data, "part1part2");
+  EXPECT_FALSE(client.streams[3].reset);
+
+  // written after the handler returned, the write is the whole response
+  ASSERT_TRUE(PollUntil(server, [&] { return later != nullptr; }));
+  ASSERT_EQ(later->GetHttp2()->SelectStream(later_id), 0);
+  EXPECT_NE(Write(later, "HTTP/1.1 200 OK\r\n\r\nlater"), -1);
+  ASSERT_TRUE(client.Wait(server, 5));
+  EXPECT_EQ(client.streams[5].data, "later");
+}
+
+TEST(http2_connection, pending_output) {
+  hpl::Server server;
+  ASSERT_EQ(server.Init("127.0.0.1", 39502, 16), 0);
+  server.EnableHttp2();
+  hpl::MemoryPolicy policy;
+  policy.max_output_per_conn = 256 * 1024;
+  server.SetMemoryPolicy(policy);
+  const std::string small(64 * 1024, 's');
+  const std::string large(512 * 1024, 'l');
+  for (auto *body : {&small, &large}) {
+    Route(server, body == &small ? "/small" : "/large",
+          [body](hpl::Connection *conn) {
+            auto rsp =
+                hpl::MakeResponse(200, hpl::HttpVersion::HTTP_1_1, {}, *body);
+            return Write(conn, rsp) == -1 ? -1 : 0;
+          });
+  }
+
+  // no window, the bodies wait in the server
+  Http2Client client;
+  ASSERT_TRUE(client.Open(39502, 0));
+  ASSERT_TRUE(client.Get(1, "/small"));
+  ASSERT_TRUE(PollUntil(server, [&] {
+    client.Receive();
+    return client.streams[1].status == "200";
+  }));
+  EXPECT_GE(server.GetMemoryBudget().Used(), small.size());
+  // over max_output_per_conn, the stream fails and the connection goes on
+  ASSERT_TRUE(client.Get(3, "/large"));
+  ASSERT_TRUE(client.Wait(server, 3));
+  EXPECT_TRUE(client.streams[3].reset);
+
+  ASSERT_TRUE(client.WindowUpdate(0, small.size()));
+  ASSERT_TRUE(client.WindowUpdate(1, small.size()));
+  ASSERT_TRUE(client.Wait(server, 1));
+  EXPECT_EQ(client.streams[1].data, small);
+  EXPECT_LT(server.GetMemoryBudget().Used(), small.size());
+}
+
+TEST(http2_connection, posted_writes) {
+  hpl::Server server;
+  ASSERT_EQ(server.Init("127.0.0.1", 39503, 16), 0);
+  server.EnableHttp2();
+  hpl::ConnHandle handle;
+  uint32_t later_id = 0;
+  Route(server, "/later", [&](hpl::Connection *conn) {
+    handle = conn->GetHandle();
+    later_id = conn->GetHttp2()->GetStreamId();
+    return 0;
+  });
+  Route(server, "/now", [](hpl::Connection *conn) {
+    return Write(conn, "HTTP/1.1 200 OK\r\n\r\nnow") == -1 ? -1 : 0;
+  });
+
+  Http2Client client;
+  ASSERT_TRUE(client.Open(39503, 65535));
+  ASSERT_TRUE(client.Get(1, "/later"));
+  ASSERT_TRUE(client.Get(3, "/now"));
+  ASSERT_TRUE(client.Wait(server, 3));
+  ASSERT_EQ(later_id, 1u);
+
+  // the stream selected last is ended, a send has no stream and is dropped
+  EXPECT_EQ(server.Send(handle, "HTTP/1.1 200 OK\r\n\r\nsent"), 0);
+  EXPECT_FALSE(PollUntil(
+      server,
+      [&] {
+        client.Receive();
+        return !server.IsOpen(handle) || !client.streams[1].data.empty();
+      },
+      std::chrono::milliseconds(100)));
+
+  EXPECT_EQ(server.Post(handle,
+                        [&](hpl::Connection *conn) {
+                          ASSERT_EQ(conn->GetHttp2()->SelectStream(later_id),
+                                    0);
+                          Write(conn, "HTTP/1.1 200 OK\r\n\r\nposted");
+                        }),
+            0);
+  ASSERT_TRUE(client.Wait(server, 1));
+  EXPECT_EQ(client.streams[1].data, "posted");
+}
+
+TEST(http2_connection, event_stream_route) {
+  hpl::SseChannel channel;
+  hpl::Server server;
+  ASSERT_EQ(server.Init("127.0.0.1", 39504, 16), 0);
+  server.EnableHttp2();
+  hpl::RequestHandler handlers;
+  handlers.sse_channel = &channel;
+  server.RegisterRequestHandler("/events", std::move(handlers));
+  Route(server, "/now", [](hpl::Connection *conn) {
+    return Write(conn, "HTTP/1.1 200 OK\r\n\r\nnow") == -1 ? -1 : 0;
+  });
+
+  // the client is told to retry the event stream over http/1.1
+  Http2Client client;
+  ASSERT_TRUE(client.Open(39504, 65535));
+  ASSERT_TRUE(client.Get(1, "/events"));
+  ASSERT_TRUE(client.Wait(server, 1));
+  EXPECT_TRUE(client.streams[1].reset);
+  EXPECT_EQ(client.streams[1].error, hpl::Http2Error::kHttp11Required);
+  EXPECT_EQ(channel.size(), 0u);
+  // the connection goes on
+  ASSERT_TRUE(client.Get(3, "/now"));
+  ASSERT_TRUE(client.Wait(server, 3));
+  EXPECT_EQ(client.streams[3].data, "now");
+}
@@ -20,9 +20,9 @@ TEST(http_header_parser, test) {
 
   EXPECT_EQ(parser.GetState(), hpl::HttpHeaderParser::ParserState::Done);
   EXPECT_EQ(parser.GetMethod(), hpl::HttpMethod::GET);
-  EXPECT_STREQ(parser.GetUri().c_str(), "/");
-  EXPECT_STREQ(parser.GetHost().c_str(), "myserver.com");
-  EXPECT_STREQ(parser.GetUserAgent().c_str(), "Mozilla/5.0");
+  EXPECT_EQ(parser.GetUri(), "/");
+  EXPECT_EQ(parser.GetHost(), "myserver.com");
+  EXPECT_EQ(parser.GetUserAgent(), "Mozilla/5.0");
   EXPECT_EQ(parser.GetVersion(), hpl::HttpVersion::HTTP_1_1);
   EXPECT_EQ(parser.GetContentLength(), 13);
   EXPECT_EQ(parser.GetUpgradeFlags(),
@@ -33,6 +33,33 @@ TEST(http_header_parser, test) {
   const auto &headers = parser.GetHeaders();
   EXPECT_EQ(headers.size(), 1);
   EXPECT_STREQ(headers.at("Extra-Header").c_str(), "some data");
-  const auto &body = parser.GetBody();
-  EXPECT_EQ(body.size(), 13);
-}
\ No newline at end of file
+  // the body is counted, the connection keeps it
+  EXPECT_EQ(parser.GetBodyLength(), 25);
+}
+
+TEST(http_header_parser, request_line) {
+  const std::pair<const char *, hpl::HttpMethod> methods[] = {
+      {"GET", hpl::HttpMethod::GET},         {"POST", hpl::HttpMethod::POST},
+      {"PUT", hpl::HttpMethod::PUT},         {"DELETE", hpl::HttpMethod::DELETE},
+      {"HEAD", hpl::HttpMethod::HEAD},       {"CONNECT", hpl::HttpMethod::CONNECT},
+      {"OPTIONS", hpl::HttpMethod::OPTIONS}, {"TRACE", hpl::HttpMethod::TRACE},
+      {"PATCH", hpl::HttpMethod::PATCH},
+  };
+  for (auto &[name, method] : methods) {
+    hpl::HttpHeaderParser parser;
+    parser.PushLine(std::string(name) + " /a/b?c=%20 HTTP/1.0\r\n");
+    EXPECT_EQ(parser.GetState(), hpl::HttpHeaderParser::ParserState::Headers);
+    EXPECT_EQ(parser.GetMethod(), method);
+    EXPECT_EQ(parser.GetUri(), "/a/b?c=%20");
+    EXPECT_EQ(parser.GetVersion(), hpl::HttpVersion::HTTP_1_0);
+  }
+
+  for (auto line : {"GE", "GETX / HTTP/1.1\r\n", "GET  / HTTP/1.1\r\n",
+                    "GET /a\"b HTTP/1.1\r\n", "GET / HTTP/1.7\r\n",
+                    "GET / HTTP/1.1 \r\n", "GET /"}) {
+    hpl::HttpHeaderParser parser;
+    parser.PushLine(line);
+    EXPECT_EQ(parser.GetState(), hpl::HttpHeaderParser::ParserState::Done);
+    EXPECT_EQ(parser.GetMethod(), hpl::HttpMethod::UNKNOWN);
+  }
+}
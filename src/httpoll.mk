@@ -6,5 +6,6 @@ LIBSRC := $(wildcard ./*.cc)
 FILTEROUT := $(wildcard ./*test.cc)
 LIBSRC := $(filter-out $(FILTEROUT), $(LIBSRC))
 LIBOBJS := $(patsubst %.cc, %.o, $(LIBSRC))
+TESTOBJS := $(patsubst %.cc, %.o, $(FILTEROUT))
 
-CXXFLAGS += -DHPL_ENABLE_PING_PONG=10 -DSMALL_MEMORY=1024
+CXXFLAGS += -DHPL_ENABLE_PING_PONG=10
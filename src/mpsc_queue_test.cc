@@ -0,0 +1,78 @@
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "hpl_mpsc_queue.h"
+
+TEST(mpsc_queue, full_and_empty) {
+  hpl::MpscQueue<std::unique_ptr<int>> queue(3);
+  EXPECT_EQ(queue.capacity(), 4);
+  std::unique_ptr<int> value;
+  EXPECT_FALSE(queue.TryPop(value));
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(queue.TryPush(std::make_unique<int>(i)));
+  }
+  auto extra = std::make_unique<int>(4);
+  EXPECT_FALSE(queue.TryPush(std::move(extra)));
+  // a failed push leaves the value to the caller
+  ASSERT_TRUE(extra);
+  // around the ring a few laps
+  for (int i = 0; i < 20; ++i) {
+    ASSERT_TRUE(queue.TryPop(value));
+    EXPECT_EQ(*value, i);
+    EXPECT_TRUE(queue.TryPush(std::make_unique<int>(i + 4)));
+  }
+  for (int i = 20; i < 24; ++i) {
+    ASSERT_TRUE(queue.TryPop(value));
+    EXPECT_EQ(*value, i);
+  }
+  EXPECT_FALSE(queue.TryPop(value));
+}
+
+TEST(mpsc_queue, producers) {
+  const int kProducers = 4;
+  const uint32_t kPerProducer = 100000;
+  // small, so the producers keep finding it full
+  hpl::MpscQueue<uint64_t> queue(64);
+
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kProducers; ++p) {
+    producers.emplace_back([&queue, p] {
+      for (uint32_t i = 0; i < kPerProducer; ++i) {
+        uint64_t value = static_cast<uint64_t>(p) << 32 | i;
+        while (!queue.TryPush(std::move(value))) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+
+  // every value once, in the order of its producer
+  std::vector<uint32_t> next(kProducers, 0);
+  uint64_t popped = 0;
+  uint64_t value;
+  while (popped < kProducers * kPerProducer) {
+    if (!queue.TryPop(value)) {
+      std::this_thread::yield();
+      continue;
+    }
+    auto p = value >> 32;
+    ASSERT_LT(p, kProducers);
+    ASSERT_EQ(value & 0xffffffff, next[p]);
+    ++next[p];
+    ++popped;
+  }
+  for (auto &producer : producers) {
+    producer.join();
+  }
+  EXPECT_FALSE(queue.TryPop(value));
+  for (int p = 0; p < kProducers; ++p) {
+    EXPECT_EQ(next[p], kPerProducer);
+  }
+}
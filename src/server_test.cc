@@ -0,0 +1,130 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "hpl_conn_handle.h"
+#include "hpl_connection.h"
+#include "hpl_request_handler.h"
+#include "hpl_server.h"
+#include "hpl_websocket_connection.h"
+#include "test_util.h"
+
+namespace {
+using hpl::test::PollUntil;
+using hpl::test::WsClient;
+
+/// @brief a server keeping the handles of the websocket connections on /ws
+struct HandleServer {
+  hpl::Server server;
+  std::vector<hpl::ConnHandle> handles;
+
+  explicit HandleServer(int port, size_t post_queue_size = 0) {
+    if (post_queue_size != 0) {
+      server.SetPostQueueSize(post_queue_size);
+    }
+    EXPECT_EQ(server.Init("127.0.0.1", port, 16), 0);
+    hpl::RequestHandler handlers;
+    handlers.ws_connect_hook = [this](hpl::WebsocketConnection *conn,
+                                      std::string_view) {
+      handles.push_back(conn->GetHandle());
+      return 0;
+    };
+    server.RegisterRequestHandler("/ws", std::move(handlers));
+  }
+};
+} // namespace
+
+TEST(server, post_from_thread) {
+  HandleServer s(39801);
+  WsClient client;
+  ASSERT_TRUE(client.Open(s.server, 39801));
+  ASSERT_EQ(s.handles.size(), 1u);
+  const auto handle = s.handles[0];
+
+  bool ran = false;
+  std::thread other([&] {
+    EXPECT_EQ(s.server.Send(handle, "sent", hpl::kTypeText), 0);
+    EXPECT_EQ(s.server.Post(handle,
+                            [&ran, handle](hpl::Connection *conn) {
+                              ran = conn->GetHandle().generation ==
+                                    handle.generation;
+                            }),
+              0);
+  });
+  other.join();
+  unsigned char b0 = 0;
+  std::string payload;
+  ASSERT_TRUE(client.ReadFrame(s.server, b0, payload));
+  EXPECT_EQ(b0, 0x81);
+  EXPECT_EQ(payload, "sent");
+  EXPECT_TRUE(ran);
+}
+
+TEST(server, stale_handle) {
+  HandleServer s(39802);
+  WsClient first;
+  ASSERT_TRUE(first.Open(s.server, 39802));
+  first.Close();
+  ASSERT_TRUE(
+      PollUntil(s.server, [&] { return s.server.GetConnectionCount() == 0; }));
+  EXPECT_FALSE(s.server.IsOpen(s.handles[0]));
+
+  // the next connection takes the slot of the closed one
+  WsClient second;
+  ASSERT_TRUE(second.Open(s.server, 39802));
+  ASSERT_EQ(s.handles.size(), 2u);
+  const auto stale = s.handles[0];
+  const auto fresh = s.handles[1];
+  ASSERT_EQ(fresh.index, stale.index);
+  ASSERT_NE(fresh.generation, stale.generation);
+
+  bool ran = false;
+  EXPECT_EQ(s.server.Send(stale, "stale", hpl::kTypeText), 0);
+  EXPECT_EQ(s.server.Post(stale, [&ran](hpl::Connection *) { ran = true; }),
+            0);
+  EXPECT_FALSE(PollUntil(
+      s.server,
+      [&] {
+        second.Receive();
+        return ran || !second.in.empty();
+      },
+      std::chrono::milliseconds(100)));
+
+  EXPECT_EQ(s.server.Send(fresh, "fresh", hpl::kTypeText), 0);
+  unsigned char b0 = 0;
+  std::string payload;
+  ASSERT_TRUE(second.ReadFrame(s.server, b0, payload));
+  EXPECT_EQ(payload, "fresh");
+  EXPECT_FALSE(ran);
+}
+
+TEST(server, post_queue_full) {
+  hpl::Server uninitialized;
+  EXPECT_EQ(uninitialized.Post({}, [](hpl::Connection *) {}), -1);
+
+  HandleServer s(39803, 4);
+  WsClient client;
+  ASSERT_TRUE(client.Open(s.server, 39803));
+  const auto handle = s.handles[0];
+  // nothing runs the posts until the loop polls
+  int ran = 0;
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(s.server.Post(handle, [&ran](hpl::Connection *) { ++ran; }), 0)
+        << i;
+  }
+  EXPECT_EQ(s.server.Post(handle, [&ran](hpl::Connection *) { ++ran; }), -1);
+  EXPECT_EQ(s.server.Send(handle, "over"), -1);
+  ASSERT_TRUE(PollUntil(s.server, [&] { return ran == 4; }));
+
+  // drained, there is room again
+  EXPECT_EQ(s.server.Send(handle, "room", hpl::kTypeText), 0);
+  unsigned char b0 = 0;
+  std::string payload;
+  ASSERT_TRUE(client.ReadFrame(s.server, b0, payload));
+  EXPECT_EQ(payload, "room");
+  EXPECT_EQ(ran, 4);
+}
@@ -0,0 +1,170 @@
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hpl_request_handler.h"
+#include "hpl_server.h"
+#include "hpl_shm_bus.h"
+#include "test_util.h"
+
+namespace {
+/// the layout of the segment in hpl_shm_bus.cc
+struct Header {
+  std::atomic<uint32_t> magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t slot_size;
+  alignas(64) std::atomic<uint64_t> write_pos;
+  alignas(64) std::atomic<uint32_t> signal;
+  std::atomic<uint32_t> waiters;
+};
+
+struct Slot {
+  std::atomic<uint64_t> seq;
+  uint32_t length;
+  uint8_t type;
+  uint8_t key_length;
+  char data[];
+};
+
+struct Received {
+  std::string key;
+  std::string data;
+};
+
+class ShmBusTest : public testing::Test {
+protected:
+  void SetUp() override {
+    name_ = "/httpoll-test-" + std::to_string(getpid());
+    shm_unlink(name_.c_str());
+    ASSERT_EQ(server_.Init("127.0.0.1", 39201, 16), 0);
+  }
+  void TearDown() override { shm_unlink(name_.c_str()); }
+
+  bool PollUntil(const std::function<bool()> &done) {
+    return hpl::test::PollUntil(server_, done);
+  }
+
+  /// poll until count messages arrived
+  bool PollFor(size_t count) {
+    return PollUntil([this, count] { return received_.size() >= count; });
+  }
+
+  hpl::ShmBroadcastBus::Sink Sink() {
+    return [this](std::string_view key, std::string_view data,
+                  hpl::WsFrameType) {
+      received_.push_back({std::string(key), std::string(data)});
+    };
+  }
+
+  std::string name_;
+  hpl::Server server_;
+  std::vector<Received> received_;
+};
+} // namespace
+
+TEST_F(ShmBusTest, wrap_around) {
+  hpl::ShmBroadcastBus bus(&server_, Sink());
+  ASSERT_EQ(bus.Open(name_.c_str(), 3, 64), 0);
+  // 4 slots, read as they come for 5 laps
+  for (int i = 0; i < 20; ++i) {
+    ASSERT_EQ(bus.Publish("m" + std::to_string(i), hpl::kTypeText,
+                          i % 2 ? "odd" : ""),
+              0);
+    ASSERT_TRUE(PollFor(i + 1)) << i;
+  }
+  for (int i = 0; i < 20; ++i) {
+    EXPECT_EQ(received_[i].data, "m" + std::to_string(i));
+    EXPECT_EQ(received_[i].key, i % 2 ? "odd" : "");
+  }
+  EXPECT_EQ(bus.Lost(), 0);
+  EXPECT_EQ(bus.Publish(std::string(65, 'x'), hpl::kTypeText), -1);
+}
+
+TEST_F(ShmBusTest, reader_lag) {
+  hpl::ShmBroadcastBus bus(&server_, Sink());
+  ASSERT_EQ(bus.Open(name_.c_str(), 4, 64), 0);
+  // a second process attached to the same ring, publishing
+  std::vector<Received> other;
+  hpl::ShmBroadcastBus publisher(
+      &server_, [&other](std::string_view key, std::string_view data,
+                         hpl::WsFrameType) {
+        other.push_back({std::string(key), std::string(data)});
+      });
+  ASSERT_EQ(publisher.Open(name_.c_str(), 4, 64), 0);
+  EXPECT_EQ(publisher.Open(name_.c_str(), 4, 64), -1);
+
+  // more than a lap before the loop reads, the oldest are overwritten
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_EQ(publisher.Publish("m" + std::to_string(i), hpl::kTypeText), 0);
+  }
+  ASSERT_TRUE(PollFor(4));
+  ASSERT_TRUE(PollUntil([&other] { return other.size() >= 4; }));
+  ASSERT_EQ(received_.size(), 4);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(received_[i].data, "m" + std::to_string(i + 6));
+  }
+  EXPECT_EQ(bus.Lost(), 6);
+  EXPECT_EQ(publisher.Lost(), 6);
+  EXPECT_EQ(other.size(), 4);
+  EXPECT_EQ(other[0].data, "m6");
+
+  // caught up, nothing more is lost
+  ASSERT_EQ(publisher.Publish("m10", hpl::kTypeText), 0);
+  ASSERT_TRUE(PollFor(5));
+  EXPECT_EQ(received_[4].data, "m10");
+  EXPECT_EQ(bus.Lost(), 6);
+
+  // a process attaching with another geometry is refused
+  hpl::ShmBroadcastBus mismatched(&server_, Sink());
+  EXPECT_EQ(mismatched.Open(name_.c_str(), 8, 64), -1);
+}
+
+TEST_F(ShmBusTest, dead_writer) {
+  hpl::ShmBroadcastBus bus(&server_, Sink());
+  ASSERT_EQ(bus.Open(name_.c_str(), 4, 64), 0);
+  int fd = shm_open(name_.c_str(), O_RDWR, 0600);
+  ASSERT_NE(fd, -1);
+  const size_t stride = (sizeof(Slot) + 64 + 63) & ~size_t(63);
+  const size_t len = sizeof(Header) + stride * 4;
+  void *map = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  ASSERT_NE(map, MAP_FAILED);
+  auto *header = static_cast<Header *>(map);
+  auto *slot0 = reinterpret_cast<Slot *>(static_cast<char *>(map) +
+                                         sizeof(Header));
+  // a writer reserved position 0 and died in the middle of the copy
+  ASSERT_EQ(header->write_pos.fetch_add(1), 0u);
+  slot0->seq.store(1);
+
+  // the readers skip it once later messages are complete
+  ASSERT_EQ(bus.Publish("m1", hpl::kTypeText), 0);
+  ASSERT_TRUE(PollFor(1));
+  EXPECT_EQ(received_[0].data, "m1");
+  EXPECT_EQ(bus.Lost(), 1);
+
+  // a lap later the producer finds the slot still held, marks it for the
+  // readers to skip and publishes in the next one
+  for (int i = 2; i < 5; ++i) {
+    ASSERT_EQ(bus.Publish("m" + std::to_string(i), hpl::kTypeText), 0);
+  }
+  EXPECT_EQ(header->write_pos.load(), 6u);
+  EXPECT_EQ(slot0->seq.load(), 10u);
+  ASSERT_TRUE(PollFor(4));
+  server_.Poll(10);
+  ASSERT_EQ(received_.size(), 4u);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(received_[i].data, "m" + std::to_string(i + 1));
+  }
+  EXPECT_EQ(bus.Lost(), 1);
+  munmap(map, len);
+}
@@ -0,0 +1,62 @@
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "hpl_request_handler.h"
+#include "hpl_server.h"
+#include "hpl_sse_channel.h"
+#include "test_util.h"
+
+namespace {
+using hpl::test::PollUntil;
+
+void Receive(int fd, std::string &in) {
+  char buf[4096];
+  ssize_t n;
+  while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    in.append(buf, n);
+  }
+}
+} // namespace
+
+TEST(sse_channel, line_breaks) {
+  hpl::Server server;
+  ASSERT_EQ(server.Init("127.0.0.1", 39401, 16), 0);
+  hpl::SseChannel channel;
+  hpl::RequestHandler handlers;
+  handlers.sse_channel = &channel;
+  server.RegisterRequestHandler("/events", std::move(handlers));
+
+  int fd = hpl::test::ConnectLoopback(39401);
+  ASSERT_NE(fd, -1);
+  const std::string request = "GET /events HTTP/1.1\r\nHost: a\r\n\r\n";
+  ASSERT_EQ(write(fd, request.data(), request.size()),
+            static_cast<ssize_t>(request.size()));
+  ASSERT_TRUE(PollUntil(server, [&] { return channel.size() == 1; }));
+  std::string in;
+  ASSERT_TRUE(PollUntil(server, [&] {
+    Receive(fd, in);
+    return in.find("\r\n\r\n") != std::string::npos;
+  }));
+  in.erase(0, in.find("\r\n\r\n") + 4);
+
+  // a line break in the event would start a field of its own
+  auto id = channel.Publish("a\r\nb\rc\nd", "tick\r\ndata: forged");
+  const std::string expected = "id: " + std::to_string(id) +
+                               "\n"
+                               "event: tickdata: forged\n"
+                               "data: a\n"
+                               "data: b\n"
+                               "data: c\n"
+                               "data: d\n"
+                               "\n";
+  ASSERT_TRUE(PollUntil(server, [&] {
+    Receive(fd, in);
+    return in.size() >= expected.size();
+  }));
+  EXPECT_EQ(in, expected);
+  close(fd);
+}
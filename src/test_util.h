@@ -0,0 +1,193 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include "hpl_server.h"
+
+#ifndef _HPL_TEST_UTIL_H_
+#define _HPL_TEST_UTIL_H_
+
+namespace hpl::test {
+/// @brief poll server until done returns true
+/// @return false once timeout passed
+inline bool PollUntil(Server &server, const std::function<bool()> &done,
+                      std::chrono::milliseconds timeout =
+                          std::chrono::seconds(2)) {
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (!done()) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    server.Poll(10);
+  }
+  return true;
+}
+
+/// @brief a blocking tcp connection to port on the loopback
+/// @param rcvbuf, set before connecting if not 0, a small one makes the
+/// client lag
+/// @return the socket, -1 on error
+inline int ConnectLoopback(int port, int rcvbuf = 0) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (rcvbuf != 0) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  }
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/// @brief a websocket client of server on /ws, reading without blocking the
+/// loop
+struct WsClient {
+  int fd = -1;
+  std::string in;
+  /// the response to the upgrade request
+  std::string handshake;
+  /// the server closed the connection
+  bool closed = false;
+
+  ~WsClient() { Close(); }
+
+  void Close() {
+    if (fd != -1) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  /// @param rcvbuf, a small one makes the client lag
+  bool Open(Server &server, int port, std::string_view extensions = {},
+            int rcvbuf = 0) {
+    fd = ConnectLoopback(port, rcvbuf);
+    if (fd == -1) {
+      return false;
+    }
+    std::string request = "GET /ws HTTP/1.1\r\n"
+                          "Host: 127.0.0.1\r\n"
+                          "Upgrade: websocket\r\n"
+                          "Connection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                          "Sec-WebSocket-Version: 13\r\n";
+    if (!extensions.empty()) {
+      request += "Sec-WebSocket-Extensions: ";
+      request += extensions;
+      request += "\r\n";
+    }
+    request += "\r\n";
+    if (!Send(request)) {
+      return false;
+    }
+    size_t end = std::string::npos;
+    if (!PollUntil(server, [&] {
+          Receive();
+          end = in.find("\r\n\r\n");
+          return end != std::string::npos;
+        })) {
+      return false;
+    }
+    bool upgraded = in.compare(0, 12, "HTTP/1.1 101") == 0;
+    handshake = in.substr(0, end + 4);
+    in.erase(0, end + 4);
+    return upgraded;
+  }
+
+  bool Send(std::string_view bytes) {
+    return write(fd, bytes.data(), bytes.size()) ==
+           static_cast<ssize_t>(bytes.size());
+  }
+
+  /// @brief a frame as a client sends it, masked unless told otherwise
+  /// @param b0, FIN, RSV and the opcode
+  static std::string Frame(unsigned char b0, std::string_view payload,
+                           bool masked = true) {
+    static const unsigned char kMask[4] = {0x37, 0xfa, 0x21, 0x3d};
+    std::string frame(1, static_cast<char>(b0));
+    const unsigned char mask_bit = masked ? 0x80 : 0;
+    if (payload.size() < 126) {
+      frame += static_cast<char>(mask_bit | payload.size());
+    } else if (payload.size() <= 0xffff) {
+      frame += static_cast<char>(mask_bit | 126);
+      frame += static_cast<char>(payload.size() >> 8);
+      frame += static_cast<char>(payload.size());
+    } else {
+      frame += static_cast<char>(mask_bit | 127);
+      for (int shift = 56; shift >= 0; shift -= 8) {
+        frame += static_cast<char>(static_cast<uint64_t>(payload.size()) >>
+                                   shift);
+      }
+    }
+    if (!masked) {
+      frame += payload;
+      return frame;
+    }
+    frame.append(reinterpret_cast<const char *>(kMask), 4);
+    for (size_t i = 0; i < payload.size(); ++i) {
+      frame += static_cast<char>(payload[i] ^ kMask[i % 4]);
+    }
+    return frame;
+  }
+
+  void Receive() {
+    char buf[65536];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+      in.append(buf, n);
+    }
+    closed = closed || n == 0;
+  }
+
+  /// @brief the next frame from the server, unmasked
+  bool ReadFrame(Server &server, unsigned char &b0, std::string &payload) {
+    return PollUntil(server, [&] {
+      Receive();
+      if (in.size() < 2) {
+        return false;
+      }
+      size_t header_len = 2;
+      uint64_t len = in[1] & 0x7f;
+      if (len == 126) {
+        header_len = 4;
+      } else if (len == 127) {
+        header_len = 10;
+      }
+      if (in.size() < header_len) {
+        return false;
+      }
+      if (header_len > 2) {
+        len = 0;
+        for (size_t i = 2; i < header_len; ++i) {
+          len = len << 8 | static_cast<unsigned char>(in[i]);
+        }
+      }
+      if (in.size() < header_len + len) {
+        return false;
+      }
+      b0 = in[0];
+      payload = in.substr(header_len, len);
+      in.erase(0, header_len + len);
+      return true;
+    });
+  }
+};
+} // namespace hpl::test
+
+#endif // _HPL_TEST_UTIL_H_
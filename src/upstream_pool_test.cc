@@ -0,0 +1,443 @@
+#include <gtest/gtest.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "hpl_server.h"
+#include "hpl_upstream_pool.h"
+#include "test_util.h"
+
+namespace {
+constexpr int kServerPort = 39601;
+constexpr int kBackendPort = 39651;
+constexpr int kOtherBackendPort = 39652;
+
+/// the size of the request at the start of in, 0 if it isn't complete
+size_t RequestSize(const std::string &in) {
+  auto end = in.find("\r\n\r\n");
+  if (end == std::string::npos) {
+    return 0;
+  }
+  std::string head = in.substr(0, end);
+  std::transform(head.begin(), head.end(), head.begin(),
+                 [](unsigned char c) { return tolower(c); });
+  size_t length = 0;
+  auto pos = head.find("\r\ncontent-length:");
+  if (pos != std::string::npos) {
+    length = strtoul(head.c_str() + pos + 17, nullptr, 10);
+  }
+  return in.size() < end + 4 + length ? 0 : end + 4 + length;
+}
+
+/// @brief a backend on a raw socket, served between the polls of the loop
+class Backend {
+public:
+  struct Reply {
+    std::string bytes;
+    /// close the connection once bytes are sent
+    bool close = false;
+  };
+
+  /// @param backlog, 0 with a connection left unaccepted makes the next
+  /// connects hang
+  Backend(int port, int backlog) {
+    fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int on = 1;
+    setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd_, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd_, backlog) == -1) {
+      ADD_FAILURE() << "backend can't listen on " << port;
+    }
+  }
+  ~Backend() {
+    for (auto &conn : conns_) {
+      if (conn.fd != -1) {
+        close(conn.fd);
+      }
+    }
+    close(fd_);
+  }
+
+  /// @brief accept, read and answer the complete requests
+  void Serve() {
+    int fd;
+    while (accepting && (fd = accept4(fd_, nullptr, nullptr,
+                                      SOCK_NONBLOCK)) != -1) {
+      conns_.push_back({fd, {}, 0});
+    }
+    for (auto &conn : conns_) {
+      if (conn.fd == -1) {
+        continue;
+      }
+      char buf[4096];
+      ssize_t n;
+      while ((n = recv(conn.fd, buf, sizeof(buf), 0)) > 0) {
+        conn.in.append(buf, n);
+      }
+      if (n == 0) {
+        close(conn.fd);
+        conn.fd = -1;
+        continue;
+      }
+      size_t size;
+      while (!hold && (size = RequestSize(conn.in)) > 0) {
+        auto request = conn.in.substr(0, size);
+        conn.in.erase(0, size);
+        requests.push_back(request);
+        auto reply = respond(request, conn.nth++);
+        send(conn.fd, reply.bytes.data(), reply.bytes.size(), MSG_NOSIGNAL);
+        if (reply.close) {
+          close(conn.fd);
+          conn.fd = -1;
+          break;
+        }
+      }
+    }
+  }
+
+  /// complete requests not answered, because of hold
+  size_t Held() const {
+    return std::count_if(conns_.begin(), conns_.end(), [](const auto &conn) {
+      return conn.fd != -1 && RequestSize(conn.in) > 0;
+    });
+  }
+
+  /// @brief the reply to the nth request of a connection
+  std::function<Reply(std::string_view request, int nth)> respond =
+      [](std::string_view, int) {
+        return Reply{"HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok"};
+      };
+  /// the requests wait unanswered while set
+  bool hold = false;
+  bool accepting = true;
+  /// the requests answered, in order
+  std::vector<std::string> requests;
+
+private:
+  struct Conn {
+    int fd = -1;
+    std::string in;
+    int nth = 0;
+  };
+  int fd_ = -1;
+  std::vector<Conn> conns_;
+};
+
+/// what the callback of a request got
+struct Result {
+  bool done = false;
+  int error = 0;
+  int status = 0;
+  std::string body;
+  /// the order the callbacks ran in
+  int order = 0;
+};
+
+class UpstreamPoolTest : public testing::Test {
+protected:
+  void SetUp() override {
+    ASSERT_EQ(server_.Init("127.0.0.1", kServerPort, 16), 0);
+  }
+
+  Backend &AddBackend(int port, int backlog = 16) {
+    return *backends_.emplace_back(std::make_unique<Backend>(port, backlog));
+  }
+
+  /// @brief PollUntil, serving the backends before each check
+  bool PollUntil(const std::function<bool()> &done) {
+    return hpl::test::PollUntil(server_, [this, &done] {
+      for (auto &backend : backends_) {
+        backend->Serve();
+      }
+      return done();
+    });
+  }
+
+  /// serve and poll for time
+  void PollFor(std::chrono::milliseconds time) {
+    auto end = std::chrono::steady_clock::now() + time;
+    PollUntil([end] { return std::chrono::steady_clock::now() >= end; });
+  }
+
+  int Send(hpl::UpstreamPool &pool, Result &result,
+           std::string_view target = "/",
+           hpl::HttpMethod method = hpl::HttpMethod::GET,
+           std::vector<std::pair<std::string, std::string>> headers = {},
+           std::string body = "") {
+    hpl::UpstreamRequest request;
+    request.method = method;
+    request.target = target;
+    request.headers = std::move(headers);
+    request.body = std::move(body);
+    return pool.Send(std::move(request),
+                     [this, &result](int error,
+                                     const hpl::UpstreamResponse &response) {
+                       result.done = true;
+                       result.error = error;
+                       result.status = response.parser.GetStatus();
+                       result.body = response.body;
+                       result.order = ++completed_;
+                     });
+  }
+
+  hpl::Server server_;
+  std::vector<std::unique_ptr<Backend>> backends_;
+  int completed_ = 0;
+};
+
+std::string Address(int port) { return "127.0.0.1:" + std::to_string(port); }
+} // namespace
+
+TEST_F(UpstreamPoolTest, body_framing) {
+  auto &backend = AddBackend(kBackendPort);
+  backend.respond = [](std::string_view request, int) -> Backend::Reply {
+    if (request.substr(0, 13) == "GET /chunked ") {
+      // an extension, a size in upper case and a trailer
+      return {"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+              "5;ext=1\r\nhello\r\nA\r\n world 123\r\n0\r\nX-Trailer: 1\r\n\r\n"};
+    } else if (request.substr(0, 11) == "GET /close ") {
+      return {"HTTP/1.1 200 OK\r\n\r\nuntil close", true};
+    } else if (request.substr(0, 9) == "GET /bad ") {
+      return {"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+              "\xb5\r\nx\r\n0\r\n\r\n"};
+    }
+    return {"HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok"};
+  };
+  hpl::UpstreamPool pool(&server_);
+  ASSERT_EQ(pool.AddBackend(Address(kBackendPort)), 0);
+
+  Result chunked;
+  ASSERT_EQ(Send(pool, chunked, "/chunked"), 0);
+  ASSERT_TRUE(PollUntil([&] { return chunked.done; }));
+  EXPECT_EQ(chunked.error, 0);
+  EXPECT_EQ(chunked.status, 200);
+  EXPECT_EQ(chunked.body, "hello world 123");
+  EXPECT_EQ(pool.GetIdleCount(0), 1);
+
+  // on the kept alive connection, which ends with the body
+  Result until_close;
+  ASSERT_EQ(Send(pool, until_close, "/close"), 0);
+  ASSERT_TRUE(PollUntil([&] { return until_close.done; }));
+  EXPECT_EQ(until_close.error, 0);
+  EXPECT_EQ(until_close.body, "until close");
+  EXPECT_EQ(pool.GetIdleCount(0), 0);
+  EXPECT_EQ(pool.GetConnectCount(), 1);
+  EXPECT_EQ(pool.GetReuseCount(), 1);
+
+  Result post;
+  ASSERT_EQ(Send(pool, post, "/post", hpl::HttpMethod::POST, {}, "data"), 0);
+  ASSERT_TRUE(PollUntil([&] { return post.done; }));
+  EXPECT_EQ(post.error, 0);
+  EXPECT_NE(backend.requests.back().find("\r\nContent-Length: 4\r\n"),
+            std::string::npos);
+
+  // a chunk size with a byte over 0x7f
+  Result bad;
+  ASSERT_EQ(Send(pool, bad, "/bad"), 0);
+  ASSERT_TRUE(PollUntil([&] { return bad.done; }));
+  EXPECT_EQ(bad.error, EPROTO);
+
+  // the framing is the pool's, the caller's is refused
+  for (auto header : {std::make_pair("Transfer-Encoding", "chunked"),
+                      std::make_pair("content-length", "0"),
+                      std::make_pair("Connection", "close"),
+                      std::make_pair("X-Injected", "a\r\nb: c")}) {
+    Result refused;
+    EXPECT_EQ(Send(pool, refused, "/", hpl::HttpMethod::POST, {header}), -1);
+    EXPECT_EQ(errno, EINVAL);
+    EXPECT_FALSE(refused.done);
+  }
+  // a second request in the target, or a header
+  for (auto target : {"/ HTTP/1.1\r\nHost: a\r\n\r\nGET /admin", "/a b",
+                      "/a\tb", ""}) {
+    Result refused;
+    EXPECT_EQ(Send(pool, refused, target), -1) << target;
+    EXPECT_EQ(errno, EINVAL);
+    EXPECT_FALSE(refused.done);
+  }
+}
+
+TEST_F(UpstreamPoolTest, stale_keep_alive_retry) {
+  // the backend closes a connection when its second request arrives, as if
+  // the idle timeout passed while the request was on the way
+  auto &backend = AddBackend(kBackendPort);
+  backend.respond = [](std::string_view, int nth) -> Backend::Reply {
+    if (nth > 0) {
+      return {"", true};
+    }
+    return {"HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok"};
+  };
+  hpl::UpstreamPool pool(&server_);
+  ASSERT_EQ(pool.AddBackend(Address(kBackendPort)), 0);
+
+  Result first;
+  ASSERT_EQ(Send(pool, first), 0);
+  ASSERT_TRUE(PollUntil([&] { return first.done; }));
+  EXPECT_EQ(first.error, 0);
+
+  // sent again on a new connection
+  Result get;
+  ASSERT_EQ(Send(pool, get), 0);
+  ASSERT_TRUE(PollUntil([&] { return get.done; }));
+  EXPECT_EQ(get.error, 0);
+  EXPECT_EQ(get.body, "ok");
+  EXPECT_EQ(backend.requests.size(), 3);
+  EXPECT_EQ(pool.GetConnectCount(), 2);
+  EXPECT_EQ(pool.GetReuseCount(), 1);
+  EXPECT_FALSE(pool.IsEjected(0));
+
+  // a POST may have been processed, it fails instead
+  Result post;
+  ASSERT_EQ(Send(pool, post, "/", hpl::HttpMethod::POST, {}, "data"), 0);
+  ASSERT_TRUE(PollUntil([&] { return post.done; }));
+  EXPECT_EQ(post.error, ECONNRESET);
+  PollFor(std::chrono::milliseconds(100));
+  EXPECT_EQ(backend.requests.size(), 4);
+  EXPECT_EQ(pool.GetConnectCount(), 2);
+}
+
+TEST_F(UpstreamPoolTest, eject_and_dispatch_again) {
+  auto &bad = AddBackend(kBackendPort);
+  bad.hold = true;
+  bad.respond = [](std::string_view, int) {
+    return Backend::Reply{"garbage\r\n\r\n"};
+  };
+  auto &good = AddBackend(kOtherBackendPort);
+  hpl::UpstreamOptions options;
+  options.max_conns = 1;
+  options.max_failures = 1;
+  hpl::UpstreamPool pool(&server_, options);
+  ASSERT_EQ(pool.AddBackend(Address(kBackendPort)), 0);
+
+  // one sent, two waiting for the connection
+  Result results[3];
+  for (auto &result : results) {
+    ASSERT_EQ(Send(pool, result), 0);
+  }
+  ASSERT_TRUE(PollUntil([&] { return bad.Held() == 1; }));
+  EXPECT_EQ(pool.GetOutstanding(0), 3);
+
+  // the malformed response ejects the backend, the waiting requests go to
+  // the other one
+  ASSERT_EQ(pool.AddBackend(Address(kOtherBackendPort)), 1);
+  bad.hold = false;
+  ASSERT_TRUE(PollUntil([&] {
+    return results[0].done && results[1].done && results[2].done;
+  }));
+  EXPECT_EQ(results[0].error, EPROTO);
+  EXPECT_EQ(results[1].error, 0);
+  EXPECT_EQ(results[2].error, 0);
+  EXPECT_TRUE(pool.IsEjected(0));
+  EXPECT_EQ(pool.GetOutstanding(0), 0);
+  EXPECT_EQ(bad.requests.size(), 1);
+  EXPECT_EQ(good.requests.size(), 2);
+
+  Result after;
+  ASSERT_EQ(Send(pool, after), 0);
+  ASSERT_TRUE(PollUntil([&] { return after.done; }));
+  EXPECT_EQ(after.error, 0);
+  EXPECT_EQ(bad.requests.size(), 1);
+}
+
+TEST_F(UpstreamPoolTest, max_pending) {
+  auto &backend = AddBackend(kBackendPort);
+  backend.hold = true;
+  hpl::UpstreamOptions options;
+  options.max_conns = 1;
+  options.max_pending = 1;
+  hpl::UpstreamPool pool(&server_, options);
+  ASSERT_EQ(pool.AddBackend(Address(kBackendPort)), 0);
+
+  Result sent, waiting, refused;
+  ASSERT_EQ(Send(pool, sent), 0);
+  ASSERT_EQ(Send(pool, waiting), 0);
+  EXPECT_EQ(Send(pool, refused), -1);
+  EXPECT_EQ(errno, EAGAIN);
+
+  backend.hold = false;
+  ASSERT_TRUE(PollUntil([&] { return sent.done && waiting.done; }));
+  EXPECT_EQ(sent.error, 0);
+  EXPECT_EQ(waiting.error, 0);
+  EXPECT_FALSE(refused.done);
+  // on the same connection
+  EXPECT_EQ(pool.GetConnectCount(), 1);
+  EXPECT_EQ(Send(pool, refused), 0);
+}
+
+TEST_F(UpstreamPoolTest, connect_timeout) {
+  // the accept queue is full, the handshake of the pool isn't answered
+  auto &backend = AddBackend(kBackendPort, 0);
+  backend.accepting = false;
+  int filler = hpl::test::ConnectLoopback(kBackendPort);
+  ASSERT_NE(filler, -1);
+
+  hpl::UpstreamOptions options;
+  options.connect_timeout = std::chrono::milliseconds(200);
+  hpl::UpstreamPool pool(&server_, options);
+  ASSERT_EQ(pool.AddBackend(Address(kBackendPort)), 0);
+  Result result;
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_EQ(Send(pool, result), 0);
+  ASSERT_TRUE(PollUntil([&] { return result.done; }));
+  EXPECT_EQ(result.error, ETIMEDOUT);
+  EXPECT_GE(std::chrono::steady_clock::now() - start, options.connect_timeout);
+  close(filler);
+}
+
+TEST_F(UpstreamPoolTest, request_and_pending_timeouts) {
+  auto &bad = AddBackend(kBackendPort);
+  bad.hold = true;
+  bad.respond = [](std::string_view, int) {
+    return Backend::Reply{"garbage\r\n\r\n"};
+  };
+  auto &slow = AddBackend(kOtherBackendPort);
+  slow.hold = true;
+  hpl::UpstreamOptions options;
+  options.max_conns = 1;
+  options.max_failures = 1;
+  options.request_timeout = std::chrono::milliseconds(500);
+  hpl::UpstreamPool pool(&server_, options);
+  ASSERT_EQ(pool.AddBackend(Address(kBackendPort)), 0);
+
+  Result results[4];
+  ASSERT_EQ(Send(pool, results[0]), 0);
+  ASSERT_EQ(Send(pool, results[1]), 0);
+  ASSERT_TRUE(PollUntil([&] { return bad.Held() == 1; }));
+  PollFor(std::chrono::milliseconds(200));
+  ASSERT_EQ(pool.AddBackend(Address(kOtherBackendPort)), 1);
+  ASSERT_EQ(Send(pool, results[2]), 0);
+  ASSERT_EQ(Send(pool, results[3]), 0);
+  EXPECT_EQ(pool.GetOutstanding(1), 2);
+
+  // the ejection moves the second request behind the fourth, its deadline
+  // comes first all the same
+  bad.hold = false;
+  ASSERT_TRUE(PollUntil([&] { return results[0].done; }));
+  EXPECT_EQ(results[0].error, EPROTO);
+  ASSERT_TRUE(PollUntil([&] {
+    return results[1].done && results[2].done && results[3].done;
+  }));
+  EXPECT_EQ(results[1].error, ETIMEDOUT);
+  EXPECT_LT(results[1].order, results[3].order);
+  // no response in time, the one sent times out
+  EXPECT_EQ(results[2].error, ETIMEDOUT);
+  EXPECT_LT(results[1].order, results[2].order);
+}
@@ -0,0 +1,336 @@
+#include <gtest/gtest.h>
+#include <zlib.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hpl_request_handler.h"
+#include "hpl_server.h"
+#include "hpl_websocket_connection.h"
+#include "test_util.h"
+
+namespace {
+using hpl::test::PollUntil;
+using hpl::test::WsClient;
+
+/// @brief a server keeping the messages of /ws
+struct MessageServer {
+  hpl::Server server;
+  std::vector<std::string> messages;
+  std::vector<hpl::WsFrameType> types;
+  hpl::WebsocketConnection *conn = nullptr;
+  /// the reply of the handler to each message
+  std::function<int()> reply = [] { return 0; };
+
+  MessageServer(int port, const hpl::MemoryPolicy &policy = {})
+      : MessageServer(port, policy, hpl::RequestHandler()) {}
+  MessageServer(int port, const hpl::MemoryPolicy &policy,
+                hpl::RequestHandler handlers) {
+    server.SetMemoryPolicy(policy);
+    EXPECT_EQ(server.Init("127.0.0.1", port, 16), 0);
+    handlers.ws_message_handler = [this](hpl::WebsocketConnection *c,
+                                         hpl::WsFrameType type,
+                                         std::string_view data) {
+      conn = c;
+      messages.emplace_back(data);
+      types.push_back(type);
+      return reply();
+    };
+    server.RegisterRequestHandler("/ws", std::move(handlers));
+  }
+};
+
+/// @brief the permessage-deflate side of a client, raw deflate with the
+/// default window
+struct ClientDeflate {
+  z_stream deflater = {};
+  z_stream inflater = {};
+  /// keep the window between the messages
+  const bool takeover;
+
+  explicit ClientDeflate(bool takeover) : takeover(takeover) {
+    deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                 Z_DEFAULT_STRATEGY);
+    inflateInit2(&inflater, -15);
+  }
+  ~ClientDeflate() {
+    deflateEnd(&deflater);
+    inflateEnd(&inflater);
+  }
+
+  /// @return the payload of a message, without the flush tail
+  std::string Compress(std::string_view data) {
+    if (!takeover) {
+      deflateReset(&deflater);
+    }
+    std::string out(deflateBound(&deflater, data.size()) + 16, '\0');
+    deflater.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    deflater.avail_in = data.size();
+    deflater.next_out = reinterpret_cast<Bytef *>(out.data());
+    deflater.avail_out = out.size();
+    EXPECT_EQ(deflate(&deflater, Z_SYNC_FLUSH), Z_OK);
+    out.resize(out.size() - deflater.avail_out - 4);
+    return out;
+  }
+
+  /// @return the message of a payload, "" on error
+  std::string Inflate(std::string_view payload) {
+    if (!takeover) {
+      inflateReset(&inflater);
+    }
+    std::string in(payload);
+    in.append("\x00\x00\xff\xff", 4);
+    inflater.next_in = reinterpret_cast<Bytef *>(in.data());
+    inflater.avail_in = in.size();
+    std::string out;
+    char buf[16384];
+    while (inflater.avail_in > 0) {
+      inflater.next_out = reinterpret_cast<Bytef *>(buf);
+      inflater.avail_out = sizeof(buf);
+      int ret = inflate(&inflater, Z_SYNC_FLUSH);
+      if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        return "";
+      }
+      out.append(buf, sizeof(buf) - inflater.avail_out);
+    }
+    return out;
+  }
+};
+
+/// @brief the status of a close frame
+int CloseStatus(std::string_view payload) {
+  if (payload.size() < 2) {
+    return -1;
+  }
+  return static_cast<unsigned char>(payload[0]) << 8 |
+         static_cast<unsigned char>(payload[1]);
+}
+} // namespace
+
+TEST(websocket_connection, pause_edge_triggered) {
+  hpl::MemoryPolicy policy;
+  policy.edge_triggered = true;
+  policy.read_chunk = 4096;
+  policy.max_input_per_conn = 16 * 1024;
+  MessageServer s(39701, policy);
+  // the first message pauses the consumer
+  s.reply = [&s] { return s.messages.size() == 1 ? 1 : 0; };
+  WsClient client;
+  ASSERT_TRUE(client.Open(s.server, 39701));
+
+  // more than max_input_per_conn behind it, left in the socket meanwhile
+  std::string frames = WsClient::Frame(0x82, "first");
+  for (int i = 0; i < 32; ++i) {
+    frames += WsClient::Frame(0x82, std::string(2000, 'a' + i % 26));
+  }
+  ASSERT_TRUE(client.Send(frames));
+  ASSERT_TRUE(PollUntil(s.server, [&] { return s.messages.size() == 1; }));
+  EXPECT_FALSE(PollUntil(
+      s.server,
+      [&] {
+        client.Receive();
+        return client.closed || s.messages.size() > 1;
+      },
+      std::chrono::milliseconds(200)));
+  ASSERT_TRUE(s.conn->IsReadPaused());
+
+  s.conn->ResumeRead();
+  ASSERT_TRUE(PollUntil(s.server, [&] { return s.messages.size() == 33; }));
+  for (int i = 0; i < 32; ++i) {
+    EXPECT_EQ(s.messages[i + 1], std::string(2000, 'a' + i % 26)) << i;
+  }
+  client.Receive();
+  EXPECT_FALSE(client.closed);
+}
+
+TEST(websocket_connection, split_header) {
+  MessageServer s(39702);
+  WsClient client;
+  ASSERT_TRUE(client.Open(s.server, 39702));
+  // the 16 bit length form, a byte per read up to the payload
+  const std::string payload(300, 'h');
+  const std::string frame = WsClient::Frame(0x82, payload);
+  ASSERT_EQ(static_cast<unsigned char>(frame[1]), 0x80 | 126);
+  for (size_t i = 0; i < 8; ++i) {
+    ASSERT_TRUE(client.Send(frame.substr(i, 1)));
+    EXPECT_FALSE(PollUntil(
+        s.server, [&] { return !s.messages.empty(); },
+        std::chrono::milliseconds(20)));
+  }
+  ASSERT_TRUE(client.Send(frame.substr(8, 100)));
+  EXPECT_FALSE(PollUntil(
+      s.server, [&] { return !s.messages.empty(); },
+      std::chrono::milliseconds(20)));
+  ASSERT_TRUE(client.Send(frame.substr(108)));
+  ASSERT_TRUE(PollUntil(s.server, [&] { return s.messages.size() == 1; }));
+  EXPECT_EQ(s.messages[0], payload);
+  EXPECT_EQ(s.types[0], hpl::kTypeBinary);
+}
+
+TEST(websocket_connection, coalesced_frames) {
+  MessageServer s(39703);
+  WsClient client;
+  ASSERT_TRUE(client.Open(s.server, 39703));
+  // the 7 bit, 16 bit and 64 bit length forms in one write
+  const std::string small(125, 's');
+  const std::string medium(65535, 'm');
+  const std::string large(70000, 'l');
+  const std::string frames = WsClient::Frame(0x81, small) +
+                             WsClient::Frame(0x82, medium) +
+                             WsClient::Frame(0x82, large) +
+                             WsClient::Frame(0x81, "");
+  ASSERT_EQ(static_cast<unsigned char>(frames[2 + 4 + 125 + 1]), 0x80 | 126);
+  ASSERT_EQ(
+      static_cast<unsigned char>(frames[(2 + 4 + 125) + (4 + 4 + 65535) + 1]),
+      0x80 | 127);
+  ASSERT_TRUE(client.Send(frames));
+  ASSERT_TRUE(PollUntil(s.server, [&] { return s.messages.size() == 4; }));
+  EXPECT_EQ(s.messages[0], small);
+  EXPECT_EQ(s.types[0], hpl::kTypeText);
+  EXPECT_EQ(s.messages[1], medium);
+  EXPECT_EQ(s.messages[2], large);
+  EXPECT_EQ(s.messages[3], "");
+}
+
+TEST(websocket_connection, fragments) {
+  MessageServer s(39704);
+  WsClient client;
+  ASSERT_TRUE(client.Open(s.server, 39704));
+  // text in three fragments, a ping between the first two
+  ASSERT_TRUE(client.Send(WsClient::Frame(0x01, "hel") +
+                          WsClient::Frame(0x89, "ping")));
+  unsigned char b0 = 0;
+  std::string payload;
+  ASSERT_TRUE(client.ReadFrame(s.server, b0, payload));
+  EXPECT_EQ(b0, 0x8a);
+  EXPECT_EQ(payload, "ping");
+  EXPECT_TRUE(s.messages.empty());
+  ASSERT_TRUE(client.Send(WsClient::Frame(0x00, "lo ") +
+                          WsClient::Frame(0x80, "world")));
+  ASSERT_TRUE(PollUntil(s.server, [&] { return s.messages.size() == 1; }));
+  EXPECT_EQ(s.messages[0], "hello world");
+  EXPECT_EQ(s.types[0], hpl::kTypeText);
+
+  // a message after the fragmented one starts afresh
+  ASSERT_TRUE(client.Send(WsClient::Frame(0x82, "next")));
+  ASSERT_TRUE(PollUntil(s.server, [&] { return s.messages.size() == 2; }));
+  EXPECT_EQ(s.messages[1], "next");
+  EXPECT_EQ(s.types[1], hpl::kTypeBinary);
+
+  // a continuation without a message is a protocol error
+  ASSERT_TRUE(client.Send(WsClient::Frame(0x80, "stray")));
+  ASSERT_TRUE(PollUntil(s.server, [&] {
+    client.Receive();
+    return client.closed;
+  }));
+  EXPECT_EQ(s.messages.size(), 2u);
+}
+
+TEST(websocket_connection, unmasked_frame) {
+  MessageServer s(39705);
+  WsClient client;
+  ASSERT_TRUE(client.Open(s.server, 39705));
+  ASSERT_TRUE(client.Send(WsClient::Frame(0x81, "plain", false)));
+  unsigned char b0 = 0;
+  std::string payload;
+  ASSERT_TRUE(client.ReadFrame(s.server, b0, payload));
+  EXPECT_EQ(b0, 0x88);
+  EXPECT_EQ(CloseStatus(payload), 1002);
+  ASSERT_TRUE(PollUntil(s.server, [&] {
+    client.Receive();
+    return client.closed;
+  }));
+  EXPECT_TRUE(s.messages.empty());
+}
+
+TEST(websocket_connection, deflate_round_trip) {
+  std::string message;
+  while (message.size() < 4000) {
+    message += "the quick brown fox jumps over the lazy dog " +
+               std::to_string(message.size()) + "\n";
+  }
+  for (bool takeover : {false, true}) {
+    SCOPED_TRACE(takeover ? "context takeover" : "no context takeover");
+    const int port = takeover ? 39707 : 39706;
+    hpl::RequestHandler handlers;
+    handlers.ws_deflate.enable = true;
+    handlers.ws_deflate.no_context_takeover = !takeover;
+    handlers.ws_deflate.threshold = 16;
+    MessageServer s(port, {}, std::move(handlers));
+    // echoed, compressed again by the server
+    s.reply = [&s] {
+      const auto &last = s.messages.back();
+      return s.conn->Write(s.types.back(), last.data(), last.size()) == -1
+                 ? -1
+                 : 0;
+    };
+    WsClient client;
+    ASSERT_TRUE(client.Open(s.server, port,
+                            "permessage-deflate; client_max_window_bits"));
+    EXPECT_NE(client.handshake.find(
+                  takeover ? "Sec-WebSocket-Extensions: permessage-deflate; "
+                             "client_max_window_bits=15\r\n"
+                           : "Sec-WebSocket-Extensions: permessage-deflate; "
+                             "server_no_context_takeover; "
+                             "client_no_context_takeover; "
+                             "client_max_window_bits=15\r\n"),
+              std::string::npos)
+        << client.handshake;
+
+    ClientDeflate deflate(takeover);
+    const std::string first = deflate.Compress(message);
+    const std::string second = deflate.Compress(message);
+    // with the window kept the second refers back to the first
+    if (takeover) {
+      EXPECT_LT(second.size(), first.size() / 4);
+    } else {
+      EXPECT_EQ(second, first);
+    }
+    ASSERT_TRUE(client.Send(WsClient::Frame(0xc1, first) +
+                            WsClient::Frame(0xc1, second)));
+    ASSERT_TRUE(PollUntil(s.server, [&] { return s.messages.size() == 2; }));
+    EXPECT_EQ(s.messages[0], message);
+    EXPECT_EQ(s.messages[1], message);
+    for (int i = 0; i < 2; ++i) {
+      unsigned char b0 = 0;
+      std::string payload;
+      ASSERT_TRUE(client.ReadFrame(s.server, b0, payload));
+      EXPECT_EQ(b0, 0xc1);
+      EXPECT_LT(payload.size(), message.size());
+      EXPECT_EQ(deflate.Inflate(payload), message) << i;
+    }
+  }
+}
+
+TEST(websocket_connection, deflate_max_message_size) {
+  hpl::RequestHandler handlers;
+  handlers.ws_deflate.enable = true;
+  handlers.ws_max_message_size = 1000;
+  MessageServer s(39708, {}, std::move(handlers));
+  WsClient client;
+  ASSERT_TRUE(client.Open(s.server, 39708, "permessage-deflate"));
+  ClientDeflate deflate(false);
+  const std::string fits(1000, 'a');
+  ASSERT_TRUE(client.Send(WsClient::Frame(0xc2, deflate.Compress(fits))));
+  ASSERT_TRUE(PollUntil(s.server, [&] { return s.messages.size() == 1; }));
+  EXPECT_EQ(s.messages[0], fits);
+
+  // a few bytes on the wire, over the limit once inflated
+  const std::string payload = deflate.Compress(std::string(5000, 'a'));
+  ASSERT_LT(payload.size(), 100u);
+  ASSERT_TRUE(client.Send(WsClient::Frame(0xc2, payload)));
+  unsigned char b0 = 0;
+  std::string close;
+  ASSERT_TRUE(client.ReadFrame(s.server, b0, close));
+  EXPECT_EQ(b0, 0x88);
+  EXPECT_EQ(CloseStatus(close), 1009);
+  ASSERT_TRUE(PollUntil(s.server, [&] {
+    client.Receive();
+    return client.closed;
+  }));
+  EXPECT_EQ(s.messages.size(), 1u);
+}